@@ -0,0 +1,1253 @@
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <errno.h>
+#include <openssl/evp.h>
+#include "constant.h"
+#include "util.h"
+#include "crypto.h"
+#include "user_directory.h"
+#include "pubkey_cache.h"
+#include "session_ticket.h"
+
+using namespace std;
+using uchar=unsigned char;
+
+/*
+* Microbenchmarks of the crypto primitives used on the message path of client and server.
+* Usage: ./bench [name of the benchmark], all the benchmarks are run if no name is given.
+* slow_handshakes is run only when it is named: it needs a server running on this machine
+*/
+
+//Minimum duration of every measure
+const double BENCH_TIME = 0.5; //seconds
+const uint payload_sizes[] = {64, 1024, 10240};
+const uint lookup_processes[] = {1, 4, 16};
+const int bench_users = 1024;
+const uint crypto_pool_sizes[] = {0, 1, 2}; //threads of the crypto pool, 0 runs the jobs in the event loop
+const int handshake_period = 5000; //us between two handshakes that arrive while the records are relayed
+const uint verify_storm_jobs = 1000; //verifications of M3 submitted together by a reconnect storm
+const uint verify_isolated_jobs = 200; //verifications of M3 submitted one at a time by isolated logins
+const uint registry_sizes[] = {1000, 100000, MAX_REGISTERED_USERS};
+const char* bench_sem_name = "/bench_user_store";
+const char* bench_pubkey_user = "alice";
+//Slow handshakes: clients of a running server that send every handshake message in parts
+const char* bench_srv_ipv4 = "127.0.0.1";
+const int bench_srv_port = 4242;
+const uint slow_clients = 1000;
+const uint slow_parts = 4; //parts of every message
+const int slow_part_interval = 250; //ms between two parts
+const double slow_max_time = 60; //seconds
+
+//Counting allocator: malloc, calloc and realloc of the benchmark, of the repo code and of OpenSSL pass through here
+uint64_t allocations = 0;
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t n, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void* malloc(size_t size){ allocations++; return __libc_malloc(size); }
+extern "C" void* calloc(size_t n, size_t size){ allocations++; return __libc_calloc(n, size); }
+extern "C" void* realloc(void* ptr, size_t size){ allocations++; return __libc_realloc(ptr, size); }
+
+double elapsed_since(chrono::steady_clock::time_point start){
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void print_result(string name, uint size, double msg_per_sec){
+    cout << "  " << name << " " << size << " B: " << (uint64_t)msg_per_sec << " msg/s ("
+        << (msg_per_sec * size / (1024 * 1024)) << " MB/s)" << endl;
+}
+
+/**
+ * @brief encrypt and decrypt records with a new cipher context for every call (auth_enc_encrypt/auth_enc_decrypt)
+ * @return messages per second, 0 on error(s)
+ */
+double bench_per_message_ctx(uchar* key, uchar* pt, uint pt_len){
+    uint aad = htonl(pt_len);
+    uint64_t messages = 0;
+    auto start = chrono::steady_clock::now();
+    do{
+        uchar *tag, *iv, *ct, *pt_out;
+        int ct_len = auth_enc_encrypt(pt, pt_len, (uchar*)&aad, sizeof(aad), key, &tag, &iv, &ct);
+        if(ct_len == 0)
+            return 0;
+        int out_len = auth_enc_decrypt(ct, ct_len, (uchar*)&aad, sizeof(aad), key, tag, iv, &pt_out);
+        if(out_len == 0)
+            return 0;
+        free(tag); free(iv); free(ct);
+        safe_free(pt_out, out_len);
+        messages++;
+    } while(elapsed_since(start) < BENCH_TIME);
+    return messages / elapsed_since(start);
+}
+
+/**
+ * @brief encrypt and decrypt records with the cipher contexts of a session (auth_enc_session_*)
+ * @param caps session capabilities, with CAP_COUNTER_NONCE the IV is derived from the sequence number
+ * @return messages per second, 0 on error(s)
+ */
+double bench_session_ctx(uchar* key, uchar* pt, uint pt_len, uint8_t caps){
+    void* sender = auth_enc_session_new(key, caps, true);
+    void* receiver = auth_enc_session_new(key, caps, false);
+    if(sender == nullptr || receiver == nullptr){
+        auth_enc_session_free(sender);
+        auth_enc_session_free(receiver);
+        return 0;
+    }
+    uint aad = htonl(pt_len);
+    uint32_t seq = 0;
+    double result = 0;
+    auto start = chrono::steady_clock::now();
+    do{
+        uchar *tag, *iv, *ct, *pt_out;
+        int ct_len = auth_enc_session_encrypt(sender, seq, pt, pt_len, (uchar*)&aad, sizeof(aad), &tag, &iv, &ct);
+        if(ct_len == 0)
+            goto end;
+        int out_len = auth_enc_session_decrypt(receiver, seq, ct, ct_len, (uchar*)&aad, sizeof(aad), tag,
+            (caps & CAP_COUNTER_NONCE)? nullptr: iv, &pt_out);
+        free(tag); free(iv); free(ct);
+        if(out_len == 0)
+            goto end;
+        safe_free(pt_out, out_len);
+        seq++;
+    } while(elapsed_since(start) < BENCH_TIME);
+    result = seq / elapsed_since(start);
+end:
+    auth_enc_session_free(sender);
+    auth_enc_session_free(receiver);
+    return result;
+}
+
+/**
+ * @brief compare per-message cipher contexts with the cached contexts of a session, with random and counter IVs (encrypt + decrypt of each record)
+ * @return 0 on success, -1 on error(s)
+ */
+int bench_record_crypto(){
+    cout << "record_crypto: authenticated encryption + decryption of one record" << endl;
+    uchar key[32];
+    uchar* pt = (uchar*)malloc(payload_sizes[2]);
+    if(!pt || 1 != random_generate(sizeof(key), key) || 1 != random_generate(payload_sizes[2], pt)){
+        free(pt);
+        return -1;
+    }
+    for(uint size : payload_sizes){
+        double before = bench_per_message_ctx(key, pt, size);
+        double after = bench_session_ctx(key, pt, size, 0);
+        double counter = bench_session_ctx(key, pt, size, CAP_COUNTER_NONCE);
+        if(before == 0 || after == 0 || counter == 0){
+            free(pt);
+            return -1;
+        }
+        print_result("per-message ctx", size, before);
+        print_result("session ctx    ", size, after);
+        print_result("counter nonce  ", size, counter);
+    }
+    free(pt);
+    return 0;
+}
+
+/**
+ * @brief build records as send_secure did before the in place encryption: copy of the plaintext with the sequence number,
+ * separate tag, IV and ciphertext buffers, assembly of the record in a new buffer
+ * @param allocs output allocations per record
+ * @return records per second, 0 on error(s)
+ */
+double bench_framing_copy(void* session, uint8_t caps, uchar* pt, uint pt_len, double* allocs){
+    uint header_len = RECORD_HEADER_LEN(caps);
+    uint32_t seq = 0;
+    uint64_t allocations_start = allocations;
+    auto start = chrono::steady_clock::now();
+    do{
+        uint32_t seq_net = htonl(seq);
+        uchar* pt_seq = (uchar*)malloc(pt_len + sizeof(uint32_t));
+        if(!pt_seq)
+            return 0;
+        memcpy(pt_seq, &seq_net, sizeof(uint32_t));
+        memcpy(pt_seq + sizeof(uint32_t), pt, pt_len);
+        uint aad = htonl(pt_len + sizeof(uint32_t));
+        uchar *tag, *iv, *ct;
+        int ct_len = auth_enc_session_encrypt(session, seq, pt_seq, pt_len + sizeof(uint32_t), (uchar*)&aad, sizeof(aad), &tag, &iv, &ct);
+        if(ct_len == 0){
+            free(pt_seq);
+            return 0;
+        }
+        uchar* record = (uchar*)malloc(header_len + ct_len);
+        if(!record)
+            return 0;
+        memcpy(record, &aad, sizeof(aad));
+        if(!(caps & CAP_COUNTER_NONCE))
+            memcpy(record + sizeof(aad), iv, IV_DEFAULT);
+        memcpy(record + header_len - TAG_DEFAULT, tag, TAG_DEFAULT);
+        memcpy(record + header_len, ct, ct_len);
+        safe_free(pt_seq, pt_len + sizeof(uint32_t));
+        free(tag); free(iv); free(ct); free(record);
+        seq++;
+    } while(elapsed_since(start) < BENCH_TIME);
+    *allocs = (double)(allocations - allocations_start) / seq;
+    return seq / elapsed_since(start);
+}
+
+/**
+ * @brief build records as send_secure does: sequence number and plaintext copied after the header of a reused buffer
+ * and encrypted in place (auth_enc_session_seal)
+ * @param allocs output allocations per record
+ * @return records per second, 0 on error(s)
+ */
+double bench_framing_seal(void* session, uint8_t caps, uchar* pt, uint pt_len, double* allocs){
+    uint header_len = RECORD_HEADER_LEN(caps);
+    uchar* record = (uchar*)malloc(header_len + sizeof(uint32_t) + pt_len);
+    if(!record)
+        return 0;
+    uint32_t seq = 0;
+    uint64_t allocations_start = allocations;
+    auto start = chrono::steady_clock::now();
+    do{
+        uint32_t seq_net = htonl(seq);
+        memcpy(record + header_len, &seq_net, sizeof(uint32_t));
+        memcpy(record + header_len + sizeof(uint32_t), pt, pt_len);
+        if(0 == auth_enc_session_seal(session, seq, record, pt_len + sizeof(uint32_t), nullptr)){
+            free(record);
+            return 0;
+        }
+        seq++;
+    } while(elapsed_since(start) < BENCH_TIME);
+    *allocs = (double)(allocations - allocations_start) / seq;
+    free(record);
+    return seq / elapsed_since(start);
+}
+
+/**
+ * @brief compare the record framing of send_secure with copies and with in place encryption, counting the allocations
+ * @return 0 on success, -1 on error(s)
+ */
+int bench_record_framing(){
+    cout << "record_framing: construction of one record to send" << endl;
+    uchar key[32];
+    uchar* pt = (uchar*)malloc(payload_sizes[2]);
+    if(!pt || 1 != random_generate(sizeof(key), key) || 1 != random_generate(payload_sizes[2], pt)){
+        free(pt);
+        return -1;
+    }
+    for(uint8_t caps : {0, CAP_COUNTER_NONCE}){
+        cout << ((caps & CAP_COUNTER_NONCE)? " counter nonce": " random IV") << endl;
+        void* session = auth_enc_session_new(key, caps, true);
+        if(session == nullptr){
+            free(pt);
+            return -1;
+        }
+        for(uint size : payload_sizes){
+            double copy_allocs, seal_allocs;
+            double before = bench_framing_copy(session, caps, pt, size, &copy_allocs);
+            double after = bench_framing_seal(session, caps, pt, size, &seal_allocs);
+            if(before == 0 || after == 0){
+                auth_enc_session_free(session);
+                free(pt);
+                return -1;
+            }
+            print_result("copies  ", size, before);
+            cout << "    allocations per record: " << copy_allocs << endl;
+            print_result("in place", size, after);
+            cout << "    allocations per record: " << seal_allocs << endl;
+        }
+        auth_enc_session_free(session);
+    }
+    free(pt);
+    return 0;
+}
+
+/**
+ * @brief presence lookup as the accessors of the user datastore did before the seqlocks: the named semaphore is opened,
+ * waited, posted and closed at every call
+ * @return -1 in case the user is offline, -2 in case of errors, the worker_id otherwise
+ */
+int sem_get_user_worker_by_user_id(int user_id){
+    sem_t* sem_id = sem_open(bench_sem_name, O_CREAT, 0600, 1);
+    if(sem_id == SEM_FAILED)
+        return -2;
+    if(-1 == sem_wait(sem_id)){
+        sem_close(sem_id);
+        return -2;
+    }
+    user_info* user = &directory->entries[user_id];
+    int owner = (user->socket_id.load() == -1)? -1: user->worker_id.load();
+    sem_post(sem_id);
+    sem_close(sem_id);
+    return owner;
+}
+
+/**
+ * @brief set the busy flag of a user under the named semaphore, as the accessors of the user datastore did before the seqlocks
+ * @return 1 on succes, -1 on error
+ */
+int sem_set_user_busy_by_user_id(int user_id, int busy){
+    sem_t* sem_id = sem_open(bench_sem_name, O_CREAT, 0600, 1);
+    if(sem_id == SEM_FAILED)
+        return -1;
+    if(-1 == sem_wait(sem_id)){
+        sem_close(sem_id);
+        return -1;
+    }
+    directory->entries[user_id].busy.store(busy);
+    sem_post(sem_id);
+    sem_close(sem_id);
+    return 1;
+}
+
+/**
+ * @brief processes that look up the presence of random users while one more process keeps changing the busy flags
+ * @param readers processes that look up
+ * @param use_sem true to access the user directory through the named semaphore
+ * @return lookups per second of all the readers, 0 on error(s)
+ */
+double bench_presence_lookups(uint readers, bool use_sem){
+    struct shared_counters {
+        atomic<bool> stop;
+        atomic<uint64_t> lookups;
+        atomic<uint32_t> errors;
+    };
+    shared_counters* shared = (shared_counters*)mmap(NULL, sizeof(shared_counters), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shared == MAP_FAILED)
+        return 0;
+    shared->stop.store(false);
+    shared->lookups.store(0);
+    shared->errors.store(0);
+
+    vector<pid_t> children;
+    for(uint i = 0; i <= readers; i++){
+        pid_t pid = fork();
+        if(pid == -1)
+            break;
+        if(pid != 0){
+            children.push_back(pid);
+            continue;
+        }
+        //Process 0 is the writer, the others are readers
+        uint32_t random = 2463534242u + i;
+        uint64_t done = 0;
+        while(!shared->stop.load(memory_order_relaxed)){
+            random ^= random << 13; random ^= random >> 17; random ^= random << 5;
+            int user_id = random % bench_users;
+            int ret;
+            if(i == 0)
+                ret = use_sem? sem_set_user_busy_by_user_id(user_id, done & 1): set_user_busy_by_user_id(user_id, done & 1);
+            else
+                ret = use_sem? sem_get_user_worker_by_user_id(user_id): get_user_worker_by_user_id(user_id);
+            if(ret == -2 || (i == 0 && ret == -1))
+                shared->errors++;
+            done++;
+        }
+        if(i != 0)
+            shared->lookups += done;
+        exit(0);
+    }
+    auto start = chrono::steady_clock::now();
+    if(children.size() == readers + 1)
+        usleep(BENCH_TIME * 1000000);
+    shared->stop.store(true);
+    double elapsed = elapsed_since(start);
+    for(pid_t pid : children)
+        waitpid(pid, NULL, 0);
+    double result = (children.size() == readers + 1 && shared->errors.load() == 0)? shared->lookups.load() / elapsed: 0;
+    munmap(shared, sizeof(shared_counters));
+    return result;
+}
+
+/**
+ * @brief write a registry file of users registered users in a temporary file and load it in a new user directory, as the
+ * server does at startup
+ * @param load_time output seconds spent to open the registry file and to load the user directory
+ * @return 0 on success, -1 on error(s)
+ */
+int load_bench_directory(uint32_t users, double* load_time){
+    char path[] = "/tmp/bench_registryXXXXXX";
+    int fd = mkstemp(path);
+    if(fd == -1)
+        return -1;
+    close(fd);
+    uchar fingerprint[FINGERPRINT_SIZE] = {0};
+    int ret = registry_open(path, true);
+    for(uint32_t i = 0; ret && i < users; i++){
+        if(registry_append("user" + to_string(i), fingerprint, IDENTITY_KEY_RSA) == -1)
+            ret = 0;
+    }
+    registry_close();
+    if(directory != nullptr)
+        munmap(directory, sizeof(user_directory));
+    directory = nullptr;
+
+    auto start = chrono::steady_clock::now();
+    ret = ret && user_directory_create() && registry_open(path, false) && user_directory_load();
+    *load_time = elapsed_since(start);
+    registry_close();
+    unlink(path);
+    return ret? 0: -1;
+}
+
+/**
+ * @brief measure the startup of the server: open of the registry file and load of the user directory
+ * @return 0 on success, -1 on error(s)
+ */
+int bench_registry_load(){
+    cout << "registry_load: open of the registry file and load of the user directory" << endl;
+    for(uint users : registry_sizes){
+        double load_time;
+        if(load_bench_directory(users, &load_time) != 0)
+            return -1;
+        cout << "  " << users << " users: " << load_time * 1000 << " ms" << endl;
+    }
+    return 0;
+}
+
+/**
+ * @brief compare the presence lookups through the named semaphore with the seqlocks of the user directory, with an
+ * increasing number of processes
+ * @return 0 on success, -1 on error(s)
+ */
+int bench_presence(){
+    cout << "presence: lookups of the worker of random users, one process keeps changing the busy flags" << endl;
+    double load_time;
+    if(load_bench_directory(bench_users, &load_time) != 0)
+        return -1;
+    sem_unlink(bench_sem_name);
+    for(uint processes : lookup_processes){
+        double before = bench_presence_lookups(processes, true);
+        double after = bench_presence_lookups(processes, false);
+        if(before == 0 || after == 0){
+            sem_unlink(bench_sem_name);
+            return -1;
+        }
+        cout << "  " << processes << " readers: named semaphore " << (uint64_t)before << " lookups/s, seqlock "
+            << (uint64_t)after << " lookups/s" << endl;
+    }
+    sem_unlink(bench_sem_name);
+    return 0;
+}
+
+/**
+ * @brief obtain the parsed public key of a user from its key file, as the handshake did before the public key cache:
+ * open of the file, serialization, check of the fingerprint and parse
+ * @return the key, to free with free_pubkey, nullptr on error(s)
+ */
+void* parse_pubkey_from_file(int user_id){
+    string path = string(PUBKEY_FOLDER) + "/" + bench_pubkey_user + "_pubkey.pem";
+    FILE* pubkey_file = fopen(path.c_str(), "rb");
+    if(!pubkey_file)
+        return nullptr;
+    uchar* pubkey_ser;
+    int pubkey_len = serialize_pubkey_from_file(pubkey_file, &pubkey_ser);
+    fclose(pubkey_file);
+    if(pubkey_len <= 0)
+        return nullptr;
+    uchar fingerprint[FINGERPRINT_SIZE], registered_fingerprint[FINGERPRINT_SIZE];
+    void* pubkey = nullptr;
+    if(pubkey_fingerprint(pubkey_ser, pubkey_len, fingerprint) && get_user_fingerprint(user_id, registered_fingerprint) &&
+        memcmp(fingerprint, registered_fingerprint, FINGERPRINT_SIZE) == 0)
+        pubkey = parse_pubkey(pubkey_ser, pubkey_len);
+    free(pubkey_ser);
+    return pubkey;
+}
+
+/**
+ * @brief compare the lookup of the public key of a user through its key file with the public key cache, the key of
+ * the user is registered in a temporary registry file
+ * @return 0 on success, -1 on error(s)
+ */
+int bench_pubkey_cache(){
+    cout << "pubkey_cache: lookup of the public key of a user for a handshake (parsed) and a chat setup (serialized)" << endl;
+    string path = string(PUBKEY_FOLDER) + "/" + bench_pubkey_user + "_pubkey.pem";
+    FILE* pubkey_file = fopen(path.c_str(), "rb");
+    if(!pubkey_file)
+        return -1;
+    uchar fingerprint[FINGERPRINT_SIZE];
+    int key_type;
+    int ret = pubkey_fingerprint_from_file(pubkey_file, fingerprint, &key_type);
+    fclose(pubkey_file);
+    char registry_path[] = "/tmp/bench_registryXXXXXX";
+    int fd = mkstemp(registry_path);
+    if(!ret || fd == -1)
+        return -1;
+    close(fd);
+    if(directory != nullptr)
+        munmap(directory, sizeof(user_directory));
+    directory = nullptr;
+    int user_id = -1;
+    ret = registry_open(registry_path, true) && (user_id = registry_append(bench_pubkey_user, fingerprint, key_type)) != -1 &&
+        user_directory_create() && user_directory_load() && pubkey_cache_create();
+
+    uint64_t parsed_files = 0, parsed_hits = 0, serialized_files = 0, serialized_hits = 0;
+    uchar pubkey_ser[PUBKEY_CACHE_MAX_SER];
+    auto start = chrono::steady_clock::now();
+    while(ret && elapsed_since(start) < BENCH_TIME){
+        void* pubkey = parse_pubkey_from_file(user_id);
+        ret = pubkey != nullptr;
+        free_pubkey(pubkey);
+        parsed_files++;
+    }
+    double parsed_file_time = elapsed_since(start);
+    start = chrono::steady_clock::now();
+    while(ret && elapsed_since(start) < BENCH_TIME){
+        ret = pubkey_cache_get_parsed(user_id) != nullptr;
+        parsed_hits++;
+    }
+    double parsed_hit_time = elapsed_since(start);
+    start = chrono::steady_clock::now();
+    while(ret && elapsed_since(start) < BENCH_TIME){
+        pubkey_file = fopen(path.c_str(), "rb");
+        uchar* pubkey;
+        ret = pubkey_file != nullptr && serialize_pubkey_from_file(pubkey_file, &pubkey) > 0;
+        if(pubkey_file)
+            fclose(pubkey_file);
+        if(ret)
+            free(pubkey);
+        serialized_files++;
+    }
+    double serialized_file_time = elapsed_since(start);
+    start = chrono::steady_clock::now();
+    while(ret && elapsed_since(start) < BENCH_TIME){
+        ret = pubkey_cache_get_serialized(user_id, pubkey_ser) != 0;
+        serialized_hits++;
+    }
+    double serialized_hit_time = elapsed_since(start);
+    registry_close();
+    unlink(registry_path);
+    if(!ret)
+        return -1;
+    cout << "  parsed: key file " << (uint64_t)(parsed_files / parsed_file_time) << " lookups/s, cache "
+        << (uint64_t)(parsed_hits / parsed_hit_time) << " lookups/s" << endl;
+    cout << "  serialized: key file " << (uint64_t)(serialized_files / serialized_file_time) << " lookups/s, cache "
+        << (uint64_t)(serialized_hits / serialized_hit_time) << " lookups/s" << endl;
+    return 0;
+}
+
+/**
+ * @brief measure the key pairs of a burst of handshakes: generated on the spot, and taken from a pool filled while the
+ * server was idle. The burst is longer than the pool, the handshakes after the underrun generate their keys as before
+ * @return 0 on success, -1 on error(s)
+ */
+int bench_eph_keys(){
+    cout << "eph_keys: ephemeral key pairs of a burst of " << 4 * EPH_KEY_POOL_DEPTH << " handshakes" << endl;
+    const uint burst = 4 * EPH_KEY_POOL_DEPTH;
+    void* privkey;
+    uchar* pubkey;
+    uint pubkey_len;
+    auto start = chrono::steady_clock::now();
+    for(uint i = 0; i < burst; i++){
+        if(!eph_key_generate(&privkey, &pubkey, &pubkey_len))
+            return -1;
+        safe_free_privkey(privkey);
+        free(pubkey);
+    }
+    double generate_time = elapsed_since(start);
+
+    if(!eph_key_pool_start(EPH_KEY_POOL_DEPTH))
+        return -1;
+    eph_key_pool_stats stats;
+    do{
+        usleep(10000); //the server is idle before the burst
+        eph_key_pool_get_stats(&stats);
+    } while(stats.generated < EPH_KEY_POOL_DEPTH);
+    uint first_underrun = 0;
+    double pool_full_time = 0;
+    start = chrono::steady_clock::now();
+    for(uint i = 0; i < burst; i++){
+        if(!eph_key_pool_get(&privkey, &pubkey, &pubkey_len, 0)){
+            eph_key_pool_stop();
+            return -1;
+        }
+        safe_free_privkey(privkey);
+        free(pubkey);
+        eph_key_pool_get_stats(&stats);
+        if(first_underrun == 0 && stats.underruns > 0){
+            first_underrun = i + 1;
+            pool_full_time = elapsed_since(start);
+        }
+    }
+    double pool_time = elapsed_since(start);
+    eph_key_pool_get_stats(&stats);
+    eph_key_pool_stop();
+    cout << "  generated on the spot: " << generate_time * 1e6 / burst << " us per handshake" << endl;
+    if(first_underrun > 1)
+        cout << "  pool, first " << first_underrun - 1 << " handshakes: " << pool_full_time * 1e6 / (first_underrun - 1)
+            << " us per handshake" << endl;
+    cout << "  pool, whole burst: " << pool_time * 1e6 / burst << " us per handshake, " << stats.underruns << " underruns"
+        << endl;
+    return 0;
+}
+
+/**
+ * @brief run the key agreement of a handshake, both sides: ephemeral key pairs, shared secret and session key
+ * @param wire_bytes output bytes of the two ephemeral public keys sent in M2 and M3
+ * @return 1 on success, 0 on error(s)
+ */
+int key_agreement(uint8_t caps, uint* wire_bytes){
+    void* privkey_s;
+    void* privkey_c;
+    uchar *pubkey_s, *pubkey_c, *secret_s, *secret_c, *key_s, *key_c;
+    uint pubkey_s_len, pubkey_c_len;
+    if(!eph_key_generate(&privkey_s, &pubkey_s, &pubkey_s_len, caps))
+        return 0;
+    if(!eph_key_generate(&privkey_c, &pubkey_c, &pubkey_c_len, caps)){
+        safe_free_privkey(privkey_s);
+        free(pubkey_s);
+        return 0;
+    }
+    //derive_secret frees the private key
+    uint secret_s_len = derive_secret(privkey_s, pubkey_c, pubkey_c_len, &secret_s);
+    uint secret_c_len = derive_secret(privkey_c, pubkey_s, pubkey_s_len, &secret_c);
+    int ret = secret_s_len != 0 && secret_c_len != 0;
+    uint key_s_len = ret? derive_session_key(secret_s, secret_s_len, caps, &key_s): 0;
+    uint key_c_len = ret? derive_session_key(secret_c, secret_c_len, caps, &key_c): 0;
+    ret = ret && key_s_len != 0 && key_s_len == key_c_len && memcmp(key_s, key_c, key_s_len) == 0;
+    *wire_bytes = pubkey_s_len + pubkey_c_len;
+    if(secret_s_len)
+        safe_free(secret_s, secret_s_len);
+    if(secret_c_len)
+        safe_free(secret_c, secret_c_len);
+    if(key_s_len)
+        safe_free(key_s, key_s_len);
+    if(key_c_len)
+        safe_free(key_c, key_c_len);
+    free(pubkey_s);
+    free(pubkey_c);
+    return ret;
+}
+
+/**
+ * @brief compare the key agreement of the handshake with P-256 keys in PEM and with X25519 raw keys and HKDF
+ * (CAP_X25519). The signatures and the certificate are the same in both cases and they are not measured
+ * @return 0 on success, -1 on error(s)
+ */
+int bench_handshake(){
+    cout << "handshake: key agreement of client and server (key pairs, shared secret, session key)" << endl;
+    const uint8_t variants[] = {0, CAP_X25519};
+    for(uint8_t caps : variants){
+        uint64_t handshakes = 0;
+        uint wire_bytes = 0;
+        auto start = chrono::steady_clock::now();
+        while(elapsed_since(start) < BENCH_TIME){
+            if(!key_agreement(caps, &wire_bytes))
+                return -1;
+            handshakes++;
+        }
+        cout << "  " << ((caps & CAP_X25519)? "X25519 raw + HKDF": "P-256 PEM + digest") << ": "
+            << (uint64_t)(handshakes / elapsed_since(start)) << " handshakes/s, ephemeral keys on the wire " << wire_bytes
+            << " B" << endl;
+    }
+    return 0;
+}
+
+/**
+ * @brief compare the identity keys of the users: the server of a handshake signs M2 and verifies the signature of M3,
+ * the client does the same with the opposite roles. The key agreement is not measured (see bench_handshake)
+ * @return 0 on success, -1 on error(s)
+ */
+int bench_signatures(){
+    cout << "signatures: identity key of a handshake, 1 signature and 1 verification per side" << endl;
+    uchar document[2 * PUBKEY_DEFAULT_SER];
+    memset(document, 0x5a, sizeof(document));
+    for(int key_type : {IDENTITY_KEY_RSA, IDENTITY_KEY_ED25519}){
+        EVP_PKEY* key = (key_type == IDENTITY_KEY_RSA)? EVP_PKEY_Q_keygen(NULL, NULL, "RSA", (size_t)2048):
+            EVP_PKEY_Q_keygen(NULL, NULL, "ED25519");
+        if(key == nullptr)
+            return -1;
+        uint64_t handshakes = 0;
+        uint sign_len = 0;
+        auto start = chrono::steady_clock::now();
+        while(elapsed_since(start) < BENCH_TIME){
+            uchar* signature;
+            if(!sign_document(document, sizeof(document), (void*)key, &signature, &sign_len)){
+                EVP_PKEY_free(key);
+                return -1;
+            }
+            //A key pair holds the public key too
+            int ret = verify_sign_parsed_pubkey(signature, sign_len, document, sizeof(document), (void*)key);
+            free(signature);
+            if(ret != 1){
+                EVP_PKEY_free(key);
+                return -1;
+            }
+            handshakes++;
+        }
+        cout << "  " << ((key_type == IDENTITY_KEY_RSA)? "RSA-2048": "Ed25519") << ": "
+            << (uint64_t)(handshakes / elapsed_since(start)) << " handshakes/s/core, signature " << sign_len << " B" << endl;
+        EVP_PKEY_free(key);
+    }
+    return 0;
+}
+
+/**
+ * @brief server side of a full handshake: key pair, signature of M2, verification of M3, shared secret and session key
+ * @return 1 on success, 0 on error(s)
+ */
+int full_handshake_server(void* server_key, void* client_key, uchar* document, uint document_len, uchar* client_signature,
+    uint client_signature_len, uchar* peer_pubkey, uint peer_pubkey_len, uchar** session_key){
+    void* privkey;
+    uchar *pubkey, *signature, *secret;
+    uint pubkey_len, signature_len;
+    if(!eph_key_generate(&privkey, &pubkey, &pubkey_len, SUPPORTED_CAPS))
+        return 0;
+    free(pubkey);
+    int ret = sign_document(document, document_len, server_key, &signature, &signature_len);
+    if(ret)
+        free(signature);
+    ret = ret && verify_sign_parsed_pubkey(client_signature, client_signature_len, document, document_len, client_key) == 1;
+    //derive_secret frees the private key
+    uint secret_len = derive_secret(privkey, peer_pubkey, peer_pubkey_len, &secret);
+    ret = ret && secret_len != 0 && derive_session_key(secret, secret_len, SUPPORTED_CAPS, session_key) != 0;
+    if(secret_len)
+        safe_free(secret, secret_len);
+    return ret;
+}
+
+/**
+ * @brief server side of a resumption: opening of the ticket, check of the binder, session key and new ticket
+ * @param M1 M1 of the client, with the ticket and the binder at the end
+ * @return 1 on success, 0 on error(s)
+ */
+int resumption_server(uchar* M1, uint M1_len, uint ticket_offset, uint ticket_len, uchar** session_key){
+    session_ticket ticket;
+    if(!session_ticket_open(M1 + ticket_offset, ticket_len, &ticket))
+        return 0;
+    uchar binder[RESUMPTION_BINDER_SIZE];
+    uint bound_len = M1_len - RESUMPTION_BINDER_SIZE;
+    int ret = hmac_compute(ticket.resumption_secret, RESUMPTION_SECRET_SIZE, M1, bound_len, binder) &&
+        digest_compare(binder, M1 + bound_len, RESUMPTION_BINDER_SIZE) == 0;
+    uchar nonces[2 * NONCE_SIZE] = {0};
+    uint key_len = ret? derive_resumed_session_key(ticket.resumption_secret, nonces, sizeof(nonces), session_key): 0;
+    uchar new_ticket[MAX_TICKET_SIZE];
+    ret = key_len != 0 && session_ticket_issue(ticket.user_id, ticket.generation + 1, *session_key, key_len, new_ticket) != 0;
+    OPENSSL_cleanse(&ticket, sizeof(ticket));
+    return ret;
+}
+
+/**
+ * @brief compare the CPU time of the server for a reconnect with a full handshake (RSA-2048 identity keys, X25519)
+ * and with a session ticket. The client side and the network are not measured
+ * @return 0 on success, -1 on error(s)
+ */
+int bench_resumption(){
+    cout << "resumption: server CPU per reconnect, full handshake vs session ticket" << endl;
+    if(!session_ticket_keys_create())
+        return -1;
+    EVP_PKEY* server_key = EVP_PKEY_Q_keygen(NULL, NULL, "RSA", (size_t)2048);
+    EVP_PKEY* client_key = EVP_PKEY_Q_keygen(NULL, NULL, "RSA", (size_t)2048);
+    void* peer_privkey;
+    uchar *peer_pubkey, *client_signature;
+    uint peer_pubkey_len, client_signature_len;
+    uchar document[NONCE_SIZE + X25519_KEY_SIZE];
+    memset(document, 0x5a, sizeof(document));
+    if(server_key == nullptr || client_key == nullptr ||
+        !eph_key_generate(&peer_privkey, &peer_pubkey, &peer_pubkey_len, SUPPORTED_CAPS) ||
+        !sign_document(document, sizeof(document), (void*)client_key, &client_signature, &client_signature_len))
+        return -1;
+    safe_free_privkey(peer_privkey);
+
+    //M1 of a resumption: R1, username length, username, ticket length, ticket, binder
+    uchar session_key[32];
+    random_generate(sizeof(session_key), session_key);
+    uchar M1[NONCE_SIZE + 2 * sizeof(uint32_t) + MAX_USERNAME_SIZE + MAX_TICKET_SIZE + RESUMPTION_BINDER_SIZE] = {0};
+    uint ticket_offset = NONCE_SIZE + 2 * sizeof(uint32_t) + MAX_USERNAME_SIZE;
+    uint ticket_len = session_ticket_issue(0, 1, session_key, sizeof(session_key), M1 + ticket_offset);
+    uchar resumption_secret[RESUMPTION_SECRET_SIZE];
+    if(ticket_len == 0 || !derive_resumption_secret(session_key, sizeof(session_key), resumption_secret) ||
+        !hmac_compute(resumption_secret, RESUMPTION_SECRET_SIZE, M1, ticket_offset + ticket_len, M1 + ticket_offset + ticket_len))
+        return -1;
+    uint M1_len = ticket_offset + ticket_len + RESUMPTION_BINDER_SIZE;
+
+    for(int resumed = 0; resumed < 2; resumed++){
+        uint64_t reconnects = 0;
+        auto start = chrono::steady_clock::now();
+        while(elapsed_since(start) < BENCH_TIME){
+            uchar* key = nullptr;
+            int ret = resumed? resumption_server(M1, M1_len, ticket_offset, ticket_len, &key):
+                full_handshake_server(server_key, client_key, document, sizeof(document), client_signature,
+                client_signature_len, peer_pubkey, peer_pubkey_len, &key);
+            if(key)
+                safe_free(key, EVP_MD_get_size(DIGEST_DEFAULT));
+            if(!ret)
+                return -1;
+            reconnects++;
+        }
+        double seconds = elapsed_since(start);
+        cout << "  " << (resumed? "session ticket": "full handshake") << ": " << (uint64_t)(reconnects / seconds)
+            << " reconnects/s/core, " << (uint64_t)(seconds * 1e6 / reconnects) << " us of server CPU each" << endl;
+    }
+    free(peer_pubkey);
+    free(client_signature);
+    EVP_PKEY_free(server_key);
+    EVP_PKEY_free(client_key);
+    return 0;
+}
+
+/**
+ * @brief event loop of a worker in one thread: it seals records of 1 KB to relay without pause, and every
+ * handshake_period us a handshake arrives, whose signature of M2 and verification of M3 go to the crypto pool
+ * @param threads threads of the crypto pool, 0 to run the jobs in the event loop as the workers did before the pool
+ * @return 0 on success, -1 on error(s)
+ */
+int relay_with_handshakes(uint threads, EVP_PKEY* key, void* session){
+    const uint pt_len = 1024;
+    uint header_len = RECORD_HEADER_LEN(CAP_COUNTER_NONCE);
+    vector<uchar> record(header_len + sizeof(uint32_t) + pt_len, 0x5a);
+    uchar document[2 * PUBKEY_DEFAULT_SER];
+    memset(document, 0x5a, sizeof(document));
+    uchar* signature;
+    uint signature_len;
+    if(!sign_document(document, sizeof(document), (void*)key, &signature, &signature_len))
+        return -1;
+    if(crypto_pool_start(threads) == -1){
+        free(signature);
+        return -1;
+    }
+
+    uint32_t seq = 0;
+    uint64_t handshakes = 0, long_pauses = 0;
+    double longest_pause = 0;
+    auto start = chrono::steady_clock::now();
+    auto last_record = start;
+    auto next_handshake = start;
+    int ret = 0;
+    while(ret == 0 && elapsed_since(start) < 4 * BENCH_TIME){
+        auto now = chrono::steady_clock::now();
+        if(now >= next_handshake){
+            crypto_job* sign_job = crypto_job_new(CRYPTO_JOB_SIGN);
+            crypto_job* verify_job = crypto_job_new(CRYPTO_JOB_VERIFY);
+            if(!sign_job || !verify_job){
+                crypto_job_free(sign_job);
+                crypto_job_free(verify_job);
+                ret = -1;
+                break;
+            }
+            sign_job->document = (uchar*)malloc(sizeof(document));
+            verify_job->document = (uchar*)malloc(sizeof(document));
+            verify_job->signature = (uchar*)malloc(signature_len);
+            memcpy(sign_job->document, document, sizeof(document));
+            memcpy(verify_job->document, document, sizeof(document));
+            memcpy(verify_job->signature, signature, signature_len);
+            sign_job->document_len = verify_job->document_len = sizeof(document);
+            verify_job->signature_len = signature_len;
+            sign_job->key = verify_job->key = key;
+            crypto_pool_submit(sign_job);
+            crypto_pool_submit(verify_job);
+            handshakes++;
+            next_handshake += chrono::microseconds(handshake_period);
+        }
+        crypto_job* job;
+        while((job = crypto_pool_take_completed()) != nullptr){
+            if(!job->result)
+                ret = -1;
+            crypto_job_free(job);
+        }
+
+        uint32_t seq_net = htonl(seq);
+        memcpy(record.data() + header_len, &seq_net, sizeof(uint32_t));
+        if(0 == auth_enc_session_seal(session, seq, record.data(), pt_len + sizeof(uint32_t), nullptr))
+            ret = -1;
+        seq++;
+        now = chrono::steady_clock::now();
+        double pause = chrono::duration<double>(now - last_record).count();
+        last_record = now;
+        longest_pause = max(longest_pause, pause);
+        long_pauses += (pause > 100e-6);
+    }
+    double seconds = elapsed_since(start);
+    crypto_pool_stop();
+    crypto_job* job;
+    while((job = crypto_pool_take_completed()) != nullptr)
+        crypto_job_free(job);
+    free(signature);
+    if(ret != 0)
+        return -1;
+    crypto_pool_stats sign_stats;
+    crypto_pool_get_stats(CRYPTO_JOB_SIGN, &sign_stats);
+    cout << "  " << ((threads == 0)? string("in the event loop"): "pool of " + to_string(threads) + " threads") << ": "
+        << (uint64_t)(seq / seconds) << " records/s, " << long_pauses << " pauses of the relay over 100 us, longest "
+        << longest_pause * 1e3 << " ms; " << handshakes << " handshakes, signature p99 under "
+        << crypto_pool_latency_percentile(&sign_stats, 0.99) << " us" << endl;
+    return 0;
+}
+
+/**
+ * @brief verifications of M3 submitted to a pool of CRYPTO_POOL_THREADS threads, verified one by one or in batches:
+ * verify_storm_jobs at once in a reconnect storm, or one at a time (each after the previous one is completed) when the
+ * logins are isolated
+ * @param batch verifications in a batch, 1 to verify them one by one
+ * @param storm true for the reconnect storm, false for the isolated logins
+ * @return 0 on success, -1 on error(s)
+ */
+int verify_logins(EVP_PKEY* key, uint batch, bool storm){
+    uchar document[NONCE_SIZE + X25519_KEY_SIZE];
+    memset(document, 0x5a, sizeof(document));
+    uchar* signature;
+    uint signature_len;
+    if(!sign_document(document, sizeof(document), (void*)key, &signature, &signature_len))
+        return -1;
+    crypto_pool_set_verify_batch(batch, CRYPTO_VERIFY_BATCH_DELAY);
+    int pool_fd = crypto_pool_start(CRYPTO_POOL_THREADS);
+    if(pool_fd == -1){
+        free(signature);
+        return -1;
+    }
+    uint jobs = storm? verify_storm_jobs: verify_isolated_jobs;
+    int ret = 0;
+    uint submitted = 0;
+    uint completed = 0;
+    auto start = chrono::steady_clock::now();
+    while(ret == 0 && completed < jobs){
+        //The next isolated login arrives only once the previous one is over
+        while(submitted < jobs && (storm || submitted == completed)){
+            crypto_job* job = crypto_job_new(CRYPTO_JOB_VERIFY);
+            if(!job){
+                ret = -1;
+                break;
+            }
+            job->document = (uchar*)malloc(sizeof(document));
+            job->signature = (uchar*)malloc(signature_len);
+            memcpy(job->document, document, sizeof(document));
+            memcpy(job->signature, signature, signature_len);
+            job->document_len = sizeof(document);
+            job->signature_len = signature_len;
+            job->key = key;
+            crypto_pool_submit(job);
+            submitted++;
+        }
+        pollfd pfd = {pool_fd, POLLIN, 0};
+        poll(&pfd, 1, 1000);
+        uint64_t completions;
+        if(read(pool_fd, &completions, sizeof(completions)) == -1 && errno != EAGAIN)
+            ret = -1;
+        crypto_job* job;
+        while((job = crypto_pool_take_completed()) != nullptr){
+            if(!job->result)
+                ret = -1;
+            crypto_job_free(job);
+            completed++;
+        }
+    }
+    double seconds = elapsed_since(start);
+    crypto_pool_stop();
+    crypto_job* job;
+    while((job = crypto_pool_take_completed()) != nullptr)
+        crypto_job_free(job);
+    crypto_pool_set_verify_batch(1, 0);
+    free(signature);
+    if(ret != 0)
+        return -1;
+    crypto_pool_stats stats;
+    crypto_pool_get_stats(CRYPTO_JOB_VERIFY, &stats);
+    cout << "    " << (storm? "storm, ": "isolated, ") << ((batch == 1)? string("one by one"): "batches of " +
+        to_string(batch) + " or " + to_string(CRYPTO_VERIFY_BATCH_DELAY) + " us") << ": " << (uint64_t)(jobs / seconds)
+        << " verifications/s, " << ((stats.batches == 0)? 0: stats.batched_jobs / stats.batches)
+        << " jobs per batch on average, p50 " << crypto_pool_latency_percentile(&stats, 0.5) << " us, p99 "
+        << crypto_pool_latency_percentile(&stats, 0.99) << " us" << endl;
+    return 0;
+}
+
+/**
+ * @brief compare the relay of records while handshakes arrive, with the signatures and verifications of the handshakes
+ * run in the event loop and in crypto pools of different sizes
+ * @return 0 on success, -1 on error(s)
+ */
+int bench_crypto_pool(){
+    cout << "crypto_pool: relay of 1 KB records with a handshake (RSA-2048 signature and verification) every "
+        << handshake_period << " us" << endl;
+    EVP_PKEY* key = EVP_PKEY_Q_keygen(NULL, NULL, "RSA", (size_t)2048);
+    uchar session_key[32];
+    if(key == nullptr || 1 != random_generate(sizeof(session_key), session_key)){
+        EVP_PKEY_free(key);
+        return -1;
+    }
+    void* session = auth_enc_session_new(session_key, CAP_COUNTER_NONCE, true);
+    int ret = (session == nullptr)? -1: 0;
+    for(uint threads : crypto_pool_sizes){
+        if(ret == 0)
+            ret = relay_with_handshakes(threads, key, session);
+    }
+    auth_enc_session_free(session);
+    EVP_PKEY_free(key);
+    if(ret != 0)
+        return -1;
+
+    cout << "  logins: " << verify_storm_jobs << " verifications of M3 at once (reconnect storm) or " << verify_isolated_jobs
+        << " one at a time (isolated), pool of " << CRYPTO_POOL_THREADS << " threads" << endl;
+    for(int key_type : {IDENTITY_KEY_RSA, IDENTITY_KEY_ED25519}){
+        key = (key_type == IDENTITY_KEY_RSA)? EVP_PKEY_Q_keygen(NULL, NULL, "RSA", (size_t)2048):
+            EVP_PKEY_Q_keygen(NULL, NULL, "ED25519");
+        if(key == nullptr)
+            return -1;
+        cout << "   " << ((key_type == IDENTITY_KEY_RSA)? "RSA-2048": "Ed25519") << endl;
+        for(bool storm : {true, false}){
+            for(uint batch : {1u, (uint)CRYPTO_VERIFY_BATCH_SIZE}){
+                if(ret == 0)
+                    ret = verify_logins(key, batch, storm);
+            }
+        }
+        EVP_PKEY_free(key);
+    }
+    return ret;
+}
+
+/*
+* Client of the slow handshakes: it sends M1 in parts, echoes the cookie if the server asks for one, waits for M2 and
+* sends in parts an M3 with a signature that is not valid, so that the server closes the connection after the check
+*/
+enum slow_step { SLOW_SEND_M1, SLOW_WAIT_M2, SLOW_SEND_M3, SLOW_WAIT_CLOSE, SLOW_DONE };
+
+struct slow_client {
+    int socket_id = -1;
+    slow_step step = SLOW_SEND_M1;
+    uchar R1[NONCE_SIZE];
+    uchar cookie[COOKIE_SIZE];
+    bool has_cookie = false;
+    vector<uchar> message; //message that is being sent
+    uint parts_sent = 0;
+    uint sent = 0;
+    chrono::steady_clock::time_point next_part;
+    chrono::steady_clock::time_point M1_sent;
+    vector<uchar> received;
+};
+
+/**
+ * @brief connect a slow client to the server, its socket is not blocking
+ * @return 1 on success, 0 on error(s)
+ */
+int slow_connect(slow_client* client){
+    struct sockaddr_in srv_addr;
+    memset(&srv_addr, 0, sizeof(srv_addr));
+    srv_addr.sin_family = AF_INET;
+    srv_addr.sin_port = htons(bench_srv_port);
+    inet_pton(AF_INET, bench_srv_ipv4, &srv_addr.sin_addr);
+    client->socket_id = socket(AF_INET, SOCK_STREAM, 0);
+    if(client->socket_id == -1 || connect(client->socket_id, (struct sockaddr*)&srv_addr, sizeof(srv_addr)) == -1){
+        cerr << "Cannot connect to the server: " << strerror(errno) << endl;
+        return 0;
+    }
+    fcntl(client->socket_id, F_SETFL, O_NONBLOCK);
+    return 1;
+}
+
+/**
+ * @brief prepare M1 of a slow client: R1, username length and capabilities, username, cookie once the server sent it
+ */
+void slow_prepare_M1(slow_client* client){
+    uint32_t username_len = strlen(bench_pubkey_user) + 1;
+    uint32_t username_len_net = htonl(username_len | ((uint32_t)(client->has_cookie? CAP_COOKIE: 0) << CAPS_SHIFT));
+    client->message.assign(client->R1, client->R1 + NONCE_SIZE);
+    client->message.insert(client->message.end(), (uchar*)&username_len_net, (uchar*)&username_len_net + sizeof(uint32_t));
+    client->message.insert(client->message.end(), (uchar*)bench_pubkey_user, (uchar*)bench_pubkey_user + username_len);
+    if(client->has_cookie){
+        uint32_t cookie_len_net = htonl(COOKIE_SIZE);
+        client->message.insert(client->message.end(), (uchar*)&cookie_len_net, (uchar*)&cookie_len_net + sizeof(uint32_t));
+        client->message.insert(client->message.end(), client->cookie, client->cookie + COOKIE_SIZE);
+    }
+    client->step = SLOW_SEND_M1;
+    client->parts_sent = 0;
+    client->sent = 0;
+    client->received.clear();
+}
+
+/**
+ * @brief length of M2 (R2, ephemeral key, signature, certificate) or of the cookie message that replaces it
+ * @return length of the message once it is all received, 0 otherwise
+ */
+uint slow_M2_length(vector<uchar>& M2, bool* cookie){
+    uint length = NONCE_SIZE;
+    //Ephemeral key (or cookie), signature and certificate, each one preceded by its length
+    for(int field = 0; field < 3; field++){
+        if(M2.size() < length + sizeof(uint32_t))
+            return 0;
+        uint32_t field_len;
+        memcpy(&field_len, M2.data() + length, sizeof(uint32_t));
+        field_len = ntohl(field_len);
+        *cookie = field == 0 && ((field_len >> CAPS_SHIFT) & CAP_COOKIE);
+        length += sizeof(uint32_t) + (field_len & CAPS_LEN_MASK);
+        if(*cookie)
+            break;
+    }
+    return (M2.size() >= length)? length: 0;
+}
+
+/**
+ * @brief drive slow_clients concurrent handshakes with the server running on this machine (the user of the benchmark
+ * has to be offline): every message is sent in slow_parts parts slow_part_interval ms apart. The server has to answer
+ * M1 of all of them while they are still sending, a server that waits for the messages of a client cannot
+ * @return 0 if every client received M2 and then saw its invalid M3 refused, -1 otherwise
+ */
+int bench_slow_handshakes(){
+    cout << "slow_handshakes: " << slow_clients << " concurrent handshakes of " << bench_pubkey_user << " with the server at "
+        << bench_srv_ipv4 << ":" << bench_srv_port << ", every message in " << slow_parts << " parts " << slow_part_interval
+        << " ms apart" << endl;
+    struct rlimit fd_limit;
+    if(0 == getrlimit(RLIMIT_NOFILE, &fd_limit)){
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+    //M3: a valid ephemeral key and a signature of the length of an RSA-2048 one that does not verify
+    void* eph_privkey;
+    uchar* eph_pubkey;
+    uint eph_pubkey_len;
+    if(!eph_key_generate(&eph_privkey, &eph_pubkey, &eph_pubkey_len))
+        return -1;
+    safe_free_privkey(eph_privkey);
+    uchar signature[PUBKEY_DEFAULT / 8];
+    random_generate(sizeof(signature), signature);
+    uint32_t eph_pubkey_len_net = htonl(eph_pubkey_len);
+    uint32_t signature_len_net = htonl(sizeof(signature));
+    vector<uchar> M3((uchar*)&eph_pubkey_len_net, (uchar*)&eph_pubkey_len_net + sizeof(uint32_t));
+    M3.insert(M3.end(), eph_pubkey, eph_pubkey + eph_pubkey_len);
+    M3.insert(M3.end(), (uchar*)&signature_len_net, (uchar*)&signature_len_net + sizeof(uint32_t));
+    M3.insert(M3.end(), signature, signature + sizeof(signature));
+    free(eph_pubkey);
+
+    vector<slow_client> clients(slow_clients);
+    auto start = chrono::steady_clock::now();
+    for(slow_client& client : clients){
+        random_generate(NONCE_SIZE, client.R1);
+        if(!slow_connect(&client))
+            return -1;
+        slow_prepare_M1(&client);
+        client.next_part = start;
+    }
+    uint done = 0, cookies = 0, M2_received = 0, refused = 0, failures = 0;
+    double M2_latency_sum = 0, M2_latency_max = 0;
+    vector<pollfd> waiting;
+    vector<slow_client*> waiting_clients;
+    while(done < slow_clients && elapsed_since(start) < slow_max_time){
+        auto now = chrono::steady_clock::now();
+        int timeout = slow_part_interval;
+        waiting.clear();
+        waiting_clients.clear();
+        for(slow_client& client : clients){
+            if(client.step == SLOW_SEND_M1 || client.step == SLOW_SEND_M3){
+                if(now >= client.next_part){
+                    client.parts_sent++;
+                    uint part_end = client.message.size() * client.parts_sent / slow_parts;
+                    if(part_end > client.sent && send(client.socket_id, client.message.data() + client.sent, part_end - client.sent, 0) != (ssize_t)(part_end - client.sent)){
+                        client.step = SLOW_DONE;
+                        failures++;
+                        done++;
+                        continue;
+                    }
+                    client.sent = part_end;
+                    client.next_part = now + chrono::milliseconds(slow_part_interval);
+                    if(client.parts_sent == slow_parts){
+                        client.M1_sent = now;
+                        client.step = (client.step == SLOW_SEND_M1)? SLOW_WAIT_M2: SLOW_WAIT_CLOSE;
+                    }
+                }
+                if(client.step == SLOW_SEND_M1 || client.step == SLOW_SEND_M3){
+                    timeout = min(timeout, (int)chrono::duration_cast<chrono::milliseconds>(client.next_part - now).count());
+                    continue;
+                }
+            }
+            if(client.step == SLOW_WAIT_M2 || client.step == SLOW_WAIT_CLOSE){
+                waiting.push_back({client.socket_id, POLLIN, 0});
+                waiting_clients.push_back(&client);
+            }
+        }
+        if(poll(waiting.data(), waiting.size(), max(timeout, 0)) <= 0)
+            continue;
+
+        for(uint i = 0; i < waiting.size(); i++){
+            if(waiting[i].revents == 0)
+                continue;
+            slow_client* client = waiting_clients[i];
+            uchar buffer[4096];
+            ssize_t ret = recv(client->socket_id, buffer, sizeof(buffer), 0);
+            if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                continue;
+            if(ret <= 0 || client->step == SLOW_WAIT_CLOSE){
+                //The server closes the connection once it has refused M3
+                if(client->step == SLOW_WAIT_CLOSE && ret <= 0)
+                    refused++;
+                else
+                    failures++;
+                close(client->socket_id);
+                client->step = SLOW_DONE;
+                done++;
+                continue;
+            }
+            client->received.insert(client->received.end(), buffer, buffer + ret);
+            bool cookie;
+            uint M2_len = slow_M2_length(client->received, &cookie);
+            if(M2_len == 0)
+                continue;
+            if(cookie){
+                //Same R1 on a new connection, with the cookie after the username
+                memcpy(client->cookie, client->received.data() + NONCE_SIZE + sizeof(uint32_t), COOKIE_SIZE);
+                client->has_cookie = true;
+                cookies++;
+                close(client->socket_id);
+                if(!slow_connect(client))
+                    return -1;
+                slow_prepare_M1(client);
+                client->next_part = chrono::steady_clock::now();
+                continue;
+            }
+            double latency = elapsed_since(client->M1_sent);
+            M2_latency_sum += latency;
+            M2_latency_max = max(M2_latency_max, latency);
+            M2_received++;
+            client->message = M3;
+            client->step = SLOW_SEND_M3;
+            client->parts_sent = 0;
+            client->sent = 0;
+            client->next_part = chrono::steady_clock::now();
+        }
+    }
+    double seconds = elapsed_since(start);
+    for(slow_client& client : clients){
+        if(client.step != SLOW_DONE)
+            close(client.socket_id);
+    }
+    cout << "  " << M2_received << " M2 received (" << cookies << " cookies asked first), " << refused << " M3 refused, "
+        << failures << " connections lost, " << slow_clients - done << " not finished in " << seconds << " s" << endl;
+    if(M2_received > 0)
+        cout << "  from the last part of M1 to M2: " << M2_latency_sum * 1000 / M2_received << " ms on average, "
+            << M2_latency_max * 1000 << " ms at most" << endl;
+    return (M2_received == slow_clients && refused == slow_clients)? 0: -1;
+}
+
+int main(int argc, char* argv[]){
+    string selected = (argc > 1)? argv[1]: "";
+    int ret = 0;
+    if(selected.empty() || selected == "record_crypto")
+        ret |= bench_record_crypto();
+    if(selected.empty() || selected == "record_framing")
+        ret |= bench_record_framing();
+    if(selected.empty() || selected == "presence")
+        ret |= bench_presence();
+    if(selected.empty() || selected == "registry_load")
+        ret |= bench_registry_load();
+    if(selected.empty() || selected == "pubkey_cache")
+        ret |= bench_pubkey_cache();
+    if(selected.empty() || selected == "eph_keys")
+        ret |= bench_eph_keys();
+    if(selected.empty() || selected == "handshake")
+        ret |= bench_handshake();
+    if(selected.empty() || selected == "signatures")
+        ret |= bench_signatures();
+    if(selected.empty() || selected == "resumption")
+        ret |= bench_resumption();
+    if(selected.empty() || selected == "crypto_pool")
+        ret |= bench_crypto_pool();
+    if(selected == "slow_handshakes")
+        ret |= bench_slow_handshakes();
+    if(ret != 0)
+        cerr << "Error during the benchmark" << endl;
+    return ret;
+}
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <iostream>
 #include <vector>
 #include <climits>
@@ -16,9 +17,13 @@
 #include <openssl/pem.h>
 #include <openssl/rand.h>
 #include <sstream>
+#include <fstream>
+#include <chrono>
+#include <algorithm>
 #include "constant.h"
 #include "util.h"
 #include "crypto.h"
+#include "protocol.h"
 
 
 using namespace std;
@@ -42,7 +47,7 @@ string peer_username;
 int peer_id;
 
 /* socket id*/
-int sock_id;                           
+int sock_id = -1;                      
 
 /* Session key between client and server*/
 unsigned char* session_key_clientToServer = NULL;
@@ -52,18 +57,45 @@ uint32_t session_key_clientToServer_len = 0;
 unsigned char* session_key_clientToClient = NULL;
 uint32_t session_key_clientToClient_len = 0;
 
+/* Authenticated encryption sessions (cipher contexts) of the two session keys */
+void* session_clientToServer = NULL;
+void* session_clientToClient = NULL;
+// Capabilities negotiated in the handshake of the sessions
+uint8_t caps_clientToServer = 0;
+uint8_t caps_clientToClient = 0;
+
 /* Peer Public Key*/
 unsigned char* peer_pub_key = NULL;
 
 /* Server certificate */
 unsigned char* server_cert = NULL;
 
+/* Trust store of the certification authority (CA certificate and CRL), loaded once by load_ca_store */
+void* ca_store = NULL;
+
 // Counter for freshness
 uint32_t receive_counter=0;
 uint32_t send_counter=0;
 uint32_t receive_counter_client_client = 0;
 uint32_t send_counter_client_client = 0;
 
+/* Buffer where send_secure builds the records, it only grows */
+unsigned char* record_buffer = NULL;
+uint32_t record_buffer_size = 0;
+
+/* Bytes received from the server and not yet opened by recv_secure (RECV_BUFFER_SIZE bytes) */
+unsigned char* recv_buffer = NULL;
+uint32_t recv_buffer_len = 0;
+
+/* Headless mode: the commands come from a script (run_script) instead of the terminal, chat requests are accepted */
+bool headless = false;
+/* Password of the private key in headless mode, NULL to ask it on the terminal */
+char* privkey_password = NULL;
+/* Opcode of the last message handled by arriveHandler, the last chat message received and how many have been received */
+uint8_t last_arrived_op = NOT_VALID_CMD;
+string last_message;
+uint64_t messages_received = 0;
+
 //---------------- STRUCTURES ------------------//
 struct commandMSG
 {
@@ -253,7 +285,7 @@ int retrieveOnlineUsers(unsigned char* plaintext, uint32_t pt_len)
         return -1;
     if(howMany==0)
         return 0;
-    if(howMany>REGISTERED_USERS)
+    if(howMany>MAX_REGISTERED_USERS)
         return -1;
 
     struct user* current = NULL;
@@ -353,348 +385,185 @@ int print_list_users(user* userlist)
 }
 
 /**
- * @brief Retrieve the plaintext from the encrypted message
+ * @brief Retrieve the plaintext from the encrypted message. The record of the other client is decrypted in place inside the
+ * message of the server, that remains owned by the caller
  * 
- * @param ciphertext ciphertext
- * @param ct_len ciphertext length
- * @param plaintext plaintext 
+ * @param ciphertext message of the server that contains the record of the other client
+ * @param msgRecLen message length
+ * @param plaintext plaintext, to release with secure_buffer_free
  * @return Return plaintext len or -1 in case of error
  */
 int open_msg_by_client(unsigned char* ciphertext, uint32_t msgRecLen, unsigned char** plaintext)
 {
     if(ciphertext==NULL)
         return -1;
-    uint32_t header_len = sizeof(uint32_t)+IV_DEFAULT+TAG_DEFAULT; 
-    uint32_t read = 9; // because seq number, opcode and len already read
-    uint32_t ct_len;
-    uint32_t pt_len;
-    int ret;
- 
-    unsigned char* header = (unsigned char*)malloc(header_len);
-    if(!header){
-        cerr << " Error in malloc for header " << endl; 
-        return -1;
-    }
-
-    memcpy(header, ciphertext+read, header_len);
-    read += header_len;
-
-    unsigned char* iv = (unsigned char*)malloc(IV_DEFAULT);
-    if(!iv){
-        cerr << " Error in malloc for iv " << endl; 
-        free(header);
-        return -1;
-    }
-    unsigned char* tag = (unsigned char*)malloc(TAG_DEFAULT);
-    if(!tag){
-        cerr << " Error in malloc for tag " << endl; 
-        free(header);
-        free(iv);
-        return -1;
-    }
-
-    // Open header
-    memcpy((void*)&ct_len, header, sizeof(uint32_t));
-    ct_len = ntohl(ct_len);
-
-    memcpy(iv, header+sizeof(uint32_t), IV_DEFAULT);
-    memcpy(tag, header+sizeof(uint32_t)+IV_DEFAULT, TAG_DEFAULT);
-
-    unsigned char* aad = (unsigned char*)malloc(sizeof(uint32_t));
-    if(!aad){
-        cerr << " Error in aad malloc " << endl;
-        free(ciphertext);
-        free(header);
-        free(tag);
-        free(iv);
-        return -1;
-    }
-    memcpy(aad, header, sizeof(uint32_t));
-
-    if(session_key_clientToClient==NULL){
+    if(session_clientToClient==NULL){
         cerr << " Null key " << endl;
-        free(ciphertext);
-        free(header);
-        free(tag);
-        free(iv);
-        free(aad);
-        return -1;
-    }
-
-    unsigned char* toDecrypt = (unsigned char*)malloc(ct_len);
-    if(!aad){
-        cerr << " Error in toDecrypt malloc " << endl;
-        free(aad);
-        free(ciphertext);
-        free(header);
-        free(tag);
-        free(iv);
         return -1;
     }
-
-    memcpy(toDecrypt, ciphertext+read, ct_len);
-
-    pt_len = auth_enc_decrypt(toDecrypt, ct_len, aad, sizeof(uint32_t), session_key_clientToClient, tag, iv, plaintext);
-    if(pt_len == 0 || pt_len!=ct_len){
-        cerr << " Error during decryption " << endl;
-        free(ciphertext);
-        free(*plaintext);
-        free(header);
-        free(tag);
-        free(iv);
+    uint32_t header_len = RECORD_HEADER_LEN(caps_clientToClient);
+    uint32_t read = 9; // because seq number, opcode and len already read
+    if(msgRecLen<read)
         return -1;
-    }
-    free(ciphertext);
-    free(header);
-    free(tag);
-    free(iv);
 
-    // check seq number
-    uint32_t sequence_number = ntohl(*(uint32_t*) (*plaintext));
-
-    if(sequence_number<receive_counter_client_client){
-        cerr << " Error: wrong seq number " << endl;
-        safe_free(*plaintext,pt_len);
+    int record_len = auth_enc_record_len(ciphertext+read, msgRecLen-read, caps_clientToClient, RELAY_MSG_SIZE);
+    if(record_len<=0){
+        cerr << " Error: invalid message length " << endl;
         return -1;
     }
-    if(sequence_number==MAX_SEQ_NUM){
-        cerr << " Error: maximum number of message in the session reached " << endl;
-        safe_free(*plaintext,pt_len);
+    // Decryption and check of the sequence number
+    int msg_len = record_open(session_clientToClient, caps_clientToClient, &receive_counter_client_client, ciphertext+read, record_len);
+    if(msg_len<0){
+        cerr << " Error during decryption or wrong seq number " << endl;
         return -1;
     }
-    receive_counter_client_client=sequence_number+1;
-
-    uint32_t msg_len = pt_len - sizeof(uint32_t);
-    unsigned char* risp = (unsigned char*)malloc(msg_len);
-    if(!risp)
+    *plaintext = secure_buffer_alloc(msg_len);
+    if(!(*plaintext))
         return -1;
 
-    memcpy(risp, ((*plaintext)+sizeof(uint32_t)), msg_len);
-
-    safe_free((*plaintext), pt_len);
-
-    *plaintext = risp; 
+    memcpy(*plaintext, ciphertext+read+header_len+sizeof(uint32_t), msg_len);
 
     return msg_len;
 }
 
+/**
+ * @brief Check if the receive buffer already holds a whole message of the server (it would not be notified by select)
+ * 
+ * @return true if recv_secure can return a message without receiving
+ */
+bool recv_secure_pending()
+{
+    return recv_buffer_len>0 && auth_enc_record_len(recv_buffer, recv_buffer_len, caps_clientToServer, RELAY_MSG_SIZE+sizeof(uint32_t))!=0;
+}
+
 /**
  * @brief Receive in a secure way the messages sent by the server, decipher it and return the plaintext in the correspodent parameter. It
- * also control the sequence number
+ * also control the sequence number. The bytes available on the socket are received in the receive buffer, also the ones of the
+ * following messages, and the message is decrypted in place
  * 
  * @param socket socket id
- * @param plaintext plaintext obtained by the decryption of the ciphertext
+ * @param plaintext plaintext obtained by the decryption of the ciphertext, to release with secure_buffer_free
  * @return int plaintext length or -1 if error
  */
 int recv_secure(int socket, unsigned char** plaintext)
 {
     if(sock_id<0)
         return -1;
-    uint32_t header_len = sizeof(uint32_t)+IV_DEFAULT+TAG_DEFAULT; 
-    uint32_t ct_len;
-    unsigned char* ciphertext = NULL;
-    uint32_t pt_len;
     int ret;
- 
-    unsigned char* header = (unsigned char*)malloc(header_len);
-    if(!header){
-        cerr << " Error in malloc for header " << endl; 
-        return -1;
-    }
-    unsigned char* iv = (unsigned char*)malloc(IV_DEFAULT);
-    if(!iv){
-        cerr << " Error in malloc for iv " << endl; 
-        free(header);
-        return -1;
-    }
-    unsigned char* tag = (unsigned char*)malloc(TAG_DEFAULT);
-    if(!tag){
-        cerr << " Error in malloc for tag " << endl; 
-        free(header);
-        free(iv);
-        return -1;
-    }
-
-    // Receive Header
-    ret = recv(sock_id, (void*)header, header_len, 0);
-    if(ret <= 0 || ret != header_len){
-        cerr << " Error in header reception " << ret << endl;
-        BIO_dump_fp(stdout, (const char*)header, header_len);
-        free(header);
-        free(tag);
-        free(iv);
-        return -1;
-    }
-
-    // Open header
-    memcpy((void*)&ct_len, header, sizeof(uint32_t));
-
-    memcpy(iv, header+sizeof(uint32_t), IV_DEFAULT);
-    memcpy(tag, header+sizeof(uint32_t)+IV_DEFAULT, TAG_DEFAULT);
-
-    unsigned char* aad = (unsigned char*)malloc(sizeof(uint32_t));
-    if(!aad){
-        cerr << " Error in aad malloc " << endl;
-        free(ciphertext);
-        free(header);
-        free(tag);
-        free(iv);
-        return -1;
+    if(!recv_buffer){
+        recv_buffer = secure_buffer_alloc(RECV_BUFFER_SIZE);
+        if(!recv_buffer){
+            cerr << " Error in malloc for the receive buffer " << endl;
+            return -1;
+        }
     }
-    memcpy(aad, header, sizeof(uint32_t));
 
-    // Receive ciphertext
-    ct_len = ntohl(ct_len);
-    ciphertext = (unsigned char*)malloc(ct_len);
-    if(!ciphertext){
-        cerr << " Error in malloc for ciphertext " << endl;
-        free(header);
-        free(tag);
-        free(iv);
-        return -1;
-    }
-    ret = recv(sock_id, (void*)ciphertext, ct_len, 0);
-    if(ret <= 0){
-        cerr << " Error in AAD reception " << endl;
-        free(ciphertext);
-        free(header);
-        free(tag);
-        free(iv);
-        return -1;
+    // Receive until the buffer holds the whole message, a partial read only means that the rest has not arrived yet
+    int record_len;
+    while((record_len = auth_enc_record_len(recv_buffer, recv_buffer_len, caps_clientToServer, RELAY_MSG_SIZE+sizeof(uint32_t)))==0){
+        ret = recv(sock_id, (void*)(recv_buffer+recv_buffer_len), RECV_BUFFER_SIZE-recv_buffer_len, 0);
+        if(ret <= 0){
+            cerr << " Error in message reception " << ret << endl;
+            return -1;
+        }
+        recv_buffer_len += ret;
     }
-
-    // Decryption
-    pt_len = auth_enc_decrypt(ciphertext, ct_len, aad, sizeof(uint32_t), session_key_clientToServer, tag, iv, plaintext);
-    if(pt_len == 0 || pt_len!=ct_len){
-        cerr << " Error during decryption " << endl;
-        free(ciphertext);
-        free(*plaintext);
-        free(header);
-        free(tag);
-        free(iv);
+    if(record_len<0){
+        cerr << " Error: invalid message length " << endl;
         return -1;
     }
-    free(ciphertext);
-    free(header);
-    free(tag);
-    free(iv);
 
-    // check seq number
-    uint32_t sequece_number = ntohl(*(uint32_t*) (*plaintext));
- 
-    if(sequece_number<receive_counter){
-        cerr << " Error: wrong seq number " << endl;
-        free(plaintext);
+    // Decryption and check of the sequence number, that remains in front of the plaintext
+    uint32_t header_len = RECORD_HEADER_LEN(caps_clientToServer);
+    int pt_len = record_open(session_clientToServer, caps_clientToServer, &receive_counter, recv_buffer, record_len);
+    if(pt_len<0){
+        cerr << " Error during decryption or wrong seq number " << endl;
         return -1;
     }
-    if(sequece_number==MAX_SEQ_NUM){
-        cerr << " Error: maximum number of message in the session reached " << endl;
-        safe_free(*plaintext,pt_len);
+    pt_len += sizeof(uint32_t);
+    *plaintext = secure_buffer_alloc(pt_len);
+    if(*plaintext)
+        memcpy(*plaintext, recv_buffer+header_len, pt_len);
+    // The message is consumed, the following ones are moved at the start of the buffer
+    OPENSSL_cleanse(recv_buffer+header_len, pt_len);
+    memmove(recv_buffer, recv_buffer+record_len, recv_buffer_len-record_len);
+    recv_buffer_len -= record_len;
+    if(!(*plaintext)){
+        cerr << " Error in malloc for plaintext " << endl;
         return -1;
     }
-    receive_counter=sequece_number+1;
 
     return pt_len;
 }
 
 /**
- * @brief Prepare the message for the client. The plaintext is safely free inside the function
+ * @brief Prepare the message for the client: the sequence number and the plaintext are copied after the header of the record,
+ * that is encrypted in place. The plaintext remains owned by the caller
  * 
  * @param plaintext 
  * @param pt_len 
- * @param msg_to_send 
+ * @param msg_to_send record for the client, to release with secure_buffer_free
  * @return The length of msg_to_send, 0 if error(s)
  */
 int prepare_msg_for_client(unsigned char* pt, uint32_t pt_len, unsigned char** msg_to_send)
 {
     if(pt==NULL)
-        return -1;
-    int ret;
-    uchar *tag, *iv, *ct, *aad;
-    uint aad_len;
-    uint32_t header_len = sizeof(uint32_t)+IV_DEFAULT+TAG_DEFAULT;
-
-    // adding sequence number
-    uint32_t counter_n=htonl(send_counter_client_client);
-    
-    if(pt_len>UINT32_MAX-sizeof(uint32_t)){
-        cerr << " Too big number for malloc " << endl;
-        return -1;
-    }
-    uchar* pt_seq = (uchar*)malloc(pt_len+sizeof(uint32_t)); 
-    if(!pt_seq){
-        safe_free(pt, pt_len);
         return 0;
-    }
-
-    memcpy(pt_seq, &counter_n, sizeof(uint32_t));
-    memcpy(pt_seq+sizeof(uint32_t), pt, pt_len);
-    pt=pt_seq;
-    pt_len+=sizeof(uint32_t);
-
-    int aad_ct_len_net = htonl(pt_len); //Since we use GCM ciphertext == plaintext
-    if(session_key_clientToClient==NULL){
+    if(session_clientToClient==NULL){
         cerr << " Null key " << endl;
         return 0;
     }
-    uint ct_len = auth_enc_encrypt(pt, pt_len, (uchar*)&aad_ct_len_net, sizeof(uint), session_key_clientToClient, &tag, &iv, &ct);
-    if(ct_len == 0){
-        cerr << "auth_enc_encrypt failed" << endl;
-        safe_free(pt, pt_len);
-        free(iv);
-        free(tag);
-        free(ct);
-        free(pt_seq);
+    if(send_counter_client_client==UINT32_MAX)
         return 0;
-    }
-
-    if(ct_len > UINT_MAX - header_len){
-        cerr << " Integer overflow " << endl;
-        safe_free(pt, pt_len);
-        free(iv);
-        free(tag);
-        free(ct);
-        free(pt_seq);
+    uint32_t header_len = RECORD_HEADER_LEN(caps_clientToClient);
+    if(pt_len>UINT32_MAX-sizeof(uint32_t)-header_len){
+        cerr << " Too big number for malloc " << endl;
         return 0;
     }
-    uint msg_to_send_len = ct_len + header_len;
-    uint bytes_copied = 0;
-    *msg_to_send = (uchar*)malloc(msg_to_send_len);
+    uint32_t record_pt_len = pt_len+sizeof(uint32_t);
+    *msg_to_send = secure_buffer_alloc(header_len+record_pt_len);
     if(!(*msg_to_send)){
         errorHandler(MALLOC_ERR);
-        safe_free(pt, pt_len);
-        free(iv);
-        free(tag);
-        free(ct);
-        free(pt_seq);
         return 0;
     }
 
-    memcpy((*msg_to_send) + bytes_copied, &aad_ct_len_net, sizeof(uint32_t));
-    bytes_copied += sizeof(uint32_t);
-    memcpy((*msg_to_send) + bytes_copied, iv, IV_DEFAULT);
-    bytes_copied += IV_DEFAULT;
-    memcpy((*msg_to_send) + bytes_copied, tag, TAG_DEFAULT);
-    bytes_copied += TAG_DEFAULT;
-    memcpy((*msg_to_send) + bytes_copied, ct, ct_len);
-    bytes_copied += ct_len;
-
-    if(bytes_copied!=msg_to_send_len)
-        cerr << " Warning " << bytes_copied << " != " << msg_to_send_len << endl;
-
-    safe_free(pt, pt_len);
-    free(iv);
-    free(tag);
-    free(ct);
-    if(send_counter_client_client==UINT32_MAX)
+    uint32_t msg_to_send_len = record_seal(session_clientToClient, caps_clientToClient, send_counter_client_client, pt, pt_len, *msg_to_send);
+    if(msg_to_send_len == 0){
+        cerr << "auth_enc_encrypt failed" << endl;
+        secure_buffer_free(*msg_to_send);
+        *msg_to_send = NULL;
         return 0;
+    }
     send_counter_client_client++;
-    return bytes_copied;
+    return msg_to_send_len;
 }
 
 
 /**
- * @brief Perform an authenticated encryption and then a send operation - add also the sequence number at the head of the plaintext
+ * @brief Make the record buffer at least size bytes long
+ * 
+ * @param size minimum size of the buffer
+ * @return pointer to the buffer, NULL in case of error
+ */
+unsigned char* reserve_record_buffer(uint32_t size)
+{
+    if(size <= record_buffer_size)
+        return record_buffer;
+    //The content is not kept: the buffer is only used inside send_secure
+    unsigned char* bigger = secure_buffer_alloc(size);
+    if(!bigger){
+        errorHandler(MALLOC_ERR);
+        return NULL;
+    }
+    secure_buffer_free(record_buffer);
+    record_buffer = bigger;
+    record_buffer_size = size;
+    return record_buffer;
+}
+
+/**
+ * @brief Perform an authenticated encryption and then a send operation - add also the sequence number at the head of the plaintext.
+ * The record is encrypted in place in the record buffer, no allocation is done once the buffer is big enough
  * 
  * @param comm_socket_id socket id
  * @param pt buffer to encrypt and send
@@ -704,94 +573,40 @@ int prepare_msg_for_client(unsigned char* pt, uint32_t pt_len, unsigned char** m
 int send_secure(int comm_socket_id, uchar* pt, int pt_len){
     if(comm_socket_id<0)
         return 0;
-    if(pt==NULL)
+    if(pt==NULL || pt_len<0)
         return 0;
     int ret;
-    uchar *tag, *iv, *ct, *aad;
-    uint aad_len;
-    uint32_t header_len = sizeof(uint32_t)+IV_DEFAULT+TAG_DEFAULT;
-
-    // adding sequence number
-    uint32_t counter_n=htonl(send_counter);
-    uchar* pt_seq = (uchar*)malloc(pt_len+sizeof(uint32_t));
-    if(!pt_seq){
-        safe_free(pt, pt_len);
-        return 0;
-    }
-    memcpy(pt_seq , &counter_n, sizeof(uint32_t));
-    memcpy(pt_seq+ sizeof(uint32_t), pt, pt_len);
-    pt=pt_seq;
-    pt_len+=sizeof(uint32_t);
- 
-    int aad_ct_len_net = htonl(pt_len); //Since we use GCM ciphertext == plaintext
-    if(session_key_clientToServer==NULL){
+    uint32_t header_len = RECORD_HEADER_LEN(caps_clientToServer);
+
+    if(session_clientToServer==NULL){
         cerr << " Null key " << endl;
         return 0;
     }
-    uint ct_len = auth_enc_encrypt(pt, pt_len, (uchar*)&aad_ct_len_net, sizeof(uint), session_key_clientToServer, &tag, &iv, &ct);
-    if(ct_len == 0){
-        cerr << "auth_enc_encrypt failed" << endl;
-        free(iv);
-        free(tag);
-        free(ct);
-        return 0;
-    }
-    
-    if(ct_len > UINT_MAX - header_len){
+    if((uint32_t)pt_len > UINT_MAX - header_len - sizeof(uint32_t)){
         cerr << " Integer overflow " << endl;
-        safe_free(pt, pt_len);
-        free(iv);
-        free(tag);
-        free(ct);
         return 0;
     }
-    uint msg_to_send_len = ct_len + header_len;
-    uint bytes_copied = 0;
-    uchar* msg_to_send = (uchar*)malloc(msg_to_send_len);
-    if(!msg_to_send){
-        errorHandler(MALLOC_ERR);
-        free(iv);
-        free(tag);
-        free(ct);
-        safe_free(pt, pt_len);
+    uint32_t record_pt_len = pt_len + sizeof(uint32_t);
+    unsigned char* record = reserve_record_buffer(header_len + record_pt_len);
+    if(!record)
         return 0;
-    }
 
-    memcpy(msg_to_send + bytes_copied, &aad_ct_len_net, sizeof(uint));
-    bytes_copied += sizeof(uint);
-    memcpy(msg_to_send + bytes_copied, iv, IV_DEFAULT);
-    bytes_copied += IV_DEFAULT;
-    memcpy(msg_to_send + bytes_copied, tag, TAG_DEFAULT);
-    bytes_copied += TAG_DEFAULT;
-    memcpy(msg_to_send + bytes_copied, ct, ct_len);
-    bytes_copied += ct_len;
-   
-    safe_free(pt, pt_len);
+    uint32_t record_len = record_seal(session_clientToServer, caps_clientToServer, send_counter, pt, pt_len, record);
+    if(record_len == 0){
+        cerr << "record_seal failed" << endl;
+        return 0;
+    }
 
-    ret = send(comm_socket_id, msg_to_send, msg_to_send_len, 0);
-    if(ret <= 0 || ret != msg_to_send_len){
+    ret = send(comm_socket_id, record, record_len, 0);
+    if(ret <= 0 || ret != record_len){
         errorHandler(SEND_ERR);
-        free(iv);
-        free(tag);
-        free(ct);
-        safe_free(msg_to_send, msg_to_send_len);
         return 0;
     }
     if(send_counter==UINT32_MAX){
         errorHandler(SEND_ERR);
-        free(iv);
-        free(tag);
-        free(ct);
-        safe_free(msg_to_send, msg_to_send_len);
         return 0;
     }
     send_counter++;
-
-    safe_free(msg_to_send, msg_to_send_len);
-
-    free(iv);
-    free(tag);
-    free(ct);
     return 1;
 }
 
@@ -858,12 +673,13 @@ int send_message(int sock_id, genericMSG* msgToSend)
         return -1;
     if(msgInternalPart_len>UINT32_MAX-(sizeof(uint8_t)+sizeof(uint32_t))){
         cerr << " Integer Overflow " << endl;
+        secure_buffer_free(msgInternalPart);
         return -1;
     }
     uint32_t msg_len = msgInternalPart_len+sizeof(uint8_t)+sizeof(uint32_t);
-    unsigned char* msg = (unsigned char*)malloc(msg_len);
+    unsigned char* msg = secure_buffer_alloc(msg_len);
     if(!msg){
-        safe_free(msgInternalPart, msgInternalPart_len);
+        secure_buffer_free(msgInternalPart);
         return -1;
     }
 
@@ -883,14 +699,13 @@ int send_message(int sock_id, genericMSG* msgToSend)
     int ret = send_secure(sock_id, msg, msg_len);
     if(ret==0){
         cerr << " send secure failed " << endl;
-        safe_free(msgInternalPart, msgInternalPart_len);
-        safe_free(msg, msg_len);
+        secure_buffer_free(msgInternalPart);
+        secure_buffer_free(msg);
         return -1;
     }
 
-    // safe_free(msgToSend->payload, msgToSend->length); not needed because free inside prepare_msg_for_client
-    safe_free(msgInternalPart, msgInternalPart_len);
-    safe_free(msg, msg_len);
+    secure_buffer_free(msgInternalPart);
+    secure_buffer_free(msg);
 
     return 0;
 }
@@ -909,14 +724,87 @@ int receive_message(int sock_id, string& msg, unsigned char* msgReceived, uint32
     if(msgReceived==NULL)
         return -1;
     unsigned char* pt = NULL;
-    uint32_t pt_len = open_msg_by_client(msgReceived, msgReceived_len, &pt);
+    int pt_len = open_msg_by_client(msgReceived, msgReceived_len, &pt);
     if(pt_len<=0){
         return -1;
     }
-    msg = (string)((char*)pt);
+    msg = string((char*)pt, strnlen((char*)pt, pt_len));
+    secure_buffer_free(pt);
+    return 0;
+}
+
+
+/**
+ * @brief Path of the file where the session ticket of the logged user is kept between two logins
+ */
+string session_ticket_path()
+{
+    return "clients_data/"+loggedUser+"/"+loggedUser+"_ticket";
+}
+
+/**
+ * @brief Save the session ticket received from the server together with the resumption secret of the session, in a file
+ * readable only by the owner: the ticket replaces the previous one
+ * 
+ * @param ticket session ticket
+ * @param ticket_len length of the ticket
+ * @return -1 in case of error, 0 otherwise
+ */
+int store_session_ticket(unsigned char* ticket, uint32_t ticket_len)
+{
+    unsigned char content[RESUMPTION_SECRET_SIZE+sizeof(uint32_t)+MAX_TICKET_SIZE];
+    if(!derive_resumption_secret(session_key_clientToServer, session_key_clientToServer_len, content))
+        return -1;
+    uint32_t ticket_len_net = htonl(ticket_len);
+    memcpy(content+RESUMPTION_SECRET_SIZE, &ticket_len_net, sizeof(uint32_t));
+    memcpy(content+RESUMPTION_SECRET_SIZE+sizeof(uint32_t), ticket, ticket_len);
+    uint32_t content_len = RESUMPTION_SECRET_SIZE+sizeof(uint32_t)+ticket_len;
+
+    int fd = open(session_ticket_path().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int ret = (fd<0) ? -1 : write(fd, content, content_len);
+    if(fd>=0)
+        close(fd);
+    OPENSSL_cleanse(content, content_len);
+    if(ret != (int)content_len){
+        cerr << " Unable to save the session ticket " << endl;
+        unlink(session_ticket_path().c_str());
+        return -1;
+    }
     return 0;
 }
 
+/**
+ * @brief Load the session ticket of the logged user, if any. The file is removed: a ticket is used only once
+ * 
+ * @param ticket output, MAX_TICKET_SIZE bytes
+ * @param ticket_len output
+ * @param resumption_secret output, RESUMPTION_SECRET_SIZE bytes
+ * @return -1 if there is no valid ticket, 0 otherwise
+ */
+int load_session_ticket(unsigned char* ticket, uint32_t* ticket_len, unsigned char* resumption_secret)
+{
+    unsigned char content[RESUMPTION_SECRET_SIZE+sizeof(uint32_t)+MAX_TICKET_SIZE];
+    int fd = open(session_ticket_path().c_str(), O_RDONLY);
+    if(fd<0)
+        return -1;
+    int content_len = read(fd, content, sizeof(content));
+    close(fd);
+    unlink(session_ticket_path().c_str());
+    if(content_len < (int)(RESUMPTION_SECRET_SIZE+sizeof(uint32_t))){
+        OPENSSL_cleanse(content, sizeof(content));
+        return -1;
+    }
+    memcpy(ticket_len, content+RESUMPTION_SECRET_SIZE, sizeof(uint32_t));
+    *ticket_len = ntohl(*ticket_len);
+    int ret = -1;
+    if(*ticket_len>0 && *ticket_len<=MAX_TICKET_SIZE && content_len == (int)(RESUMPTION_SECRET_SIZE+sizeof(uint32_t)+*ticket_len)){
+        memcpy(resumption_secret, content, RESUMPTION_SECRET_SIZE);
+        memcpy(ticket, content+RESUMPTION_SECRET_SIZE+sizeof(uint32_t), *ticket_len);
+        ret = 0;
+    }
+    OPENSSL_cleanse(content, sizeof(content));
+    return ret;
+}
 
 /**
  * @brief Called after authentication it is in charge of receving the user id of the logged user
@@ -939,13 +827,30 @@ int retrieve_my_userID(int socket)
 
     if(opcode_rec!=USRID){
         cerr << " Error: wrong opcode " << endl;
-        free(plaintext);
+        secure_buffer_free(plaintext);
         return -1;
     }
 
+    if(pt_len < 2*sizeof(uint32_t)+1){
+        cerr << " Error: user id message too short " << endl;
+        secure_buffer_free(plaintext);
+        return -1;
+    }
     int loggedUser_id_net;
     memcpy(&loggedUser_id_net, plaintext+sizeof(uint32_t)+1, sizeof(uint32_t));
     loggedUser_id = ntohl(loggedUser_id_net);  
+
+    // A session ticket may follow the user id, it lets the next login resume this session
+    uint32_t read_from_msg = 2*sizeof(uint32_t)+1;
+    if(pt_len >= read_from_msg+sizeof(uint32_t)){
+        uint32_t ticket_len;
+        memcpy(&ticket_len, plaintext+read_from_msg, sizeof(uint32_t));
+        ticket_len = ntohl(ticket_len);
+        read_from_msg += sizeof(uint32_t);
+        if(ticket_len>0 && ticket_len<=MAX_TICKET_SIZE && read_from_msg+ticket_len<=pt_len)
+            store_session_ticket(plaintext+read_from_msg, ticket_len);
+    }
+    secure_buffer_free(plaintext);
     return 0;
 }
 
@@ -961,7 +866,7 @@ int automatic_neg_response(int sock_id, int refused_user)
     if(sock_id<0)
         return -1;
 
-    if(ntohl(refused_user)<0 || ntohl(refused_user)>REGISTERED_USERS)
+    if(ntohl(refused_user)<0 || ntohl(refused_user)>MAX_REGISTERED_USERS)
         return -1;
     
     
@@ -985,6 +890,131 @@ int automatic_neg_response(int sock_id, int refused_user)
 }
 
 
+/**
+ * @brief Load (or load again) the trust store with the certificate and the CRL of the certification authority
+ * 
+ * @return -1 in case of error, 0 otherwise; in case of error the previous trust store is kept
+ */
+int load_ca_store()
+{
+    FILE* CA_cert_file = fopen("certification/TrustMe CA_cert.pem","rb");
+    if(!CA_cert_file){
+        cerr<<"no CA cert"<<endl;
+        return -1;
+    }
+    FILE* CA_crl_file = fopen("certification/TrustMe CA_crl.pem","rb");
+    if(!CA_crl_file){
+        cerr<<"no CA crl"<<endl;
+        fclose(CA_cert_file);
+        return -1;
+    }
+    void* store = cert_store_new(CA_cert_file, CA_crl_file);
+    fclose(CA_cert_file);
+    fclose(CA_crl_file);
+    if(!store)
+        return -1;
+    cert_store_free(ca_store);
+    ca_store = store;
+    return 0;
+}
+
+/**
+ * @brief Connect to the server, a socket already open is closed first
+ * 
+ * @return -1 in case of error, 0 otherwise
+ */
+int connect_to_server()
+{
+    // net structure and info
+    struct sockaddr_in srv_addr;
+    const char* srv_ip = "127.0.0.1";
+    const int srv_port = 4242;  
+    if(sock_id>=0)
+        close(sock_id);
+    // Socket creation
+    sock_id = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock_id<0)
+        return -1;
+    // Initialization for server address
+    memset(&srv_addr, 0, sizeof(srv_addr));
+    srv_addr.sin_family = AF_INET;
+    srv_addr.sin_port = htons(srv_port);
+    if(inet_pton(AF_INET, srv_ip, &srv_addr.sin_addr)<=0)
+        return -1;
+    // Socket connection
+    if(connect(sock_id, (struct sockaddr*)&srv_addr, sizeof(srv_addr)) < 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief Set up the session with the server resumed with a session ticket
+ * 
+ * @param nonce nonce R1 sent in M1
+ * @param server_nonce nonce R2 received in M2
+ * @param resumption_secret resumption secret of the ticket
+ * @param caps capabilities of the session selected by the server
+ * @return -1 in case of error, 0 otherwise
+ */
+int resume_session(unsigned char* nonce, unsigned char* server_nonce, unsigned char* resumption_secret, uint8_t caps)
+{
+    unsigned char nonces[2*NONCE_SIZE];
+    memcpy(nonces, nonce, NONCE_SIZE);
+    memcpy(nonces+NONCE_SIZE, server_nonce, NONCE_SIZE);
+    session_key_clientToServer_len = derive_resumed_session_key(resumption_secret, nonces, sizeof(nonces), &session_key_clientToServer);
+    if(session_key_clientToServer_len==0)
+        return -1;
+    caps_clientToServer = caps;
+    session_clientToServer = auth_enc_session_new(session_key_clientToServer, caps_clientToServer, true);
+    if(!session_clientToServer){
+        cerr << "Failed creation of the session" << endl;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read the identity key of the logged user, protected by its password
+ * 
+ * @return the key, to release with safe_free_privkey; NULL in case of error
+ */
+void* read_my_privkey()
+{
+    string privkey_file_path = "clients_data/"+loggedUser+"/"+loggedUser+"_privkey.pem";
+    FILE* privKey_file = fopen(privkey_file_path.c_str(), "rb");
+    if(!privKey_file){
+        cerr<<"error unable to read privkey file"<<endl;
+        return NULL;
+    }
+    void* privkey = read_privkey(privKey_file, privkey_password);
+    fclose(privKey_file);
+    return privkey;
+}
+
+/**
+ * @brief Receive M2 of the server, or the cookie or the acceptance of the ticket that replace it. Only the bytes still
+ * missing are received (MSG_WAITALL waits for the ones that arrive in other segments), the following messages stay on the socket
+ * 
+ * @param sock_id socket id
+ * @param M2 output, the message
+ * @param selected_caps output, capabilities selected by the server
+ * @return -1 in case of error, 0 otherwise
+ */
+int recv_M2(int sock_id, vector<unsigned char>& M2, uint8_t* selected_caps)
+{
+    uint32_t received = 0;
+    uint32_t M2_len;
+    M2.clear();
+    while((M2_len = handshake_M2_length(M2.data(), received, selected_caps)) > received){
+        M2.resize(M2_len);
+        int ret = recv(sock_id, (void*)(M2.data()+received), M2_len-received, MSG_WAITALL);
+        if(ret <= 0)
+            return -1;
+        received += ret;
+    }
+    return 0;
+}
+
 /**
  * @brief It performs the authentication procedure with the server or the client depending by the passed parameter
  * 
@@ -1000,34 +1030,35 @@ int authentication(int sock_id, uint8_t ver)
     if(ver!=AUTH_CLNT_CLNT && ver!=AUTH_CLNT_SRV)
         return -1;
     bool tooBig = false;                    // indicates if the username inserted by the user is too big
-    unsigned char* nonce = NULL;            // nonce R
-    unsigned char* server_nonce = NULL;     // nonce R2 from the server
-    uint32_t usernameSize;              
-    uint32_t net_usernameSize;
-    uint16_t size_to_allocate;          
-    size_t msg_bytes_written;               // how many byte of the messagge I have been written
+    unsigned char nonce[NONCE_SIZE];        // nonce R
     int ret;
     int peer_id_net = htonl(peer_id);
-    unsigned char* name = NULL;
-    unsigned char* msg_auth_1 = NULL;
+    vector<unsigned char> msg;              // message to send
 
-    unsigned char* msg2_pt = NULL;
-    uint32_t msg2_pt_len = 0;
+    vector<unsigned char> msg2;             // M2 of the server
+    unsigned char* msg2_pt = NULL;          // record of the other client with M2
+    int msg2_pt_len = 0;
+    unsigned char* M2 = NULL;               // M2 inside msg2 or msg2_pt
+    uint32_t M2_len = 0;
+    unsigned char* peer_eph = NULL;         // ephemeral key of the peer inside M2
+    uint32_t peer_eph_len = 0;
 
-    int dh_pub_srv_key_size;
-    unsigned char* dh_server_pubkey = NULL;
+    uint8_t offered_caps = SUPPORTED_CAPS;  // capabilities offered in M1
+    uint8_t selected_caps;                  // capabilities selected by the peer in M2
 
-    uint32_t len_signature;
-    uint32_t len_signed_msg;
-    unsigned char* signed_msg = NULL;
-    unsigned char* signature = NULL;
+    bool resume = false;                    // a session ticket is offered in M1
+    unsigned char ticket[MAX_TICKET_SIZE];
+    uint32_t ticket_len = 0;
+    unsigned char resumption_secret[RESUMPTION_SECRET_SIZE];
 
-    uint32_t cert_length;
-    unsigned char* server_cert = NULL;  
+    unsigned char cookie[COOKIE_SIZE];      // cookie of a server under load, echoed in M1
+    uint32_t cookie_len = 0;
 
-    // Acquire the username from stdin
+    // Acquire the username from stdin, a script sets it before
     if(ver==AUTH_CLNT_SRV){
         do{
+            if(headless)
+                break;
             if(tooBig)
                 cout << " The username inserted is too big! " << endl;
             cout << "Who are you? " << endl;
@@ -1042,78 +1073,105 @@ int authentication(int sock_id, uint8_t ver)
             if(loggedUser.size()+1>MAX_USERNAME_SIZE)
                 tooBig = true;
         }while(tooBig);
+        // With the ticket of a previous login the session is resumed in one round trip, without signatures
+        resume = (load_session_ticket(ticket, &ticket_len, resumption_secret)==0);
+        if(resume)
+            offered_caps |= CAP_RESUME;
     }
 
     /*************************************************************
      * M1 - Send R,username to the server
      *************************************************************/
-    // Nonce Generation
-    nonce = (unsigned char*)malloc(NONCE_SIZE);
-    if(!nonce)
-        return -1;
     random_generate(NONCE_SIZE, nonce);
 
-    // Preparation of the username
+send_M1:
+    msg.clear();
     if(ver==AUTH_CLNT_SRV){
-        usernameSize = loggedUser.size()+1; // +1 for string terminator
-        name = (unsigned char*)malloc(usernameSize);
-        if(!name){
-            free(nonce);
+        // R, USERNAME_SIZE, USERNAME, the cookie, then the ticket and its binder: the HMAC of M1 with the resumption secret
+        handshake_M1(nonce, loggedUser, offered_caps, (cookie_len>0)? cookie: NULL, msg);
+        if(resume){
+            uint32_t ticket_len_net = htonl(ticket_len);
+            msg.insert(msg.end(), (unsigned char*)&ticket_len_net, (unsigned char*)&ticket_len_net+sizeof(uint32_t));
+            msg.insert(msg.end(), ticket, ticket+ticket_len);
+            uint32_t binder_offset = msg.size();
+            msg.resize(binder_offset+RESUMPTION_BINDER_SIZE);
+            if(!hmac_compute(resumption_secret, RESUMPTION_SECRET_SIZE, msg.data(), binder_offset, msg.data()+binder_offset)){
+                OPENSSL_cleanse(resumption_secret, RESUMPTION_SECRET_SIZE);
+                return -1;
+            }
+        }
+        ret = send(sock_id, (void*)msg.data(), msg.size(), 0);
+        if(ret<=0 || ret != msg.size()){
+            OPENSSL_cleanse(resumption_secret, RESUMPTION_SECRET_SIZE);
             return -1;
         }
-        net_usernameSize = htonl(usernameSize);
-        strncpy((char*)name, loggedUser.c_str(), usernameSize);
-        name[usernameSize-1] = '\0'; // to avoid error in strncpy
-    }
-    // Composition of the message: OPCODE, R, USERNAME_SIZE, USERNAME
-    size_to_allocate = (ver==AUTH_CLNT_SRV) ? (NONCE_SIZE+sizeof(uint32_t)+usernameSize) : (sizeof(uint8_t) + NONCE_SIZE + sizeof(int));
-    msg_auth_1 = (unsigned char*)malloc(size_to_allocate);
-    if(!msg_auth_1){
-        free(name);
-        free(nonce);
-        return -1;
-    }
-
-    if(ver==AUTH_CLNT_SRV){
-        memcpy(msg_auth_1, nonce, NONCE_SIZE);
-        msg_bytes_written = NONCE_SIZE; 
-        memcpy(msg_auth_1+msg_bytes_written, &net_usernameSize, sizeof(uint32_t));
-        msg_bytes_written += sizeof(uint32_t);
-        memcpy(msg_auth_1+msg_bytes_written, name, usernameSize);
-        msg_bytes_written += usernameSize;
     }
     else if(ver==AUTH_CLNT_CLNT){
-        uint8_t op = AUTH;
-        memcpy(msg_auth_1, (void*)&op, sizeof(uint8_t));
-        msg_bytes_written = sizeof(uint8_t); 
-        memcpy(msg_auth_1+msg_bytes_written, (void*)&peer_id_net, sizeof(int));
-        msg_bytes_written += sizeof(int);
-        memcpy(msg_auth_1+msg_bytes_written, nonce, NONCE_SIZE);
-        msg_bytes_written += NONCE_SIZE;
+        // OPCODE, PEER_ID, R, CAPS
+        msg.push_back(AUTH);
+        msg.insert(msg.end(), (unsigned char*)&peer_id_net, (unsigned char*)&peer_id_net+sizeof(int));
+        handshake_peer_M1(nonce, offered_caps, msg);
+        if(send_secure(sock_id, msg.data(), msg.size())==0)
+            return -1;
     }
 
-    // Send the message to the server
+    /*************************************************************
+     * M2 - Wait for message from the server
+     *************************************************************/
     if(ver==AUTH_CLNT_SRV){
-        ret = send(sock_id, (void*)msg_auth_1, msg_bytes_written, 0);
-        if(ret<=0 || ret != msg_bytes_written){
-            free(msg_auth_1);
-            free(name);
-            free(nonce);
+        if(recv_M2(sock_id, msg2, &selected_caps)!=0){
+            OPENSSL_cleanse(resumption_secret, RESUMPTION_SECRET_SIZE);
+            return -1;
+        }
+        M2 = msg2.data();
+        M2_len = msg2.size();
+        // A server under load asks for a cookie before the handshake: connect again and echo it in M1, with the same nonce
+        if(selected_caps==CAP_COOKIE && cookie_len==0){
+            uint32_t offset = NONCE_SIZE;
+            unsigned char* cookie_field;
+            if(handshake_read_field(M2, M2_len, &offset, &cookie_field, NULL)!=COOKIE_SIZE || connect_to_server()!=0){
+                OPENSSL_cleanse(resumption_secret, RESUMPTION_SECRET_SIZE);
+                return -1;
+            }
+            memcpy(cookie, cookie_field, COOKIE_SIZE);
+            sock_id = ::sock_id;
+            cookie_len = COOKIE_SIZE;
+            offered_caps |= CAP_COOKIE;
+            goto send_M1;
+        }
+        if(selected_caps & CAP_RESUME){
+            // The server accepted the ticket: the session key comes from the resumption secret and the two nonces
+            ret = -1;
+            if((selected_caps & ~offered_caps)==0 && M2_len==NONCE_SIZE+sizeof(uint32_t))
+                ret = resume_session(nonce, M2, resumption_secret, selected_caps & ~CAP_RESUME);
+            OPENSSL_cleanse(resumption_secret, RESUMPTION_SECRET_SIZE);
+            if(ret!=0)
+                return -1;
+            ret = retrieve_my_userID(sock_id);
+            if(ret!=0){
+                cerr << " Error during the retrieving of the user id " << endl;
+                return -1;
+            }
+            return 0;
+        }
+        // The ticket has not been accepted, the full handshake follows
+        OPENSSL_cleanse(resumption_secret, RESUMPTION_SECRET_SIZE);
+
+        // Check the authenticity of the msg (the capabilities are signed to avoid downgrades). The files of the CA are
+        // read only the first time, or again if the certificate does not pass the check with the trust store already
+        // loaded (the CRL may have been updated)
+        bool fresh_store = (ca_store == NULL);
+        if(fresh_store && load_ca_store() != 0)
+            return -1;
+        ret = handshake_check_M2(nonce, offered_caps, M2, M2_len, ca_store, &peer_eph, &peer_eph_len, &selected_caps);
+        if(ret!=1 && !fresh_store && load_ca_store() == 0)
+            ret = handshake_check_M2(nonce, offered_caps, M2, M2_len, ca_store, &peer_eph, &peer_eph_len, &selected_caps);
+        if(ret!=1){
+            cerr << " The signature is not valid " << endl;
             return -1;
         }
-        // free message and unnecessary stuff
-        free(name);
     }
     else if(ver==AUTH_CLNT_CLNT){
-        send_secure(sock_id, msg_auth_1, size_to_allocate);
-    }
-    safe_free(msg_auth_1, size_to_allocate);
-
-    /*************************************************************
-     * M2 - Wait for message from the server
-     *************************************************************/
-    // wait for nonce
-    if(ver==AUTH_CLNT_CLNT){
         uint8_t op_tmp;
         uint32_t read_tmp;
         do{
@@ -1129,418 +1187,95 @@ int authentication(int sock_id, uint8_t ver)
                 // automatic refuse
                 int rejected_user;
                 memcpy(&rejected_user, msg2_pt+read_tmp, sizeof(uint32_t));
+                secure_buffer_free(msg2_pt);
+                msg2_pt = NULL;
                 ret = automatic_neg_response(sock_id, rejected_user);
-                if(ret==-1){
-                    free(nonce);
+                if(ret==-1)
                     return -1;
-                }
             }
             else if(op_tmp!=AUTH){
-                free(nonce);
+                secure_buffer_free(msg2_pt);
                 return -1;
             }
         }while(op_tmp!=AUTH);
-    }
-    uint32_t read_from_msg2 = sizeof(uint32_t) + sizeof(uint8_t); // seq number already read in recv_secure and opcode already handled
-    
-    server_nonce = (unsigned char*)malloc(NONCE_SIZE);
-    if(!server_nonce){
-        free(nonce);
-        return -1;
-    }
 
-    if(ver==AUTH_CLNT_SRV){
-        ret = recv(sock_id, (void*)server_nonce, NONCE_SIZE, 0);  
-        if(ret <= 0){
-            free(server_nonce);
-            free(nonce);
+        // seq number, opcode and user id (I am not interested in it) before M2
+        uint32_t read_from_msg2 = sizeof(uint32_t) + sizeof(uint8_t) + sizeof(int);
+        if(msg2_pt_len < read_from_msg2 || !peer_pub_key){
+            cerr << " Peer public key not present or M2 too short " << endl; 
+            secure_buffer_free(msg2_pt);
             return -1;
         }
-    }
-    else if(ver==AUTH_CLNT_CLNT){
-        read_from_msg2 += sizeof(int); // because of there is the user id but i am not interested in it
-        memcpy(server_nonce, msg2_pt + read_from_msg2, NONCE_SIZE);
-        read_from_msg2 += NONCE_SIZE;
-    }
-
-    // Read the length of the DH server pub key
-    if(ver==AUTH_CLNT_SRV){
-        ret = recv(sock_id, (void*)&dh_pub_srv_key_size, sizeof(int), 0);  
-        if(ret <= 0){
-            free(server_nonce);
-            free(nonce);
+        M2 = msg2_pt + read_from_msg2;
+        M2_len = msg2_pt_len - read_from_msg2;
+        void* peer_key = parse_pubkey(peer_pub_key, PUBKEY_DEFAULT_SER);
+        ret = (peer_key)? handshake_check_peer_M2(nonce, offered_caps, M2, M2_len, peer_key, &peer_eph, &peer_eph_len, &selected_caps) : 0;
+        free_pubkey(peer_key);
+        if(ret!=1){
+            cerr << " Verification of the signature of the peer failed " << endl;
+            secure_buffer_free(msg2_pt);
             return -1;
         }
     }
-    else if(ver==AUTH_CLNT_CLNT){
-        memcpy(&dh_pub_srv_key_size, msg2_pt+read_from_msg2, sizeof(int));
-        read_from_msg2 += sizeof(int);
-    }
-    dh_pub_srv_key_size = ntohl(dh_pub_srv_key_size);
-
-    // Read DH server pub key
-    dh_server_pubkey = (unsigned char*)malloc(dh_pub_srv_key_size);
-    if(!dh_server_pubkey){
-        free(server_nonce);
-        free(nonce);
-    }
-
-    if(ver==AUTH_CLNT_SRV){
-        ret = recv(sock_id, (void*)dh_server_pubkey, dh_pub_srv_key_size, 0);  
-        if(ret <= 0 || ret != dh_pub_srv_key_size){
-            free(server_nonce);
-            free(nonce);
-            free(dh_server_pubkey);
-            return -1;
-        }
-    }
-    else if(ver==AUTH_CLNT_CLNT){
-        if(read_from_msg2 + dh_pub_srv_key_size > msg2_pt_len){
-            free(server_nonce);
-            free(nonce);
-            free(dh_server_pubkey);
-            return -1;
-        }
-        memcpy(dh_server_pubkey, msg2_pt+read_from_msg2, dh_pub_srv_key_size);
-        read_from_msg2 += dh_pub_srv_key_size;
-    }
-
-    // Read signature length
-    if(ver==AUTH_CLNT_SRV){
-        ret = recv(sock_id, (void*)&len_signature, sizeof(uint32_t), 0);  
-        if(ret <= 0 || ret!=sizeof(uint32_t)){
-            free(server_nonce);
-            free(nonce);
-            free(dh_server_pubkey);
-            return -1;
-        }
-    }
-    else if(ver==AUTH_CLNT_CLNT){
-        memcpy(&len_signature, msg2_pt+read_from_msg2, sizeof(uint32_t));
-        read_from_msg2 += sizeof(uint32_t);
-    }
-    len_signature = ntohl(len_signature);
-
-    
-    // Read signature
-    signature = (unsigned char*)malloc(len_signature);
-    if(!signature){
-        free(server_nonce);
-        free(nonce);
-        free(dh_server_pubkey);
-        return -1;
-    }
-
-    if(ver==AUTH_CLNT_SRV){
-        ret = recv(sock_id, (void*)signature, len_signature, 0);  
-        if(ret <= 0 || ret!=len_signature){
-            free(server_nonce);
-            free(nonce);
-            free(dh_server_pubkey);
-            free(signature);
-            return -1;
-        }
-    }
-    else if(ver==AUTH_CLNT_CLNT){
-        if(read_from_msg2 + len_signature > msg2_pt_len){
-            free(server_nonce);
-            free(nonce);
-            free(dh_server_pubkey);
-            return -1;
-        }
-        memcpy(signature, msg2_pt+read_from_msg2, len_signature);
-        read_from_msg2 += len_signature;
-    }
-    
-    // Read certificate length
-    if(ver==AUTH_CLNT_SRV){
-        ret = recv(sock_id, (void*)&cert_length, sizeof(uint32_t), 0);  
-        if(ret <= 0 || ret!=sizeof(uint32_t)){
-            free(server_nonce);
-            free(nonce);
-            free(dh_server_pubkey);
-            free(signature);
-            return -1;
-        }
-        cert_length = ntohl(cert_length);
-
-        // Read certificate
-        server_cert = (unsigned char*)malloc(cert_length);
-        if(!server_cert){
-            free(server_nonce);
-            free(nonce);
-            free(dh_server_pubkey);
-            free(signature);
-            return -1;
-        }
-        ret = recv(sock_id, (void*)server_cert, cert_length, 0);  
-        if(ret <= 0 || ret!=cert_length){
-            free(server_nonce);
-            free(nonce);
-            free(dh_server_pubkey);
-            free(signed_msg);
-            free(signature);
-            free(server_cert);
-            return -1;
-        }
-    }
-
-    // Check the authenticity of the msg
-    len_signed_msg = NONCE_SIZE*2+dh_pub_srv_key_size;
-    signed_msg = (unsigned char*)malloc(len_signed_msg);
-    if(!signed_msg){
-        cerr<<" no msg "<<endl;
-        free(server_nonce);
-        free(nonce);
-        free(dh_server_pubkey);
-        free(signature);
-        free(server_cert);
-        return -1;
-    }
-
-    memcpy(signed_msg, nonce, NONCE_SIZE);
-    memcpy(signed_msg+NONCE_SIZE, server_nonce, NONCE_SIZE);
-    memcpy(signed_msg+(2*NONCE_SIZE), dh_server_pubkey, dh_pub_srv_key_size);
-
-    if(ver==AUTH_CLNT_SRV){
-        FILE* CA_cert_file = fopen("certification/TrustMe CA_cert.pem","rb");
-        if(!CA_cert_file){
-            cerr<<"no CA cert"<<endl;
-            free(server_nonce);
-            free(nonce);
-            free(dh_server_pubkey);
-            free(signed_msg);
-            free(signature);
-            free(server_cert);
-            return -1;
-        }
-        FILE* CA_crl_file = fopen("certification/TrustMe CA_crl.pem","rb");
-        if(!CA_crl_file){
-            cerr<<"no CA crl"<<endl;
-            free(server_nonce);
-            free(nonce);
-            free(dh_server_pubkey);
-            free(signed_msg);
-            free(signature);
-            free(server_cert);
-            fclose(CA_cert_file);
-            return -1;
-        }
-
-        ret = verify_sign_cert(server_cert, cert_length, CA_cert_file, CA_crl_file, signature, len_signature, signed_msg, len_signed_msg);
-        if(ret!=1){
-            cerr << " The signature is not valid " << endl;
-            free(server_nonce);
-            free(nonce);
-            free(dh_server_pubkey);
-            free(signed_msg);
-            free(signature);
-            free(server_cert);
-            fclose(CA_cert_file);
-            fclose(CA_crl_file);
-            return -1;
-        }
-        // Close and free the unnecessary stuff
-        fclose(CA_cert_file);
-        fclose(CA_crl_file);
-    }
-    else if(ver==AUTH_CLNT_CLNT){
-        if(!peer_pub_key){
-            cerr << " Peer public key not present " << endl; 
-            free(server_nonce);
-            free(nonce);
-            free(dh_server_pubkey);
-            free(signed_msg);
-            free(signature);
-            return -1;
-        }
-        ret = verify_sign_pubkey(signature, len_signature, signed_msg, len_signed_msg, peer_pub_key, PUBKEY_DEFAULT_SER);
-        if(ret==0){
-            cerr << " Verification of the signature of the peer failed " << endl;
-            free(server_nonce);
-            free(nonce);
-            free(dh_server_pubkey);
-            free(signed_msg);
-            free(signature);
-            return -1;
-        }
-    }
-    free(signature);
-    free(signed_msg);
-    free(nonce);
-    
-
-    /*************************************************************
-     *  Generate (DH_pubKey_C, DH_privKey_C)
-     *************************************************************/
-    void* eph_dh_privKey = NULL;
-    unsigned char* eph_dh_pubKey = NULL; 
-    uint32_t eph_dh_pubKey_len;   
-    ret = eph_key_generate(&eph_dh_privKey, &eph_dh_pubKey, &eph_dh_pubKey_len);
-    if(ret!=1){
-        cerr<<" error generating eph keys "<<endl;
-        free(server_nonce);
-        free(dh_server_pubkey);
-        free(server_cert);
-        return -1;
-    }
 
     /*************************************************************
-     * M3 - Send to the server my DHpubKey and the nonce R2
+     * M3 - Send to the server my DHpubKey and the signature of it and of the nonce R2
      *************************************************************/
-    // Preparation of the message to sign
-    uint32_t msg_to_sign_len = NONCE_SIZE+eph_dh_pubKey_len;
-    unsigned char* msg_to_sign = (unsigned char*)malloc(msg_to_sign_len);
-    if(!msg_to_sign){
-        cerr<<"error M3 msg to sign malloc failed"<<endl;
-        free(server_nonce);
-        free(dh_server_pubkey);
-        free(server_cert);
-        free(eph_dh_privKey);
-        free(eph_dh_pubKey);
+    void* privkey = read_my_privkey();
+    if(!privkey){
+        secure_buffer_free(msg2_pt);
         return -1;
     }
-
-    memcpy(msg_to_sign, eph_dh_pubKey,eph_dh_pubKey_len );
-    memcpy(msg_to_sign+eph_dh_pubKey_len, server_nonce, NONCE_SIZE);
-
-    unsigned char* client_signature = NULL;
-    uint32_t client_sign_len;
-    string privkey_file_path = "clients_data/"+loggedUser+"/"+loggedUser+"_privkey.pem";
-    FILE* privKey_file = fopen(privkey_file_path.c_str(), "rb");
-    if(!privKey_file){
-        cerr<<"error unable to read privkey file"<<endl;
-        free(server_nonce);
-        free(dh_server_pubkey);
-        free(server_cert);
-        free(msg_to_sign);
-        free(eph_dh_privKey);
-        free(eph_dh_pubKey);
-        return -1;
+    void* eph_dh_privKey = NULL;
+    msg.clear();
+    if(ver==AUTH_CLNT_CLNT){
+        // additional opcode and peer id
+        msg.push_back(AUTH);
+        msg.insert(msg.end(), (unsigned char*)&peer_id_net, (unsigned char*)&peer_id_net+sizeof(int));
     }
-    ret = sign_document(msg_to_sign, msg_to_sign_len, privKey_file,NULL, &client_signature, &client_sign_len);
+    ret = handshake_M3(M2, selected_caps, privkey, &eph_dh_privKey, msg);
+    safe_free_privkey(privkey);
     if(ret!=1){
         cerr<<"unable to sign"<<endl;
-        free(server_nonce);
-        free(dh_server_pubkey);
-        free(server_cert);
-        free(msg_to_sign);
-        free(eph_dh_privKey);
-        free(eph_dh_pubKey);
-        fclose(privKey_file);
+        secure_buffer_free(msg2_pt);
         return -1;
     }
-    
-    free(server_nonce);
-    free(msg_to_sign);
-    fclose(privKey_file);
 
-    // Building the message to send
-    uint32_t msglen = sizeof(uint32_t)+eph_dh_pubKey_len+sizeof(uint32_t)+client_sign_len;
-    if(ver==AUTH_CLNT_CLNT)
-        msglen = msglen + sizeof(uint8_t) + sizeof(int); // additional size for the opcode and peer id
-    unsigned char* msg_to_send_M3 = (unsigned char*)malloc(msglen);
-    if(!msg_to_send_M3){
-        free(dh_server_pubkey);
-        free(server_cert);
-        free(client_signature);
-        free(eph_dh_privKey);
-        free(eph_dh_pubKey);
-        return -1;
-    }
-
-    uint32_t n_eph_dh_pubKey_len=htonl(eph_dh_pubKey_len);
-    uint32_t n_client_sign_len=htonl(client_sign_len);
-    msg_bytes_written = 0;
-    if(ver==AUTH_CLNT_CLNT){
-        uint8_t op_tmp = AUTH;
-        memcpy(msg_to_send_M3+msg_bytes_written, &op_tmp, sizeof(uint8_t));
-        msg_bytes_written += sizeof(uint8_t);
-        memcpy(msg_to_send_M3+msg_bytes_written, &peer_id_net, sizeof(int));
-        msg_bytes_written += sizeof(int);
-    }
-    memcpy(msg_to_send_M3 + msg_bytes_written, &n_eph_dh_pubKey_len, sizeof(uint32_t));
-    msg_bytes_written += sizeof(uint32_t);
-    memcpy(msg_to_send_M3+ msg_bytes_written, eph_dh_pubKey, eph_dh_pubKey_len);
-    msg_bytes_written += eph_dh_pubKey_len;
-    memcpy(msg_to_send_M3 + msg_bytes_written, &n_client_sign_len, sizeof(uint32_t));
-    msg_bytes_written += sizeof(uint32_t);
-    memcpy(msg_to_send_M3 + msg_bytes_written, client_signature, client_sign_len);
-    msg_bytes_written += client_sign_len;
-    if(msg_bytes_written != msglen){
-        cerr<<"ERR - error on copyng"<<endl;
-        free(dh_server_pubkey);
-        free(server_cert);
-        free(client_signature);
-        free(msg_to_send_M3);
-        free(eph_dh_privKey);
-        free(eph_dh_pubKey);
-        return -1;
-    }
-
-    // Send the message to send to the server
     if(ver==AUTH_CLNT_SRV){
-        ret = send(sock_id, (void*)msg_to_send_M3, msglen, 0);
-        if(ret<=0 || ret != msglen){
-            free(dh_server_pubkey);
-            free(server_cert);
-            free(client_signature);
-            free(msg_to_send_M3);
-            free(eph_dh_privKey);
-            free(eph_dh_pubKey);
-            return -1;
-        }
+        ret = send(sock_id, (void*)msg.data(), msg.size(), 0);
+        ret = (ret>0 && ret==msg.size());
     }
-    else if(ver==AUTH_CLNT_CLNT){
-        ret = send_secure(sock_id, msg_to_send_M3, msglen);
-        if(ret==0){
-            free(dh_server_pubkey);
-            free(client_signature);
-            free(msg_to_send_M3);
-            free(eph_dh_privKey);
-            free(eph_dh_pubKey);
-            return -1;
-        }
+    else if(ver==AUTH_CLNT_CLNT)
+        ret = send_secure(sock_id, msg.data(), msg.size());
+    if(ret==0){
+        safe_free_privkey(eph_dh_privKey);
+        secure_buffer_free(msg2_pt);
+        return -1;
     }
 
-    free(msg_to_send_M3);
-    free(client_signature);
-
     /*************************************************************
      * Derive the session key through the master secret
      *************************************************************/
-    unsigned char* secret = NULL;
-    uint32_t secret_len = derive_secret(eph_dh_privKey, dh_server_pubkey, dh_pub_srv_key_size, &secret);
-    if(secret_len==0){
-        free(dh_server_pubkey);
-        free(server_cert);
-        free(eph_dh_pubKey);
-        return -1;
+    if(ver==AUTH_CLNT_SRV){
+        caps_clientToServer = selected_caps;
+        session_clientToServer = handshake_session(eph_dh_privKey, peer_eph, peer_eph_len, selected_caps, true,
+            &session_key_clientToServer, &session_key_clientToServer_len);
     }
-    
-    free(dh_server_pubkey);
-    free(eph_dh_pubKey);
-
-    uint32_t keylen;
-    if(ver==AUTH_CLNT_SRV)
-        keylen = default_digest(secret, secret_len, &session_key_clientToServer);
-    else if(ver==AUTH_CLNT_CLNT)
-        keylen = default_digest(secret, secret_len, &session_key_clientToClient);
+    else if(ver==AUTH_CLNT_CLNT){
+        if(session_key_clientToClient)
+            safe_free(session_key_clientToClient, session_key_clientToClient_len);
+        session_key_clientToClient = NULL;
+        auth_enc_session_free(session_clientToClient);
+        caps_clientToClient = selected_caps;
+        session_clientToClient = handshake_session(eph_dh_privKey, peer_eph, peer_eph_len, selected_caps, true,
+            &session_key_clientToClient, &session_key_clientToClient_len);
+    }
+    secure_buffer_free(msg2_pt);
 
-    if(keylen==0){
-        free(server_cert);
-        safe_free(session_key_clientToServer, session_key_clientToServer_len);
-        safe_free(session_key_clientToClient, session_key_clientToClient_len);
-        safe_free(secret, secret_len);
+    if((ver==AUTH_CLNT_SRV && !session_clientToServer) || (ver==AUTH_CLNT_CLNT && !session_clientToClient)){
+        cerr << "Failed creation of the session" << endl;
         return -1;
     }
-    
-    if(ver==AUTH_CLNT_SRV)
-        session_key_clientToServer_len =  keylen;
-    else if(ver==AUTH_CLNT_CLNT)
-        session_key_clientToClient_len = keylen;
-
-    safe_free(secret, secret_len);
 
     /************************************************************
      * End of Authentication 
@@ -1571,16 +1306,13 @@ int authentication_receiver(int sock_id)
     int peer_id_net = htonl(peer_id);
     uint8_t op_rec;
     uint32_t id_dest, id_dest_net;
+    // Seq number, opcode and destination id in front of the messages of the handshake
+    const uint32_t msg_header_len = sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t);
     /*************************************************************
      * M1 - R1
      *************************************************************/
-    uchar* R1 = (uchar*)malloc(NONCE_SIZE);
-    if(!R1){
-        errorHandler(MALLOC_ERR);
-        return -1;
-    }
     unsigned char* pt_M1 = NULL;
-    uint32_t pt_M1_len = 0;
+    int pt_M1_len = 0;
     uint8_t op_tmp_checker;
     uint32_t read_tmp_checker;
 
@@ -1588,7 +1320,6 @@ int authentication_receiver(int sock_id)
         pt_M1_len = recv_secure(sock_id, &pt_M1);
         if(pt_M1_len<=0){
             cerr << " Error during M1 reception in authentication_receiver " << endl;
-            safe_free(R1, NONCE_SIZE);
             return -1;
         }
     
@@ -1600,14 +1331,14 @@ int authentication_receiver(int sock_id)
             // automatic refuse
             int rejected_user;
             memcpy(&rejected_user, pt_M1+read_tmp_checker, sizeof(uint32_t));
+            secure_buffer_free(pt_M1);
+            pt_M1 = NULL;
             ret = automatic_neg_response(sock_id, rejected_user);
-            if(ret==-1){
-                safe_free(R1, NONCE_SIZE);
+            if(ret==-1)
                 return -1;
-            }
         }
         else if(op_tmp_checker!=AUTH){
-            safe_free(R1, NONCE_SIZE);
+            secure_buffer_free(pt_M1);
             return -1;
         }
     }while(op_tmp_checker!=AUTH);
@@ -1615,187 +1346,62 @@ int authentication_receiver(int sock_id)
     uint32_t bytes_read = sizeof(uint32_t); // Because sequence number already read in recv_secure
 
     // Double check
+    if(pt_M1_len<msg_header_len){
+        cerr << " M1 too short " << endl;
+        secure_buffer_free(pt_M1);
+        return -1;
+    }
     memcpy(&op_rec, pt_M1+bytes_read, sizeof(uint8_t));
     bytes_read += sizeof(uint8_t);
-    if(op_rec!=AUTH){
-        cerr << " Wrong opcode received " << endl;
-        free(R1);
-        safe_free(pt_M1, pt_M1_len);
-    }
     memcpy(&id_dest_net, pt_M1+bytes_read, sizeof(uint32_t));
     id_dest = ntohl(id_dest_net);
     bytes_read += sizeof(uint32_t);
-    if(id_dest!=loggedUser_id){
-        cerr << " Wrong destination id " << endl;
-        free(R1);
-        safe_free(pt_M1, pt_M1_len);
+    if(op_rec!=AUTH || id_dest!=loggedUser_id){
+        cerr << " Wrong opcode or destination id " << endl;
+        secure_buffer_free(pt_M1);
+        return -1;
     }
-    memcpy(R1, pt_M1+bytes_read, NONCE_SIZE);
-    bytes_read+=NONCE_SIZE;
-    
-    safe_free(pt_M1, pt_M1_len);
 
     /*************************************************************
      * M2 - Send R2,pubkey_eph,signature
      *************************************************************/
-    uchar* R2 = (uchar*)malloc(NONCE_SIZE);
-    if(!R2){
-        errorHandler(MALLOC_ERR);
-        safe_free(R1, NONCE_SIZE);
-        return -1;
-    }
-
-    //Generate pair of ephermeral DH keys
-    void* eph_privkey_s;
-    uchar* eph_pubkey_s;
-    uint eph_pubkey_s_len;
-    ret = eph_key_generate(&eph_privkey_s, &eph_pubkey_s, &eph_pubkey_s_len);
-    if(ret != 1){
-        cerr << "Error on EPH_KEY_GENERATE" << endl;
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
-        return -1;
-    }
-
-    //Generate nuance R2
-    ret = random_generate(NONCE_SIZE, R2);
-    if(ret != 1){
-        cerr <<  "Error on random_generate" << endl;
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
-        return -1;
-    }
-
-    uint32_t M2_to_sign_length = (NONCE_SIZE*2) + eph_pubkey_s_len;
-    uint32_t M2_signed_length;
-    uchar* M2_signed;
-    uchar* M2_to_sign = (uchar*)malloc(M2_to_sign_length);
-
-    if(!M2_to_sign){
-        cerr << "Error on M2_to_sign" << endl;
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
-        return -1;
-    }
-
-    memcpy(M2_to_sign, R1, NONCE_SIZE);
-    memcpy((void*)(M2_to_sign + NONCE_SIZE), R2, NONCE_SIZE);
-    memcpy((void*)(M2_to_sign + (2*NONCE_SIZE)), eph_pubkey_s, eph_pubkey_s_len);
-
-    string privkey_file_path = "clients_data/"+loggedUser+"/"+loggedUser+"_privkey.pem";
-    FILE* privKey_file = fopen(privkey_file_path.c_str(), "rb");
-    if(!privKey_file){
-        cerr<<"error unable to read privkey file"<<endl;
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
-        safe_free(M2_to_sign, M2_to_sign_length);
-        return -1;
-    }
-
-    
-    ret = sign_document(M2_to_sign, M2_to_sign_length, privKey_file, NULL, &M2_signed, &M2_signed_length);
+    unsigned char R2[NONCE_SIZE];
+    void* eph_privkey_s = NULL;
+    uint8_t selected_caps;
+    void* privkey = read_my_privkey();
+    if(!privkey){
+        secure_buffer_free(pt_M1);
+        return -1;
+    }
+    vector<unsigned char> M2;
+    M2.push_back(AUTH);
+    M2.insert(M2.end(), (unsigned char*)&peer_id_net, (unsigned char*)&peer_id_net+sizeof(uint32_t));
+    ret = handshake_peer_M2(pt_M1+bytes_read, pt_M1_len-bytes_read, privkey, R2, &eph_privkey_s, &selected_caps, M2);
+    safe_free_privkey(privkey);
+    secure_buffer_free(pt_M1);
     if(ret != 1){
         cerr << "Error on signing part on M2" << endl;
-        safe_free(M2_to_sign, M2_to_sign_length);
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
-        fclose(privKey_file);
         return -1;
     }
-    
-    fclose(privKey_file);
 
-    //Send M2 part by part
-    if(M2_signed_length > UINT32_MAX -(sizeof(uint8_t) + sizeof(int) + NONCE_SIZE + sizeof(int)+ sizeof(int))){
-        cerr << " Integer Overflow" << endl;
-        safe_free(M2_to_sign, M2_to_sign_length);
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
-        return -1;
-    }
-    if(eph_pubkey_s_len>UINT_MAX-(sizeof(uint8_t) + sizeof(int) + NONCE_SIZE + sizeof(int)+ sizeof(int) + M2_signed_length)){
-        cerr << " Integer Overflow " << endl;
-        safe_free(M2_to_sign, M2_to_sign_length);
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
-        return -1;
-    }
-    uint M2_size = sizeof(uint8_t) + sizeof(int) + NONCE_SIZE + sizeof(int) + eph_pubkey_s_len + sizeof(int) + M2_signed_length;
-    uint offset = 0;
-    uchar* M2 = (uchar*)malloc(M2_size);
-    if(!M2){
-        cerr << "Error during malloc for M2" << endl;
-        safe_free(M2_to_sign, M2_to_sign_length);
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
-        return -1;
-    }
-    uint eph_pubkey_s_len_net = htonl(eph_pubkey_s_len);
-    uint M2_signed_length_net = htonl(M2_signed_length);
-   
-    uint8_t opcode = AUTH;
-    memcpy(M2+offset, &opcode, sizeof(uint8_t));
-    offset += sizeof(uint8_t);
-    memcpy(M2+offset, &peer_id_net, sizeof(uint32_t));
-    offset += sizeof(uint32_t);
-    memcpy((void*)(M2 + offset), R2, NONCE_SIZE);
-    offset += NONCE_SIZE;
-    memcpy((void*)(M2 + offset), &eph_pubkey_s_len_net, sizeof(uint));
-    offset += sizeof(uint);
-    memcpy((void*)(M2 + offset), eph_pubkey_s, eph_pubkey_s_len);
-    offset += eph_pubkey_s_len;
-    memcpy((void*)(M2 + offset), &M2_signed_length_net ,sizeof(uint));
-    offset += sizeof(uint);
-    memcpy((void*)(M2 + offset), M2_signed,M2_signed_length);
-    offset += M2_signed_length;
-
-
-    ret = send_secure(sock_id, M2, M2_size);
+    ret = send_secure(sock_id, M2.data(), M2.size());
     if(ret==0){
         cerr << " Error during send_secure in sending M2 " << endl;
-        safe_free(M2_to_sign, M2_to_sign_length);
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
         safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
         return -1;
     }
-        
-    safe_free(M2, M2_size);
-    safe_free(M2_to_sign, M2_to_sign_length);
-    safe_free(R1, NONCE_SIZE);
-    safe_free(eph_pubkey_s, eph_pubkey_s_len);
-    
 
     /*************************************************************
      * M3 - client_pubkey and signing of pubkey and R2
      *************************************************************/
-    uint32_t eph_pubkey_c_len;
     unsigned char* msg3 = NULL;
-    uint32_t msg3_len = 0;
+    int msg3_len = 0;
 
     cout << "Wait ..."<< endl;
     do{
        msg3_len = recv_secure(sock_id, &msg3);
        if(msg3_len <= 0){
             cerr << " Error in recv_secure during M3 reception " << endl;
-            safe_free(R2, NONCE_SIZE);
             safe_free_privkey(eph_privkey_s);
             return -1;
         }
@@ -1807,14 +1413,17 @@ int authentication_receiver(int sock_id)
             // automatic refuse
             int rejected_user;
             memcpy(&rejected_user, msg3+read_tmp_checker, sizeof(uint32_t));
+            secure_buffer_free(msg3);
+            msg3 = NULL;
             ret = automatic_neg_response(sock_id, rejected_user);
             if(ret==-1){
-                safe_free(R1, NONCE_SIZE);
+                safe_free_privkey(eph_privkey_s);
                 return -1;
             }
         }
         else if(op_tmp_checker!=AUTH){
-            safe_free(R1, NONCE_SIZE);
+            safe_free_privkey(eph_privkey_s);
+            secure_buffer_free(msg3);
             return -1;
         }
     }while(op_tmp_checker!=AUTH);
@@ -1822,140 +1431,48 @@ int authentication_receiver(int sock_id)
 
     bytes_read = 4; // seq number already read in recv secure
 
-    memcpy(&op_rec, msg3+bytes_read, sizeof(uint8_t));
-    bytes_read += sizeof(uint8_t);
-    if(op_rec!=AUTH){
-        cerr << " Wrong opcode received " << endl;
-        safe_free(R2, NONCE_SIZE);
+    if(msg3_len<msg_header_len){
+        cerr << " M3 too short " << endl;
         safe_free_privkey(eph_privkey_s);
-        safe_free(msg3, msg3_len);
+        secure_buffer_free(msg3);
+        return -1;
     }
+    memcpy(&op_rec, msg3+bytes_read, sizeof(uint8_t));
+    bytes_read += sizeof(uint8_t);
     memcpy(&id_dest_net, msg3+bytes_read, sizeof(uint32_t));
     id_dest = ntohl(id_dest_net);
     bytes_read += sizeof(uint32_t);
-    if(id_dest!=loggedUser_id){
-        cerr << " Wrong destination id " << endl;
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(msg3, msg3_len);
-    }
-    memcpy(&eph_pubkey_c_len, msg3+bytes_read, sizeof(uint32_t));
-    bytes_read+=sizeof(uint32_t);
-    eph_pubkey_c_len = ntohl(eph_pubkey_c_len);
-
-    uchar* eph_pubkey_c = (uchar*)malloc(eph_pubkey_c_len);
-    if(!eph_pubkey_c ){
-        errorHandler(MALLOC_ERR);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(msg3, msg3_len);
-        return -1;
-    }
-
-    if(bytes_read + eph_pubkey_c_len > msg3_len){
-        cerr << " Error in message len " << endl;
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(msg3, msg3_len);
-        safe_free(eph_pubkey_c,eph_pubkey_c_len);
-        return -1;
-    }
-    memcpy(eph_pubkey_c, msg3+bytes_read, eph_pubkey_c_len);
-    bytes_read += eph_pubkey_c_len;
-
-    uint32_t m3_signature_len;
-    memcpy(&m3_signature_len, msg3+bytes_read, sizeof(uint32_t));
-    bytes_read += sizeof(uint32_t);
-    m3_signature_len = ntohl(m3_signature_len);
-
-    uchar* M3_signed = (uchar*)malloc(m3_signature_len);
-    if(!M3_signed){
-        errorHandler(MALLOC_ERR);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(msg3, msg3_len);
-        safe_free(eph_pubkey_c, eph_pubkey_c_len);
-        return -1;
-    }
-
-    if(bytes_read + m3_signature_len > msg3_len){
-        cerr << " Error in message len " << endl;
-        safe_free(R2, NONCE_SIZE);
+    if(op_rec!=AUTH || id_dest!=loggedUser_id || peer_pub_key==NULL){
+        cerr << " Wrong opcode or destination id, or peer public key not present " << endl;
         safe_free_privkey(eph_privkey_s);
-        safe_free(msg3, msg3_len);
-        safe_free(eph_pubkey_c,eph_pubkey_c_len);
-        safe_free(M3_signed, m3_signature_len);
+        secure_buffer_free(msg3);
         return -1;
     }
-    memcpy(M3_signed, msg3+bytes_read, m3_signature_len);
-    bytes_read += m3_signature_len;
 
-    safe_free(msg3, msg3_len);
-
-    if(eph_pubkey_c_len>UINT_MAX-NONCE_SIZE){
-        errorHandler(MALLOC_ERR);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_c, eph_pubkey_c_len);
-        safe_free(M3_signed, m3_signature_len);
-        return -1;
-    }
-    uint m3_document_size = eph_pubkey_c_len + NONCE_SIZE;
-    uchar* m3_document = (uchar*)malloc(m3_document_size);
-    if(!m3_document){
-        errorHandler(MALLOC_ERR);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_c, eph_pubkey_c_len);
-        safe_free(M3_signed, m3_signature_len);
-        return -1;
-    }
-
-    memcpy(m3_document, eph_pubkey_c,eph_pubkey_c_len );
-    memcpy(m3_document+eph_pubkey_c_len, R2, NONCE_SIZE);
-
-    if(peer_pub_key==NULL){
-        cerr << " Peer public key not present " << endl;
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_c, eph_pubkey_c_len);
-        safe_free(M3_signed, m3_signature_len);
-    }
-
-    ret = verify_sign_pubkey(M3_signed, m3_signature_len, m3_document, m3_document_size, peer_pub_key, PUBKEY_DEFAULT_SER);
-    if(ret == 0){
+    unsigned char* eph_pubkey_c;
+    uint32_t eph_pubkey_c_len;
+    void* peer_key = parse_pubkey(peer_pub_key, PUBKEY_DEFAULT_SER);
+    ret = (peer_key)? handshake_check_M3(R2, msg3+bytes_read, msg3_len-bytes_read, peer_key, &eph_pubkey_c, &eph_pubkey_c_len) : 0;
+    free_pubkey(peer_key);
+    if(ret != 1){
         cerr << "Failed sign verification on M3" << endl;
-        safe_free(R2, NONCE_SIZE);
         safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_c, eph_pubkey_c_len);
-        safe_free(M3_signed, m3_signature_len);
+        secure_buffer_free(msg3);
         return -1;
     }
 
-    safe_free(R2, NONCE_SIZE);
-    safe_free(M3_signed, m3_signature_len);
-
-    uchar* shared_secret;
-    uint shared_secret_len;
-    shared_secret_len = derive_secret(eph_privkey_s, eph_pubkey_c, eph_pubkey_c_len, &shared_secret);
-    if(shared_secret_len == 0){
-        cerr << "Failed derive secret" << endl;
-        safe_free(eph_pubkey_c, eph_pubkey_c_len);
-        safe_free_privkey(eph_privkey_s);
-        return -1;    
-    }
-
-    session_key_clientToClient_len = default_digest(shared_secret, shared_secret_len, &session_key_clientToClient);
-    if(session_key_clientToClient_len == 0){
-        cerr << "Failed digest computation of the secret" << endl;
-        safe_free(eph_pubkey_c, eph_pubkey_c_len);
-        safe_free(shared_secret, shared_secret_len);
-        safe_free_privkey(eph_privkey_s);
+    if(session_key_clientToClient)
+        safe_free(session_key_clientToClient, session_key_clientToClient_len);
+    session_key_clientToClient = NULL;
+    auth_enc_session_free(session_clientToClient);
+    caps_clientToClient = selected_caps;
+    session_clientToClient = handshake_session(eph_privkey_s, eph_pubkey_c, eph_pubkey_c_len, selected_caps, false,
+        &session_key_clientToClient, &session_key_clientToClient_len);
+    secure_buffer_free(msg3);
+    if(session_clientToClient == NULL){
+        cerr << "Failed creation of the session" << endl;
         return -1;    
     }
- 
-    safe_free(eph_pubkey_c, eph_pubkey_c_len);
-    safe_free(shared_secret, shared_secret_len);
     
     cout << "AUTHENTICATION WITH " << peer_username << " SUCCESFULLY EXECUTED " << endl;
     return 0;
@@ -2041,6 +1558,11 @@ int chatRequestHandler(unsigned char* plaintext, uint32_t pt_len)
     cout << "\n**********************************************************" << endl;
     cout << "Do you want to chat with " << counterpart << " with user id " << peer_id << " ? (y/n)" << endl;
    
+    // A script accepts every request
+    if(headless){
+        user_resp = 'y';
+        response = CHAT_POS;
+    }
     while(user_resp!='y' && user_resp!='n') {
         cin >> user_resp;
         if(cin.fail()){
@@ -2248,6 +1770,7 @@ int arriveHandler(int sock_id){
         return -1;
     // I read the first byte to understand which type of message the server is sending to me
     memcpy(&op, plaintext+sizeof(uint32_t), sizeof(uint8_t));
+    last_arrived_op = op;
 
     /* ****************************************************************
     * Action to perform considering the things sent from the server
@@ -2261,13 +1784,13 @@ int arriveHandler(int sock_id){
         else if (ret==-1){
             error = true;
             errorHandler(GEN_ERR);
-            free(plaintext);
+            secure_buffer_free(plaintext);
             return -1;
         }
-        else if(print_list_users(user_list)!=0){
+        else if(!headless && print_list_users(user_list)!=0){
             error = true;
             errorHandler(GEN_ERR);
-            free(plaintext);
+            secure_buffer_free(plaintext);
             return -1;
         }
         break;
@@ -2280,7 +1803,7 @@ int arriveHandler(int sock_id){
             cout << " DBG - Peer username is empty " << endl;
             error = true;
             errorHandler(GEN_ERR);
-            free(plaintext);
+            secure_buffer_free(plaintext);
             return -1;
         }
                     
@@ -2297,20 +1820,20 @@ int arriveHandler(int sock_id){
         peer_pub_key = (unsigned char*)malloc(PUBKEY_DEFAULT_SER);
         if(!peer_pub_key){
             errorHandler(MALLOC_ERR);
-            free(plaintext);
+            secure_buffer_free(plaintext);
             return -1;
         }
         memcpy(peer_pub_key, plaintext+5+sizeof(int), PUBKEY_DEFAULT_SER);
         if(peer_pub_key==NULL){
             cerr << " Error in receiving peer public key " << endl;
-            free(plaintext);
+            secure_buffer_free(plaintext);
             return -1;
         }
 
         ret = authentication(sock_id, AUTH_CLNT_CLNT);
         if(ret!=0){
             cout << " Authentication with " << peer_username << " failed " << endl;
-            free(plaintext);
+            secure_buffer_free(plaintext);
             return -1;
         }
         isChatting = true;
@@ -2334,17 +1857,20 @@ int arriveHandler(int sock_id){
             error = true;
             perror("chat response");
             errorHandler(REC_ERR);
-            free(plaintext);
+            secure_buffer_free(plaintext);
             return -1;
         }
 
         if(peer_username.empty()){
             error = true;
             errorHandler(GEN_ERR);
-            free(plaintext);
+            secure_buffer_free(plaintext);
             return -1;
         }
-        cout << " \t\t\t\t " << peer_username << " -> " << message << endl;
+        last_message = message;
+        messages_received++;
+        if(!headless)
+            cout << " \t\t\t\t " << peer_username << " -> " << message << endl;
     }
     break;
     case CHAT_CMD:
@@ -2353,7 +1879,7 @@ int arriveHandler(int sock_id){
             error = true;
             perror("chat command");
             errorHandler(REC_ERR);
-            free(plaintext);
+            secure_buffer_free(plaintext);
             return -1;
         }
     break;
@@ -2368,15 +1894,334 @@ int arriveHandler(int sock_id){
     default:{
         error = true;
         errorHandler(SRV_INTERNAL_ERR);
-        free(plaintext);
+        secure_buffer_free(plaintext);
         return -1;
     }
     break;
     }
 
+    secure_buffer_free(plaintext);
     return 1;
 }
 
+/* ****************************************
+*          HEADLESS MODE
+* *****************************************/
+/*
+* A script is a text file with one entry per line, # starts a comment:
+*   username <name>         identity of the user, its private key is clients_data/<name>/<name>_privkey.pem
+*   password <password>     password of the private key
+* and then the operations, run in order:
+*   login                   connect and authenticate with the server
+*   users_online            ask for the list of the online users
+*   wait_online <name>      ask for the online users every SCRIPT_POLL_INTERVAL ms until <name> is online
+*   chat <name>             ask to chat with <name> and authenticate with it
+*   accept                  wait for a chat request and accept it
+*   send <count> <size>     send count messages of size bytes, each one is sent back by the peer (echo)
+*   echo <count>            send back count messages of the peer
+*   stop_chat               terminate the chat
+*   wait_stop               wait until the peer terminates the chat
+*   sleep <ms>
+*   exit                    close the application
+* The latency of every operation (and the round trip of every message of send) is printed at the end
+*/
+struct script_op {
+    string name;
+    vector<string> args;
+    int line;
+};
+
+/*
+* Latencies of a kind of operation, in ms
+*/
+struct script_latency {
+    string name;
+    vector<double> samples;
+};
+
+vector<script_latency> script_latencies;
+
+/**
+ * @brief Store the latency of an operation of the script
+ */
+void record_latency(const string& name, double ms)
+{
+    for(script_latency& latency : script_latencies){
+        if(latency.name==name){
+            latency.samples.push_back(ms);
+            return;
+        }
+    }
+    script_latencies.push_back({name, {ms}});
+}
+
+/**
+ * @brief Print count, mean, p50, p99 and max of the latencies of every kind of operation of the script
+ */
+void print_latencies()
+{
+    printf("\n %-14s %8s %10s %10s %10s %10s\n", "operation", "count", "mean ms", "p50 ms", "p99 ms", "max ms");
+    for(script_latency& latency : script_latencies){
+        vector<double>& samples = latency.samples;
+        sort(samples.begin(), samples.end());
+        double total = 0;
+        for(double sample : samples)
+            total += sample;
+        size_t p50 = (samples.size()*50+99)/100-1;
+        size_t p99 = (samples.size()*99+99)/100-1;
+        printf(" %-14s %8zu %10.3f %10.3f %10.3f %10.3f\n", latency.name.c_str(), samples.size(), total/samples.size(),
+            samples[p50], samples[p99], samples.back());
+    }
+}
+
+/**
+ * @brief Read a script and check its operations
+ * 
+ * @param path script file
+ * @param ops output, operations of the script in order
+ * @return -1 in case of error, 0 otherwise
+ */
+int load_script(const char* path, vector<script_op>& ops)
+{
+    ifstream script(path);
+    if(!script){
+        cerr << " Unable to open the script " << path << endl;
+        return -1;
+    }
+    string line;
+    int line_number = 0;
+    while(getline(script, line)){
+        line_number++;
+        line = line.substr(0, line.find('#'));
+        istringstream words(line);
+        script_op op;
+        op.line = line_number;
+        if(!(words >> op.name))
+            continue;
+        string arg;
+        while(words >> arg)
+            op.args.push_back(arg);
+        size_t args = op.args.size();
+        bool valid;
+        if(op.name=="username" || op.name=="password" || op.name=="wait_online" || op.name=="chat")
+            valid = (args==1);
+        else if(op.name=="echo" || op.name=="sleep")
+            valid = (args==1 && strtoul(op.args[0].c_str(), NULL, 10)>0);
+        else if(op.name=="send"){
+            uint32_t size = (args==2)? strtoul(op.args[1].c_str(), NULL, 10): 0;
+            valid = (args==2 && strtoul(op.args[0].c_str(), NULL, 10)>0 && size>0 && size<=SCRIPT_MAX_MESSAGE_SIZE);
+        }
+        else
+            valid = (args==0) && (op.name=="login" || op.name=="users_online" || op.name=="accept" ||
+                op.name=="stop_chat" || op.name=="wait_stop" || op.name=="exit");
+        if(!valid){
+            cerr << " Script " << path << ", line " << line_number << ": invalid operation " << line << endl;
+            return -1;
+        }
+        if(op.name=="username")
+            loggedUser = op.args[0];
+        else if(op.name=="password"){
+            free(privkey_password);
+            privkey_password = strdup(op.args[0].c_str());
+        }
+        else
+            ops.push_back(op);
+    }
+    if(loggedUser.empty() || loggedUser.size()+1>MAX_USERNAME_SIZE){
+        cerr << " Script " << path << ": missing or too big username" << endl;
+        return -1;
+    }
+    if(ops.empty() || ops[0].name!="login"){
+        cerr << " Script " << path << ": the first operation must be login" << endl;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Handle the messages of the server until one with the given opcode arrives (the socket has a receive
+ * timeout of SCRIPT_TIMEOUT seconds)
+ * 
+ * @return -1 in case of error, 0 otherwise
+ */
+int wait_for_op(uint8_t op)
+{
+    do{
+        last_arrived_op = NOT_VALID_CMD;
+        if(arriveHandler(sock_id)<0)
+            return -1;
+    }while(last_arrived_op!=op);
+    return 0;
+}
+
+/**
+ * @brief Handle the messages of the server until a new chat message arrives
+ * 
+ * @return -1 in case of error, 0 otherwise
+ */
+int wait_for_message()
+{
+    uint64_t received = messages_received;
+    while(messages_received==received){
+        if(arriveHandler(sock_id)<0)
+            return -1;
+        if(!isChatting){
+            cerr << " The chat has been terminated by the peer" << endl;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Ask to chat with a user, the user id is taken from the list of the online users
+ * 
+ * @return -1 in case of error or if the user refuses, 0 otherwise
+ */
+int script_chat(const string& username)
+{
+    if(isChatting)
+        return -1;
+    int user_id = -1;
+    for(user* tmp = user_list; tmp!=NULL && user_id==-1; tmp = tmp->next){
+        if(username==(char*)tmp->username)
+            user_id = tmp->userId;
+    }
+    if(user_id==-1){
+        cerr << " " << username << " is not in the list of the online users" << endl;
+        return -1;
+    }
+    struct commandMSG cmdToSend;
+    cmdToSend.opcode = CHAT_CMD;
+    cmdToSend.userId = user_id;
+    peer_id = user_id;
+    peer_username = username;
+    if(send_command_to_server(sock_id, &cmdToSend)!=0)
+        return -1;
+    // CHAT_POS starts the authentication with the peer
+    do{
+        last_arrived_op = NOT_VALID_CMD;
+        if(arriveHandler(sock_id)<0)
+            return -1;
+    }while(last_arrived_op!=CHAT_POS && last_arrived_op!=CHAT_NEG);
+    return isChatting? 0: -1;
+}
+
+/**
+ * @brief Run an operation of a script
+ * 
+ * @return -1 in case of error, 1 after exit, 0 otherwise
+ */
+int run_script_op(script_op& op)
+{
+    if(op.name=="login"){
+        if(connect_to_server()<0)
+            return -1;
+        struct timeval timeout = {SCRIPT_TIMEOUT, 0};
+        setsockopt(sock_id, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        return (authentication(sock_id, AUTH_CLNT_SRV)<0)? -1: 0;
+    }
+    if(op.name=="users_online"){
+        if(commandHandler("!users_online")!=2)
+            return -1;
+        return wait_for_op(ONLINE_CMD);
+    }
+    if(op.name=="wait_online"){
+        auto deadline = chrono::steady_clock::now()+chrono::seconds(SCRIPT_TIMEOUT);
+        while(true){
+            if(commandHandler("!users_online")!=2 || wait_for_op(ONLINE_CMD)<0)
+                return -1;
+            for(user* tmp = user_list; tmp!=NULL; tmp = tmp->next){
+                if(op.args[0]==(char*)tmp->username)
+                    return 0;
+            }
+            if(chrono::steady_clock::now()>deadline){
+                cerr << " " << op.args[0] << " is not online" << endl;
+                return -1;
+            }
+            usleep(SCRIPT_POLL_INTERVAL*1000);
+        }
+    }
+    if(op.name=="chat")
+        return script_chat(op.args[0]);
+    if(op.name=="accept"){
+        while(!isChatting){
+            if(wait_for_op(CHAT_CMD)<0)
+                return -1;
+        }
+        return 0;
+    }
+    if(op.name=="send"){
+        uint64_t count = strtoull(op.args[0].c_str(), NULL, 10);
+        uint32_t size = strtoul(op.args[1].c_str(), NULL, 10);
+        for(uint64_t i = 0; i<count; i++){
+            // The number of the message makes every message different, the terminator is part of its size
+            string message = to_string(i);
+            message.resize(max((size_t)size-1, message.size()), 'x');
+            auto start = chrono::steady_clock::now();
+            if(!isChatting || commandHandler(message)!=1 || wait_for_message()<0)
+                return -1;
+            record_latency("message rtt", chrono::duration<double, milli>(chrono::steady_clock::now()-start).count());
+            if(last_message!=message){
+                cerr << " The peer has sent back a different message" << endl;
+                return -1;
+            }
+        }
+        return 0;
+    }
+    if(op.name=="echo"){
+        uint64_t count = strtoull(op.args[0].c_str(), NULL, 10);
+        for(uint64_t i = 0; i<count; i++){
+            if(wait_for_message()<0 || commandHandler(last_message)!=1)
+                return -1;
+        }
+        return 0;
+    }
+    if(op.name=="stop_chat")
+        return (isChatting && commandHandler("!stop_chat")==1)? 0: -1;
+    if(op.name=="wait_stop"){
+        while(isChatting){
+            if(wait_for_op(STOP_CHAT)<0)
+                return -1;
+        }
+        return 0;
+    }
+    if(op.name=="sleep"){
+        usleep(strtoul(op.args[0].c_str(), NULL, 10)*1000);
+        return 0;
+    }
+    // exit
+    return (commandHandler("!exit")==3)? 1: -1;
+}
+
+/**
+ * @brief Run a script without the terminal and print the latency of its operations
+ * 
+ * @param path script file
+ * @return -1 in case of error, 0 otherwise
+ */
+int run_script(const char* path)
+{
+    vector<script_op> ops;
+    if(load_script(path, ops)<0)
+        return -1;
+    headless = true;
+    for(script_op& op : ops){
+        auto start = chrono::steady_clock::now();
+        int ret = run_script_op(op);
+        if(ret<0){
+            cerr << " Script " << path << ", line " << op.line << ": " << op.name << " failed" << endl;
+            print_latencies();
+            return -1;
+        }
+        record_latency(op.name, chrono::duration<double, milli>(chrono::steady_clock::now()-start).count());
+        if(ret==1)
+            break;
+    }
+    print_latencies();
+    return 0;
+}
+
 int main(int argc, char* argv[])
 {     
     string userInput;
@@ -2399,34 +2244,19 @@ int main(int argc, char* argv[])
     struct commandMSG cmdToSend;
     cmdToSend.opcode = NOT_VALID_CMD;
     cmdToSend.userId = -1;
-    // net structure and info
-    struct sockaddr_in srv_addr;
-    const char* srv_ip = "127.0.0.1";
-    const int srv_port = 4242;  
-    // Socket creation
-    sock_id = socket(AF_INET, SOCK_STREAM, 0);
-    if(sock_id<0){
-        error = true;
-        errorHandler(CONN_ERR);
-        goto close_all;
-    }
-    // Initialization for server address
-    if(!memset(&srv_addr, 0, sizeof(srv_addr))){
-        error = true;
-        errorHandler(GEN_ERR); 
+    // ./client --script <file> runs a script instead of reading the commands from the terminal
+    if(argc==3 && strcmp(argv[1], "--script")==0){
+        if(run_script(argv[2])<0)
+            error = true;
         goto close_all;
     }
-    srv_addr.sin_family = AF_INET;
-    srv_addr.sin_port = htons(srv_port);
-    ret = inet_pton(AF_INET, srv_ip, &srv_addr.sin_addr);
-    if(ret<=0){
-        error = true;
-        errorHandler(CONN_ERR);
-        goto close_all;
+    if(argc!=1){
+        cout << "Usage: ./client [--script <file>]" << endl;
+        return 1;
     }
-    // Socket connection
-    ret = connect(sock_id, (struct sockaddr*)&srv_addr, sizeof(srv_addr));
-    if(ret < 0){
+    // Socket creation and connection
+    ret = connect_to_server();
+    if(ret<0){
         error = true;
         errorHandler(CONN_ERR);
         goto close_all;
@@ -2454,7 +2284,14 @@ int main(int argc, char* argv[])
         int howManyDescr = 0;
         int max_descr = (fileno(stdin)>=sock_id)?fileno(stdin):sock_id;
         max_descr++;
-        howManyDescr = select(max_descr, &fdlist, NULL, NULL, NULL);
+        // Messages received together with the previous ones are already in the receive buffer: select does not notify them
+        bool pending = recv_secure_pending();
+        struct timeval no_wait = {0, 0};
+        howManyDescr = select(max_descr, &fdlist, NULL, NULL, pending? &no_wait: NULL);
+        if(pending && howManyDescr>=0){
+            FD_SET(sock_id, &fdlist);
+            howManyDescr++;
+        }
         
         switch(howManyDescr){
         case 0:
@@ -2505,11 +2342,18 @@ close_all:
         safe_free(session_key_clientToClient, session_key_clientToClient_len);
     if(server_cert)
         free(server_cert);
+    cert_store_free(ca_store);
     if(session_key_clientToServer)
         safe_free(session_key_clientToServer, session_key_clientToServer_len);
+    auth_enc_session_free(session_clientToClient);
+    auth_enc_session_free(session_clientToServer);
+    secure_buffer_free(record_buffer);
+    secure_buffer_free(recv_buffer);
+    secure_pool_log_stats();
 
     if(user_list)
         free_list_users(user_list);
+    free(privkey_password);
     close(sock_id);
     
     if(error) {
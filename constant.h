@@ -58,21 +58,154 @@
 
 #define VERBOSITY_LEVEL 4
 
+/*
+ *  DEBUG CONSTANTS
+ *  Define SEND_SELF_CHECK (e.g. make CFLAGS="-c -g -DSEND_SELF_CHECK") to make the server decrypt every
+ *  record it sends and compare it with the plaintext before the send
+*/
+//#define SEND_SELF_CHECK
+#define SELF_CHECK_LOG_INTERVAL 1000 //records between two logs of the self check counters
+
+/*
+ *  Define RELAY_TIMESTAMPS (make CFLAGS="-c -g -DRELAY_TIMESTAMPS") to make the server append to every relayed chat
+ *  message (CHAT_RESPONSE) a trailer with the times (CLOCK_MONOTONIC, ns) of the stages of the relay. The clients
+ *  ignore the trailer after the record of the peer, loadgen reports the latency of every stage
+*/
+//#define RELAY_TIMESTAMPS
+#define RELAY_STAMP_INGRESS 0 //handle_auth_and_msg of the worker of the sender
+#define RELAY_STAMP_ENQUEUE 1 //relay_write, before the push in the relay ring of the worker of the recipient
+#define RELAY_STAMP_DEQUEUE 2 //deliver_to_user of the worker of the recipient
+#define RELAY_STAMP_EGRESS 3 //deliver_relay, before the sealing of the record for the recipient
+#define RELAY_STAMPS 4
+#define RELAY_STAMPS_SIZE (RELAY_STAMPS * sizeof(uint64_t))
+
 
 /**************************
 *   OTHER CONSTANTS
 ***************************/
 
-#define SOCKET_QUEUE 10
-#define REGISTERED_USERS 5
+#define SOCKET_QUEUE 1024
+#define MAX_REGISTERED_USERS (1 << 20) //capacity of the user directory of the server
+#define USER_INDEX_SLOTS (2 * MAX_REGISTERED_USERS) //slots of the hash index of the usernames, a power of two
+#define USER_LOCK_STRIPES 64 //locks of the writers of the user directory
+#define USER_REGISTRY_FILE "certification/user_registry.dat" //registered users, it is created at the first start of the server
+#define REGISTRY_GROWTH 4096 //records added to the registry file when it is full
+#define PUBKEY_FOLDER "certification" //public keys of the users, <username>_pubkey.pem
+#define PUBKEY_CACHE_SLOTS 4096 //public keys cached in shared memory, user_id % PUBKEY_CACHE_SLOTS is the slot of a user
+#define PUBKEY_CACHE_MAX_SER 512 //bytes of a serialized public key in the cache
 #define BUFFER_MAX  10000
 #define REQUEST_CONTROL_TIME 30 // seconds
-#define RELAY_CONTROL_TIME 2 //seconds
+#define HANDSHAKE_TIMEOUT 5 //seconds, a client has to complete its handshake within this time
+#define POOL_STATS_INTERVAL 60 //seconds between two logs of the statistics of the pools of a worker
+#define HANDSHAKE_BUFFER_SIZE 2048 //bytes, the longest handshake message the server receives (M1 or M3)
 #define RELAY_MSG_SIZE 11000
+#define RECV_BUFFER_SIZE 32768 //bytes, it holds at least two records of RELAY_MSG_SIZE
 #define NONCE_SIZE 2
 #define AUTH_CLNT_SRV 1
 #define AUTH_CLNT_CLNT 2
 #define MAX_SEQ_NUM 0xFFFFFFFF
+
+/**************************
+*   HANDSHAKE CAPABILITIES
+***************************/
+//Offered in the high byte of the username length of M1 (a trailing byte in client to client M1), 
+//selected in the high byte of the ephemeral key length of M2. Both are signed in M2
+#define CAP_COUNTER_NONCE 0x01 //IV = salt XOR sequence number, not sent on the wire
+#define CAP_X25519 0x02 //ephemeral X25519 keys sent as raw 32 byte points, session key derived with HKDF
+#define SUPPORTED_CAPS (CAP_COUNTER_NONCE | CAP_X25519)
+//Offered when M1 carries a session ticket after the username, selected when the session is resumed with it
+//(M2 is then only R2 and a key length of 0). It is never offered to another client
+#define CAP_RESUME 0x04
+//Selected by a server under load in place of M2: R2 is 0, the key length is the length of a cookie that follows it and
+//the connection is closed. The client connects again and echoes the cookie after the username of M1 (offering CAP_COOKIE)
+#define CAP_COOKIE 0x08
+#define X25519_KEY_SIZE 32
+#define SESSION_KEY_INFO "secureCom session key" //HKDF info of the session key with CAP_X25519
+#define CAPS_SHIFT 24
+#define CAPS_LEN_MASK 0x00FFFFFF
+#define NONCE_DIR_INITIATOR 0x01
+#define NONCE_DIR_RESPONDER 0x02
+//Header of a record: ciphertext length, IV (only without CAP_COUNTER_NONCE), tag
+#define RECORD_HEADER_LEN(caps) (sizeof(uint32_t) + (((caps) & CAP_COUNTER_NONCE)? 0: IV_DEFAULT) + TAG_DEFAULT)
+
+/**************************
+*   SECURE BUFFER POOL CONSTANTS
+***************************/
+#define SECURE_POOL_MIN_BUFFER 64 //bytes, usable size of the smallest class (the classes are powers of two)
+#define SECURE_POOL_CLASSES 10 //from 64 bytes to 32 KB
+#define SECURE_POOL_SLAB_SIZE (64 * 1024) //bytes locked in memory at once for a class
+
+/**************************
+*   EPHEMERAL KEY POOL CONSTANTS
+***************************/
+#define EPH_KEY_POOL_DEPTH 64 //ephemeral key pairs kept ready by every worker of the server
+
+/**************************
+*   CRYPTO POOL CONSTANTS
+***************************/
+#define CRYPTO_POOL_THREADS 2 //threads of every worker of the server that sign, verify and derive the keys of the handshakes
+#define CRYPTO_VERIFY_BATCH_SIZE 32 //verifications of M3 batched together at most, default of ./server --verify-batch
+#define CRYPTO_VERIFY_BATCH_DELAY 300 //us that a batch of verifications waits at most behind the other jobs of the pool
+#define CRYPTO_JOB_SIGN 0
+#define CRYPTO_JOB_VERIFY 1
+#define CRYPTO_JOB_DERIVE 2
+#define CRYPTO_JOB_KINDS 3
+#define CRYPTO_POOL_LATENCY_BUCKETS 32 //powers of two of us
+
+/**************************
+*   SESSION TICKET CONSTANTS
+***************************/
+#define TICKET_KEY_LIFETIME 3600 //seconds, the server seals the tickets with a new key in every period
+#define TICKET_KEYS 2 //keys kept: tickets are opened with the key of the current period or of the previous one
+#define TICKET_LIFETIME TICKET_KEY_LIFETIME //seconds, a ticket older than this is not accepted
+#define TICKET_KEY_SIZE 32 //bytes, AUTH_ENCRYPT_DEFAULT key
+#define RESUMPTION_SECRET_SIZE 32 //bytes, length of DIGEST_DEFAULT
+#define MAX_TICKET_SIZE 256 //bytes
+#define RESUMPTION_BINDER_SIZE 32 //bytes, HMAC of M1 with the resumption secret, it follows the ticket in M1
+#define RESUMPTION_SECRET_INFO "secureCom resumption secret" //HKDF info of the resumption secret of a session
+#define RESUMED_KEY_INFO "secureCom resumed session key" //HKDF info of the session key of a resumed session
+
+/**************************
+*   HEADLESS CLIENT CONSTANTS
+***************************/
+#define SCRIPT_TIMEOUT 30 //seconds that an operation of a script waits for the server or for the peer
+#define SCRIPT_POLL_INTERVAL 100 //ms between two requests of the online users of wait_online
+#define SCRIPT_MAX_MESSAGE_SIZE 8192 //bytes of a chat message sent by a script
+
+/**************************
+*   COOKIE CONSTANTS
+***************************/
+#define COOKIE_QUEUE_THRESHOLD 32 //connections waiting in the accept queue that turn the cookie mode on, 0 to keep it always on
+#define COOKIE_LIFETIME 10 //seconds, a cookie is accepted in its period and in the following one
+#define COOKIE_SECRET_SIZE 32 //bytes, key of the HMAC of the cookies
+#define COOKIE_SIZE (sizeof(uint32_t) + 32) //period and HMAC of client address, R1 and period
+
+/**************************
+*   EVENT LOOP CONSTANTS
+***************************/
+#define MAX_EVENTS 256
+#define CONN_READY 0
+#define CONN_WAIT_CHAT_REPLY 1
+#define CONN_WAIT_M1 2 //handshake, the server waits for M1
+#define CONN_WAIT_M3 3 //handshake, M2 has been sent and the server waits for M3
+//Results of a step of the handshake that are not a user id
+#define HANDSHAKE_COOKIE_SENT -2 //the client has been asked for a cookie, the connection is closed
+#define HANDSHAKE_PENDING -3 //the handshake goes on when more bytes arrive
+#define SEND_QUEUE_MAX (1 << 20) //bytes queued for a client that does not read, beyond them its connection is closed
+#define READ_BUDGET (2 * RECV_BUFFER_SIZE) //bytes read from a client for each readiness event, the rest waits for the next round
+
+/**************************
+*   RELAY CONSTANTS
+***************************/
+#define SERVER_WORKERS 4
+#define RELAY_RING_SIZE (1 << 20) //bytes, for each worker
+#define RELAY_RING_FULL 1
+#define RELAY_RECORD_PAD 0x80000000
+//States of the reservation of a producer in a relay ring
+#define RELAY_RESERVATION_NONE 0
+#define RELAY_RESERVATION_PENDING 1 //the producer is trying to reserve its space with the CAS on tail
+#define RELAY_RESERVATION_TAKEN 2 //the space is reserved and the record is not published yet
+#define RELAY_RESERVATION_ABANDONED 3 //the producer died before publishing, the consumer skips the space
 /**************************
 *   CRYPTO CONSTANTS
 ***************************/
@@ -84,4 +217,8 @@
 #define IV_DEFAULT EVP_CIPHER_iv_length(AUTH_ENCRYPT_DEFAULT) // 12
 #define PUBKEY_DEFAULT 2048
 #define PUBKEY_DEFAULT_SER 451
+#define FINGERPRINT_SIZE 32 //digest of a public key, length of DIGEST_DEFAULT
+//Kinds of identity keys of users and server, Ed25519 keys sign without a separate digest
+#define IDENTITY_KEY_RSA 0
+#define IDENTITY_KEY_ED25519 1
 #endif
\ No newline at end of file
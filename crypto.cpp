@@ -2,14 +2,25 @@
 #include <stdio.h>
 #include <iostream>
 #include <string.h> 
+#include <arpa/inet.h>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
 #include <openssl/rand.h>
 #include <openssl/x509_vfy.h>
+#include <openssl/kdf.h>
 #include "util.h"
 #include "constant.h"
 #include "crypto.h"
 #include <openssl/err.h> // for error descriptions
+#include <sys/mman.h>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 using uchar=unsigned char;
 using namespace std;
@@ -381,11 +392,345 @@ int auth_enc_decrypt(uchar *ciphertext, uint ciphertext_len, uchar* aad, uint aa
     plaintext_len += len;
 
     // deallocate contxt
-    EVP_CIPHER_CTX_cleanup(ctx);
+    EVP_CIPHER_CTX_free(ctx);
 
     return plaintext_len;    
 }
 
+/*
+* Authenticated encryption session: contexts initialized once with the session key, so that every record
+* only resets the IV instead of allocating a context and redoing the key schedule.
+* With CAP_COUNTER_NONCE the IV of a record is salt XOR sequence number (as in TLS 1.3), each direction has its own salt
+*/
+struct auth_enc_session {
+    EVP_CIPHER_CTX* encrypt_ctx;
+    EVP_CIPHER_CTX* decrypt_ctx;
+    uint8_t caps;
+    uchar send_salt[EVP_MAX_IV_LENGTH];
+    uchar receive_salt[EVP_MAX_IV_LENGTH];
+};
+
+/**
+ * @brief derive the nonce salt of one direction of the session from the session key
+ * 
+ * @param key input
+ * @param key_len input
+ * @param direction input NONCE_DIR_INITIATOR or NONCE_DIR_RESPONDER
+ * @param salt output (IV length bytes, has to be preallocated)
+ * @return 1 on success, 0 on error(s)
+ */
+int derive_nonce_salt(uchar* key, uint key_len, uint8_t direction, uchar* salt){
+    uchar digest[EVP_MAX_MD_SIZE];
+    uint digest_len;
+    EVP_MD_CTX* md_ctx = EVP_MD_CTX_new();
+    if(md_ctx == nullptr){
+        perror("Error: unallocated context\n");
+        return 0;
+    }
+    if(1 != EVP_DigestInit(md_ctx, DIGEST_DEFAULT) || 1 != EVP_DigestUpdate(md_ctx, key, key_len) ||
+        1 != EVP_DigestUpdate(md_ctx, &direction, sizeof(direction)) || 1 != EVP_DigestFinal(md_ctx, digest, &digest_len)){
+        perror("Error: salt derivation failed\n");
+        EVP_MD_CTX_free(md_ctx);
+        return 0;
+    }
+    EVP_MD_CTX_free(md_ctx);
+    memcpy(salt, digest, EVP_CIPHER_iv_length(AUTH_ENCRYPT_DEFAULT));
+    OPENSSL_cleanse(digest, sizeof(digest));
+    return 1;
+}
+
+/**
+ * @brief compute the IV of the record with sequence number seq: salt XOR seq (big endian, in the last bytes)
+ */
+void counter_nonce(const uchar* salt, uint32_t seq, uchar* iv){
+    int iv_len = EVP_CIPHER_iv_length(AUTH_ENCRYPT_DEFAULT);
+    memcpy(iv, salt, iv_len);
+    for(int i = 0; i < 4; i++)
+        iv[iv_len - 1 - i] ^= (uchar)(seq >> (8 * i));
+}
+
+void* auth_enc_session_new(uchar* key, uint8_t caps, bool initiator){
+    if(key == nullptr){
+        perror("Error: unallocated key\n");
+        return nullptr;
+    }
+    const EVP_CIPHER *cypher=AUTH_ENCRYPT_DEFAULT;
+    auth_enc_session* session = (auth_enc_session*) malloc(sizeof(auth_enc_session));
+    if(session == nullptr){
+        errorHandler(MALLOC_ERR);
+        return nullptr;
+    }
+    session->caps = caps;
+    if(caps & CAP_COUNTER_NONCE){
+        uint8_t send_dir = (initiator)? NONCE_DIR_INITIATOR: NONCE_DIR_RESPONDER;
+        uint8_t receive_dir = (initiator)? NONCE_DIR_RESPONDER: NONCE_DIR_INITIATOR;
+        int key_len = EVP_CIPHER_key_length(cypher);
+        if(1 != derive_nonce_salt(key, key_len, send_dir, session->send_salt) ||
+            1 != derive_nonce_salt(key, key_len, receive_dir, session->receive_salt)){
+            free(session);
+            return nullptr;
+        }
+    }
+    session->encrypt_ctx = EVP_CIPHER_CTX_new();
+    session->decrypt_ctx = EVP_CIPHER_CTX_new();
+    if(session->encrypt_ctx == nullptr || session->decrypt_ctx == nullptr){
+        perror("Error: unallocated context\n");
+        auth_enc_session_free(session);
+        return nullptr;
+    }
+    if(1 != EVP_EncryptInit_ex(session->encrypt_ctx, cypher, NULL, key, NULL) ||
+        1 != EVP_DecryptInit_ex(session->decrypt_ctx, cypher, NULL, key, NULL)){
+        perror("Error: session init failed\n");
+        auth_enc_session_free(session);
+        return nullptr;
+    }
+    return session;
+}
+
+void auth_enc_session_free(void* session){
+    auth_enc_session* s = (auth_enc_session*) session;
+    if(s == nullptr)
+        return;
+    //Freeing the contexts also cleanses the key schedule
+    EVP_CIPHER_CTX_free(s->encrypt_ctx);
+    EVP_CIPHER_CTX_free(s->decrypt_ctx);
+    OPENSSL_cleanse(s, sizeof(auth_enc_session));
+    free(s);
+}
+
+int auth_enc_session_encrypt(void* session, uint32_t seq, uchar *plaintext, int plaintext_len, uchar* aad, uint aad_len,
+                    uchar** tag, uchar **iv,  uchar **ciphertext){
+    auth_enc_session* s = (auth_enc_session*) session;
+    if(s == nullptr){
+        perror("Error: unallocated session\n");
+        return 0;
+    }
+    int block_len = EVP_CIPHER_CTX_block_size(s->encrypt_ctx);
+    int iv_len = EVP_CIPHER_CTX_iv_length(s->encrypt_ctx);
+    int tag_len=TAG_DEFAULT;
+
+    if(plaintext_len < 0 || plaintext_len > INT_MAX -block_len) { 
+        perror("Error: integer overflow (meggase too big?)\n");
+        return 0;
+    }
+
+    // allocate buffers
+    *tag=(uchar*) malloc(tag_len); 
+    *ciphertext = (uchar*) malloc(plaintext_len+block_len);
+    *iv = (uchar*) malloc(iv_len);
+    if(*tag==nullptr || *ciphertext==nullptr || *iv==nullptr) { 
+        errorHandler(MALLOC_ERR);
+        free(*tag); free(*ciphertext); free(*iv);
+        return 0;
+    }
+
+    // IV from the sequence number or, without CAP_COUNTER_NONCE, random IV
+    if(s->caps & CAP_COUNTER_NONCE){
+        counter_nonce(s->send_salt, seq, *iv);
+    } else {
+        RAND_poll();
+        if(1 != RAND_bytes(*iv, iv_len)) { 
+            perror("Error: RAND_bytes failed\n");
+            free(*tag); free(*ciphertext); free(*iv);
+            return 0;
+        }
+    }
+
+    int len;
+    int ciphertext_len;
+
+    // Encrypt init: only the IV is set, the key schedule of the session is kept
+    if(1 != EVP_EncryptInit_ex(s->encrypt_ctx, NULL, NULL, NULL, *iv) ||
+        1 != EVP_EncryptUpdate(s->encrypt_ctx, NULL, &len, aad, aad_len) ||
+        1 != EVP_EncryptUpdate(s->encrypt_ctx, *ciphertext, &len, plaintext, plaintext_len)) { 
+        perror("Error: encryption update failed\n");
+        free(*tag); free(*ciphertext); free(*iv);
+        return 0;
+    }
+    ciphertext_len = len;
+
+    if(1 != EVP_EncryptFinal_ex(s->encrypt_ctx, *ciphertext + len, &len)) { 
+        perror("Error: encryption final failed\n");
+        free(*tag); free(*ciphertext); free(*iv);
+        return 0;
+    }
+    ciphertext_len += len;
+
+    if(1 != EVP_CIPHER_CTX_ctrl(s->encrypt_ctx, EVP_CTRL_AEAD_GET_TAG, tag_len, *tag)){ 
+        perror("Error: encryption ctrl failed\n");
+        free(*tag); free(*ciphertext); free(*iv);
+        return 0;
+    }
+    return ciphertext_len;
+}
+
+uint auth_enc_session_seal(void* session, uint32_t seq, uchar* record, uint plaintext_len, uchar* iv_used){
+    auth_enc_session* s = (auth_enc_session*) session;
+    if(s == nullptr || record == nullptr){
+        perror("Error: unallocated session\n");
+        return 0;
+    }
+    int iv_len = EVP_CIPHER_CTX_iv_length(s->encrypt_ctx);
+    uint header_len = RECORD_HEADER_LEN(s->caps);
+    if(plaintext_len > INT_MAX - header_len) { 
+        perror("Error: integer overflow (meggase too big?)\n");
+        return 0;
+    }
+
+    // Header: the length of the ciphertext (== plaintext with GCM) is also the AAD
+    uint32_t len_net = htonl(plaintext_len);
+    memcpy(record, &len_net, sizeof(uint32_t));
+    uchar* tag = record + header_len - TAG_DEFAULT;
+    uchar* plaintext = record + header_len;
+
+    // IV from the sequence number or, without CAP_COUNTER_NONCE, random IV written in the header
+    uchar seq_iv[EVP_MAX_IV_LENGTH];
+    uchar* iv = seq_iv;
+    if(s->caps & CAP_COUNTER_NONCE){
+        counter_nonce(s->send_salt, seq, seq_iv);
+    } else {
+        iv = record + sizeof(uint32_t);
+        RAND_poll();
+        if(1 != RAND_bytes(iv, iv_len)) { 
+            perror("Error: RAND_bytes failed\n");
+            return 0;
+        }
+    }
+
+    // GCM is a stream mode: the plaintext is encrypted in place and no bytes are left for the final
+    int len;
+    if(1 != EVP_EncryptInit_ex(s->encrypt_ctx, NULL, NULL, NULL, iv) ||
+        1 != EVP_EncryptUpdate(s->encrypt_ctx, NULL, &len, record, sizeof(uint32_t)) ||
+        1 != EVP_EncryptUpdate(s->encrypt_ctx, plaintext, &len, plaintext, plaintext_len) ||
+        1 != EVP_EncryptFinal_ex(s->encrypt_ctx, plaintext + len, &len) ||
+        1 != EVP_CIPHER_CTX_ctrl(s->encrypt_ctx, EVP_CTRL_AEAD_GET_TAG, TAG_DEFAULT, tag)) { 
+        perror("Error: encryption failed\n");
+        OPENSSL_cleanse(plaintext, plaintext_len);
+        return 0;
+    }
+    if(iv_used != nullptr)
+        memcpy(iv_used, iv, iv_len);
+    return header_len + plaintext_len;
+}
+
+int auth_enc_record_len(uchar* buffer, uint buffer_len, uint8_t caps, uint max_ciphertext_len){
+    uint header_len = RECORD_HEADER_LEN(caps);
+    if(buffer == nullptr || buffer_len < header_len)
+        return 0;
+    uint32_t ct_len;
+    memcpy(&ct_len, buffer, sizeof(uint32_t));
+    ct_len = ntohl(ct_len);
+    if(ct_len == 0 || ct_len > max_ciphertext_len)
+        return -1;
+    return (buffer_len >= header_len + ct_len)? header_len + ct_len: 0;
+}
+
+uint auth_enc_session_open(void* session, uint32_t seq, uchar* record, uint record_len){
+    auth_enc_session* s = (auth_enc_session*) session;
+    if(s == nullptr || record == nullptr){
+        perror("Error: unallocated session\n");
+        return 0;
+    }
+    uint header_len = RECORD_HEADER_LEN(s->caps);
+    uint32_t ct_len;
+    memcpy(&ct_len, record, sizeof(uint32_t));
+    ct_len = ntohl(ct_len);
+    if(record_len < header_len || ct_len != record_len - header_len || ct_len > INT_MAX){
+        perror("Error: invalid record length\n");
+        return 0;
+    }
+    uchar* tag = record + header_len - TAG_DEFAULT;
+    uchar* ciphertext = record + header_len;
+
+    // IV of the expected sequence number or, without CAP_COUNTER_NONCE, IV written in the header
+    uchar seq_iv[EVP_MAX_IV_LENGTH];
+    uchar* iv = record + sizeof(uint32_t);
+    if(s->caps & CAP_COUNTER_NONCE){
+        counter_nonce(s->receive_salt, seq, seq_iv);
+        iv = seq_iv;
+    }
+
+    // The ciphertext is decrypted in place, the tag is verified by the final
+    int len;
+    if(1 != EVP_DecryptInit_ex(s->decrypt_ctx, NULL, NULL, NULL, iv) ||
+        1 != EVP_DecryptUpdate(s->decrypt_ctx, NULL, &len, record, sizeof(uint32_t)) ||
+        1 != EVP_DecryptUpdate(s->decrypt_ctx, ciphertext, &len, ciphertext, ct_len) ||
+        1 != EVP_CIPHER_CTX_ctrl(s->decrypt_ctx, EVP_CTRL_AEAD_SET_TAG, TAG_DEFAULT, tag) ||
+        EVP_DecryptFinal_ex(s->decrypt_ctx, ciphertext + len, &len) <= 0){
+        perror("Error: decryption failed\n");
+        OPENSSL_cleanse(ciphertext, ct_len);
+        return 0;
+    }
+    return ct_len;
+}
+
+int auth_enc_session_decrypt(void* session, uint32_t seq, uchar *ciphertext, uint ciphertext_len, uchar* aad, uint aad_len,
+                    uchar* tag, uchar *iv,  uchar **plaintext){
+    auth_enc_session* s = (auth_enc_session*) session;
+    if(s == nullptr){
+        perror("Error: unallocated session\n");
+        return 0;
+    }
+    int block_len = EVP_CIPHER_CTX_block_size(s->decrypt_ctx);
+    int tag_len=TAG_DEFAULT;
+
+    if(ciphertext_len > INT_MAX -block_len) { 
+        perror("Error: integer overflow (meggase too big?)\n");
+        return 0;
+    }
+
+    // allocate buffers
+    *plaintext = (uchar*) malloc(ciphertext_len+block_len);
+    if(*plaintext==nullptr) { 
+        errorHandler(MALLOC_ERR);
+        return 0;
+    }
+
+    // Without an explicit IV the one of the expected sequence number is used
+    uchar seq_iv[EVP_MAX_IV_LENGTH];
+    if(iv == nullptr){
+        if(!(s->caps & CAP_COUNTER_NONCE)){
+            perror("Error: missing IV\n");
+            safe_free(*plaintext, ciphertext_len+block_len);
+            *plaintext = nullptr;
+            return 0;
+        }
+        counter_nonce(s->receive_salt, seq, seq_iv);
+        iv = seq_iv;
+    }
+
+    int len;
+    int plaintext_len;
+
+    // Decrypt init: only the IV is set, the key schedule of the session is kept
+    if(1 != EVP_DecryptInit_ex(s->decrypt_ctx, NULL, NULL, NULL, iv) ||
+        1 != EVP_DecryptUpdate(s->decrypt_ctx, NULL, &len, aad, aad_len) ||
+        1 != EVP_DecryptUpdate(s->decrypt_ctx, *plaintext, &len, ciphertext, ciphertext_len)) { 
+        perror("Error: decryption update failed\n");
+        safe_free(*plaintext, ciphertext_len+block_len);
+        *plaintext = nullptr;
+        return 0;
+    }
+    plaintext_len = len;
+
+    if(1 != EVP_CIPHER_CTX_ctrl(s->decrypt_ctx, EVP_CTRL_AEAD_SET_TAG, tag_len, tag)){ 
+        perror("Error: decryption ctrl failed\n");
+        safe_free(*plaintext, ciphertext_len+block_len);
+        *plaintext = nullptr;
+        return 0;
+    }
+
+    //Decrypt Final. The tag is verified here
+    if(EVP_DecryptFinal_ex(s->decrypt_ctx, *plaintext + len, &len) <= 0){ 
+        perror("Error: decryption final failed \n");
+        safe_free(*plaintext, ciphertext_len+block_len);
+        *plaintext = nullptr;
+        return 0;
+    }
+    plaintext_len += len;
+    return plaintext_len;    
+}
+
 /**
  * @brief digest computation
  * 
@@ -483,52 +828,93 @@ int serialize_certificate(FILE* cert_file, uchar** certificate){
 // }
 
 /**
- * @brief verify a certificate with a self signed CA certificate and ctrl
+ * @brief verify a certificate with a trust store built by cert_store_new
  * 
  * @param certificate certificate under verification
- * @param CAcertificate self signed CA certificate
- * @param CAcrl self signed CA ctrl
+ * @param store trust store with the self signed CA certificate and its crl
  * @return 1 if succesfull verification, 0 otherwise
  */
-int verify_certificate(  X509* certificate,  X509*  CAcertificate,    X509_CRL* CAcrl){
+int verify_certificate(X509* certificate, X509_STORE* store){
     int ret; // used for return values
-   
-    // build a store with the CA's certificate and the CRL:
-    X509_STORE* store = X509_STORE_new();
-    if(!store) { 
-        cerr << "Error: X509_STORE_new returned NULL\n" << ERR_error_string(ERR_get_error(), NULL) << "\n"; 
-        return 0; }
-    ret = X509_STORE_add_cert(store, CAcertificate);
-    if(ret != 1) { 
-        cerr << "Error: X509_STORE_add_cert returned " << ret << "\n" << ERR_error_string(ERR_get_error(), NULL) << "\n";
-         X509_STORE_free(store); return 0; }
-    ret = X509_STORE_add_crl(store, CAcrl);
-    if(ret != 1) { 
-        cerr << "Error: X509_STORE_add_crl returned " << ret << "\n" << ERR_error_string(ERR_get_error(), NULL) << "\n"; 
-         X509_STORE_free(store); return 0; }
-    ret = X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK);
-    if(ret != 1) { 
-        cerr << "Error: X509_STORE_set_flags returned " << ret << "\n" << ERR_error_string(ERR_get_error(), NULL) << "\n";
-         X509_STORE_free(store); return 0; }
 
     // verify the certificate
     X509_STORE_CTX* certvfy_ctx = X509_STORE_CTX_new();
     if(!certvfy_ctx) { 
         cerr << "Error: X509_STORE_CTX_new returned NULL\n" << ERR_error_string(ERR_get_error(), NULL) << "\n"; 
-         X509_STORE_free(store); return 0; }
+        return 0; }
     ret = X509_STORE_CTX_init(certvfy_ctx, store, certificate, NULL);
     if(ret != 1) { cerr << "Error: X509_STORE_CTX_init returned " << ret << "\n" << ERR_error_string(ERR_get_error(), NULL) << "\n"; 
         ret=0; goto finish; }
     ret= X509_verify_cert(certvfy_ctx);
 finish:
-    X509_STORE_free(store);
     X509_STORE_CTX_free(certvfy_ctx);
     return ret;
 }
 
+void* cert_store_new(FILE* const CAcertificate, FILE* const CAcrl){
+    int ret; // used for return values
+
+    // load CA certificate (self signed)
+    if(!CAcertificate){ cerr << "Error: cannot open ca certificate file (missing?)\n"; return NULL; }
+    X509* cacert = PEM_read_X509(CAcertificate, NULL, NULL, NULL);
+    if(!cacert){ cerr << "Error: PEM_read_X509 returned NULL\n"; return NULL; }
+
+    // load CA ctrl for revocation list
+    if(!CAcrl){ cerr << "Error: cannot open ca ctrl file (missing?)\n"; X509_free(cacert); return NULL; }
+    X509_CRL* crl = PEM_read_X509_CRL(CAcrl, NULL, NULL, NULL);
+    if(!crl){ cerr << "Error: PEM_read_X509_CRL returned NULL\n"; X509_free(cacert); return NULL; }
+
+    // build a store with the CA's certificate and the CRL, the store keeps its own references to them:
+    X509_STORE* store = X509_STORE_new();
+    if(!store) { 
+        cerr << "Error: X509_STORE_new returned NULL\n" << ERR_error_string(ERR_get_error(), NULL) << "\n"; 
+        X509_free(cacert); X509_CRL_free(crl); return NULL; }
+    ret = X509_STORE_add_cert(store, cacert);
+    X509_free(cacert);
+    if(ret != 1) { 
+        cerr << "Error: X509_STORE_add_cert returned " << ret << "\n" << ERR_error_string(ERR_get_error(), NULL) << "\n";
+        X509_CRL_free(crl); X509_STORE_free(store); return NULL; }
+    ret = X509_STORE_add_crl(store, crl);
+    X509_CRL_free(crl);
+    if(ret != 1) { 
+        cerr << "Error: X509_STORE_add_crl returned " << ret << "\n" << ERR_error_string(ERR_get_error(), NULL) << "\n"; 
+        X509_STORE_free(store); return NULL; }
+    ret = X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK);
+    if(ret != 1) { 
+        cerr << "Error: X509_STORE_set_flags returned " << ret << "\n" << ERR_error_string(ERR_get_error(), NULL) << "\n";
+        X509_STORE_free(store); return NULL; }
+    return store;
+}
+
+void cert_store_free(void* store){
+    X509_STORE_free((X509_STORE*)store);
+}
+
+/**
+ * @brief verify a signature with an Ed25519 key, that signs the whole document without a separate digest
+ * 
+ * @return 1 if the signature is valid, 0 otherwise
+ */
+int _verify_sign_ed25519(uchar* signature, uint sign_lenght, uchar* document, uint doc_lenght, EVP_PKEY* pubkey){
+    EVP_MD_CTX* md_ctx = EVP_MD_CTX_new();
+    if(!md_ctx){ cerr << "Error: EVP_MD_CTX_new returned NULL\n"; return 0; }
+    int ret = EVP_DigestVerifyInit(md_ctx, NULL, NULL, NULL, pubkey);
+    if(ret == 1)
+        ret = EVP_DigestVerify(md_ctx, signature, sign_lenght, document, doc_lenght);
+    if(ret != 1){ // it is 0 if invalid signature, a negative value if some other error, 1 if success.
+        cerr << "Error: EVP_DigestVerify returned " << ret << " (invalid signature?)\n";
+        ret=0;
+    }
+    EVP_MD_CTX_free(md_ctx);
+    return ret;
+}
+
 int _verify_sing_pubkey(uchar* signature, uint sign_lenght, uchar* document, uint doc_lenght, 
     EVP_PKEY* pubkey){
     
+    if(!pubkey){ cerr << "Error: no pubkey \n"; return 0; }
+    if(EVP_PKEY_get_id(pubkey) == EVP_PKEY_ED25519)
+        return _verify_sign_ed25519(signature, sign_lenght, document, doc_lenght, pubkey);
     int ret; // used for return values
     // create the signature context:
     // declare some useful variables:
@@ -576,48 +962,58 @@ int verify_sign_pubkey(uchar* signature, uint sign_lenght, uchar* document, uint
 
 }
 
-int verify_sign_cert(const uchar* certificate, const uint cert_lenght,  FILE* const CAcertificate,  
-    FILE* const CAcrl, uchar* signature, uint sign_lenght, uchar* document, uint doc_lenght ){
+int verify_sign_parsed_pubkey(uchar* signature, uint sign_lenght, uchar* document, uint doc_lenght, void* pubkey){
+    if(!pubkey){ cerr << "Error: no pubkey \n"; return 0; }
+    return _verify_sing_pubkey(signature, sign_lenght, document, doc_lenght, (EVP_PKEY*)pubkey);
+}
+
+void* parse_pubkey(const uchar* pubkey, uint key_lenght){
+    EVP_PKEY* pkey;
+    if(!deserialize_pubkey(pubkey, key_lenght, &pkey)){
+        cerr << "Error: unable to deserialize pubkey \n"; return NULL;
+    }
+    return pkey;
+}
+
+void free_pubkey(void* pubkey){
+    EVP_PKEY_free((EVP_PKEY*)pubkey);
+}
+
+int verify_sign_cert(const uchar* certificate, const uint cert_lenght, void* store, uchar* signature, uint sign_lenght, 
+    uchar* document, uint doc_lenght){
     int ret;
 
     if(!signature || sign_lenght==0) { cerr << "Error: no signature \n"; return 0; }
     if(!document || doc_lenght==0) { cerr << "Error: no document \n"; return 0; }
     if(!certificate || cert_lenght==0) { cerr << "Error: no certificate \n"; return 0; }
+    if(!store) { cerr << "Error: no trust store \n"; return 0; }
 
     // load the certificate under validation
     X509* cert=d2i_X509(NULL,   &certificate ,cert_lenght);
     if(!cert){ cerr << "Error: PEM_read_X509 returned NULL\n"; return 0; }
-    
-    // load CA certificate (self signed)
-    if(!CAcertificate){ 
-        cerr << "Error: cannot open ca certificate file (missing?)\n"; X509_free(cert); return 0; }
-    X509* cacert = PEM_read_X509(CAcertificate, NULL, NULL, NULL);
-    if(!cacert){ X509_free(cert); cerr << "Error: PEM_read_X509 returned NULL\n"; return 0; }
 
-    // load CA ctrl for revocation list
-    if(!CAcrl){ cerr << "Error: cannot open ca ctrl file (missing?)\n"; 
-        X509_free(cacert); X509_free(cert); return 0; }
-    X509_CRL* crl = PEM_read_X509_CRL(CAcrl, NULL, NULL, NULL);
-    if(!crl){ cerr << "Error: PEM_read_X509_CRL returned NULL\n"; 
-        X509_free(cacert); X509_free(cert); return 0; }
-  
-
-    if(!verify_certificate( cert,  cacert, crl)){
+    if(!verify_certificate(cert, (X509_STORE*)store)){
         perror("certificate validation failed, the certificate is not valid");
-        X509_free(cacert); 
-        X509_CRL_free(crl); 
         X509_free(cert);
         return 0;
     }
 
     // verify the signature with extracted public key
-    ret=_verify_sing_pubkey(signature, sign_lenght, document, doc_lenght,X509_get_pubkey(cert) );
-    X509_free(cacert); 
-    X509_CRL_free(crl); 
+    ret=_verify_sing_pubkey(signature, sign_lenght, document, doc_lenght,X509_get0_pubkey(cert) );
     X509_free(cert);
     return ret;
 }
 
+int verify_sign_cert(const uchar* certificate, const uint cert_lenght,  FILE* const CAcertificate,  
+    FILE* const CAcrl, uchar* signature, uint sign_lenght, uchar* document, uint doc_lenght ){
+    void* store = cert_store_new(CAcertificate, CAcrl);
+    if(!store)
+        return 0;
+    int ret = verify_sign_cert(certificate, cert_lenght, store, signature, sign_lenght, document, doc_lenght);
+    cert_store_free(store);
+    return ret;
+}
+
 int sign_document( const uchar* document, uint doc_lenght, FILE* const priv_key, char* const password, 
         uchar** signature, uint* sign_lenght){
     void* pkey=read_privkey(priv_key,password );
@@ -627,10 +1023,36 @@ int sign_document( const uchar* document, uint doc_lenght, FILE* const priv_key,
         
 }
 
+/**
+ * @brief sign a document with an Ed25519 key, that signs the whole document without a separate digest
+ * 
+ * @return 1 if successful, 0 otherwise
+ */
+int _sign_ed25519(const uchar* document, uint doc_lenght, EVP_PKEY* prvkey, uchar** signature, uint* sign_lenght){
+    EVP_MD_CTX* md_ctx = EVP_MD_CTX_new();
+    if(!md_ctx){ cerr << "Error: EVP_MD_CTX_new returned NULL\n"; return 0; }
+    size_t len = EVP_PKEY_size(prvkey);
+    *signature = (unsigned char*)malloc(len);
+    if(!*signature){ cerr << "Error: malloc returned NULL (signature too big?)\n"; EVP_MD_CTX_free(md_ctx); return 0; }
+    if(1 != EVP_DigestSignInit(md_ctx, NULL, NULL, NULL, prvkey) ||
+        1 != EVP_DigestSign(md_ctx, *signature, &len, document, doc_lenght)){
+        cerr << "Error: EVP_DigestSign failed\n";
+        free(*signature);
+        *signature = NULL;
+        EVP_MD_CTX_free(md_ctx);
+        return 0;
+    }
+    *sign_lenght = len;
+    EVP_MD_CTX_free(md_ctx);
+    return 1;
+}
+
 int sign_document( const uchar* document, uint doc_lenght, void* priv_key, uchar** signature, uint* sign_lenght){
     EVP_PKEY* prvkey = (EVP_PKEY*)priv_key;
     if(!prvkey){ cerr << "Error:no private key\n"; return 0; }
     if(!document || doc_lenght==0) { cerr << "Error: no document \n"; return 0; }
+    if(EVP_PKEY_get_id(prvkey) == EVP_PKEY_ED25519)
+        return _sign_ed25519(document, doc_lenght, prvkey, signature, sign_lenght);
 
     // declare some useful variables:
     int ret;
@@ -666,49 +1088,65 @@ int sign_document( const uchar* document, uint doc_lenght, void* priv_key, uchar
     return 1;
 }
 
-int eph_key_generate(void** privkey, uchar** pubkey, uint* pubkey_len ){
-
-    EVP_PKEY* dh_params = NULL;
+/**
+ * @brief generate an ephemeral X25519 key pair, the public key is serialized as its raw 32 bytes
+ */
+int eph_key_generate_x25519(void** privkey, uchar** pubkey, uint* pubkey_len ){
     EVP_PKEY* priv_key=NULL;
-    EVP_PKEY_CTX* pctx;
-
-    // using elliptic-curve
-    pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
-    if(!pctx){cerr << "Error: unable to allocate EC generation context";return 0;}
-    if(!EVP_PKEY_paramgen_init(pctx)){
-        cerr << "Error: unable to initialize EC parameters generation";
-        EVP_PKEY_CTX_free(pctx);
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL);
+    if(!ctx){cerr << "Error: unable to allocate X25519 generation context";return 0;}
+    if(1!=EVP_PKEY_keygen_init(ctx) || 1!=EVP_PKEY_keygen(ctx, &priv_key)){
+        cerr << "Error: unable to generate X25519 keys";
+        EVP_PKEY_CTX_free(ctx);
         return 0;
     }
-    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1);
-    if(!EVP_PKEY_paramgen(pctx, &dh_params)){
-        cerr << "Error: unable to generate EC parameters";
-        EVP_PKEY_CTX_free(pctx);
+    EVP_PKEY_CTX_free(ctx);
+
+    size_t raw_len = X25519_KEY_SIZE;
+    *pubkey = (uchar*)malloc(X25519_KEY_SIZE);
+    if(!*pubkey || 1!=EVP_PKEY_get_raw_public_key(priv_key, *pubkey, &raw_len) || raw_len != X25519_KEY_SIZE){
+        cerr << "Error: unable to serialize X25519 keys\n";
+        free(*pubkey);
+        *pubkey=NULL;
+        EVP_PKEY_free(priv_key);
         return 0;
     }
-    EVP_PKEY_CTX_free(pctx);
+    *pubkey_len = X25519_KEY_SIZE;
+    *privkey = (void*) priv_key;
+    return 1;
+}
 
-    // using DH keys
-    EVP_PKEY_CTX* ctx=EVP_PKEY_CTX_new(dh_params, NULL);
-    if(!ctx){cerr << "Error: unable to allocate DH context";EVP_PKEY_free(dh_params);return 0;}
-    if(1!=EVP_PKEY_keygen_init(ctx)){
+int eph_key_generate(void** privkey, uchar** pubkey, uint* pubkey_len ){
+    return eph_key_generate(privkey, pubkey, pubkey_len, 0);
+}
+
+int eph_key_generate(void** privkey, uchar** pubkey, uint* pubkey_len, uint8_t caps){
+
+    EVP_PKEY* priv_key=NULL;
+    *privkey=NULL;
+    *pubkey=NULL;
+    *pubkey_len=0;
+    if(caps & CAP_X25519)
+        return eph_key_generate_x25519(privkey, pubkey, pubkey_len);
+
+    // using elliptic-curve, the named curve is set on the key generation context (no parameters generation)
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if(!ctx){cerr << "Error: unable to allocate EC generation context";return 0;}
+    if(1!=EVP_PKEY_keygen_init(ctx) || 1!=EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1)){
         cerr << "Error: unable to initialize DH context";
         EVP_PKEY_CTX_free(ctx);
-        EVP_PKEY_free(dh_params);
         return 0;
     }
     if(1!=EVP_PKEY_keygen(ctx, &priv_key)){
         cerr << "Error: unable to generate DH keys";
         EVP_PKEY_CTX_free(ctx);
-        EVP_PKEY_free(dh_params);
         return 0;
     }
     EVP_PKEY_CTX_free(ctx);
-    EVP_PKEY_free(dh_params);
   
     // serialize public key
     *pubkey_len= serialize_pubkey(priv_key, pubkey);
-    if(!*pubkey){cerr << "Error: unable to serialize DH keys\n";return 0;}
+    if(!*pubkey_len){cerr << "Error: unable to serialize DH keys\n"; EVP_PKEY_free(priv_key); return 0;}
     *privkey=(void*) priv_key; 
     
     return 1;
@@ -718,12 +1156,18 @@ uint derive_secret(void* privkey, uchar* peer_key, uint peer_key_len , uchar** s
     EVP_PKEY_CTX *derive_ctx;
     size_t skeylen=0;
 
-    // deserialize keys
+    // deserialize keys: X25519 keys travel as raw points, the others in PEM
     EVP_PKEY* priv_key=(EVP_PKEY*) privkey;
     EVP_PKEY* peer_pubkey;
 
-    if(!deserialize_pubkey(peer_key, peer_key_len, &peer_pubkey))
-        {cerr << "Error: unable to deserialize peer key\n";return 0;}
+    if(EVP_PKEY_get_id(priv_key) == EVP_PKEY_X25519){
+        peer_pubkey = (peer_key_len == X25519_KEY_SIZE)? 
+            EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, peer_key, peer_key_len): NULL;
+        if(!peer_pubkey)
+            {cerr << "Error: unable to decode X25519 peer key\n"; EVP_PKEY_free(priv_key); return 0;}
+    }
+    else if(!deserialize_pubkey(peer_key, peer_key_len, &peer_pubkey))
+        {cerr << "Error: unable to deserialize peer key\n"; EVP_PKEY_free(priv_key); return 0;}
 
     // secret derivation
     derive_ctx = EVP_PKEY_CTX_new(priv_key,NULL);
@@ -741,7 +1185,7 @@ uint derive_secret(void* privkey, uchar* peer_key, uint peer_key_len , uchar** s
     if (!*secret){cerr << "Error: unable to allocate DH secret buffer";goto finish;}
     /*Perform again the derivation and store it in skey buffer*/
     if (EVP_PKEY_derive(derive_ctx, *secret, &skeylen) <= 0) 
-        {cerr << "Error: unable to derive DH secret";skeylen=0; free(secret);goto finish;}
+        {cerr << "Error: unable to derive DH secret";skeylen=0; free(*secret);goto finish;}
     
     //FREE EVERYTHING INVOLVED WITH THE EXCHANGE
 finish:
@@ -751,6 +1195,64 @@ finish:
     return skeylen;
 }
 
+uint derive_session_key(uchar* secret, uint secret_len, uint8_t caps, uchar** session_key){
+    if(!(caps & CAP_X25519))
+        return default_digest(secret, secret_len, session_key);
+
+    // HKDF of the shared secret, as long as a digest so that the cipher does not change
+    uint key_len = EVP_MD_get_size(DIGEST_DEFAULT);
+    *session_key = (uchar*)malloc(key_len);
+    if(!*session_key){ cerr << "Error: unable to allocate the session key\n"; return 0; }
+    if(!hkdf_derive(secret, secret_len, NULL, 0, SESSION_KEY_INFO, *session_key, key_len)){
+        safe_free(*session_key, key_len);
+        *session_key = NULL;
+        return 0;
+    }
+    return key_len;
+}
+
+int derive_resumption_secret(const uchar* session_key, uint session_key_len, uchar* secret){
+    return hkdf_derive(session_key, session_key_len, NULL, 0, RESUMPTION_SECRET_INFO, secret, RESUMPTION_SECRET_SIZE);
+}
+
+uint derive_resumed_session_key(const uchar* resumption_secret, const uchar* nonces, uint nonces_len, uchar** session_key){
+    uint key_len = EVP_MD_get_size(DIGEST_DEFAULT);
+    *session_key = (uchar*)malloc(key_len);
+    if(!*session_key){ cerr << "Error: unable to allocate the session key\n"; return 0; }
+    if(!hkdf_derive(resumption_secret, RESUMPTION_SECRET_SIZE, nonces, nonces_len, RESUMED_KEY_INFO, *session_key, key_len)){
+        safe_free(*session_key, key_len);
+        *session_key = NULL;
+        return 0;
+    }
+    return key_len;
+}
+
+int hkdf_derive(const uchar* key, uint key_len, const uchar* salt, uint salt_len, const char* info, uchar* out, uint out_len){
+    size_t derived_len = out_len;
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    if(!ctx || EVP_PKEY_derive_init(ctx) <= 0 || EVP_PKEY_CTX_set_hkdf_md(ctx, DIGEST_DEFAULT) <= 0 ||
+        EVP_PKEY_CTX_set1_hkdf_key(ctx, key, key_len) <= 0 ||
+        (salt_len > 0 && EVP_PKEY_CTX_set1_hkdf_salt(ctx, salt, salt_len) <= 0) ||
+        EVP_PKEY_CTX_add1_hkdf_info(ctx, (const uchar*)info, strlen(info)) <= 0 ||
+        EVP_PKEY_derive(ctx, out, &derived_len) <= 0 || derived_len != out_len){
+        cerr << "Error: HKDF failed\n";
+        EVP_PKEY_CTX_free(ctx);
+        return 0;
+    }
+    EVP_PKEY_CTX_free(ctx);
+    return 1;
+}
+
+int hmac_compute(const uchar* key, uint key_len, const uchar* document, uint doc_lenght, uchar* mac){
+    size_t mac_len;
+    if(!EVP_Q_mac(NULL, "HMAC", NULL, EVP_MD_get0_name(DIGEST_DEFAULT), NULL, key, key_len, document, doc_lenght,
+        mac, EVP_MD_get_size(DIGEST_DEFAULT), &mac_len)){
+        cerr << "Error: HMAC failed\n";
+        return 0;
+    }
+    return 1;
+}
+
 int random_generate(const uint lenght, uchar* nuance){
     
     if(!RAND_poll()){return 0;}
@@ -772,6 +1274,551 @@ void safe_free(uchar* buffer, uint buffer_len ){
 #pragma optimize("", on)
     free(buffer);
 }
+
+/*
+* Secure buffer pool. The buffers of a class have a usable size of SECURE_POOL_MIN_BUFFER << class bytes and are carved from
+* slabs that are mmapped and mlocked, a released buffer is zeroized and pushed on the free list of its class. Every buffer
+* is preceded by a header with its class; the buffers bigger than the biggest class are allocated and freed one by one.
+*/
+struct secure_buffer_header {
+    uint32_t size_class; //SECURE_POOL_CLASSES for the buffers outside the classes
+    uint32_t size; //usable size
+    uint64_t next_free; //address of the next buffer in the free list of the class
+};
+static_assert(sizeof(secure_buffer_header) % 16 == 0, "the buffers of the pool have to be 16 bytes aligned");
+
+struct secure_pool_class {
+    uchar* free_list = nullptr;
+    uchar* slab_cursor = nullptr; //next buffer never used in the last slab
+    uint slab_remaining = 0;
+};
+
+static secure_pool_class secure_pool[SECURE_POOL_CLASSES];
+static secure_pool_stats secure_pool_counters = {0, 0, 0, 0};
+static mutex secure_pool_mutex;
+static bool secure_pool_lock_warned = false;
+
+/**
+ * @brief map size bytes of memory locked in RAM
+ * @return pointer to the memory, nullptr on error
+ */
+static uchar* secure_pool_map(size_t size){
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED){
+        errorHandler(MMAP_ERR);
+        return nullptr;
+    }
+    //Without the privilege or over RLIMIT_MEMLOCK the buffers are still zeroized, only the locking is lost
+    if(mlock(memory, size) != 0 && !secure_pool_lock_warned){
+        secure_pool_lock_warned = true;
+        perror("Warning: the secure buffer pool cannot lock its memory");
+    }
+    secure_pool_counters.footprint += size;
+    if(secure_pool_counters.footprint > secure_pool_counters.peak_footprint)
+        secure_pool_counters.peak_footprint = secure_pool_counters.footprint;
+    return (uchar*)memory;
+}
+
+uchar* secure_buffer_alloc(uint size){
+    uint size_class = 0;
+    while(size_class < SECURE_POOL_CLASSES && (uint)(SECURE_POOL_MIN_BUFFER << size_class) < size)
+        size_class++;
+
+    lock_guard<mutex> lock(secure_pool_mutex);
+    secure_pool_counters.requests++;
+    secure_buffer_header* header;
+    if(size_class == SECURE_POOL_CLASSES){
+        if(size > UINT_MAX - sizeof(secure_buffer_header))
+            return nullptr;
+        header = (secure_buffer_header*)secure_pool_map(sizeof(secure_buffer_header) + size);
+        if(!header)
+            return nullptr;
+        header->size = size;
+    }
+    else {
+        secure_pool_class* pool_class = &secure_pool[size_class];
+        uint usable = SECURE_POOL_MIN_BUFFER << size_class;
+        if(pool_class->free_list != nullptr){
+            secure_pool_counters.hits++;
+            header = (secure_buffer_header*)pool_class->free_list;
+            pool_class->free_list = (uchar*)header->next_free;
+        }
+        else {
+            uint buffer_size = sizeof(secure_buffer_header) + usable;
+            if(pool_class->slab_remaining == 0){
+                uint buffers = (SECURE_POOL_SLAB_SIZE > buffer_size)? SECURE_POOL_SLAB_SIZE / buffer_size: 1;
+                pool_class->slab_cursor = secure_pool_map((size_t)buffers * buffer_size);
+                if(!pool_class->slab_cursor)
+                    return nullptr;
+                pool_class->slab_remaining = buffers;
+            }
+            header = (secure_buffer_header*)pool_class->slab_cursor;
+            pool_class->slab_cursor += buffer_size;
+            pool_class->slab_remaining--;
+        }
+        header->size = usable;
+    }
+    header->size_class = size_class;
+    header->next_free = 0;
+    return (uchar*)(header + 1);
+}
+
+void secure_buffer_free(uchar* buffer){
+    if(buffer == nullptr)
+        return;
+    secure_buffer_header* header = (secure_buffer_header*)buffer - 1;
+    OPENSSL_cleanse(buffer, header->size);
+
+    lock_guard<mutex> lock(secure_pool_mutex);
+    if(header->size_class >= SECURE_POOL_CLASSES){
+        size_t size = sizeof(secure_buffer_header) + header->size;
+        munmap(header, size);
+        secure_pool_counters.footprint -= size;
+        return;
+    }
+    secure_pool_class* pool_class = &secure_pool[header->size_class];
+    header->next_free = (uint64_t)pool_class->free_list;
+    pool_class->free_list = (uchar*)header;
+}
+
+void secure_pool_get_stats(secure_pool_stats* stats){
+    lock_guard<mutex> lock(secure_pool_mutex);
+    *stats = secure_pool_counters;
+}
+
+void secure_pool_log_stats(){
+    secure_pool_stats stats;
+    secure_pool_get_stats(&stats);
+    double hit_rate = (stats.requests > 0)? 100.0 * stats.hits / stats.requests: 0;
+    vlog("Secure buffer pool: " + to_string(stats.requests) + " requests, hit rate " + to_string(hit_rate) + "%, peak footprint " +
+        to_string(stats.peak_footprint / 1024) + " KB");
+}
+
+/*
+* Pool of ephemeral keys ready for the handshakes: a thread keeps eph_key_pool_depth key pairs of every kind (P-256 and
+* X25519) generated, with their public key already serialized. A handshake that finds the pool empty (underrun) generates
+* its key pair by itself
+*/
+struct eph_key_pair {
+    void* privkey;
+    uchar* pubkey;
+    uint pubkey_len;
+};
+
+static const uint8_t eph_key_kinds[] = {0, CAP_X25519}; //capabilities that select the kind of the key pairs
+static const int EPH_KEY_KINDS = sizeof(eph_key_kinds) / sizeof(eph_key_kinds[0]);
+static vector<eph_key_pair> eph_key_pool[EPH_KEY_KINDS];
+static eph_key_pool_stats eph_key_pool_counters = {0, 0, 0};
+static uint eph_key_pool_depth = 0;
+static bool eph_key_pool_stopping = false;
+static mutex eph_key_pool_mutex;
+static condition_variable eph_key_pool_refill;
+static thread eph_key_pool_thread;
+
+/**
+ * @brief kind of key pair of the pool used with the capabilities of a handshake
+ */
+static int eph_key_kind(uint8_t caps){
+    return (caps & CAP_X25519)? 1: 0;
+}
+
+/**
+ * @brief kind of key pair that the pool is missing the most, -1 if the pool is full
+ */
+static int eph_key_pool_missing(){
+    int kind = -1;
+    for(int i = 0; i < EPH_KEY_KINDS; i++){
+        if(eph_key_pool[i].size() < eph_key_pool_depth && (kind == -1 || eph_key_pool[i].size() < eph_key_pool[kind].size()))
+            kind = i;
+    }
+    return kind;
+}
+
+/**
+ * @brief body of the thread that refills the pool of ephemeral keys, the keys are generated without holding the lock
+ */
+static void eph_key_pool_run(){
+    unique_lock<mutex> lock(eph_key_pool_mutex);
+    while(true){
+        eph_key_pool_refill.wait(lock, []{ return eph_key_pool_stopping || eph_key_pool_missing() != -1; });
+        if(eph_key_pool_stopping)
+            return;
+        int kind = eph_key_pool_missing();
+        lock.unlock();
+        eph_key_pair pair;
+        int ret = eph_key_generate(&pair.privkey, &pair.pubkey, &pair.pubkey_len, eph_key_kinds[kind]);
+        lock.lock();
+        if(ret != 1)
+            continue;
+        eph_key_pool[kind].push_back(pair);
+        eph_key_pool_counters.generated++;
+    }
+}
+
+int eph_key_pool_start(uint depth){
+    lock_guard<mutex> lock(eph_key_pool_mutex);
+    if(eph_key_pool_thread.joinable() || depth == 0)
+        return 0;
+    eph_key_pool_depth = depth;
+    eph_key_pool_stopping = false;
+    for(int i = 0; i < EPH_KEY_KINDS; i++)
+        eph_key_pool[i].reserve(depth);
+    try{
+        eph_key_pool_thread = thread(eph_key_pool_run);
+    }
+    catch(const system_error&){
+        cerr << "Error: unable to start the ephemeral key pool thread\n";
+        return 0;
+    }
+    return 1;
+}
+
+void eph_key_pool_stop(){
+    {
+        lock_guard<mutex> lock(eph_key_pool_mutex);
+        eph_key_pool_stopping = true;
+    }
+    eph_key_pool_refill.notify_one();
+    if(eph_key_pool_thread.joinable())
+        eph_key_pool_thread.join();
+    lock_guard<mutex> lock(eph_key_pool_mutex);
+    for(int i = 0; i < EPH_KEY_KINDS; i++){
+        for(eph_key_pair& pair : eph_key_pool[i]){
+            safe_free_privkey(pair.privkey);
+            free(pair.pubkey);
+        }
+        eph_key_pool[i].clear();
+    }
+    eph_key_pool_depth = 0;
+}
+
+int eph_key_pool_get(void** privkey, uchar** pubkey, uint* pubkey_len, uint8_t caps){
+    *privkey = NULL;
+    *pubkey = NULL;
+    *pubkey_len = 0;
+    {
+        lock_guard<mutex> lock(eph_key_pool_mutex);
+        vector<eph_key_pair>& pool = eph_key_pool[eph_key_kind(caps)];
+        eph_key_pool_counters.requests++;
+        if(!pool.empty()){
+            eph_key_pair pair = pool.back();
+            pool.pop_back();
+            *privkey = pair.privkey;
+            *pubkey = pair.pubkey;
+            *pubkey_len = pair.pubkey_len;
+        }
+        else
+            eph_key_pool_counters.underruns++;
+    }
+    //Wake up the thread even on an underrun: the keys of the next handshakes are generated meanwhile
+    eph_key_pool_refill.notify_one();
+    if(*pubkey_len == 0)
+        return eph_key_generate(privkey, pubkey, pubkey_len, caps);
+    return 1;
+}
+
+void eph_key_pool_get_stats(eph_key_pool_stats* stats){
+    lock_guard<mutex> lock(eph_key_pool_mutex);
+    *stats = eph_key_pool_counters;
+}
+
+void eph_key_pool_log_stats(){
+    eph_key_pool_stats stats;
+    eph_key_pool_get_stats(&stats);
+    vlog("Ephemeral key pool: " + to_string(stats.requests) + " requests, " + to_string(stats.underruns) + " underruns, " +
+        to_string(stats.generated) + " keys generated in background");
+}
+
+/*
+* Pool of threads that run the expensive steps of the handshakes (signatures, verifications, key derivations) out of the
+* event loop. Jobs are run in order of submission; a completed job is moved to the completed queue and the eventfd of the
+* pool is written, the event loop takes the job from there. With batching, a verification that finds no idle thread waits
+* in crypto_pool_batch: the batch is taken by the first thread with nothing else to run, or before the other jobs once it
+* is full or its first job has waited crypto_verify_batch_delay ns. A batch is split among the idle threads
+*/
+static deque<crypto_job*> crypto_pool_queue;
+static deque<crypto_job*> crypto_pool_batch;
+static uint crypto_verify_batch_max = 1;
+static uint64_t crypto_verify_batch_delay = 0;
+static deque<crypto_job*> crypto_pool_completed;
+static crypto_pool_stats crypto_pool_counters[CRYPTO_JOB_KINDS];
+static vector<thread> crypto_pool_threads;
+static uint crypto_pool_idle = 0; //threads waiting for a job
+static bool crypto_pool_stopping = false;
+static int crypto_pool_eventfd = -1;
+static mutex crypto_pool_mutex;
+static condition_variable crypto_pool_work;
+static const char* crypto_job_names[CRYPTO_JOB_KINDS] = {"sign", "verify", "derive"};
+
+/**
+ * @return current time in ns of CLOCK_MONOTONIC
+ */
+static uint64_t crypto_pool_now(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * @brief run a job in the calling thread, then release the reference to the key of a signature or of a verification
+ */
+static void crypto_job_run(crypto_job* job){
+    job->started = crypto_pool_now();
+    if(job->kind == CRYPTO_JOB_SIGN)
+        job->result = sign_document(job->document, job->document_len, job->key, &job->signature, &job->signature_len) == 1;
+    else if(job->kind == CRYPTO_JOB_VERIFY)
+        job->result = verify_sign_parsed_pubkey(job->signature, job->signature_len, job->document, job->document_len, job->key) == 1;
+    else{
+        //derive_secret releases the private key
+        uchar* secret;
+        uint secret_len = derive_secret(job->key, job->peer_key, job->peer_key_len, &secret);
+        job->key = nullptr;
+        if(secret_len != 0){
+            job->session_key_len = derive_session_key(secret, secret_len, job->caps, &job->session_key);
+            safe_free(secret, secret_len);
+        }
+        job->result = job->session_key_len != 0;
+    }
+    if(job->key){
+        EVP_PKEY_free((EVP_PKEY*)job->key);
+        job->key = nullptr;
+    }
+    job->completed = crypto_pool_now();
+}
+
+/**
+ * @brief verify a batch of signatures sharing one digest context and one fetch of the digest, that every verification
+ * would otherwise allocate and look up. OpenSSL has no batch verification of Ed25519 signatures: they are checked one
+ * by one, with the same context
+ */
+static void crypto_jobs_verify_batch(vector<crypto_job*>& batch){
+    uint64_t started = crypto_pool_now();
+    EVP_MD_CTX* md_ctx = EVP_MD_CTX_new();
+    EVP_MD* md = EVP_MD_fetch(NULL, EVP_MD_get0_name(DIGEST_DEFAULT), NULL);
+    for(crypto_job* job : batch){
+        job->started = started;
+        EVP_PKEY* pubkey = (EVP_PKEY*)job->key;
+        int ret = md_ctx != NULL && md != NULL && pubkey != NULL && EVP_MD_CTX_reset(md_ctx) == 1;
+        if(ret && EVP_PKEY_get_id(pubkey) == EVP_PKEY_ED25519){
+            ret = EVP_DigestVerifyInit(md_ctx, NULL, NULL, NULL, pubkey) == 1 &&
+                EVP_DigestVerify(md_ctx, job->signature, job->signature_len, job->document, job->document_len) == 1;
+        }
+        else if(ret){
+            ret = EVP_VerifyInit_ex(md_ctx, md, NULL) == 1 && EVP_VerifyUpdate(md_ctx, job->document, job->document_len) == 1 &&
+                EVP_VerifyFinal(md_ctx, job->signature, job->signature_len, pubkey) == 1;
+        }
+        if(!ret)
+            cerr << "Error: verification of a signature of a batch failed (invalid signature?)\n";
+        job->result = ret;
+        EVP_PKEY_free(pubkey);
+        job->key = nullptr;
+        job->completed = crypto_pool_now();
+    }
+    EVP_MD_free(md);
+    EVP_MD_CTX_free(md_ctx);
+}
+
+/**
+ * @brief count a job that has been run and hand it to the event loop, with the lock of the pool held
+ */
+static void crypto_job_complete(crypto_job* job){
+    crypto_pool_stats* stats = &crypto_pool_counters[job->kind];
+    uint64_t latency = job->completed - job->submitted;
+    uint64_t latency_us = latency / 1000;
+    int bucket = (latency_us == 0)? 0: 64 - __builtin_clzll(latency_us);
+    stats->jobs++;
+    stats->failures += (job->result == 0);
+    stats->wait_total += job->started - job->submitted;
+    stats->run_total += job->completed - job->started;
+    stats->latency_max = max(stats->latency_max, latency);
+    stats->latency_buckets[min(bucket, CRYPTO_POOL_LATENCY_BUCKETS - 1)]++;
+    crypto_pool_completed.push_back(job);
+    uint64_t completions = 1;
+    if(crypto_pool_eventfd != -1 && write(crypto_pool_eventfd, &completions, sizeof(completions)) == -1 && errno != EAGAIN)
+        cerr << "Error: unable to signal the completion of a crypto job\n";
+}
+
+/**
+ * @brief body of the threads of the crypto pool, the jobs are run without holding the lock
+ */
+static void crypto_pool_run(){
+    unique_lock<mutex> lock(crypto_pool_mutex);
+    while(true){
+        uint64_t now = crypto_pool_now();
+        uint64_t deadline = crypto_pool_batch.empty()? 0: crypto_pool_batch.front()->submitted + crypto_verify_batch_delay;
+        //A full batch or one whose first job has waited enough is verified before the other jobs
+        if(!crypto_pool_batch.empty() && (crypto_pool_queue.empty() ||
+            crypto_pool_batch.size() >= crypto_verify_batch_max || crypto_pool_stopping || now >= deadline)){
+            //The idle threads take their share of the batch instead of waiting for this one to verify all of it
+            uint share = (crypto_pool_batch.size() + crypto_pool_idle) / (crypto_pool_idle + 1);
+            uint taken = min(share, crypto_verify_batch_max);
+            vector<crypto_job*> batch(crypto_pool_batch.begin(), crypto_pool_batch.begin() + taken);
+            crypto_pool_batch.erase(crypto_pool_batch.begin(), crypto_pool_batch.begin() + taken);
+            if(!crypto_pool_batch.empty() && crypto_pool_idle > 0)
+                crypto_pool_work.notify_all();
+            lock.unlock();
+            crypto_jobs_verify_batch(batch);
+            lock.lock();
+            crypto_pool_counters[CRYPTO_JOB_VERIFY].batches++;
+            crypto_pool_counters[CRYPTO_JOB_VERIFY].batched_jobs += batch.size();
+            for(crypto_job* job : batch)
+                crypto_job_complete(job);
+            continue;
+        }
+        if(!crypto_pool_queue.empty()){
+            crypto_job* job = crypto_pool_queue.front();
+            crypto_pool_queue.pop_front();
+            lock.unlock();
+            crypto_job_run(job);
+            lock.lock();
+            crypto_job_complete(job);
+            continue;
+        }
+        if(crypto_pool_stopping)
+            return;
+        crypto_pool_idle++;
+        crypto_pool_work.wait(lock);
+        crypto_pool_idle--;
+    }
+}
+
+int crypto_pool_start(uint threads){
+    lock_guard<mutex> lock(crypto_pool_mutex);
+    if(crypto_pool_eventfd != -1)
+        return -1;
+    crypto_pool_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(crypto_pool_eventfd == -1){
+        cerr << "Error: unable to create the eventfd of the crypto pool\n";
+        return -1;
+    }
+    crypto_pool_stopping = false;
+    memset(crypto_pool_counters, 0, sizeof(crypto_pool_counters));
+    try{
+        for(uint i = 0; i < threads; i++)
+            crypto_pool_threads.emplace_back(crypto_pool_run);
+    }
+    catch(const system_error&){
+        cerr << "Error: unable to start the threads of the crypto pool\n";
+        crypto_pool_stopping = true;
+        crypto_pool_work.notify_all();
+        return -1; //the threads already started are stopped by crypto_pool_stop
+    }
+    return crypto_pool_eventfd;
+}
+
+void crypto_pool_stop(){
+    {
+        lock_guard<mutex> lock(crypto_pool_mutex);
+        crypto_pool_stopping = true;
+    }
+    crypto_pool_work.notify_all();
+    for(thread& pool_thread : crypto_pool_threads)
+        pool_thread.join();
+    lock_guard<mutex> lock(crypto_pool_mutex);
+    crypto_pool_threads.clear();
+    if(crypto_pool_eventfd != -1)
+        close(crypto_pool_eventfd);
+    crypto_pool_eventfd = -1;
+}
+
+void crypto_pool_set_verify_batch(uint max_jobs, uint delay_us){
+    lock_guard<mutex> lock(crypto_pool_mutex);
+    crypto_verify_batch_max = max(max_jobs, 1u);
+    crypto_verify_batch_delay = (uint64_t)delay_us * 1000;
+}
+
+crypto_job* crypto_job_new(int kind){
+    if(kind < 0 || kind >= CRYPTO_JOB_KINDS)
+        return nullptr;
+    crypto_job* job = new(nothrow) crypto_job();
+    if(job)
+        job->kind = kind;
+    return job;
+}
+
+void crypto_job_free(crypto_job* job){
+    if(!job)
+        return;
+    //Only the key of a derivation belongs to the job, the others are referenced while the job runs
+    if(job->kind == CRYPTO_JOB_DERIVE && job->key)
+        safe_free_privkey(job->key);
+    free(job->document);
+    free(job->signature);
+    free(job->peer_key);
+    if(job->session_key)
+        safe_free(job->session_key, job->session_key_len);
+    delete job;
+}
+
+void crypto_pool_submit(crypto_job* job){
+    if(job->kind != CRYPTO_JOB_DERIVE && job->key)
+        EVP_PKEY_up_ref((EVP_PKEY*)job->key);
+    job->submitted = crypto_pool_now();
+    bool run_here;
+    {
+        lock_guard<mutex> lock(crypto_pool_mutex);
+        run_here = crypto_pool_threads.empty();
+        //A verification is batched only when the jobs back up: while a thread is idle it is run at once
+        if(!run_here && job->kind == CRYPTO_JOB_VERIFY && crypto_verify_batch_max > 1 &&
+            crypto_pool_queue.size() + crypto_pool_batch.size() >= crypto_pool_idle)
+            crypto_pool_batch.push_back(job);
+        else if(!run_here)
+            crypto_pool_queue.push_back(job);
+    }
+    if(!run_here){
+        crypto_pool_work.notify_one();
+        return;
+    }
+    crypto_job_run(job);
+    lock_guard<mutex> lock(crypto_pool_mutex);
+    crypto_job_complete(job);
+}
+
+crypto_job* crypto_pool_take_completed(){
+    lock_guard<mutex> lock(crypto_pool_mutex);
+    if(crypto_pool_completed.empty())
+        return nullptr;
+    crypto_job* job = crypto_pool_completed.front();
+    crypto_pool_completed.pop_front();
+    return job;
+}
+
+void crypto_pool_get_stats(int kind, crypto_pool_stats* stats){
+    lock_guard<mutex> lock(crypto_pool_mutex);
+    *stats = crypto_pool_counters[kind];
+}
+
+uint64_t crypto_pool_latency_percentile(crypto_pool_stats* stats, double fraction){
+    uint64_t counted = 0;
+    for(int i = 0; i < CRYPTO_POOL_LATENCY_BUCKETS; i++){
+        counted += stats->latency_buckets[i];
+        if(counted > 0 && counted >= fraction * stats->jobs)
+            return min((uint64_t)1 << i, stats->latency_max / 1000 + 1);
+    }
+    return 0;
+}
+
+void crypto_pool_log_stats(){
+    //The counters of all the kinds are copied at once, the pool threads wait for the lock only for the copy
+    crypto_pool_stats all_stats[CRYPTO_JOB_KINDS];
+    {
+        lock_guard<mutex> lock(crypto_pool_mutex);
+        for(int kind = 0; kind < CRYPTO_JOB_KINDS; kind++)
+            all_stats[kind] = crypto_pool_counters[kind];
+    }
+    for(int kind = 0; kind < CRYPTO_JOB_KINDS; kind++){
+        crypto_pool_stats& stats = all_stats[kind];
+        if(stats.jobs == 0)
+            continue;
+        vlog("Crypto pool " + string(crypto_job_names[kind]) + ": " + to_string(stats.jobs) + " jobs (" +
+            to_string(stats.failures) + " failed), " + ((stats.batches == 0)? string(""): to_string(stats.batches) +
+            " batches of " + to_string(stats.batched_jobs / stats.batches) + " jobs on average, ") +
+            to_string(stats.wait_total / stats.jobs / 1000) + " us waiting and " +
+            to_string(stats.run_total / stats.jobs / 1000) + " us running on average, p99 under " +
+            to_string(crypto_pool_latency_percentile(&stats, 0.99)) + " us, max " + to_string(stats.latency_max / 1000) + " us");
+    }
+}
+
 void* read_privkey(FILE* privk_file, char* const password){
     if(!privk_file){ cerr << "Error: cannot open private key file  (missing?)\n"; return NULL; }
     EVP_PKEY* prvkey = PEM_read_PrivateKey(privk_file, NULL, NULL, password);
@@ -784,14 +1831,59 @@ int serialize_pubkey_from_file(FILE* pubk_file, uchar** pubkey_buf){
     EVP_PKEY* pubk = PEM_read_PUBKEY(pubk_file, NULL, NULL, NULL);
     if(!pubk){ cerr << "Error: PEM_read_PUBKEY returned NULL\n"; return 0; }
     BIO* mbio = BIO_new(BIO_s_mem());
-    PEM_write_bio_PUBKEY(mbio, pubk);
-    long pubkey_size = BIO_get_mem_data(mbio, pubkey_buf);
+    if(!mbio || 1 != PEM_write_bio_PUBKEY(mbio, pubk)){
+        cerr << "Error: PEM_write_bio_PUBKEY failed\n"; BIO_free(mbio); EVP_PKEY_free(pubk); return 0;
+    }
+    EVP_PKEY_free(pubk);
+    //The serialization is copied out of the BIO, that is freed
+    uchar* bio_data;
+    long pubkey_size = BIO_get_mem_data(mbio, &bio_data);
+    *pubkey_buf = (pubkey_size > 0)? (uchar*)malloc(pubkey_size): NULL;
+    if(!(*pubkey_buf)){ BIO_free(mbio); return 0; }
+    memcpy(*pubkey_buf, bio_data, pubkey_size);
     // log("BIO (written: " + to_string(pubkey_size) + "):");
     // BIO_dump_fp(stdout, (const char*)(*pubkey_buf), pubkey_size);
-    // BIO_free(mbio);
+    BIO_free(mbio);
     return pubkey_size;
 }
 
+int pubkey_fingerprint(const uchar* pubkey, uint key_lenght, uchar* fingerprint){
+    uint fingerprint_len;
+    if(1 != EVP_Digest(pubkey, key_lenght, fingerprint, &fingerprint_len, DIGEST_DEFAULT, NULL) ||
+        fingerprint_len != FINGERPRINT_SIZE){
+        cerr << "Error: EVP_Digest failed\n";
+        return 0;
+    }
+    return 1;
+}
+
+int identity_key_type(void* key){
+    switch(EVP_PKEY_get_id((EVP_PKEY*)key)){
+        case EVP_PKEY_RSA: return IDENTITY_KEY_RSA;
+        case EVP_PKEY_ED25519: return IDENTITY_KEY_ED25519;
+        default: return -1;
+    }
+}
+
+int pubkey_fingerprint_from_file(FILE* pubk_file, uchar* fingerprint, int* key_type){
+    uchar* pubkey_ser;
+    int pubkey_ser_len = serialize_pubkey_from_file(pubk_file, &pubkey_ser);
+    if(pubkey_ser_len <= 0)
+        return 0;
+    int ret = pubkey_fingerprint(pubkey_ser, pubkey_ser_len, fingerprint);
+    if(ret && key_type){
+        void* pubkey = parse_pubkey(pubkey_ser, pubkey_ser_len);
+        *key_type = pubkey? identity_key_type(pubkey): -1;
+        free_pubkey(pubkey);
+        if(*key_type == -1){
+            cerr << "Error: the public key is not a supported identity key (RSA or Ed25519)\n";
+            ret = 0;
+        }
+    }
+    free(pubkey_ser);
+    return ret;
+}
+
 
 
 /*
@@ -2,6 +2,7 @@
 #define FUNCTIONS_CRYPTO_INCLUDED
 
 #include <openssl/evp.h>
+#include "constant.h"
 
 using uchar=unsigned char;
 using namespace std;
@@ -39,6 +40,94 @@ int auth_enc_decrypt(uchar *ciphertext, uint ciphertext_len, uchar* aad, uint aa
 int auth_enc_encrypt( uchar *plaintext, int plaintext_len, uchar* aad, uint aad_len, uchar *key, uchar** tag,
                     uchar **iv,  uchar **ciphertext);
 
+/**
+ * @brief create an authenticated encryption session: the cipher contexts are initialized once with the key and
+ * reused for every record
+ * 
+ * @param key input, the session keeps its own key schedule (key can be freed after the call)
+ * @param caps input capabilities negotiated in the handshake (CAP_COUNTER_NONCE: IVs derived from sequence numbers)
+ * @param initiator input true for the side that started the handshake (it selects the nonce salt of each direction)
+ * @return pointer to the session, must be freed by auth_enc_session_free(), nullptr on error
+ */
+void* auth_enc_session_new(uchar* key, uint8_t caps, bool initiator);
+
+/**
+ * @brief deallocate an authenticated encryption session in a secure way
+ * 
+ * @param session the session to deallocate (it can be nullptr)
+ */
+void auth_enc_session_free(void* session);
+
+/**
+ * @brief authenticated encryption encrypt with the key of a session (same outputs of auth_enc_encrypt)
+ * 
+ * @param session input
+ * @param seq input sequence number of the record (used only with CAP_COUNTER_NONCE)
+ * @param plaintext input
+ * @param plaintext_len input
+ * @param aad input
+ * @param aad_len input
+ * @param tag ouput
+ * @param iv output
+ * @param ciphertext output
+ * @return ciphertext lenght, 0 on error
+ */
+int auth_enc_session_encrypt(void* session, uint32_t seq, uchar *plaintext, int plaintext_len, uchar* aad, uint aad_len,
+                    uchar** tag, uchar **iv,  uchar **ciphertext);
+
+/**
+ * @brief build a record in place: the plaintext, already written after RECORD_HEADER_LEN(caps) bytes of record, is
+ * encrypted where it is and the header (length, IV when it is sent, tag) is filled in front of it, without allocations
+ * 
+ * @param session input
+ * @param seq input sequence number of the record (used only with CAP_COUNTER_NONCE)
+ * @param record input/output buffer of RECORD_HEADER_LEN(caps) + plaintext_len bytes
+ * @param plaintext_len input
+ * @param iv_used output IV of the record (IV length bytes, has to be preallocated), nullptr if not needed
+ * @return record length, 0 on error
+ */
+uint auth_enc_session_seal(void* session, uint32_t seq, uchar* record, uint plaintext_len, uchar* iv_used);
+
+/**
+ * @brief length of the record at the start of a receive buffer
+ * 
+ * @param buffer input received bytes
+ * @param buffer_len input
+ * @param caps input capabilities of the session (they select the header length)
+ * @param max_ciphertext_len input longest ciphertext accepted
+ * @return record length if the whole record is in the buffer, 0 if more bytes are needed, -1 if the header is invalid
+ */
+int auth_enc_record_len(uchar* buffer, uint buffer_len, uint8_t caps, uint max_ciphertext_len);
+
+/**
+ * @brief open a received record in place: the ciphertext is decrypted where it is, so the plaintext starts
+ * RECORD_HEADER_LEN(caps) bytes after record
+ * 
+ * @param session input
+ * @param seq input expected sequence number of the record (used only with CAP_COUNTER_NONCE)
+ * @param record input/output the whole record (auth_enc_record_len)
+ * @param record_len input
+ * @return plaintext length, 0 on error (authentication failure included)
+ */
+uint auth_enc_session_open(void* session, uint32_t seq, uchar* record, uint record_len);
+
+/**
+ * @brief authenticated encryption decrypt with the key of a session (same outputs of auth_enc_decrypt)
+ * 
+ * @param session input
+ * @param seq input expected sequence number of the record (used only with CAP_COUNTER_NONCE and iv == nullptr)
+ * @param ciphertext input
+ * @param ciphertext_len input
+ * @param aad input
+ * @param aad_len input
+ * @param tag input
+ * @param iv input, nullptr to use the IV of seq (CAP_COUNTER_NONCE)
+ * @param plaintext output
+ * @return plaintext lenght, 0 on error
+ */
+int auth_enc_session_decrypt(void* session, uint32_t seq, uchar *ciphertext, uint ciphertext_len, uchar* aad, uint aad_len,
+                    uchar* tag, uchar *iv,  uchar **plaintext);
+
 /**
  * @brief compare 2 digests (wrap the crypto memcompare)
  * 
@@ -93,6 +182,32 @@ int verify_sign_pubkey(uchar* signature, uint sign_lenght, uchar* document, uint
  */
 int verify_sign_pubkey(uchar* signature, uint sign_lenght, uchar* document, uint doc_lenght, 
     FILE*pubkey);
+
+/**
+ * @brief verify a signature on a docuemnt using the public key of the signer (already parsed by parse_pubkey)
+ * 
+ * @param signature input
+ * @param sign_lenght input
+ * @param document input
+ * @param doc_lenght input
+ * @param pubkey input
+ * @return 1 if succesfully, 0 otherwise
+ */
+int verify_sign_parsed_pubkey(uchar* signature, uint sign_lenght, uchar* document, uint doc_lenght, void* pubkey);
+
+/**
+ * @brief parse a serialized public key (PEM)
+ * 
+ * @param pubkey input
+ * @param key_lenght input
+ * @return pointer to the UNSERIALIZED public key, must be freed by free_pubkey(), NULL on error(s)
+ */
+void* parse_pubkey(const uchar* pubkey, uint key_lenght);
+
+/**
+ * @brief free a public key returned by parse_pubkey
+ */
+void free_pubkey(void* pubkey);
     
 /**
  * @brief verify a signature on a docuemnt using a certificate, signed by a certification authority
@@ -110,6 +225,36 @@ int verify_sign_pubkey(uchar* signature, uint sign_lenght, uchar* document, uint
 int verify_sign_cert(const uchar* certificate, const uint cert_lenght,  FILE* const CAcertificate,  
     FILE* const CAcrl, uchar* signature, uint sign_lenght, uchar* document, uint doc_lenght );
 
+/**
+ * @brief parse the certificate of a certification authority and its crl in a trust store, to verify many certificates
+ * without reading the files again
+ * 
+ * @param CAcertificate input certificate of the CA (PEM)
+ * @param CAcrl input (PEM)
+ * @return pointer to the trust store, must be freed by cert_store_free(), NULL on error(s)
+ */
+void* cert_store_new(FILE* const CAcertificate, FILE* const CAcrl);
+
+/**
+ * @brief free a trust store returned by cert_store_new
+ */
+void cert_store_free(void* store);
+
+/**
+ * @brief verify a signature on a docuemnt using a certificate, verified with a trust store built by cert_store_new
+ * 
+ * @param certificate input certificate of the signer
+ * @param cert_lenght input lenght of the certificate of the signer
+ * @param store input trust store
+ * @param signature input
+ * @param sign_lenght input
+ * @param document input
+ * @param doc_lenght input
+ * @return 1 if succesfully, 0 otherwise
+ */
+int verify_sign_cert(const uchar* certificate, const uint cert_lenght, void* store, uchar* signature, uint sign_lenght, 
+    uchar* document, uint doc_lenght);
+
 /**
  * @brief sign a document with a priv_key
  * 
@@ -124,7 +269,7 @@ int verify_sign_cert(const uchar* certificate, const uint cert_lenght,  FILE* co
 int sign_document( const uchar* document, uint doc_lenght, FILE* const priv_key,char* const password,uchar** signature, uint* sign_lenght);
 
 /**
- * @brief sign a document with a priv_key
+ * @brief sign a document with a priv_key: RSA keys sign the default digest of the document, Ed25519 keys the document
  * 
  * @param document innput
  * @param doc_lenght input
@@ -153,17 +298,135 @@ int random_generate(const uint lenght, uchar* nuance);
  */
 int eph_key_generate(void** privkey, uchar** pubkey, uint* pubkey_len );
 
+/**
+ * @brief generate a pair of DH ephimeral key of the kind selected by the capabilities of the handshake: X25519 with the
+ * public key serialized as raw point if CAP_X25519 is set, P-256 with the public key serialized in PEM otherwise
+ * 
+ * @param privkey output (NO SERIALIZED)
+ * @param pubkey output (serialized)
+ * @param pubkey_len 
+ * @param caps capabilities of the handshake
+ * @return 1 on succes, 0 otherwise
+ */
+int eph_key_generate(void** privkey, uchar** pubkey, uint* pubkey_len, uint8_t caps);
+
+/*
+* Counters of the ephemeral key pool
+* requests: key pairs requested, underruns: requests that found the pool empty and generated the key pair by themselves
+* generated: key pairs generated by the thread of the pool
+*/
+struct eph_key_pool_stats {
+    uint64_t requests;
+    uint64_t underruns;
+    uint64_t generated;
+};
+
+/**
+ * @brief start the thread that keeps a pool of ephemeral key pairs of every kind ready for the handshakes of the process.
+ * Threads do not survive fork: a process that forks starts the pool in the children
+ * 
+ * @param depth number of key pairs kept ready
+ * @return 1 on succes, 0 otherwise
+ */
+int eph_key_pool_start(uint depth);
+
+/**
+ * @brief stop the thread of the ephemeral key pool and free the key pairs not used
+ */
+void eph_key_pool_stop();
+
+/**
+ * @brief take a pair of DH ephimeral key from the pool, the pair is generated on the spot if the pool is empty
+ * 
+ * @param privkey output (NO SERIALIZED)
+ * @param pubkey output (serialized)
+ * @param pubkey_len 
+ * @param caps capabilities of the handshake, they select the kind of key pair (see eph_key_generate)
+ * @return 1 on succes, 0 otherwise
+ */
+int eph_key_pool_get(void** privkey, uchar** pubkey, uint* pubkey_len, uint8_t caps);
+
+/**
+ * @brief read the counters of the ephemeral key pool of the process
+ * 
+ * @param stats output
+ */
+void eph_key_pool_get_stats(eph_key_pool_stats* stats);
+
+/**
+ * @brief log requests and underruns of the ephemeral key pool of the process
+ */
+void eph_key_pool_log_stats();
+
 /**
  * @brief derive the shared seceret from a pair fo DH keys
  * 
  * @param privkey input (NO SERIALIZED)
- * @param peer_key input (serialized)
+ * @param peer_key input (serialized: raw point if privkey is a X25519 key, PEM otherwise)
  * @param peer_key_len input
  * @param secret output shred secret
  * @return shared secret lenght, 0 on error(s) 
  */
 uint derive_secret(void* privkey, uchar* peer_key, uint peer_key_len , uchar** secret );
 
+/**
+ * @brief derive the session key from the shared secret: HKDF if CAP_X25519 is set, the default digest otherwise
+ * 
+ * @param secret input shared secret
+ * @param secret_len input
+ * @param caps capabilities of the handshake
+ * @param session_key output
+ * @return session key lenght, 0 on error(s)
+ */
+uint derive_session_key(uchar* secret, uint secret_len, uint8_t caps, uchar** session_key);
+
+/**
+ * @brief derive the resumption secret of a session from its session key, client and server obtain the same one
+ * 
+ * @param session_key input
+ * @param session_key_len input
+ * @param secret output, RESUMPTION_SECRET_SIZE bytes
+ * @return 1 on success, 0 on error(s)
+ */
+int derive_resumption_secret(const uchar* session_key, uint session_key_len, uchar* secret);
+
+/**
+ * @brief derive the session key of a resumed session from the resumption secret of the previous one
+ * 
+ * @param resumption_secret input, RESUMPTION_SECRET_SIZE bytes
+ * @param nonces input, nonces of the two sides (R1 and R2)
+ * @param nonces_len input
+ * @param session_key output
+ * @return session key lenght, 0 on error(s)
+ */
+uint derive_resumed_session_key(const uchar* resumption_secret, const uchar* nonces, uint nonces_len, uchar** session_key);
+
+/**
+ * @brief HKDF (extract and expand) with the default digest
+ * 
+ * @param key input key material
+ * @param key_len input
+ * @param salt input, it can be NULL
+ * @param salt_len input
+ * @param info input label of the derived key
+ * @param out output, out_len bytes
+ * @param out_len input
+ * @return 1 on success, 0 on error(s)
+ */
+int hkdf_derive(const uchar* key, uint key_len, const uchar* salt, uint salt_len, const char* info, uchar* out, uint out_len);
+
+/**
+ * @brief compute the HMAC of a document with the default digest
+ * 
+ * @param key input
+ * @param key_len input
+ * @param document input
+ * @param doc_lenght input
+ * @param mac output, as long as the default digest
+ * @return 1 on success, 0 on error(s)
+ */
+int hmac_compute(const uchar* key, uint key_len, const uchar* document, uint doc_lenght, uchar* mac);
+
 /**
  * @brief dellocate an UNSERIALIZED private key in a secure way
  * 
@@ -179,6 +442,45 @@ void safe_free_privkey(void* key);
  */
 void safe_free(uchar* buffer, uint buffer_len );
 
+/*
+* Counters of the secure buffer pool
+* requests: buffers requested, hits: requests served with a released buffer
+* footprint: bytes currently taken from the system (slabs and buffers bigger than the classes), peak_footprint: its maximum
+*/
+struct secure_pool_stats {
+    uint64_t requests;
+    uint64_t hits;
+    uint64_t footprint;
+    uint64_t peak_footprint;
+};
+
+/**
+ * @brief get a buffer from the secure buffer pool: its memory is locked (it is not swapped) and it is zeroized when released
+ * 
+ * @param size minimum size of the buffer
+ * @return pointer to the buffer, must be released by secure_buffer_free(), nullptr on error
+ */
+uchar* secure_buffer_alloc(uint size);
+
+/**
+ * @brief zeroize a buffer of the secure buffer pool and give it back to the pool
+ * 
+ * @param buffer the buffer to release (it can be nullptr)
+ */
+void secure_buffer_free(uchar* buffer);
+
+/**
+ * @brief read the counters of the secure buffer pool of the process
+ * 
+ * @param stats output
+ */
+void secure_pool_get_stats(secure_pool_stats* stats);
+
+/**
+ * @brief log hit rate and peak footprint of the secure buffer pool of the process
+ */
+void secure_pool_log_stats();
+
 /**
  * @brief read a private key from a file
  * 
@@ -192,7 +494,151 @@ void* read_privkey(FILE* privk_file, char* const password);
  * @brief read a public key from a file
  * 
  * @param pubk_file file containing the public key
+ * @param pubkey_buf output serialized pubkey (PEM), must be freed with free()
  * @return size of serialized pubkey, 0 in case of errors
  */
 int serialize_pubkey_from_file(FILE* pubk_file, uchar** pubkey_buf);
-#endif
\ No newline at end of file
+
+/**
+ * @brief compute the fingerprint of a serialized public key: its default digest
+ * 
+ * @param pubkey input
+ * @param key_lenght input
+ * @param fingerprint output, FINGERPRINT_SIZE bytes
+ * @return 1 on success, 0 on error(s)
+ */
+int pubkey_fingerprint(const uchar* pubkey, uint key_lenght, uchar* fingerprint);
+
+/**
+ * @brief kind of an identity key: sign_document and the verify_sign functions dispatch on it
+ * 
+ * @param key public or private key (UNSERIALIZED)
+ * @return IDENTITY_KEY_RSA or IDENTITY_KEY_ED25519, -1 if the key cannot be an identity key
+ */
+int identity_key_type(void* key);
+
+/**
+ * @brief compute the fingerprint of a public key: the default digest of its serialization
+ * 
+ * @param pubk_file file containing the public key
+ * @param fingerprint output, FINGERPRINT_SIZE bytes
+ * @param key_type output kind of identity key (identity_key_type), it can be NULL; keys of other kinds are an error
+ * @return 1 on success, 0 on error(s)
+ */
+int pubkey_fingerprint_from_file(FILE* pubk_file, uchar* fingerprint, int* key_type);
+
+/*
+* Job of the crypto pool, run by one of its threads. The submitter fills the input of the kind of job and does not touch
+* the job until it is completed, the job owns its buffers and it is released by crypto_job_free.
+* CRYPTO_JOB_SIGN: document, key (private key, it is not released) -> signature
+* CRYPTO_JOB_VERIFY: signature, document, key (public key, it is not released) -> result
+* CRYPTO_JOB_DERIVE: key (ephemeral private key, released by the job), peer_key, caps -> session_key (derive_secret and
+* derive_session_key)
+* owner: opaque to the pool, the submitter uses it to find the job again (nullptr if nobody waits for the job anymore)
+* result: 1 on success, 0 on error(s) or if the signature is not valid
+* submitted, started, completed: ns of CLOCK_MONOTONIC, for the latency of the job
+*/
+struct crypto_job {
+    int kind;
+    void* owner = nullptr;
+    void* key = nullptr;
+    uchar* document = nullptr;
+    uint document_len = 0;
+    uchar* signature = nullptr;
+    uint signature_len = 0;
+    uchar* peer_key = nullptr;
+    uint peer_key_len = 0;
+    uint8_t caps = 0;
+    uchar* session_key = nullptr;
+    uint session_key_len = 0;
+    int result = 0;
+    uint64_t submitted = 0;
+    uint64_t started = 0;
+    uint64_t completed = 0;
+};
+
+/*
+* Counters of a kind of job of the crypto pool, times in ns
+* wait: from the submission to the start (for a batched verification, the start of its batch), run: from the start to
+* the completion
+* batches, batched_jobs: batches of verifications run and jobs in them
+* latency_buckets: jobs by latency (wait + run), bucket i counts the latencies from 2^(i-1) to 2^i us
+*/
+struct crypto_pool_stats {
+    uint64_t jobs;
+    uint64_t failures;
+    uint64_t batches;
+    uint64_t batched_jobs;
+    uint64_t wait_total;
+    uint64_t run_total;
+    uint64_t latency_max;
+    uint64_t latency_buckets[CRYPTO_POOL_LATENCY_BUCKETS];
+};
+
+/**
+ * @brief start the threads of the crypto pool of the process. Threads do not survive fork: a process that forks
+ * starts the pool in the children
+ * 
+ * @param threads number of threads, with 0 the jobs are run by crypto_pool_submit itself
+ * @return eventfd that becomes readable when jobs are completed, -1 on error(s)
+ */
+int crypto_pool_start(uint threads);
+
+/**
+ * @brief stop the threads of the crypto pool, the jobs not completed yet are run before
+ */
+void crypto_pool_stop();
+
+/**
+ * @brief batch the verifications submitted to the threads of the crypto pool when they back up: a verification that
+ * finds no idle thread is held with the others until a thread has nothing else to run, max_jobs are pending or the
+ * first one has waited delay_us behind the other jobs. The threads verify a batch with one digest context, sharing it
+ * out among the idle ones
+ * 
+ * @param max_jobs verifications in a batch, 1 to verify every signature as soon as a thread is free
+ * @param delay_us time that a batch waits at most behind the other jobs of the pool
+ */
+void crypto_pool_set_verify_batch(uint max_jobs, uint delay_us);
+
+/**
+ * @brief allocate a job of the crypto pool
+ * @param kind CRYPTO_JOB_SIGN, CRYPTO_JOB_VERIFY or CRYPTO_JOB_DERIVE
+ * @return the job, nullptr on error(s)
+ */
+crypto_job* crypto_job_new(int kind);
+
+/**
+ * @brief release a job and its buffers (the session key is zeroized), also a job that has not been run
+ */
+void crypto_job_free(crypto_job* job);
+
+/**
+ * @brief queue a job for the threads of the crypto pool, the keys of the job are referenced until it is completed
+ */
+void crypto_pool_submit(crypto_job* job);
+
+/**
+ * @brief take a completed job, in order of completion
+ * @return the job, nullptr if no job is completed
+ */
+crypto_job* crypto_pool_take_completed();
+
+/**
+ * @brief read the counters of a kind of job of the crypto pool of the process
+ * 
+ * @param stats output
+ */
+void crypto_pool_get_stats(int kind, crypto_pool_stats* stats);
+
+/**
+ * @brief latency under which a fraction of the jobs of a kind has been completed, from the buckets of the counters
+ * @param fraction between 0 and 1
+ * @return latency in us (upper bound of its bucket, at most the maximum latency), 0 if no job has been completed
+ */
+uint64_t crypto_pool_latency_percentile(crypto_pool_stats* stats, double fraction);
+
+/**
+ * @brief log jobs, average wait and run time and tail latency of every kind of job of the crypto pool of the process
+ */
+void crypto_pool_log_stats();
+#endif
@@ -0,0 +1,876 @@
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <vector>
+#include <queue>
+#include <unordered_set>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include "constant.h"
+#include "util.h"
+#include "crypto.h"
+#include "user_directory.h"
+#include "protocol.h"
+
+using namespace std;
+using uchar=unsigned char;
+
+/*
+* Load generator: simulated users of a server running on this machine, all in one process driven by one epoll loop.
+* The users log in, pair up in chats (user 2i asks user 2i+1) and send each other messages at a fixed rate, then the
+* throughput, the latencies and the errors are printed.
+* The messages of the handshakes and the records are the ones of the client, built and checked with protocol.h.
+* Usage: ./loadgen setup <users>
+*            create the users lg0 ... lg<users - 1> with Ed25519 keys and add them to the registry created by the
+*            server (SIGHUP a running server)
+*        ./loadgen run <users> <messages/s of every user> <message size> <seconds>
+*/
+
+const char* lg_srv_ipv4 = "127.0.0.1";
+const int lg_srv_port = 4242;
+const char* lg_key_folder = "clients_data/loadgen"; //private keys of the simulated users, not encrypted
+const char* lg_ca_cert = "certification/TrustMe CA_cert.pem";
+const char* lg_ca_crl = "certification/TrustMe CA_crl.pem";
+const uint lg_login_window = 64; //handshakes with the server in progress at the same time
+const int lg_phase_timeout = 60; //seconds to log in all the users, and then to set up all the chats
+const int lg_drain_time = 2; //seconds to wait for the messages in flight after the last send
+const uint lg_max_backlog = 256 * 1024; //bytes waiting for the socket of a user, the messages beyond are skipped
+const uint lg_max_reported_errors = 10;
+
+enum lg_step { LG_IDLE, LG_WAIT_M2, LG_WAIT_USER_ID, LG_LOGGED, LG_WAIT_CHAT_REPLY, LG_WAIT_PEER_M1, LG_WAIT_PEER_M2,
+    LG_WAIT_PEER_M3, LG_CHATTING, LG_STOPPED, LG_FAILED };
+
+/*
+* Simulated user: its connection with the server, its session and the session of its chat
+* in, out: bytes received and not handled yet, bytes to send (out_sent of them already sent)
+* R1, R2: nonces of the handshake in progress (with the server or with the peer)
+*/
+struct lg_user {
+    string username;
+    void* key = nullptr;
+    int user_id = -1;
+    int socket_id = -1;
+    lg_step step = LG_IDLE;
+    uint64_t started = 0; //start of the login or of the chat request, ns
+    uchar R1[NONCE_SIZE];
+    uchar R2[NONCE_SIZE];
+    uchar cookie[COOKIE_SIZE];
+    bool has_cookie = false;
+    uint8_t offered_caps = 0;
+    void* eph_privkey = nullptr;
+    void* session = nullptr;
+    uint8_t caps = 0;
+    uint32_t send_seq = 0;
+    uint32_t recv_seq = 0;
+    vector<uchar> in;
+    vector<uchar> out;
+    size_t out_sent = 0;
+    bool writing = false;
+    int peer = -1; //index of the user of the chat
+    int peer_id = -1; //user id of the peer, as the server sent it
+    void* peer_key = nullptr;
+    void* chat_session = nullptr;
+    uint8_t chat_caps = 0;
+    uint32_t chat_send_seq = 0;
+    uint32_t chat_recv_seq = 0;
+};
+
+struct lg_stats {
+    uint logins = 0;
+    uint login_failures = 0;
+    uint logging = 0; //handshakes in progress
+    uint cookies = 0;
+    uint chats = 0;
+    uint chat_failures = 0;
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t skipped = 0;
+    uint64_t errors = 0;
+    vector<uint32_t> login_latency; //us
+    vector<uint32_t> chat_latency;
+    vector<uint32_t> message_latency;
+    vector<uint32_t> stage_latency[RELAY_STAMPS + 1]; //between the stamps of a server built with RELAY_TIMESTAMPS
+};
+
+//Stages of a relayed message, delimited by the send, the stamps of the server and the receive
+const char* lg_stages[RELAY_STAMPS + 1] = {"send -> ingress", "ingress -> enqueue", "enqueue -> dequeue",
+    "dequeue -> egress", "egress -> receive"};
+
+vector<lg_user> lg_users;
+lg_stats stats;
+int lg_epoll_fd = -1;
+void* lg_ca_store = nullptr;
+uint lg_message_size = 0;
+
+/**
+ * @return current time in ns of the steady clock, shared by all the simulated users
+ */
+uint64_t lg_now(){
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief close the connection of a user after an error, its peer learns it from the server
+ */
+void lg_fail(lg_user* user, const string& reason){
+    if(user->step == LG_FAILED)
+        return;
+    if(stats.errors < lg_max_reported_errors)
+        cerr << "  " << user->username << ": " << reason << endl;
+    stats.errors++;
+    if(user->step == LG_WAIT_M2 || user->step == LG_WAIT_USER_ID){
+        stats.login_failures++;
+        stats.logging--;
+    }
+    else if(user->step == LG_WAIT_CHAT_REPLY || user->step == LG_WAIT_PEER_M1 || user->step == LG_WAIT_PEER_M2 ||
+        user->step == LG_WAIT_PEER_M3)
+        stats.chat_failures++;
+    user->step = LG_FAILED;
+    if(user->socket_id != -1)
+        close(user->socket_id);
+    user->socket_id = -1;
+    safe_free_privkey(user->eph_privkey);
+    user->eph_privkey = nullptr;
+}
+
+// ---------------------------------------------------------------------
+// FUNCTIONS of the CONNECTION with the SERVER
+// ---------------------------------------------------------------------
+
+/**
+ * @brief connect a user to the server and register its socket (not blocking) in the epoll of the load generator
+ * @return 1 on success, 0 on error(s)
+ */
+int lg_connect(lg_user* user, int index){
+    if(user->socket_id != -1)
+        close(user->socket_id);
+    struct sockaddr_in srv_addr;
+    memset(&srv_addr, 0, sizeof(srv_addr));
+    srv_addr.sin_family = AF_INET;
+    srv_addr.sin_port = htons(lg_srv_port);
+    inet_pton(AF_INET, lg_srv_ipv4, &srv_addr.sin_addr);
+    user->socket_id = socket(AF_INET, SOCK_STREAM, 0);
+    if(user->socket_id == -1 || connect(user->socket_id, (struct sockaddr*)&srv_addr, sizeof(srv_addr)) == -1)
+        return 0;
+    fcntl(user->socket_id, F_SETFL, O_NONBLOCK);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = index;
+    user->in.clear();
+    user->out.clear();
+    user->out_sent = 0;
+    user->writing = false;
+    return epoll_ctl(lg_epoll_fd, EPOLL_CTL_ADD, user->socket_id, &event) == 0;
+}
+
+/**
+ * @brief send what the socket of a user accepts now, the rest is sent when the socket becomes writable
+ * @return 1 on success, 0 on error(s)
+ */
+int lg_flush(lg_user* user, int index){
+    while(user->out_sent < user->out.size()){
+        ssize_t ret = send(user->socket_id, user->out.data() + user->out_sent, user->out.size() - user->out_sent, MSG_NOSIGNAL);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if(ret <= 0)
+            return 0;
+        user->out_sent += ret;
+    }
+    if(user->out_sent == user->out.size()){
+        user->out.clear();
+        user->out_sent = 0;
+    }
+    bool writing = !user->out.empty();
+    if(writing != user->writing){
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | (writing? EPOLLOUT: 0);
+        event.data.u32 = index;
+        if(epoll_ctl(lg_epoll_fd, EPOLL_CTL_MOD, user->socket_id, &event) != 0)
+            return 0;
+        user->writing = writing;
+    }
+    return 1;
+}
+
+/**
+ * @brief append to the output of a user a record of its session with the server
+ */
+int lg_send_record(lg_user* user, int index, const uchar* payload, uint payload_len){
+    size_t offset = user->out.size();
+    user->out.resize(offset + RECORD_HEADER_LEN(user->caps) + sizeof(uint32_t) + payload_len);
+    uint record_len = record_seal(user->session, user->caps, user->send_seq, payload, payload_len, user->out.data() + offset);
+    if(record_len == 0)
+        return 0;
+    user->out.resize(offset + record_len);
+    user->send_seq++;
+    return lg_flush(user, index);
+}
+
+/**
+ * @brief send M1 to the server, with the cookie if the server asked for one
+ */
+int lg_send_M1(lg_user* user, int index){
+    user->offered_caps = SUPPORTED_CAPS | (user->has_cookie? CAP_COOKIE: 0);
+    handshake_M1(user->R1, user->username, user->offered_caps, user->has_cookie? user->cookie: nullptr, user->out);
+    user->step = LG_WAIT_M2;
+    return lg_flush(user, index);
+}
+
+/**
+ * @brief start the login of a user (a full handshake, the session tickets are not used)
+ */
+void lg_start_login(lg_user* user, int index){
+    stats.logging++;
+    user->step = LG_WAIT_M2;
+    user->started = lg_now();
+    user->has_cookie = false;
+    user->send_seq = user->recv_seq = 0;
+    random_generate(NONCE_SIZE, user->R1);
+    if(!lg_connect(user, index) || !lg_send_M1(user, index))
+        lg_fail(user, "cannot connect to the server");
+}
+
+/**
+ * @brief check M2 of the server, send M3 and create the session; M2 is at the start of the input of the user
+ * @return 1 on success, 0 on error(s)
+ */
+int lg_handle_M2(lg_user* user, int index, uint M2_len){
+    uchar* M2 = user->in.data();
+    uchar* peer_eph;
+    uint peer_eph_len;
+    uint8_t selected_caps;
+    if(!handshake_check_M2(user->R1, user->offered_caps, M2, M2_len, lg_ca_store, &peer_eph, &peer_eph_len, &selected_caps))
+        return 0;
+    memcpy(user->R2, M2, NONCE_SIZE);
+    void* eph_privkey;
+    if(!handshake_M3(user->R2, selected_caps, user->key, &eph_privkey, user->out))
+        return 0;
+    user->session = handshake_session(eph_privkey, peer_eph, peer_eph_len, selected_caps, true, nullptr, nullptr);
+    user->caps = selected_caps;
+    user->in.erase(user->in.begin(), user->in.begin() + M2_len);
+    user->step = LG_WAIT_USER_ID;
+    return user->session != nullptr && lg_flush(user, index);
+}
+
+// ---------------------------------------------------------------------
+// FUNCTIONS of the CHATS
+// ---------------------------------------------------------------------
+
+/**
+ * @brief send a message of the user to the server for its peer: opcode, user id of the peer and body
+ */
+int lg_send_to_peer(lg_user* user, int index, uint8_t opcode, const uchar* body, uint body_len){
+    vector<uchar> payload(1 + sizeof(uint32_t) + body_len);
+    uint32_t peer_id_net = htonl(user->peer_id);
+    payload[0] = opcode;
+    memcpy(payload.data() + 1, &peer_id_net, sizeof(uint32_t));
+    if(body_len > 0)
+        memcpy(payload.data() + 1 + sizeof(uint32_t), body, body_len);
+    return lg_send_record(user, index, payload.data(), payload.size());
+}
+
+/**
+ * @brief send the first message of the handshake between two users
+ */
+int lg_send_peer_M1(lg_user* user, int index){
+    vector<uchar> M1;
+    random_generate(NONCE_SIZE, user->R1);
+    handshake_peer_M1(user->R1, SUPPORTED_CAPS, M1);
+    user->step = LG_WAIT_PEER_M2;
+    return lg_send_to_peer(user, index, AUTH, M1.data(), M1.size());
+}
+
+/**
+ * @brief answer M1 of the peer with M2
+ */
+int lg_send_peer_M2(lg_user* user, int index, uchar* M1, uint M1_len){
+    vector<uchar> M2;
+    if(!handshake_peer_M2(M1, M1_len, user->key, user->R2, &user->eph_privkey, &user->chat_caps, M2))
+        return 0;
+    user->step = LG_WAIT_PEER_M3;
+    return lg_send_to_peer(user, index, AUTH, M2.data(), M2.size());
+}
+
+/**
+ * @brief check M2 of the peer, send M3 and create the session of the chat
+ */
+int lg_send_peer_M3(lg_user* user, int index, uchar* M2, uint M2_len){
+    uchar* peer_eph;
+    uint peer_eph_len;
+    if(!handshake_check_peer_M2(user->R1, SUPPORTED_CAPS, M2, M2_len, user->peer_key, &peer_eph, &peer_eph_len,
+            &user->chat_caps))
+        return 0;
+    vector<uchar> M3;
+    void* eph_privkey;
+    if(!handshake_M3(M2, user->chat_caps, user->key, &eph_privkey, M3))
+        return 0;
+    user->chat_session = handshake_session(eph_privkey, peer_eph, peer_eph_len, user->chat_caps, true, nullptr, nullptr);
+    return user->chat_session != nullptr && lg_send_to_peer(user, index, AUTH, M3.data(), M3.size());
+}
+
+/**
+ * @brief check M3 of the peer and create the session of the chat
+ */
+int lg_handle_peer_M3(lg_user* user, uchar* M3, uint M3_len){
+    uchar* peer_eph;
+    uint peer_eph_len;
+    if(!handshake_check_M3(user->R2, M3, M3_len, user->peer_key, &peer_eph, &peer_eph_len))
+        return 0;
+    user->chat_session = handshake_session(user->eph_privkey, peer_eph, peer_eph_len, user->chat_caps, false,
+        nullptr, nullptr);
+    user->eph_privkey = nullptr;
+    return user->chat_session != nullptr;
+}
+
+/**
+ * @brief a user is in chat with its peer: the setup is counted by the user that asked for the chat
+ */
+void lg_chat_ready(lg_user* user, bool requester){
+    user->step = LG_CHATTING;
+    if(requester){
+        stats.chats++;
+        stats.chat_latency.push_back((lg_now() - user->started) / 1000);
+    }
+}
+
+/**
+ * @brief send a chat message to the peer of a user: the body (the send time and a filler) is sealed with the
+ * session of the chat
+ * @return 1 on success (also if the message is skipped because the socket is backlogged), 0 on error(s)
+ */
+int lg_send_message(lg_user* user, int index){
+    if(user->out.size() - user->out_sent > lg_max_backlog){
+        stats.skipped++;
+        return 1;
+    }
+    vector<uchar> body(lg_message_size, 'x');
+    vector<uchar> record(RECORD_HEADER_LEN(user->chat_caps) + sizeof(uint32_t) + lg_message_size);
+    uint64_t now = lg_now();
+    memcpy(body.data(), &now, sizeof(uint64_t));
+    uint record_len = record_seal(user->chat_session, user->chat_caps, user->chat_send_seq, body.data(), body.size(),
+        record.data());
+    if(record_len == 0)
+        return 0;
+    user->chat_send_seq++;
+    stats.sent++;
+    return lg_send_to_peer(user, index, CHAT_RESPONSE, record.data(), record_len);
+}
+
+/**
+ * @brief open a chat message of the peer and measure its latency from the send time in its body, and the latency of
+ * the stages of the relay if the server appended its stamps after the record
+ */
+int lg_handle_message(lg_user* user, uchar* record, uint record_len){
+    int len = auth_enc_record_len(record, record_len, user->chat_caps, RELAY_MSG_SIZE);
+    if(len <= 0)
+        return 0;
+    uint64_t stamps[RELAY_STAMPS + 2];
+    bool stamped = record_len == len + RELAY_STAMPS_SIZE;
+    if(stamped)
+        memcpy(stamps + 1, record + len, RELAY_STAMPS_SIZE);
+    int pt_len = record_open(user->chat_session, user->chat_caps, &user->chat_recv_seq, record, len);
+    if(pt_len < (int)sizeof(uint64_t))
+        return 0;
+    uint64_t sent;
+    uint64_t received = lg_now();
+    memcpy(&sent, record + RECORD_HEADER_LEN(user->chat_caps) + sizeof(uint32_t), sizeof(uint64_t));
+    stats.received++;
+    stats.message_latency.push_back((received - sent) / 1000);
+    if(stamped){
+        stamps[0] = sent;
+        stamps[RELAY_STAMPS + 1] = received;
+        for(int stage = 0; stage <= RELAY_STAMPS; stage++)
+            stats.stage_latency[stage].push_back((stamps[stage + 1] - stamps[stage]) / 1000);
+    }
+    return 1;
+}
+
+// ---------------------------------------------------------------------
+// FUNCTIONS of the EVENT LOOP
+// ---------------------------------------------------------------------
+
+/**
+ * @brief handle a message of the server (payload after the sequence number) according to the step of the user
+ * @return 1 on success, 0 on error(s)
+ */
+int lg_dispatch(lg_user* user, int index, uchar* payload, uint payload_len){
+    uint8_t opcode = payload[0];
+    uchar* body = payload + 1 + sizeof(uint32_t);
+    uint body_len = (payload_len >= 1 + sizeof(uint32_t))? payload_len - 1 - sizeof(uint32_t): 0;
+    if(payload_len < 1 + sizeof(uint32_t))
+        return 0;
+    int32_t id;
+    memcpy(&id, payload + 1, sizeof(int32_t));
+    switch(opcode){
+    case USRID:
+        if(user->step != LG_WAIT_USER_ID)
+            return 0;
+        user->user_id = ntohl(id);
+        user->step = LG_LOGGED;
+        stats.logins++;
+        stats.logging--;
+        stats.login_latency.push_back((lg_now() - user->started) / 1000);
+        return 1;
+    case CHAT_CMD:{
+        //Requester id, username length, username and identity key of the requester
+        if(user->step != LG_LOGGED){
+            uchar refused[1 + sizeof(uint32_t)] = {CHAT_NEG};
+            memcpy(refused + 1, &id, sizeof(int32_t));
+            return lg_send_record(user, index, refused, sizeof(refused));
+        }
+        uint32_t username_len;
+        if(body_len < sizeof(uint32_t))
+            return 0;
+        memcpy(&username_len, body, sizeof(uint32_t));
+        username_len = ntohl(username_len);
+        if(username_len > MAX_USERNAME_SIZE || body_len < sizeof(uint32_t) + username_len + PUBKEY_DEFAULT_SER)
+            return 0;
+        free_pubkey(user->peer_key);
+        user->peer_key = parse_pubkey(body + sizeof(uint32_t) + username_len, PUBKEY_DEFAULT_SER);
+        user->peer_id = ntohl(id);
+        user->step = LG_WAIT_PEER_M1;
+        uchar accepted[1 + sizeof(uint32_t)] = {CHAT_POS};
+        memcpy(accepted + 1, &id, sizeof(int32_t));
+        return user->peer_key != nullptr && lg_send_record(user, index, accepted, sizeof(accepted));
+    }
+    case CHAT_POS:
+        //User id of the peer (host order, written by the server) and identity key of the peer
+        if(user->step != LG_WAIT_CHAT_REPLY || body_len < PUBKEY_DEFAULT_SER || id != user->peer_id)
+            return 0;
+        free_pubkey(user->peer_key);
+        user->peer_key = parse_pubkey(body, PUBKEY_DEFAULT_SER);
+        return user->peer_key != nullptr && lg_send_peer_M1(user, index);
+    case CHAT_NEG:
+        if(user->step != LG_WAIT_CHAT_REPLY)
+            return 1;
+        stats.chat_failures++;
+        user->step = LG_LOGGED;
+        return 1;
+    case AUTH:
+        //The user id in front of the body is the one of the recipient
+        if(user->step == LG_WAIT_PEER_M1)
+            return lg_send_peer_M2(user, index, body, body_len);
+        if(user->step == LG_WAIT_PEER_M2){
+            if(!lg_send_peer_M3(user, index, body, body_len))
+                return 0;
+            lg_chat_ready(user, true);
+            return 1;
+        }
+        if(user->step == LG_WAIT_PEER_M3){
+            if(!lg_handle_peer_M3(user, body, body_len))
+                return 0;
+            lg_chat_ready(user, false);
+            return 1;
+        }
+        return 0;
+    case CHAT_RESPONSE:
+        return user->step == LG_CHATTING && lg_handle_message(user, body, body_len);
+    case STOP_CHAT:
+        if(user->step == LG_CHATTING)
+            user->step = LG_STOPPED;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief receive what the server sent to a user and handle the whole messages
+ */
+void lg_handle_input(lg_user* user, int index){
+    uchar buffer[RECV_BUFFER_SIZE];
+    //The server closes the connection right after some messages (the cookie): they are handled before the close
+    bool closed = false;
+    while(true){
+        ssize_t ret = recv(user->socket_id, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if(ret > 0){
+            user->in.insert(user->in.end(), buffer, buffer + ret);
+            continue;
+        }
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if(ret < 0){
+            lg_fail(user, "recv failed: " + string(strerror(errno)));
+            return;
+        }
+        closed = true;
+        break;
+    }
+
+    if(user->step == LG_WAIT_M2){
+        uint8_t selected_caps;
+        uint M2_len = handshake_M2_length(user->in.data(), user->in.size(), &selected_caps);
+        if(M2_len > user->in.size()){
+            if(closed)
+                lg_fail(user, "connection closed by the server");
+            return;
+        }
+        if(selected_caps == CAP_COOKIE){
+            //The server is under load: connect again and echo the cookie in M1, with the same R1
+            uint offset = NONCE_SIZE;
+            uchar* cookie;
+            if(handshake_read_field(user->in.data(), M2_len, &offset, &cookie, nullptr) != COOKIE_SIZE){
+                lg_fail(user, "invalid cookie from the server");
+                return;
+            }
+            stats.cookies++;
+            memcpy(user->cookie, cookie, COOKIE_SIZE);
+            user->has_cookie = true;
+            if(!lg_connect(user, index) || !lg_send_M1(user, index))
+                lg_fail(user, "cannot connect to the server to echo the cookie");
+            return;
+        }
+        if(!lg_handle_M2(user, index, M2_len)){
+            lg_fail(user, "handshake with the server failed");
+            return;
+        }
+    }
+
+    size_t consumed = 0;
+    uint header_len = RECORD_HEADER_LEN(user->caps);
+    while(user->step != LG_FAILED && user->session != nullptr){
+        int record_len = auth_enc_record_len(user->in.data() + consumed, user->in.size() - consumed, user->caps,
+            RELAY_MSG_SIZE + sizeof(uint32_t));
+        if(record_len == 0)
+            break;
+        uchar* record = user->in.data() + consumed;
+        int pt_len = (record_len < 0)? -1: record_open(user->session, user->caps, &user->recv_seq, record, record_len);
+        if(pt_len < 0){
+            lg_fail(user, "invalid record from the server");
+            return;
+        }
+        consumed += record_len;
+        if(!lg_dispatch(user, index, record + header_len + sizeof(uint32_t), pt_len)){
+            lg_fail(user, "unexpected message " + to_string(record[header_len + sizeof(uint32_t)]) + " from the server");
+            return;
+        }
+    }
+    user->in.erase(user->in.begin(), user->in.begin() + consumed);
+    if(closed)
+        lg_fail(user, "connection closed by the server");
+}
+
+/**
+ * @brief wait up to timeout_ms for the sockets of the users and handle them
+ */
+void lg_poll(int timeout_ms){
+    struct epoll_event events[MAX_EVENTS];
+    int ready = epoll_wait(lg_epoll_fd, events, MAX_EVENTS, timeout_ms);
+    for(int i = 0; i < ready; i++){
+        int index = events[i].data.u32;
+        lg_user* user = &lg_users[index];
+        if(user->step == LG_FAILED)
+            continue;
+        if((events[i].events & EPOLLOUT) && !lg_flush(user, index))
+            lg_fail(user, "send failed");
+        if(user->step != LG_FAILED && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+            lg_handle_input(user, index);
+    }
+}
+
+/**
+ * @return the value of the latency at fraction of the sorted samples, in ms
+ */
+double lg_percentile(vector<uint32_t>& samples, double fraction){
+    if(samples.empty())
+        return 0;
+    size_t rank = (size_t)(fraction * samples.size() + 0.999999);
+    return samples[min(max(rank, (size_t)1), samples.size()) - 1] / 1000.0;
+}
+
+/**
+ * @brief print count and p50, p99, p999 of some latencies
+ */
+void lg_print_latency(const string& name, vector<uint32_t>& samples){
+    sort(samples.begin(), samples.end());
+    cout << "    " << name << " latency: p50 " << lg_percentile(samples, 0.5) << " ms, p99 " << lg_percentile(samples, 0.99)
+        << " ms, p999 " << lg_percentile(samples, 0.999) << " ms, max " << lg_percentile(samples, 1) << " ms" << endl;
+}
+
+/**
+ * @brief log in the users, pair them in chats, send messages at rate per user for seconds and print the results
+ * @return 0 if every user logged in, every chat was set up and no error happened, 1 otherwise
+ */
+int run_load(uint users, uint rate, uint seconds){
+    cout << "loadgen: " << users << " users (" << users / 2 << " chats) on " << lg_srv_ipv4 << ":" << lg_srv_port << ", "
+        << rate << " messages/s of " << lg_message_size << " B from every user for " << seconds << " s" << endl;
+    struct rlimit fd_limit;
+    if(0 == getrlimit(RLIMIT_NOFILE, &fd_limit)){
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+    FILE* ca_cert = fopen(lg_ca_cert, "rb");
+    FILE* ca_crl = fopen(lg_ca_crl, "rb");
+    lg_ca_store = (ca_cert && ca_crl)? cert_store_new(ca_cert, ca_crl): nullptr;
+    if(ca_cert)
+        fclose(ca_cert);
+    if(ca_crl)
+        fclose(ca_crl);
+    lg_epoll_fd = epoll_create1(0);
+    if(lg_ca_store == nullptr || lg_epoll_fd == -1){
+        cerr << "Cannot load the trust store of the CA" << endl;
+        return 1;
+    }
+    lg_users.resize(users);
+    for(uint i = 0; i < users; i++){
+        lg_users[i].username = "lg" + to_string(i);
+        string path = string(lg_key_folder) + "/" + lg_users[i].username + "_privkey.pem";
+        FILE* key_file = fopen(path.c_str(), "rb");
+        lg_users[i].key = key_file? read_privkey(key_file, NULL): nullptr;
+        if(key_file)
+            fclose(key_file);
+        if(lg_users[i].key == nullptr){
+            cerr << "Cannot read " << path << ", run ./loadgen setup " << users << " first" << endl;
+            return 1;
+        }
+    }
+
+    //Logins, at most lg_login_window at the same time
+    uint64_t phase_start = lg_now();
+    uint next_login = 0;
+    while(stats.logins + stats.login_failures < users && lg_now() - phase_start < lg_phase_timeout * 1000000000ull){
+        while(stats.logging < lg_login_window && next_login < users){
+            lg_start_login(&lg_users[next_login], next_login);
+            next_login++;
+        }
+        lg_poll(100);
+    }
+    double login_time = (lg_now() - phase_start) / 1e9;
+    cout << "  logins: " << stats.logins << " in " << login_time << " s (" << stats.logins / login_time << "/s), "
+        << stats.login_failures << " failed, " << stats.cookies << " cookies asked by the server" << endl;
+    lg_print_latency("login", stats.login_latency);
+
+    //Chats: user 2i asks user 2i + 1
+    phase_start = lg_now();
+    uint requests = 0;
+    for(uint i = 0; i + 1 < users; i += 2){
+        lg_user* requester = &lg_users[i];
+        if(requester->step != LG_LOGGED || lg_users[i + 1].step != LG_LOGGED)
+            continue;
+        requester->peer = i + 1;
+        requester->peer_id = lg_users[i + 1].user_id;
+        requester->step = LG_WAIT_CHAT_REPLY;
+        requester->started = lg_now();
+        lg_users[i + 1].peer = i;
+        uchar request[1 + sizeof(uint32_t)] = {CHAT_CMD};
+        uint32_t peer_id_net = htonl(requester->peer_id);
+        memcpy(request + 1, &peer_id_net, sizeof(uint32_t));
+        if(!lg_send_record(requester, i, request, sizeof(request)))
+            lg_fail(requester, "cannot send the chat request");
+        requests++;
+    }
+    while(stats.chats + stats.chat_failures < requests && lg_now() - phase_start < lg_phase_timeout * 1000000000ull)
+        lg_poll(100);
+    cout << "  chats: " << stats.chats << " set up in " << (lg_now() - phase_start) / 1e9 << " s, "
+        << requests - stats.chats << " failed" << endl;
+    lg_print_latency("chat setup", stats.chat_latency);
+
+    //Messages: every user in chat sends one every 1/rate s, the first ones are spread over the period
+    typedef pair<uint64_t, uint> lg_send_time;
+    priority_queue<lg_send_time, vector<lg_send_time>, greater<lg_send_time>> next_sends;
+    uint64_t period = 1000000000ull / max(rate, 1u);
+    phase_start = lg_now();
+    for(uint i = 0; i < users; i++){
+        if(lg_users[i].step == LG_CHATTING)
+            next_sends.push({phase_start + period * i / users, i});
+    }
+    uint64_t phase_end = phase_start + seconds * 1000000000ull;
+    uint64_t next_report = phase_start + 1000000000ull;
+    uint64_t reported_sent = 0, reported_received = 0;
+    uint64_t now;
+    while((now = lg_now()) < phase_end){
+        while(!next_sends.empty() && next_sends.top().first <= now){
+            lg_send_time next = next_sends.top();
+            next_sends.pop();
+            lg_user* user = &lg_users[next.second];
+            if(user->step != LG_CHATTING)
+                continue;
+            if(!lg_send_message(user, next.second))
+                lg_fail(user, "cannot send a message");
+            next_sends.push({next.first + period, next.second});
+        }
+        if(now >= next_report){
+            cout << "  " << (now - phase_start) / 1000000000ull << " s: " << stats.sent - reported_sent << " messages sent, "
+                << stats.received - reported_received << " received" << endl;
+            reported_sent = stats.sent;
+            reported_received = stats.received;
+            next_report += 1000000000ull;
+        }
+        uint64_t wake = min(phase_end, next_report);
+        if(!next_sends.empty())
+            wake = min(wake, next_sends.top().first);
+        lg_poll((wake > now)? (wake - now + 999999) / 1000000: 0);
+    }
+    uint64_t sent = stats.sent;
+    //Messages in flight
+    while(stats.received < sent && lg_now() - phase_end < lg_drain_time * 1000000000ull)
+        lg_poll(10);
+
+    //The requesters stop their chats, then every user exits
+    for(uint i = 0; i < users; i++){
+        lg_user* user = &lg_users[i];
+        if(user->step == LG_FAILED || user->step == LG_IDLE)
+            continue;
+        if(user->step == LG_CHATTING && i % 2 == 0){
+            uchar stop[1 + sizeof(uint32_t)] = {STOP_CHAT};
+            uint32_t peer_id_net = htonl(user->peer_id);
+            memcpy(stop + 1, &peer_id_net, sizeof(uint32_t));
+            lg_send_record(user, i, stop, sizeof(stop));
+        }
+        uchar exit_cmd = EXIT_CMD;
+        lg_send_record(user, i, &exit_cmd, sizeof(exit_cmd));
+        fcntl(user->socket_id, F_SETFL, 0);
+        lg_flush(user, i);
+        close(user->socket_id);
+        user->socket_id = -1;
+    }
+
+    double send_time = seconds + (lg_now() - phase_end) / 1e9;
+    cout << "  messages: " << stats.sent << " sent, " << stats.received << " received, " << stats.sent - stats.received
+        << " lost, " << stats.skipped << " skipped (backlog over " << lg_max_backlog / 1024 << " KB); "
+        << (uint64_t)(stats.received / send_time) << " messages/s, "
+        << stats.received * lg_message_size / send_time / (1024 * 1024) << " MB/s" << endl;
+    lg_print_latency("message", stats.message_latency);
+    if(!stats.stage_latency[0].empty()){
+        cout << "  relay stages of " << stats.stage_latency[0].size() << " messages stamped by the server:" << endl;
+        for(int stage = 0; stage <= RELAY_STAMPS; stage++)
+            lg_print_latency(lg_stages[stage], stats.stage_latency[stage]);
+    }
+    cout << "  errors: " << stats.errors << endl;
+
+    for(lg_user& user : lg_users){
+        safe_free_privkey(user.key);
+        free_pubkey(user.peer_key);
+        auth_enc_session_free(user.session);
+        auth_enc_session_free(user.chat_session);
+        safe_free_privkey(user.eph_privkey);
+    }
+    cert_store_free(lg_ca_store);
+    close(lg_epoll_fd);
+    bool complete = stats.logins == users && stats.chats == requests && stats.errors == 0;
+    return complete? 0: 1;
+}
+
+// ---------------------------------------------------------------------
+// FUNCTIONS of the SETUP of the USERS
+// ---------------------------------------------------------------------
+
+/**
+ * @brief create the key pair of a simulated user: the private key in lg_key_folder, the public key in PUBKEY_FOLDER
+ * @return 1 on success, 0 on error(s)
+ */
+int write_user_keys(const string& username){
+    EVP_PKEY* key = EVP_PKEY_Q_keygen(NULL, NULL, "ED25519");
+    if(key == nullptr)
+        return 0;
+    string privkey_path = string(lg_key_folder) + "/" + username + "_privkey.pem";
+    string pubkey_path = string(PUBKEY_FOLDER) + "/" + username + "_pubkey.pem";
+    int privkey_fd = open(privkey_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    FILE* privkey_file = (privkey_fd == -1)? nullptr: fdopen(privkey_fd, "wb");
+    FILE* pubkey_file = fopen(pubkey_path.c_str(), "wb");
+    int ret = privkey_file && pubkey_file && PEM_write_PrivateKey(privkey_file, key, NULL, NULL, 0, NULL, NULL) == 1 &&
+        PEM_write_PUBKEY(pubkey_file, key) == 1;
+    if(privkey_file)
+        fclose(privkey_file);
+    else if(privkey_fd != -1)
+        close(privkey_fd);
+    if(pubkey_file)
+        fclose(pubkey_file);
+    EVP_PKEY_free(key);
+    if(!ret)
+        cerr << "Cannot write the keys of " << username << endl;
+    return ret;
+}
+
+/**
+ * @brief create and register the users lg0 ... lg<users - 1>, the ones already registered with a key are kept
+ * @return 0 on success, 1 on error(s)
+ */
+int setup_users(uint users){
+    //The first start of the server creates the registry with the users of the certification folder
+    if(!registry_open(USER_REGISTRY_FILE, false)){
+        cerr << "Cannot open " << USER_REGISTRY_FILE << ", start the server once to create it" << endl;
+        return 1;
+    }
+    mkdir(lg_key_folder, 0700);
+    if(!registry_lock()){
+        registry_close();
+        return 1;
+    }
+    uint32_t count;
+    const registry_record* records = registry_get_records(&count);
+    unordered_set<string> registered;
+    for(uint32_t i = 0; i < count; i++){
+        if(!records[i].removed)
+            registered.insert(string(records[i].username, strnlen(records[i].username, MAX_USERNAME_SIZE + 1)));
+    }
+    int ret = 0;
+    uint added = 0;
+    for(uint i = 0; i < users && ret == 0; i++){
+        string username = "lg" + to_string(i);
+        string privkey_path = string(lg_key_folder) + "/" + username + "_privkey.pem";
+        bool has_key = access(privkey_path.c_str(), R_OK) == 0;
+        if(registered.count(username) && has_key)
+            continue;
+        if(registered.count(username)){
+            cerr << username << " is registered without its private key in " << lg_key_folder << endl;
+            ret = 1;
+            break;
+        }
+        uchar fingerprint[FINGERPRINT_SIZE];
+        int key_type;
+        string pubkey_path = string(PUBKEY_FOLDER) + "/" + username + "_pubkey.pem";
+        FILE* pubkey_file = write_user_keys(username)? fopen(pubkey_path.c_str(), "rb"): nullptr;
+        if(!pubkey_file || !pubkey_fingerprint_from_file(pubkey_file, fingerprint, &key_type) ||
+            registry_append(username, fingerprint, key_type) == -1)
+            ret = 1;
+        if(pubkey_file)
+            fclose(pubkey_file);
+        added += (ret == 0);
+    }
+    if(!registry_flush())
+        ret = 1;
+    registry_unlock();
+    registry_close();
+    cout << "Registered " << added << " new users, " << users - added << " were already registered" << endl;
+    if(added > 0)
+        cout << "Send SIGHUP to the main process of a running server to apply the change" << endl;
+    return ret;
+}
+
+int main(int argc, char* argv[]){
+    string command = (argc > 1)? argv[1]: "";
+    uint users = (argc > 2)? strtoul(argv[2], NULL, 10): 0;
+    if(command == "setup" && argc == 3 && users > 0)
+        return setup_users(users);
+    if(command == "run" && argc == 6 && users >= 2){
+        uint rate = strtoul(argv[3], NULL, 10);
+        lg_message_size = strtoul(argv[4], NULL, 10);
+        uint seconds = strtoul(argv[5], NULL, 10);
+        //The body of a message holds its send time, the whole record has to fit in a relayed message
+        if(rate > 0 && seconds > 0 && lg_message_size >= sizeof(uint64_t) && lg_message_size <= SCRIPT_MAX_MESSAGE_SIZE)
+            return run_load(users, rate, seconds);
+    }
+    cout << "Usage: ./loadgen setup <users>" << endl;
+    cout << "       ./loadgen run <users> <messages/s of every user> <message size> <seconds>" << endl;
+    return 1;
+}
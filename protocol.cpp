@@ -0,0 +1,220 @@
+#include <string.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+#include "crypto.h"
+
+/**
+ * @brief append a field preceded by its length, with the capabilities in the most significant byte of the length
+ */
+void append_field(vector<uchar>& msg, const uchar* field, uint field_len, uint8_t caps){
+    uint32_t field_len_net = htonl(field_len | ((uint32_t)caps << CAPS_SHIFT));
+    msg.insert(msg.end(), (uchar*)&field_len_net, (uchar*)&field_len_net + sizeof(uint32_t));
+    msg.insert(msg.end(), field, field + field_len);
+}
+
+/**
+ * @brief document signed in M2: R1, R2, ephemeral key, capabilities offered and selected (they are signed to avoid
+ * downgrades)
+ */
+void M2_document(const uchar* R1, const uchar* R2, const uchar* eph, uint eph_len, uint8_t offered_caps,
+        uint8_t selected_caps, vector<uchar>& document){
+    document.assign(R1, R1 + NONCE_SIZE);
+    document.insert(document.end(), R2, R2 + NONCE_SIZE);
+    document.insert(document.end(), eph, eph + eph_len);
+    document.push_back(offered_caps);
+    document.push_back(selected_caps);
+}
+
+/**
+ * @brief read R2, the ephemeral key and the signature of M2 and check the capabilities selected
+ * @return 1 on success, 0 if M2 is malformed or the capabilities were not offered
+ */
+int read_M2(uchar* M2, uint M2_len, uint8_t offered_caps, uchar** eph, uint* eph_len, uint8_t* selected_caps,
+        uchar** signature, uint* signature_len, uint* offset){
+    *offset = NONCE_SIZE;
+    int len = handshake_read_field(M2, M2_len, offset, eph, selected_caps);
+    if(len < 0)
+        return 0;
+    *eph_len = len;
+    len = handshake_read_field(M2, M2_len, offset, signature, nullptr);
+    if(len < 0)
+        return 0;
+    *signature_len = len;
+    return (*selected_caps & ~offered_caps) == 0 && (*selected_caps & CAP_RESUME) == 0;
+}
+
+void handshake_M1(const uchar* R1, const string& username, uint8_t offered_caps, const uchar* cookie, vector<uchar>& M1){
+    M1.insert(M1.end(), R1, R1 + NONCE_SIZE);
+    append_field(M1, (uchar*)username.c_str(), username.size() + 1, offered_caps);
+    if(cookie)
+        append_field(M1, cookie, COOKIE_SIZE, 0);
+}
+
+uint handshake_M2_length(const uchar* msg, uint msg_len, uint8_t* selected_caps){
+    uint length = NONCE_SIZE;
+    for(int field = 0; field < 3; field++){
+        if(msg_len < length + sizeof(uint32_t))
+            return length + sizeof(uint32_t);
+        uint32_t field_len;
+        memcpy(&field_len, msg + length, sizeof(uint32_t));
+        field_len = ntohl(field_len);
+        length += sizeof(uint32_t) + (field_len & CAPS_LEN_MASK);
+        if(field == 0){
+            //The cookie and the acceptance of a ticket have only the first field
+            *selected_caps = field_len >> CAPS_SHIFT;
+            if(*selected_caps == CAP_COOKIE || (*selected_caps & CAP_RESUME))
+                break;
+        }
+    }
+    return length;
+}
+
+int handshake_read_field(uchar* msg, uint msg_len, uint* offset, uchar** field, uint8_t* caps){
+    if(*offset > msg_len || msg_len - *offset < sizeof(uint32_t))
+        return -1;
+    uint32_t field_len;
+    memcpy(&field_len, msg + *offset, sizeof(uint32_t));
+    field_len = ntohl(field_len);
+    if(caps)
+        *caps = field_len >> CAPS_SHIFT;
+    field_len &= CAPS_LEN_MASK;
+    *offset += sizeof(uint32_t);
+    if(msg_len - *offset < field_len)
+        return -1;
+    *field = msg + *offset;
+    *offset += field_len;
+    return field_len;
+}
+
+int handshake_check_M2(const uchar* R1, uint8_t offered_caps, uchar* M2, uint M2_len, void* ca_store,
+        uchar** peer_eph, uint* peer_eph_len, uint8_t* selected_caps){
+    uchar *signature, *cert;
+    uint signature_len, offset;
+    if(!read_M2(M2, M2_len, offered_caps, peer_eph, peer_eph_len, selected_caps, &signature, &signature_len, &offset))
+        return 0;
+    int cert_len = handshake_read_field(M2, M2_len, &offset, &cert, nullptr);
+    if(cert_len < 0)
+        return 0;
+    vector<uchar> document;
+    M2_document(R1, M2, *peer_eph, *peer_eph_len, offered_caps, *selected_caps, document);
+    return verify_sign_cert(cert, cert_len, ca_store, signature, signature_len, document.data(), document.size()) == 1;
+}
+
+void handshake_peer_M1(const uchar* R1, uint8_t offered_caps, vector<uchar>& M1){
+    M1.insert(M1.end(), R1, R1 + NONCE_SIZE);
+    M1.push_back(offered_caps);
+}
+
+int handshake_peer_M2(uchar* M1, uint M1_len, void* privkey, uchar* R2, void** eph_privkey, uint8_t* selected_caps,
+        vector<uchar>& M2){
+    if(M1_len < NONCE_SIZE)
+        return 0;
+    //The capabilities are absent if the peer does not support any
+    uint8_t offered_caps = (M1_len > NONCE_SIZE)? M1[NONCE_SIZE]: 0;
+    *selected_caps = offered_caps & SUPPORTED_CAPS;
+    uchar *eph_pubkey, *signature;
+    uint eph_pubkey_len, signature_len;
+    if(random_generate(NONCE_SIZE, R2) != 1)
+        return 0;
+    if(eph_key_generate(eph_privkey, &eph_pubkey, &eph_pubkey_len, *selected_caps) != 1)
+        return 0;
+    vector<uchar> document;
+    M2_document(M1, R2, eph_pubkey, eph_pubkey_len, offered_caps, *selected_caps, document);
+    if(eph_pubkey_len > CAPS_LEN_MASK ||
+            sign_document(document.data(), document.size(), privkey, &signature, &signature_len) != 1){
+        free(eph_pubkey);
+        safe_free_privkey(*eph_privkey);
+        *eph_privkey = nullptr;
+        return 0;
+    }
+    M2.insert(M2.end(), R2, R2 + NONCE_SIZE);
+    append_field(M2, eph_pubkey, eph_pubkey_len, *selected_caps);
+    append_field(M2, signature, signature_len, 0);
+    free(eph_pubkey);
+    free(signature);
+    return 1;
+}
+
+int handshake_check_peer_M2(const uchar* R1, uint8_t offered_caps, uchar* M2, uint M2_len, void* peer_key,
+        uchar** peer_eph, uint* peer_eph_len, uint8_t* selected_caps){
+    uchar* signature;
+    uint signature_len, offset;
+    if(!read_M2(M2, M2_len, offered_caps, peer_eph, peer_eph_len, selected_caps, &signature, &signature_len, &offset))
+        return 0;
+    vector<uchar> document;
+    M2_document(R1, M2, *peer_eph, *peer_eph_len, offered_caps, *selected_caps, document);
+    return verify_sign_parsed_pubkey(signature, signature_len, document.data(), document.size(), peer_key) == 1;
+}
+
+int handshake_M3(const uchar* R2, uint8_t caps, void* privkey, void** eph_privkey, vector<uchar>& M3){
+    uchar *eph_pubkey, *signature;
+    uint eph_pubkey_len, signature_len;
+    if(eph_key_generate(eph_privkey, &eph_pubkey, &eph_pubkey_len, caps) != 1)
+        return 0;
+    vector<uchar> document(eph_pubkey, eph_pubkey + eph_pubkey_len);
+    document.insert(document.end(), R2, R2 + NONCE_SIZE);
+    if(sign_document(document.data(), document.size(), privkey, &signature, &signature_len) != 1){
+        free(eph_pubkey);
+        safe_free_privkey(*eph_privkey);
+        *eph_privkey = nullptr;
+        return 0;
+    }
+    append_field(M3, eph_pubkey, eph_pubkey_len, 0);
+    append_field(M3, signature, signature_len, 0);
+    free(eph_pubkey);
+    free(signature);
+    return 1;
+}
+
+int handshake_check_M3(const uchar* R2, uchar* M3, uint M3_len, void* peer_key, uchar** peer_eph, uint* peer_eph_len){
+    uchar* signature;
+    uint offset = 0;
+    int eph_len = handshake_read_field(M3, M3_len, &offset, peer_eph, nullptr);
+    int signature_len = (eph_len < 0)? -1: handshake_read_field(M3, M3_len, &offset, &signature, nullptr);
+    if(signature_len < 0)
+        return 0;
+    *peer_eph_len = eph_len;
+    vector<uchar> document(*peer_eph, *peer_eph + eph_len);
+    document.insert(document.end(), R2, R2 + NONCE_SIZE);
+    return verify_sign_parsed_pubkey(signature, signature_len, document.data(), document.size(), peer_key) == 1;
+}
+
+void* handshake_session(void* eph_privkey, uchar* peer_eph, uint peer_eph_len, uint8_t caps, bool initiator,
+        uchar** session_key, uint* session_key_len){
+    uchar *secret, *key;
+    uint secret_len = derive_secret(eph_privkey, peer_eph, peer_eph_len, &secret);
+    if(secret_len == 0)
+        return nullptr;
+    uint key_len = derive_session_key(secret, secret_len, caps, &key);
+    safe_free(secret, secret_len);
+    if(key_len == 0)
+        return nullptr;
+    void* session = auth_enc_session_new(key, caps, initiator);
+    if(session && session_key){
+        *session_key = key;
+        *session_key_len = key_len;
+    }
+    else
+        safe_free(key, key_len);
+    return session;
+}
+
+uint record_seal(void* session, uint8_t caps, uint32_t seq, const uchar* pt, uint pt_len, uchar* record){
+    uint header_len = RECORD_HEADER_LEN(caps);
+    uint32_t seq_net = htonl(seq);
+    memcpy(record + header_len, &seq_net, sizeof(uint32_t));
+    memcpy(record + header_len + sizeof(uint32_t), pt, pt_len);
+    return auth_enc_session_seal(session, seq, record, sizeof(uint32_t) + pt_len, nullptr);
+}
+
+int record_open(void* session, uint8_t caps, uint32_t* recv_seq, uchar* record, uint record_len){
+    uint pt_len = auth_enc_session_open(session, *recv_seq, record, record_len);
+    if(pt_len <= sizeof(uint32_t))
+        return -1;
+    uint32_t seq = ntohl(*(uint32_t*)(record + RECORD_HEADER_LEN(caps)));
+    //The last sequence number is not accepted: the counter of the peer would wrap
+    if(seq < *recv_seq || seq == MAX_SEQ_NUM)
+        return -1;
+    *recv_seq = seq + 1;
+    return pt_len - sizeof(uint32_t);
+}
@@ -0,0 +1,133 @@
+#ifndef PROTOCOL_INCLUDED
+#define PROTOCOL_INCLUDED
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "constant.h"
+
+using uchar=unsigned char;
+
+using namespace std;
+
+/*
+* Client side of the handshakes and of the records, shared by the client and the load generator. The functions only
+* build and check messages in memory, they never use a socket: the client sends and receives the messages with
+* blocking calls, the load generator from its epoll loop. The builders append the message to their output.
+* Handshake with the server:
+*   M1: R1 | username length with the capabilities offered | username [| cookie length | cookie]
+*   M2: R2 | ephemeral key length with the capabilities selected | ephemeral key | signature length | signature |
+*       certificate length | certificate
+*   M3: ephemeral key length | ephemeral key | signature length | signature
+* Handshake between two users, inside the records after the opcode and the user id:
+*   M1: R1 | capabilities offered
+*   M2: as the one of the server, without the certificate
+*   M3: as the one of the server
+* The signature of M2 covers R1 | R2 | ephemeral key | capabilities offered | capabilities selected, the signature of M3
+* covers ephemeral key | R2.
+* Record: header | sequence number | plaintext, sealed with the session
+*/
+
+/**
+ * @brief build M1 for the server; the ticket and its binder of a resumption are appended by the caller
+ * @param cookie cookie sent by the server (COOKIE_SIZE bytes), nullptr if the server did not ask for it
+ */
+void handshake_M1(const uchar* R1, const string& username, uint8_t offered_caps, const uchar* cookie, vector<uchar>& M1);
+
+/**
+ * @brief length of M2 of the server, or of the cookie or of the acceptance of a ticket that replace it
+ * @param msg_len bytes of the message received so far
+ * @param selected_caps output, capabilities selected by the server (CAP_COOKIE alone for a cookie), set once
+ * the length of the ephemeral key is received
+ * @return length of the message as far as it is known from the bytes received: while it is more than msg_len the
+ * message is not complete
+ */
+uint handshake_M2_length(const uchar* msg, uint msg_len, uint8_t* selected_caps);
+
+/**
+ * @brief read a field of a message preceded by its length
+ * @param offset input/output, offset of the length of the field, then of the next field
+ * @param field output, start of the field in msg
+ * @param caps output, capabilities in the most significant byte of the length (nullptr if there are none)
+ * @return length of the field (capabilities excluded), -1 if the message is too short
+ */
+int handshake_read_field(uchar* msg, uint msg_len, uint* offset, uchar** field, uint8_t* caps);
+
+/**
+ * @brief check M2 of the server: the signature of R1, R2, its ephemeral key and the capabilities with the
+ * certificate of the server, checked with the trust store
+ * @param M2 whole M2, of handshake_M2_length bytes
+ * @param peer_eph output, ephemeral key of the server inside M2
+ * @param selected_caps output, capabilities selected by the server
+ * @return 1 if M2 is valid, 0 otherwise
+ */
+int handshake_check_M2(const uchar* R1, uint8_t offered_caps, uchar* M2, uint M2_len, void* ca_store,
+    uchar** peer_eph, uint* peer_eph_len, uint8_t* selected_caps);
+
+/**
+ * @brief build M1 for another user
+ */
+void handshake_peer_M1(const uchar* R1, uint8_t offered_caps, vector<uchar>& M1);
+
+/**
+ * @brief answer M1 of another user: generate R2 and the ephemeral key, and sign them with R1 and the capabilities
+ * @param privkey identity key of the user, parsed
+ * @param R2 output, NONCE_SIZE bytes
+ * @param eph_privkey output, ephemeral private key for handshake_session once M3 of the peer is checked
+ * @param selected_caps output, capabilities of the session
+ * @return 1 on success, 0 on error(s)
+ */
+int handshake_peer_M2(uchar* M1, uint M1_len, void* privkey, uchar* R2, void** eph_privkey, uint8_t* selected_caps,
+    vector<uchar>& M2);
+
+/**
+ * @brief check M2 of another user with its identity key
+ * @param peer_key identity key of the peer, parsed
+ * @param peer_eph output, ephemeral key of the peer inside M2
+ * @param selected_caps output, capabilities selected by the peer
+ * @return 1 if M2 is valid, 0 otherwise
+ */
+int handshake_check_peer_M2(const uchar* R1, uint8_t offered_caps, uchar* M2, uint M2_len, void* peer_key,
+    uchar** peer_eph, uint* peer_eph_len, uint8_t* selected_caps);
+
+/**
+ * @brief build M3, for the server or for another user: a new ephemeral key and the signature of it and R2
+ * @param privkey identity key of the user, parsed
+ * @param eph_privkey output, ephemeral private key for handshake_session
+ * @return 1 on success, 0 on error(s)
+ */
+int handshake_M3(const uchar* R2, uint8_t caps, void* privkey, void** eph_privkey, vector<uchar>& M3);
+
+/**
+ * @brief check M3 of another user with its identity key
+ * @param peer_eph output, ephemeral key of the peer inside M3
+ * @return 1 if M3 is valid, 0 otherwise
+ */
+int handshake_check_M3(const uchar* R2, uchar* M3, uint M3_len, void* peer_key, uchar** peer_eph, uint* peer_eph_len);
+
+/**
+ * @brief derive the session key of a handshake and create its session, the ephemeral private key is released
+ * @param initiator true for the user that sent M1
+ * @param session_key output, key of the session to release with safe_free (nullptr if it is not needed)
+ * @return the session, nullptr on error(s)
+ */
+void* handshake_session(void* eph_privkey, uchar* peer_eph, uint peer_eph_len, uint8_t caps, bool initiator,
+    uchar** session_key, uint* session_key_len);
+
+/**
+ * @brief build a record: the sequence number and the plaintext are copied after the header and sealed in place
+ * @param record output, RECORD_HEADER_LEN(caps) + sizeof(uint32_t) + pt_len bytes
+ * @return length of the record, 0 on error(s)
+ */
+uint record_seal(void* session, uint8_t caps, uint32_t seq, const uchar* pt, uint pt_len, uchar* record);
+
+/**
+ * @brief open a record in place and check its sequence number, that must not be lower than the expected one
+ * @param record whole record, of auth_enc_record_len bytes
+ * @param recv_seq input/output, sequence number expected, then the one after the record
+ * @return length of the plaintext, that starts after the sequence number at
+ * record + RECORD_HEADER_LEN(caps) + sizeof(uint32_t); -1 on error(s)
+ */
+int record_open(void* session, uint8_t caps, uint32_t* recv_seq, uchar* record, uint record_len);
+
+#endif
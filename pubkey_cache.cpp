@@ -0,0 +1,254 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include "pubkey_cache.h"
+#include "user_directory.h"
+#include "crypto.h"
+#include "util.h"
+
+static_assert(PUBKEY_CACHE_MAX_SER >= PUBKEY_DEFAULT_SER, "a slot of the public key cache holds a default public key");
+
+//Shared memory for caching the public keys of the users
+pubkey_cache* pubkeys = nullptr;
+
+/*
+* Public key parsed by this process from a slot of the cache, it is valid while the slot keeps the same fill
+*/
+struct parsed_pubkey {
+    int user_id = -1;
+    uint64_t fill = 0;
+    void* pubkey = nullptr;
+};
+
+//Parsed keys of this process, one per slot of the cache, allocated at the first use (after the fork)
+vector<parsed_pubkey> parsed_pubkeys;
+
+const string pubkey_suffix = "_pubkey.pem";
+
+
+// ---------------------------------------------------------------------
+// FUNCTIONS of the SLOTS of the CACHE
+// ---------------------------------------------------------------------
+
+/**
+ * @brief copy the key of a user out of its slot without locking, the read is repeated if a writer changed it meanwhile
+ * @param pubkey output, PUBKEY_CACHE_MAX_SER bytes
+ * @param fill output, fill of the slot that has been read
+ * @return length of the key, 0 if the key of the user is not in the cache
+ */
+uint32_t read_slot(int user_id, uchar* pubkey, uint64_t* fill){
+    pubkey_cache_slot* slot = &pubkeys->slots[user_id % PUBKEY_CACHE_SLOTS];
+    uint32_t seq, pubkey_len;
+    bool found;
+    do{
+        while((seq = slot->seq.load(memory_order_acquire)) & 1)
+            sched_yield(); //a writer is in the middle of a change, let it finish
+        found = slot->user_id.load(memory_order_relaxed) == user_id;
+        pubkey_len = slot->pubkey_len;
+        *fill = slot->fill;
+        if(found && pubkey_len <= PUBKEY_CACHE_MAX_SER)
+            memcpy(pubkey, slot->pubkey, pubkey_len);
+        atomic_thread_fence(memory_order_acquire);
+    } while(slot->seq.load(memory_order_relaxed) != seq);
+    return found? pubkey_len: 0;
+}
+
+/**
+ * @brief lock the writers of a slot, the slot is emptied if the previous owner of the lock died in the middle of a change
+ */
+void lock_slot(pubkey_cache_slot* slot){
+    if(shared_lock(&slot->lock))
+        return;
+    if(slot->seq.load(memory_order_relaxed) & 1){
+        slot->user_id.store(-1, memory_order_relaxed);
+        slot->seq.fetch_add(1, memory_order_release);
+        log("Emptied a slot of the public key cache left half written by a dead process");
+    }
+}
+
+/**
+ * @brief read the key of a user from its key file, check it against the registry and store it in its slot
+ * @param pubkey output, PUBKEY_CACHE_MAX_SER bytes
+ * @param fill output, fill of the slot, 0 if the key has not been stored because the key file changed meanwhile
+ * @return length of the key, 0 on error(s)
+ */
+uint32_t fill_slot(int user_id, uchar* pubkey, uint64_t* fill){
+    pubkey_cache_slot* slot = &pubkeys->slots[user_id % PUBKEY_CACHE_SLOTS];
+    //Taken before reading the file: a change of the file after this point prevents storing what is read
+    uint32_t invalidations = slot->invalidations.load(memory_order_acquire);
+    string username = get_username_by_user_id(user_id);
+    if(username.empty())
+        return 0;
+    string path = string(PUBKEY_FOLDER) + "/" + username + pubkey_suffix;
+    FILE* pubkey_file = fopen(path.c_str(), "rb");
+    if(!pubkey_file){
+        log("ERROR: Cannot open the public key of " + username);
+        return 0;
+    }
+    uchar* pubkey_ser;
+    int pubkey_len = serialize_pubkey_from_file(pubkey_file, &pubkey_ser);
+    fclose(pubkey_file);
+    if(pubkey_len <= 0)
+        return 0;
+    uchar fingerprint[FINGERPRINT_SIZE];
+    uchar registered_fingerprint[FINGERPRINT_SIZE];
+    if(pubkey_len > PUBKEY_CACHE_MAX_SER || !pubkey_fingerprint(pubkey_ser, pubkey_len, fingerprint) ||
+        !get_user_fingerprint(user_id, registered_fingerprint) ||
+        memcmp(fingerprint, registered_fingerprint, FINGERPRINT_SIZE) != 0){
+        log("ERROR: The public key of " + username + " is not the registered one");
+        free(pubkey_ser);
+        return 0;
+    }
+    memcpy(pubkey, pubkey_ser, pubkey_len);
+    free(pubkey_ser);
+    vlog("Public key of " + username + " loaded from its file");
+
+    *fill = 0;
+    lock_slot(slot);
+    if(slot->invalidations.load(memory_order_relaxed) == invalidations){
+        slot->seq.fetch_add(1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        *fill = pubkeys->fills.fetch_add(1, memory_order_relaxed);
+        slot->user_id.store(user_id, memory_order_relaxed);
+        slot->fill = *fill;
+        slot->pubkey_len = pubkey_len;
+        memcpy(slot->pubkey, pubkey, pubkey_len);
+        slot->seq.fetch_add(1, memory_order_release);
+    }
+    shared_unlock(&slot->lock);
+    return pubkey_len;
+}
+
+
+// ---------------------------------------------------------------------
+// FUNCTIONS for accessing to the PUBLIC KEY CACHE
+// ---------------------------------------------------------------------
+
+int pubkey_cache_create(){
+    void* shared = mmap(NULL, sizeof(pubkey_cache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shared == MAP_FAILED){
+        log("ERROR: mmap of the public key cache failed");
+        return 0;
+    }
+    pubkeys = (pubkey_cache*)shared;
+    pubkeys->fills = 1;
+    for(int i = 0; i < PUBKEY_CACHE_SLOTS; i++){
+        pubkeys->slots[i].user_id = -1;
+        if(!shared_lock_init(&pubkeys->slots[i].lock)){
+            log("ERROR: initialization of the locks of the public key cache failed");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int pubkey_cache_watch(){
+    int watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(watch_fd == -1){
+        log("ERROR: inotify_init1 failed");
+        return -1;
+    }
+    //Editors and tools replace a file either in place (close after write) or by renaming a new one over it
+    uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB;
+    if(inotify_add_watch(watch_fd, PUBKEY_FOLDER, mask) == -1){
+        log("ERROR: inotify_add_watch on " + string(PUBKEY_FOLDER) + " failed");
+        close(watch_fd);
+        return -1;
+    }
+    return watch_fd;
+}
+
+void pubkey_cache_handle_events(int watch_fd){
+    alignas(inotify_event) char events[4096];
+    ssize_t len;
+    while((len = read(watch_fd, events, sizeof(events))) > 0){
+        for(char* ptr = events; ptr < events + len; ptr += sizeof(inotify_event) + ((inotify_event*)ptr)->len){
+            inotify_event* event = (inotify_event*)ptr;
+            if(event->len == 0)
+                continue;
+            string name = event->name;
+            if(name.size() <= pubkey_suffix.size() ||
+                name.compare(name.size() - pubkey_suffix.size(), pubkey_suffix.size(), pubkey_suffix) != 0)
+                continue;
+            int user_id = get_user_id_by_username(name.substr(0, name.size() - pubkey_suffix.size()));
+            if(user_id != -1){
+                pubkey_cache_invalidate(user_id);
+                //The session tickets of the user have been issued to the owner of the previous key
+                renew_user_ticket(user_id);
+            }
+        }
+    }
+}
+
+void pubkey_cache_invalidate(int user_id){
+    if(user_id < 0)
+        return;
+    pubkey_cache_slot* slot = &pubkeys->slots[user_id % PUBKEY_CACHE_SLOTS];
+    lock_slot(slot);
+    slot->invalidations.fetch_add(1, memory_order_relaxed);
+    if(slot->user_id.load(memory_order_relaxed) == user_id){
+        slot->seq.fetch_add(1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        slot->user_id.store(-1, memory_order_relaxed);
+        slot->seq.fetch_add(1, memory_order_release);
+        vlog("Public key of user " + to_string(user_id) + " invalidated");
+    }
+    shared_unlock(&slot->lock);
+}
+
+/**
+ * @brief obtain the serialized key of a user and the fill of the slot it comes from (0 if it was not stored)
+ */
+uint32_t get_serialized(int user_id, uchar* pubkey, uint64_t* fill){
+    if(!valid_user_id(user_id)){
+        log("ERROR: No public key for the invalid user id " + to_string(user_id));
+        return 0;
+    }
+    uint32_t pubkey_len = read_slot(user_id, pubkey, fill);
+    if(pubkey_len != 0)
+        return pubkey_len;
+    return fill_slot(user_id, pubkey, fill);
+}
+
+uint32_t pubkey_cache_get_serialized(int user_id, uchar* pubkey){
+    uint64_t fill;
+    return get_serialized(user_id, pubkey, &fill);
+}
+
+void* pubkey_cache_get_parsed(int user_id){
+    uchar pubkey[PUBKEY_CACHE_MAX_SER];
+    uint64_t fill;
+    uint32_t pubkey_len = get_serialized(user_id, pubkey, &fill);
+    if(pubkey_len == 0)
+        return nullptr;
+    if(parsed_pubkeys.empty())
+        parsed_pubkeys.resize(PUBKEY_CACHE_SLOTS);
+    parsed_pubkey* parsed = &parsed_pubkeys[user_id % PUBKEY_CACHE_SLOTS];
+    if(parsed->pubkey != nullptr && parsed->user_id == user_id && fill != 0 && parsed->fill == fill)
+        return parsed->pubkey;
+    free_pubkey(parsed->pubkey);
+    parsed->pubkey = parse_pubkey(pubkey, pubkey_len);
+    parsed->user_id = user_id;
+    parsed->fill = fill;
+    //The registry selects the kind of identity key of the user
+    if(parsed->pubkey != nullptr && identity_key_type(parsed->pubkey) != get_user_key_type(user_id)){
+        log("ERROR: The public key of user " + to_string(user_id) + " is not of the registered kind");
+        free_pubkey(parsed->pubkey);
+        parsed->pubkey = nullptr;
+    }
+    return parsed->pubkey;
+}
+
+void pubkey_cache_recover(){
+    //The readers of a slot spin on its seqlock even if nobody writes it anymore
+    for(int i = 0; i < PUBKEY_CACHE_SLOTS; i++){
+        lock_slot(&pubkeys->slots[i]);
+        shared_unlock(&pubkeys->slots[i].lock);
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef PUBKEY_CACHE_INCLUDED
+#define PUBKEY_CACHE_INCLUDED
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include "constant.h"
+
+using uchar=unsigned char;
+
+using namespace std;
+
+/*
+* Cache of the public keys of the registered users, shared by the workers.
+* The serialized keys (PEM) live in shared memory, the key of a user is kept in slot user_id % PUBKEY_CACHE_SLOTS.
+* A key enters the cache only after its fingerprint has been checked against the registry, so a hit needs neither
+* the filesystem nor a digest. Every worker keeps its own parsed copy of the keys it used, tagged with the fill of
+* the slot it was parsed from: a parsed key is used again until the slot is filled again.
+* seq: seqlock of the slot, it is odd while a writer is changing it. lock: lock of the writers of the slot, a robust
+* mutex shared among processes
+* invalidations: incremented when the key file of the user of the slot changes, a fill that started before an
+* invalidation is not stored
+* fill: unique id of the content of the slot, 0 is never used
+*/
+struct alignas(64) pubkey_cache_slot {
+    atomic<uint32_t> seq;
+    pthread_mutex_t lock;
+    atomic<uint32_t> invalidations;
+    atomic<int> user_id; //-1 when the slot is empty
+    uint64_t fill;
+    uint32_t pubkey_len;
+    uchar pubkey[PUBKEY_CACHE_MAX_SER];
+};
+
+struct pubkey_cache {
+    atomic<uint64_t> fills;
+    pubkey_cache_slot slots[PUBKEY_CACHE_SLOTS];
+};
+
+/**
+ * @brief create the public key cache in shared memory, before forking the processes that use it
+ * @return 1 on success, 0 on error(s)
+ */
+int pubkey_cache_create();
+
+/**
+ * @brief watch the folder of the public keys for changes (inotify), every worker watches it on its own
+ * @return file descriptor to poll for events, -1 on error(s)
+ */
+int pubkey_cache_watch();
+
+/**
+ * @brief read the pending events of the watch and invalidate the keys and the session tickets of the users whose
+ * key file changed
+ * @param watch_fd file descriptor returned by pubkey_cache_watch
+ */
+void pubkey_cache_handle_events(int watch_fd);
+
+/**
+ * @brief invalidate the cached key of a user
+ */
+void pubkey_cache_invalidate(int user_id);
+
+/**
+ * @brief take over the locks of the slots held by a terminated worker, emptying the slots that it left half written
+ */
+void pubkey_cache_recover();
+
+/**
+ * @brief obtain the serialized public key of a registered user, from the cache or from its key file
+ * @param pubkey output, PUBKEY_CACHE_MAX_SER bytes
+ * @return length of the key, 0 on error(s) (unknown user, missing key file, key that is not the registered one)
+ */
+uint32_t pubkey_cache_get_serialized(int user_id, uchar* pubkey);
+
+/**
+ * @brief obtain the parsed public key of a registered user, to use with verify_sign_parsed_pubkey
+ * @return the key, owned by the cache of this process and valid until the next call, nullptr on error(s)
+ */
+void* pubkey_cache_get_parsed(int user_id);
+
+#endif
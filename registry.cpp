@@ -0,0 +1,126 @@
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include "constant.h"
+#include "util.h"
+#include "crypto.h"
+#include "user_directory.h"
+
+using namespace std;
+
+/*
+* Administration of the registered users of the server, kept in USER_REGISTRY_FILE.
+* Usage: ./registry list
+*        ./registry add <username> <public key file>
+*        ./registry remove <username>
+* A running server applies the changes when its main process receives SIGHUP (kill -HUP <pid>)
+*/
+
+void print_usage(){
+    cout << "Usage: ./registry list" << endl;
+    cout << "       ./registry add <username> <public key file>" << endl;
+    cout << "       ./registry remove <username>" << endl;
+}
+
+/**
+ * @brief look for a user that has not been removed in the registry file
+ * @return the user id, -1 if the user is not registered
+ */
+int find_registered_user(const string& username){
+    uint32_t count;
+    const registry_record* records = registry_get_records(&count);
+    for(uint32_t i = 0; i < count; i++){
+        if(!records[i].removed && strncmp(records[i].username, username.c_str(), MAX_USERNAME_SIZE + 1) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief print the registered users, with the kind and the fingerprint of their public key
+ * @return 0 on success, 1 on error(s)
+ */
+int list_users(){
+    uint32_t count;
+    const registry_record* records = registry_get_records(&count);
+    for(uint32_t i = 0; i < count; i++){
+        if(records[i].removed)
+            continue;
+        printf("%u\t%-*.*s\t%s\t", records[i].user_id, MAX_USERNAME_SIZE, MAX_USERNAME_SIZE, records[i].username,
+            (records[i].key_type == IDENTITY_KEY_ED25519)? "ed25519": "rsa");
+        for(int j = 0; j < FINGERPRINT_SIZE; j++)
+            printf("%02x", records[i].fingerprint[j]);
+        printf("\n");
+    }
+    return 0;
+}
+
+/**
+ * @brief register a user with the public key in pubkey_path
+ * @return 0 on success, 1 on error(s)
+ */
+int add_user(const string& username, const string& pubkey_path){
+    if(find_registered_user(username) != -1){
+        cerr << username << " is already registered" << endl;
+        return 1;
+    }
+    FILE* pubkey_file = fopen(pubkey_path.c_str(), "rb");
+    if(!pubkey_file){
+        cerr << "Cannot open " << pubkey_path << endl;
+        return 1;
+    }
+    uchar fingerprint[FINGERPRINT_SIZE];
+    int key_type;
+    int ret = pubkey_fingerprint_from_file(pubkey_file, fingerprint, &key_type);
+    fclose(pubkey_file);
+    if(!ret)
+        return 1;
+    int user_id = registry_append(username, fingerprint, key_type);
+    if(user_id == -1 || !registry_flush())
+        return 1;
+    cout << "Registered " << username << " with user id " << user_id << endl;
+    return 0;
+}
+
+/**
+ * @brief remove a registered user, its user id is not used again
+ * @return 0 on success, 1 on error(s)
+ */
+int remove_user(const string& username){
+    int user_id = find_registered_user(username);
+    if(user_id == -1){
+        cerr << username << " is not registered" << endl;
+        return 1;
+    }
+    if(!registry_remove(user_id) || !registry_flush())
+        return 1;
+    cout << "Removed " << username << endl;
+    return 0;
+}
+
+int main(int argc, char* argv[]){
+    string command = (argc > 1)? argv[1]: "";
+    if(!((command == "list" && argc == 2) || (command == "add" && argc == 4) || (command == "remove" && argc == 3))){
+        print_usage();
+        return 1;
+    }
+    if(!registry_open(USER_REGISTRY_FILE, true))
+        return 1;
+    if(!registry_lock()){
+        registry_close();
+        return 1;
+    }
+    int ret;
+    if(command == "list")
+        ret = list_users();
+    else if(command == "add")
+        ret = add_user(argv[2], argv[3]);
+    else
+        ret = remove_user(argv[2]);
+    registry_unlock();
+    registry_close();
+    if(ret == 0 && command != "list")
+        cout << "Send SIGHUP to the main process of a running server to apply the change" << endl;
+    return ret;
+}
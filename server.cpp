@@ -10,19 +10,29 @@
 #include <vector>
 #include <limits.h>
 #include <sys/mman.h>
-#include <semaphore.h>
 #include <sys/wait.h>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
 #include <openssl/rand.h>
 #include <openssl/x509_vfy.h>
-#include <sys/msg.h>
-#include <sys/ipc.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <signal.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <atomic>
+#include <sys/eventfd.h>
+#include <dirent.h>
+#include <algorithm>
+#include <deque>
+#include <time.h>
 #include "constant.h"
 #include "util.h"
 #include "crypto.h"
+#include "user_directory.h"
+#include "pubkey_cache.h"
+#include "session_ticket.h"
 
 using namespace std;
 using uchar=unsigned char;
@@ -30,44 +40,157 @@ typedef void (*sighandler_t)(int);
 
 
 
+struct msg_to_relay{
+    char buffer[RELAY_MSG_SIZE];
+};
+
+/*
+* State of a handshake in progress: the bytes of the message that is being received and what the server keeps from M1
+* and M2 until M3 arrives. The socket is never read with blocking calls, a slow client does not hold the worker.
+* deadline: time (ms of CLOCK_MONOTONIC) after which the connection is closed if the handshake is not over
+* eph_privkey, eph_pubkey: ephemeral key pair of the server, the public key is sent in M2
+* job: job of the crypto pool that the handshake waits for, nullptr if the handshake waits for the client
+*/
+struct handshake {
+    uint64_t deadline;
+    uchar R1[NONCE_SIZE];
+    uchar R2[NONCE_SIZE];
+    uint8_t offered_caps = 0;
+    int user_id = -1;
+    void* eph_privkey = nullptr;
+    uchar* eph_pubkey = nullptr;
+    uint eph_pubkey_len = 0;
+    crypto_job* job = nullptr;
+    uchar buffer[HANDSHAKE_BUFFER_SIZE];
+    uint buffer_len = 0;
+};
+
 /*
-* socket_id: if equal to -1 the user is not connected to the service
+* Per-connection state owned by the event loop (it replaces the globals of the old per-client process)
+* state: CONN_WAIT_M1 and CONN_WAIT_M3 during the handshake, then CONN_READY, or CONN_WAIT_CHAT_REPLY while a chat
+* request of the user waits for the answer of chat_peer_id
 */
-struct user_info {
-    string username;
-    int socket_id; 
-    int busy =0;
+struct connection {
+    int socket_id;
+    int user_id = -1;
+    int state = CONN_WAIT_M1;
+    handshake* hs = nullptr; //until the end of the handshake
+    int chat_peer_id = -1;
+    uchar* session_key = nullptr;
+    uint32_t session_key_len = 0;
+    void* session = nullptr; //authenticated encryption contexts of session_key
+    uint8_t caps = 0; //capabilities negotiated in the handshake
+    uint32_t send_counter = 0;
+    uint32_t receive_counter = 0;
+    uchar* parked_relay = nullptr; //record that did not fit in a full relay ring, the client is not read until it is relayed
+    uint parked_relay_len = 0;
+    uint parked_relay_to = 0;
+    uchar* recv_buffer = nullptr; //RECV_BUFFER_SIZE bytes received from the client, not yet handled
+    uint recv_buffer_len = 0;
+    vector<uchar> send_queue; //bytes that the socket (not blocking) has not accepted yet, sent when it becomes writable
+    uint send_queue_sent = 0; //bytes at the start of send_queue already sent
 };
 
+/*
+* Relay ring of a worker, placed in shared memory: every worker can write in it (multi producer), only its owner reads it.
+* Records have variable length and are never split: when a record does not fit at the end of data a padding record fills
+* the rest. A producer reserves space by moving tail with a CAS and publishes the record by storing its len (0 means not
+* published yet), the consumer zeroes the records it has delivered and releases their space by moving head.
+* sleeping: set by the consumer before waiting in epoll, a producer that clears it writes the eventfd of the ring
+* blocked_producers: bitmask of the workers that found the ring full, they are woken up when the consumer frees space
+* reservations: reservation in progress of every producer. A producer that dies between its CAS and the publication of
+* len would stop the consumer for good: the main process turns its reservation into an abandoned one, that the consumer
+* skips as padding (relay_ring_recover)
+*/
+struct relay_record {
+    atomic<uint32_t> len;
+    uint32_t to_user_id;
+};
 
-struct msg_to_relay{
-    long type;
-    char buffer[RELAY_MSG_SIZE];
+/*
+* Space that a producer reserves in a ring: pad bytes of padding at start (0 if the record fits before the end of the ring)
+* followed by the record_size bytes of the record
+*/
+struct relay_reservation {
+    atomic<uint32_t> state;
+    uint32_t pad;
+    uint64_t start;
+    uint64_t record_size;
+};
+
+struct relay_ring {
+    alignas(64) atomic<uint64_t> tail;
+    atomic<uint32_t> blocked_producers;
+    alignas(64) atomic<uint64_t> head;
+    atomic<uint32_t> sleeping;
+    int eventfd;
+    alignas(64) relay_reservation reservations[SERVER_WORKERS];
+    alignas(64) uchar data[RELAY_RING_SIZE];
 };
+static_assert(atomic<uint64_t>::is_always_lock_free, "relay rings need lock free atomics to be shared among processes");
+static_assert(SERVER_WORKERS <= 32, "blocked_producers has one bit for each worker");
+static_assert(RECV_BUFFER_SIZE >= 2 * (sizeof(uint32_t) + EVP_MAX_IV_LENGTH + TAG_DEFAULT + RELAY_MSG_SIZE),
+    "the receive buffer of a connection has to hold a record and part of the following one");
+
+//Space used in the ring by a record of msg_len bytes (records are 8 bytes aligned)
+#define RELAY_RECORD_SIZE(msg_len) ((sizeof(relay_record) + (uint64_t)(msg_len) + 7) & ~(uint64_t)7)
 
 //---------------- GLOBAL VARIABLES ------------------//
-int client_user_id;
-int comm_socket_id;
 msg_to_relay relay_msg;
 
+//Connections handled by the event loop of this worker, indexed by socket id
+vector<connection*> connections;
+//Socket ids and deadlines of the handshakes in progress, in order of deadline (entries of finished handshakes are skipped)
+deque<pair<int, uint64_t>> handshake_deadlines;
+uint handshakes_in_progress = 0;
+int epoll_fd;
+int worker_id = -1;
+pid_t workers[SERVER_WORKERS];
+
+//Sockets of the connections with a parked relay
+vector<int> parked_connections;
+
+//Connections closed by this worker since the last log of the statistics of its pools, and when the next log is due (ms)
+uint64_t closed_since_stats = 0;
+uint64_t next_stats_log = 0;
+
+//Set by SIGHUP in the main process: users have been added to or removed from the registry file
+volatile sig_atomic_t registry_changed = 0;
+
+//Buffer where send_secure builds the records of this worker, it only grows
+uchar* record_buffer = nullptr;
+uint record_buffer_size = 0;
+
+#ifdef SEND_SELF_CHECK
+//Records sent by this worker that have been decrypted again before the send, and how many of them did not match
+uint64_t self_checked_records = 0;
+uint64_t self_check_failures = 0;
+#endif
+
 //Parameters of connection
 const char *srv_ipv4 = "127.0.0.1";
 const int srv_port = 4242;
 void* server_privk;
-
-uchar* session_key;
-uint32_t session_key_len;
-
-//Handling mutual exclusion for accessing the user datastore
-const char* sem_user_store_name = "/user_store";
-const char* message_queue_name = "/user_message_queue";
+//Certificate of the server (DER), serialized once at startup and sent in every handshake
+uchar* server_certificate = nullptr;
+uint server_certificate_len = 0;
+//Batching of the verifications of M3 in the crypto pools of the workers, set by the command line
+uint verify_batch_size = CRYPTO_VERIFY_BATCH_SIZE;
+uint verify_batch_delay = CRYPTO_VERIFY_BATCH_DELAY;
+//Key of the HMAC of the cookies, generated at startup before the workers are forked
+uchar cookie_secret[COOKIE_SECRET_SIZE];
+//Set while too many clients wait in the accept queue: a new client has to echo a cookie before the handshake
+bool cookie_mode = (COOKIE_QUEUE_THRESHOLD == 0);
 
 void* create_shared_memory(ssize_t size);
 
-//Shared memory for storing data of users
-void* shmem = create_shared_memory(sizeof(user_info)*REGISTERED_USERS);
-int send_secure(int comm_socket_id, uchar* pt, uint pt_len);
-int recv_secure(int comm_socket_id, unsigned char** plaintext);
+//Shared memory for the relay rings, one for each worker
+relay_ring* relay_rings = (relay_ring*)create_shared_memory(sizeof(relay_ring)*SERVER_WORKERS);
+int send_secure(connection* conn, uchar* pt, uint pt_len);
+int recv_secure(connection* conn, uint offset, unsigned char** plaintext, uint* record_len);
+int handle_buffered_records(connection* conn);
+int update_connection_events(connection* conn);
+void close_connection(connection* conn);
     
 void* create_shared_memory(ssize_t size){
     int protection = PROT_READ | PROT_WRITE; //Processes can read/write the contents of the memory
@@ -80,1116 +203,1304 @@ void* create_shared_memory(ssize_t size){
 // FUNCTIONS for accessing to the USER DATASTORE
 // ---------------------------------------------------------------------
 
-
 /**
- * @brief prologue for granting mutual exclusion by using named semaphore sem_id
- * @return -1 in case of errors, 0 otherwise
+ * @brief fill a new registry with the users that have a public key in the certification folder, in alphabetical order
+ * @return 0 in case of errors, 1 in case of success
  */
-int sem_prologue(sem_t* sem_id){
-    vlog("sem_enter");
-    if(sem_id == nullptr){
-        log("sem_prologue: nullptr found");    
-        return -1;
-    }
-    if(sem_id == SEM_FAILED){
-        log("SEM_FAILED");
-        return -1;
+int seed_user_registry(){
+    DIR* certification = opendir("certification");
+    if(!certification){
+        log("ERROR: cannot open the certification folder");
+        return 0;
     }
-    if(-1 == sem_wait(sem_id)){
-        log("ERROR on sem_wait");
-        return -1;
+    const string suffix = "_pubkey.pem";
+    vector<string> usernames;
+    struct dirent* entry;
+    while((entry = readdir(certification)) != nullptr){
+        string file_name = entry->d_name;
+        if(file_name.length() > suffix.length() && file_name.length() - suffix.length() <= MAX_USERNAME_SIZE &&
+            file_name.compare(file_name.length() - suffix.length(), suffix.length(), suffix) == 0)
+            usernames.push_back(file_name.substr(0, file_name.length() - suffix.length()));
+    }
+    closedir(certification);
+    sort(usernames.begin(), usernames.end());
+
+    for(size_t i=0; i < usernames.size(); i++){
+        uchar fingerprint[FINGERPRINT_SIZE];
+        int key_type;
+        FILE* pubkey_file = fopen(("certification/" + usernames[i] + suffix).c_str(), "rb");
+        if(!pubkey_file)
+            return 0;
+        int ret = pubkey_fingerprint_from_file(pubkey_file, fingerprint, &key_type);
+        fclose(pubkey_file);
+        if(!ret || registry_append(usernames[i], fingerprint, key_type) == -1)
+            return 0;
+        log("Registered user " + usernames[i]);
     }
-    return 0;
+    return registry_flush();
 }
 
 /**
- * @brief epilogue for granting mutual exclusion by using named semaphore sem_id
- * @return -1 in case of errors, 0 otherwise
+ * @brief initialize content of user datastore from the registry file, that is created at the first start
+ * @return 0 in case of errors, 1 in case of success
  */
-int sem_epilogue(sem_t* sem_id){
-    vlog("sem_exit");
-    if(sem_id == nullptr){
-        log("sem_epilogue: nullptr found");    
-        return -1;
-    }
-    if(-1 == sem_post(sem_id)){
-        log("ERROR on sem_exit");
-        return -1;
-    }
-    if(-1 == sem_close(sem_id)){
-        log("ERROR on sem_close");
-        return -1;
+int initialize_user_info(){
+    if(!registry_open(USER_REGISTRY_FILE, true))
+        return 0;
+    uint32_t registered;
+    registry_get_records(&registered);
+    if(registered == 0){
+        if(!registry_lock())
+            return 0;
+        int ret = seed_user_registry();
+        registry_unlock();
+        if(!ret)
+            return 0;
     }
-    return 0;
+    if(!user_directory_load())
+        return 0;
+    registry_get_records(&registered);
+    log("Loaded " + to_string(registered) + " registered users");
+    return 1;
+}
+
+/**
+ * @brief signal handler of SIGHUP: the registry file has been changed
+ */
+void registry_changed_handler(int sig){
+    registry_changed = 1;
 }
 
 
+// ---------------------------------------------------------------------
+// FUNCTIONS of RELAY BETWEEN CONNECTIONS
+// ---------------------------------------------------------------------
 
 /**
- * @brief test socket of communication in the user data store
- * @return return -1 in case the user is offline, -2 in case of errors, the socket_id otherwise
+ * @brief obtain the connection of an online user owned by this worker
+ * @return the connection, nullptr in case the user is offline, owned by another worker or in case of errors
  */
-int get_user_socket_by_user_id(int user_id){
-    if(user_id < 0 || user_id >= REGISTERED_USERS){
-        log("ERROR: Invalid user id");
-        return -2;
-    }
-    sem_t* sem_id= sem_open(sem_user_store_name, O_CREAT, 0600, 1);
-    if(-1 == sem_prologue(sem_id)){
-        log("ERROR on sem_prologue");
-        return -2;
-    }
-    
-    user_info* user_status = (user_info*)shmem;
-    int socket_id = user_status[user_id].socket_id;
-
-    if(-1 == sem_epilogue(sem_id)){
-        log("ERROR on sem_epilogue");
-        return -2;
-    }
+connection* get_connection_by_user_id(int user_id){
+    if(get_user_worker_by_user_id(user_id) != worker_id)
+        return nullptr;
+    int socket_id = get_user_socket_by_user_id(user_id);
+    if(socket_id < 0 || (size_t)socket_id >= connections.size())
+        return nullptr;
+    connection* conn = connections[socket_id];
+    if(conn == nullptr || conn->user_id != user_id)
+        return nullptr;
+    return conn;
+}
 
-    return socket_id;
+#ifdef RELAY_TIMESTAMPS
+/**
+ * @brief write the current time in a stamp of the trailer of a relayed chat message, the other messages have no trailer
+ * @param msg: relayed message, opcode first and trailer last
+ * @param msg_len: length of the message, trailer included
+ * @param stage: RELAY_STAMP_INGRESS, RELAY_STAMP_ENQUEUE, RELAY_STAMP_DEQUEUE or RELAY_STAMP_EGRESS
+ */
+void relay_stamp(uchar* msg, uint msg_len, int stage){
+    if(msg[0] != CHAT_RESPONSE || msg_len < 5 + RELAY_STAMPS_SIZE)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t stamp = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    memcpy(msg + msg_len - RELAY_STAMPS_SIZE + stage * sizeof(uint64_t), &stamp, sizeof(uint64_t));
 }
+#endif
 
 /**
- * @brief test if the user is buidi in a chat request
- * 
- * @param user_id 
- * @return int 0 if busy, 1 if free, -1 on error(s)
+ * @brief forward to the client of conn a message relayed by another user (it takes the place of the old SIGALRM handler).
+ * A CHAT_POS/CHAT_NEG that arrives while the connection waits for the answer to its chat request completes the request.
+ * @param msg: relayed record, it can be modified
+ * @param msg_len: length of the relayed record
+ * @return 0 in case of success, -1 in case of errors
  */
-int test_user_busy_by_user_id(int user_id){
-    
-    if(user_id < 0 || user_id >= REGISTERED_USERS){
-        log("ERROR: Invalid user id");
+int deliver_relay(connection* conn, uchar* msg, uint msg_len){
+    int ret;
+    uint8_t opcode = msg[0];
+    uint send_len;
+    log("Found request to relay with opcode: " + to_string(opcode));
+    if(msg_len < 5){
+        log("ERROR: relayed record too short");
         return -1;
     }
-    sem_t* sem_id= sem_open(sem_user_store_name, O_CREAT, 0600, 1);
-    if(-1 == sem_prologue(sem_id)){
-        log("ERROR on sem_prologue");
-        return -1;
+
+    if(conn->state == CONN_WAIT_CHAT_REPLY && (opcode == CHAT_POS || opcode == CHAT_NEG)){
+        // Send reply of the peer to the client
+        send_len = (opcode == CHAT_NEG)? 5: 5 + PUBKEY_DEFAULT_SER;
+        if(send_len > msg_len){
+            log("ERROR: invalid length of relayed chat reply");
+            return -1;
+        }
+        memcpy((void*)(msg + 1), (void*)&conn->chat_peer_id, sizeof(int));
+        conn->state = CONN_READY;
+        conn->chat_peer_id = -1;
+
+        ret = send_secure(conn, msg, send_len);
+        if(ret == 0){
+            errorHandler(SEND_ERR);
+            return -1;
+        }
+        if(-1 == set_user_busy_by_user_id(conn->user_id, 0)){
+            log("ERROR: setting user busy while e ending requesting to chat \n");
+            return -1;
+        }
+        return 0;
     }
-    
-    user_info* user_status = (user_info*)shmem;
-    int ret=user_status[user_id].busy;
-    if(-1 == sem_epilogue(sem_id)){
-        log("ERROR on sem_epilogue");
-        return -1;
+
+    if(opcode == CHAT_CMD) {
+        uint username_length, username_length_net;
+        if(msg_len < 9){
+            log("ERROR: relayed record too short");
+            return -1;
+        }
+        memcpy(&username_length_net, (void*)(msg + 5), sizeof(int));
+        username_length = ntohl(username_length_net);
+        vlog("USERNAME LENGTH: " + to_string(username_length));
+        
+        if(username_length > MAX_USERNAME_SIZE){
+            log("ERROR: invalid username length");
+            return -1;
+        }
+        send_len = 9 + username_length + PUBKEY_DEFAULT_SER;
+        if(send_len > msg_len){
+            log("ERROR: invalid length of relayed chat request");
+            return -1;
+        }
+
+        // Send reply of the peer to the client
+        ret = send_secure(conn, msg, send_len);
+        if(ret == 0){
+            log("ERROR on send_secure");
+            return -1;
+        }       
+
+    } else if(opcode == AUTH || opcode == CHAT_RESPONSE){
+        memcpy(&send_len, msg + 1, sizeof(int)); //Added len field
+        if(send_len < 1 || send_len > msg_len - 4){
+            log("ERROR: invalid msg_len");
+            return -1;
+        }
+
+        uchar* msg_to_send = secure_buffer_alloc(send_len);
+        if(!msg_to_send){
+            log("ERROR on malloc");
+            return -1;
+        }
+
+        msg_to_send[0] = opcode;
+        memcpy(msg_to_send + 1, msg + 5, send_len - 1);
+#ifdef RELAY_TIMESTAMPS
+        relay_stamp(msg_to_send, send_len, RELAY_STAMP_EGRESS);
+#endif
+
+        ret = send_secure(conn, (uchar*)msg_to_send, send_len);
+        secure_buffer_free(msg_to_send);
+        if(ret == 0){
+            log("ERROR on send_secure");
+            return -1;
+        }       
+
+    } else if(opcode == STOP_CHAT || opcode == CHAT_NEG){
+        send_len = 5;
+
+        // Send reply of the peer to the client
+        ret = send_secure(conn, msg, send_len);
+        if(ret == 0){
+            log("ERROR on send_secure");
+            return -1;
+        }       
+    } else {
+        log("OPCODE not recognized (" + to_string(opcode) + ")");
     }
-    return !ret;
+    return 0;
 }
 
 /**
- * @brief set the user busy flag
- * 
- * @param user_id 
- * @param busy 
- * @return 1 on succes, -1 on error 
+ * @brief deliver a relayed record to the connection of to_user_id, which must be owned by this worker. If the delivery
+ * fails the connection of the recipient is shut down, the event loop will then close it
+ * @return 0 in case of success, -1 in case of error
  */
-int set_user_busy_by_user_id(int user_id, int busy){
-    
-    if(user_id < 0 || user_id >= REGISTERED_USERS){
-        log("ERROR: Invalid user id");
-        return -1;
-    }
-    sem_t* sem_id= sem_open(sem_user_store_name, O_CREAT, 0600, 1);
-    if(-1 == sem_prologue(sem_id)){
-        log("ERROR on sem_prologue");
+int deliver_to_user(uint to_user_id, uchar* msg, uint msg_len){
+#ifdef RELAY_TIMESTAMPS
+    relay_stamp(msg, msg_len, RELAY_STAMP_DEQUEUE);
+#endif
+    connection* conn = get_connection_by_user_id(to_user_id);
+    if(!conn){
+        log("relay: user " + to_string(to_user_id) + " is offline");
         return -1;
     }
-    
-    user_info* user_status = (user_info*)shmem;
-    user_status[user_id].busy=busy;
-    if(-1 == sem_epilogue(sem_id)){
-        log("ERROR on sem_epilogue");
+    if(-1 == deliver_relay(conn, msg, msg_len)){
+        log("ERROR on deliver_relay, closing connection of user " + to_string(to_user_id));
+        shutdown(conn->socket_id, SHUT_RDWR);
         return -1;
     }
-    return 1;
+    return 0;
 }
 
-
-
 /**
- * @brief test socket of communication in the user data store
- * @return return -1 in case of errors, 0 otherwise
+ * @brief tell the consumer of the ring that it has records (or space) to look at
  */
-int set_user_socket(string username, int socket){
-    if(socket < -1){ //Sanitization (-1 indicate that the user will be offline)
-        log("SOCKET fd invalid"); //since file descriptors can have only values >= 0
-        return -1;
-    }
-    sem_t* sem_id= sem_open(sem_user_store_name, O_CREAT, 0600, 1);
-    if(-1 == sem_prologue(sem_id)){
-        log("ERROR on sem_prologue");
-        return -1;
-    }
+void relay_ring_wake(relay_ring* ring){
+    uint64_t one = 1;
+    if(-1 == write(ring->eventfd, &one, sizeof(one)) && errno != EAGAIN)
+        log("ERROR on write of the relay eventfd");
+}
 
-    user_info* user_status = (user_info*)shmem;
-    int found = 0;
-    for(int i=0; i<REGISTERED_USERS; i++){
-        if(user_status[i].username.compare(username) == 0){
-            user_status[i].socket_id = socket;
-            if(socket==-1)
-                vlog("\n\n***** logout of client " +username+" *****\n\n");
-            vlog("Set socket of " + username + " correctly");
-            found = 1;
-            break;
+/**
+ * @brief append a record for to_user_id to the relay ring of a worker, it never blocks
+ * @return 0 in case of success, RELAY_RING_FULL if there is not enough free space in the ring, -1 in case of errors
+ */
+int relay_ring_push(relay_ring* ring, uint to_user_id, uchar* msg, uint msg_len){
+    if(ring == nullptr || msg == nullptr || msg_len == 0 || msg_len > RELAY_MSG_SIZE){
+        log("ERROR invalid parameters on relay_ring_push");
+        return -1;
+    }
+    uint64_t record_size = RELAY_RECORD_SIZE(msg_len);
+    uint64_t tail = ring->tail.load(memory_order_relaxed);
+    uint64_t offset, pad;
+    bool blocked = false;
+    relay_reservation* reservation = &ring->reservations[worker_id];
+
+    //Reserve the space of the record (and of the padding at the end of the ring, if needed)
+    while(true){
+        uint64_t head = ring->head.load(memory_order_acquire);
+        offset = tail % RELAY_RING_SIZE;
+        pad = (RELAY_RING_SIZE - offset < record_size)? RELAY_RING_SIZE - offset: 0;
+        if(tail + pad + record_size - head > RELAY_RING_SIZE){
+            if(blocked){
+                reservation->state.store(RELAY_RESERVATION_NONE, memory_order_relaxed);
+                return RELAY_RING_FULL;
+            }
+            //Ask to be woken up when there is space, then check again: the consumer may have freed it in the meantime
+            ring->blocked_producers.fetch_or(1u << worker_id, memory_order_seq_cst);
+            blocked = true;
+            tail = ring->tail.load(memory_order_relaxed);
+            continue;
         }
+        //The space is described before it is taken, the main process finds it if this worker dies in the middle
+        reservation->start = tail;
+        reservation->pad = pad;
+        reservation->record_size = record_size;
+        reservation->state.store(RELAY_RESERVATION_PENDING, memory_order_release);
+        if(ring->tail.compare_exchange_weak(tail, tail + pad + record_size, memory_order_release, memory_order_relaxed))
+            break;
     }
-    if(-1 == sem_epilogue(sem_id)){
-        log("ERROR on sem_epilogue");
-        return -1;
+    reservation->state.store(RELAY_RESERVATION_TAKEN, memory_order_release);
+
+    if(pad != 0){
+        relay_record* pad_record = (relay_record*)(ring->data + offset);
+        pad_record->len.store(RELAY_RECORD_PAD | (uint32_t)pad, memory_order_release);
+        offset = 0;
     }
-    return found;
-}
 
+    relay_record* record = (relay_record*)(ring->data + offset);
+    record->to_user_id = to_user_id;
+    memcpy((void*)(record + 1), msg, msg_len);
+    record->len.store(msg_len, memory_order_release);
+    reservation->state.store(RELAY_RESERVATION_NONE, memory_order_release);
+
+    //The system call is paid only if the consumer is (going to be) waiting in epoll
+    atomic_thread_fence(memory_order_seq_cst);
+    if(ring->sleeping.exchange(0, memory_order_seq_cst))
+        relay_ring_wake(ring);
+    return 0;
+}
 
 /**
- * @brief prints content of user datastore for debugging purposes
+ * @brief prepare the consumer of the ring to wait in epoll
+ * @return 1 if there are already records to deliver (the consumer must not wait), 0 otherwise
  */
-void print_user_data_store(){
-    sem_t* sem_id= sem_open(sem_user_store_name, O_CREAT, 0600, 1);
-    if(-1 == sem_prologue(sem_id)){
-        log("ERROR on sem_prologue");
-        return;
-    }
-    
-    user_info* user_status = (user_info*)shmem;
-    cout << "\n\n****** USER STATUS *******\n\n" << endl;
-    for(int i=0; i<REGISTERED_USERS; i++){
-        cout << "[" << i << "] " << user_status[i].username << " | " << user_status[i].socket_id << " | " << " | "  << ((user_status[i].socket_id==-1)?"offline":"online") << endl;
-    }
-    cout << "\n\n**************************\n\n" << endl;
+int relay_ring_sleep(relay_ring* ring){
+    ring->sleeping.store(1, memory_order_seq_cst);
+    atomic_thread_fence(memory_order_seq_cst);
+    relay_record* record = (relay_record*)(ring->data + ring->head.load(memory_order_relaxed) % RELAY_RING_SIZE);
+    return record->len.load(memory_order_acquire) != 0;
+}
 
-    if(-1 == sem_epilogue(sem_id)){
-        log("ERROR on sem_epilogue");
-        return;
+/**
+ * @brief look for an abandoned reservation at head, the consumer skips its space as padding. The reservations already
+ * passed by head (their records were published before the producer died) are dropped
+ * @return RELAY_RECORD_PAD with the bytes to skip, 0 if no abandoned reservation starts at head
+ */
+uint32_t relay_ring_abandoned(relay_ring* ring, uint64_t head){
+    for(int i = 0; i < SERVER_WORKERS; i++){
+        relay_reservation* reservation = &ring->reservations[i];
+        if(reservation->state.load(memory_order_acquire) != RELAY_RESERVATION_ABANDONED)
+            continue;
+        uint64_t record_start = reservation->start + reservation->pad;
+        if(head == reservation->start && reservation->pad != 0)
+            return RELAY_RECORD_PAD | reservation->pad;
+        if(head == record_start){
+            reservation->state.store(RELAY_RESERVATION_NONE, memory_order_relaxed);
+            log("Skipped a relay record abandoned by worker " + to_string(i));
+            return RELAY_RECORD_PAD | (uint32_t)reservation->record_size;
+        }
+        if(head > record_start)
+            reservation->state.store(RELAY_RESERVATION_NONE, memory_order_relaxed);
     }
+    return 0;
 }
 
 /**
- * @brief obtain a copy of the user datastore
- * @return the copy of the user datastore, nullptr in case of errors
+ * @brief deliver all the records published in the relay ring of this worker
+ * @return number of records found in the ring
  */
-user_info* get_user_datastore_copy(){
-    sem_t* sem_id= sem_open(sem_user_store_name, O_CREAT, 0600, 1);
-    if(-1 == sem_prologue(sem_id)){
-        log("ERROR on sem_prologue");
-        return nullptr;
-    }
-    int ret;
-    char buf;
-    //Obtain a copy of the user datastore    
-    user_info* user_status = (user_info*)malloc(REGISTERED_USERS*sizeof(user_info));
-    if(!user_status){
-        log("ERROR on malloc");
-        return nullptr;
-    }
-    memcpy(user_status, shmem, REGISTERED_USERS*sizeof(user_info));
+int relay_ring_drain(relay_ring* ring){
+    int records = 0;
+    uint64_t head = ring->head.load(memory_order_relaxed);
+    uint64_t first_head = head;
+    while(true){
+        relay_record* record = (relay_record*)(ring->data + head % RELAY_RING_SIZE);
+        uint32_t len = record->len.load(memory_order_acquire);
+        if(len == 0)
+            len = relay_ring_abandoned(ring, head);
+        if(len == 0)
+            break;
 
-    if(-1 == sem_epilogue(sem_id)){
-        log("ERROR on sem_epilogue");
-        return nullptr;
+        uint64_t record_size;
+        if(len & RELAY_RECORD_PAD){
+            record_size = len & ~RELAY_RECORD_PAD;
+        } else {
+            record_size = RELAY_RECORD_SIZE(len);
+            deliver_to_user(record->to_user_id, (uchar*)(record + 1), len);
+            records++;
+        }
+
+        //Space must be zeroed before giving it back, a producer will find there the len of a future record
+        memset((void*)(record + 1), 0, record_size - sizeof(relay_record));
+        record->to_user_id = 0;
+        record->len.store(0, memory_order_relaxed);
+        head += record_size;
+        ring->head.store(head, memory_order_release);
+    }
+
+    //Workers that are waiting for space in this ring can retry their parked relays
+    atomic_thread_fence(memory_order_seq_cst);
+    if(head != first_head && ring->blocked_producers.load(memory_order_relaxed) != 0){
+        uint32_t blocked = ring->blocked_producers.exchange(0, memory_order_seq_cst);
+        for(int i = 0; i < SERVER_WORKERS; i++){
+            if(blocked & (1u << i))
+                relay_ring_wake(&relay_rings[i]);
+        }
     }
-    return user_status;
+    return records;
 }
 
-
 /**
- * @brief initialize content of user datastore which is used to simulate a database
- * @return 0 in case of errors, 1 in case of success
+ * @brief called by the main process once a worker is dead and has been given time to finish what the other workers were
+ * relaying to it. The reservations that the dead worker left in the rings of the others become abandoned, so that their
+ * consumers skip them, and the ring of the dead worker is emptied for the worker that replaces it.
+ * A reservation still PENDING is the dead worker's only if tail has moved past its start and nobody published a record
+ * there in the meantime: a live producer that reserved the same start in the last instants would not be told apart
+ * @param dead_worker_id worker that has terminated
  */
-int initialize_user_info(user_info* user_status){
-    if(user_status == nullptr){
-        return 0;
+void relay_ring_recover(int dead_worker_id){
+    for(int i = 0; i < SERVER_WORKERS; i++){
+        relay_ring* ring = &relay_rings[i];
+        relay_reservation* reservation = &ring->reservations[dead_worker_id];
+        uint32_t state = reservation->state.load(memory_order_acquire);
+        if(i == dead_worker_id || state == RELAY_RESERVATION_NONE)
+            continue;
+        if(state == RELAY_RESERVATION_PENDING){
+            relay_record* record = (relay_record*)(ring->data + reservation->start % RELAY_RING_SIZE);
+            if(ring->tail.load(memory_order_acquire) <= reservation->start ||
+                ring->head.load(memory_order_acquire) > reservation->start || record->len.load(memory_order_acquire) != 0){
+                reservation->state.store(RELAY_RESERVATION_NONE, memory_order_relaxed);
+                continue;
+            }
+        }
+        reservation->state.store(RELAY_RESERVATION_ABANDONED, memory_order_release);
+        log("Relay ring of worker " + to_string(i) + " has a record abandoned by worker " + to_string(dead_worker_id));
+        relay_ring_wake(ring);
+    }
+
+    //The users of the dead worker have been logged out: the records left in its ring have no recipient anymore
+    relay_ring* ring = &relay_rings[dead_worker_id];
+    memset(ring->data, 0, RELAY_RING_SIZE);
+    for(int i = 0; i < SERVER_WORKERS; i++)
+        ring->reservations[i].state.store(RELAY_RESERVATION_NONE, memory_order_relaxed);
+    ring->head.store(0, memory_order_relaxed);
+    ring->sleeping.store(0, memory_order_relaxed);
+    ring->blocked_producers.store(0, memory_order_relaxed);
+    ring->tail.store(0, memory_order_release);
+    //The workers blocked on the ring retry their parked relays, that are released since the recipients are offline
+    for(int i = 0; i < SERVER_WORKERS; i++){
+        if(i != dead_worker_id)
+            relay_ring_wake(&relay_rings[i]);
     }
-    vector<string> usernames {"alice", "bob", "charlie", "dave", "ethan"};
+}
 
-    for(int i=0; i < REGISTERED_USERS; i++){
-        user_status[i].username = usernames[i];
-        user_status[i].socket_id = -1;
+/** 
+ *  Send message to the connection of to_user_id: directly if the connection is owned by this worker, through the relay ring
+ *  of the owner otherwise
+ *  @return 0 in case of success, RELAY_RING_FULL if the ring of the owner has no space for the message, -1 in case of error
+ */
+int relay_write(uint to_user_id, msg_to_relay& msg, uint msg_len){
+    if(!valid_user_id(to_user_id) || msg_len > RELAY_MSG_SIZE)
+        return -1;
+    
+    vlog("Entering relay_write for " + to_string(to_user_id));
+    int owner = get_user_worker_by_user_id(to_user_id);
+    if(owner < 0 || owner >= SERVER_WORKERS){
+        log("relay_write: user " + to_string(to_user_id) + " is offline");
+        return -1;
     }
+#ifdef RELAY_TIMESTAMPS
+    relay_stamp((uchar*)msg.buffer, msg_len, RELAY_STAMP_ENQUEUE);
+#endif
+    if(owner == worker_id)
+        return deliver_to_user(to_user_id, (uchar*)msg.buffer, msg_len);
 
-    return 1;
+    int ret = relay_ring_push(&relay_rings[owner], to_user_id, (uchar*)msg.buffer, msg_len);
+    if(ret == RELAY_RING_FULL)
+        log("relay_write: relay ring of worker " + to_string(owner) + " is full");
+    return ret;
 }
 
-
-int get_user_id_by_username(string username){
-    vlog("Entering get id by username");
-    if(username.empty()){
-        log("INVALID usernam on get_user_id_by_username");
+/**
+ * @brief keep a message that found the relay ring full and stop reading from the client until the message is relayed
+ * @return 0 in case of success, -1 in case of errors
+ */
+int park_relay(connection* conn, uint to_user_id, msg_to_relay& msg, uint msg_len){
+    if(conn == nullptr || conn->parked_relay != nullptr || msg_len > RELAY_MSG_SIZE){
+        log("ERROR invalid parameters on park_relay");
         return -1;
     }
-    sem_t* sem_id= sem_open(sem_user_store_name, O_CREAT, 0600, 1);
-    if(-1 == sem_prologue(sem_id)){
-        log("ERROR on sem_prologue");
+    conn->parked_relay = secure_buffer_alloc(msg_len);
+    if(!conn->parked_relay){
+        errorHandler(MALLOC_ERR);
         return -1;
     }
-    
-    int ret = -1;
-    user_info* user_status = (user_info*)shmem;
-    for(int i=0; i<REGISTERED_USERS; i++){
-        if(user_status[i].username.compare(username) == 0){
-            vlog("Found username " + username + " in the datastore with user_id " + to_string(i));
-            ret = i;
-            break;
+    memcpy(conn->parked_relay, msg.buffer, msg_len);
+    conn->parked_relay_len = msg_len;
+    conn->parked_relay_to = to_user_id;
+    if(-1 == update_connection_events(conn))
+        return -1;
+    parked_connections.push_back(conn->socket_id);
+    vlog("Relay parked for user " + to_string(conn->user_id));
+    return 0;
+}
+
+/**
+ * @brief try again to relay the parked messages, the clients whose message is relayed are read again
+ */
+void retry_parked_relays(){
+    vector<int> resumed;
+    for(size_t i = 0; i < parked_connections.size();){
+        int socket_id = parked_connections[i];
+        connection* conn = ((size_t)socket_id < connections.size())? connections[socket_id]: nullptr;
+        if(conn != nullptr && conn->parked_relay != nullptr){
+            int owner = get_user_worker_by_user_id(conn->parked_relay_to);
+            if(owner >= 0 && owner < SERVER_WORKERS && owner != worker_id &&
+                RELAY_RING_FULL == relay_ring_push(&relay_rings[owner], conn->parked_relay_to, conn->parked_relay, conn->parked_relay_len)){
+                i++;
+                continue;
+            }
+            //Relayed, or the recipient is not reachable through a ring anymore: in both cases the message is released
+            if(owner == worker_id)
+                deliver_to_user(conn->parked_relay_to, conn->parked_relay, conn->parked_relay_len);
+            secure_buffer_free(conn->parked_relay);
+            conn->parked_relay = nullptr;
+            conn->parked_relay_len = 0;
+            if(-1 == update_connection_events(conn))
+                shutdown(socket_id, SHUT_RDWR);
+            resumed.push_back(socket_id);
         }
+        parked_connections[i] = parked_connections.back();
+        parked_connections.pop_back();
     }
-    if(-1 == sem_epilogue(sem_id)){
-        log("ERROR on sem_epilogue");
-        return -1;
+    //The messages received after the parked one are already in the receive buffer and they would not be notified again
+    for(int socket_id : resumed){
+        connection* conn = connections[socket_id];
+        if(conn != nullptr && -1 == handle_buffered_records(conn))
+            close_connection(conn);
     }
-    return ret;
 }
 
 
+// ---------------------------------------------------------------------
+// FUNCTIONS of SECURITY
+// ---------------------------------------------------------------------
 
+#ifdef SEND_SELF_CHECK
 /**
- * @return username or empty string in case of errors
+ * @brief decrypt a record just sealed by send_secure and compare it with the plaintext, updating the self check counters
+ * @param pt: plaintext with sequence number
+ * @param iv: IV used by auth_enc_session_seal for the record
+ * @return 1 if the record decrypts to pt, 0 otherwise
  */
-string get_username_by_user_id(size_t id){
-    vlog("get username by id");
-    if(id >= REGISTERED_USERS){ 
-        log(" ERR - User_id not present");
-        errorHandler(GEN_ERR);
-    }
-
-    sem_t* sem_id= sem_open(sem_user_store_name, O_CREAT, 0600, 1);
-    if(-1 == sem_prologue(sem_id)){
-        log("ERROR on sem_prologue");
-        return string();
-    }
+int self_check_record(connection* conn, uchar* pt, uint pt_len, uchar* record, uint record_len, uchar* iv){
+    uint header_len = RECORD_HEADER_LEN(conn->caps);
+    unsigned char* pt_test = NULL;
+    int pt_len_test = auth_enc_session_decrypt(conn->session, conn->send_counter, record + header_len, record_len - header_len,
+        record, sizeof(uint32_t), record + header_len - TAG_DEFAULT, iv, &pt_test);
+    int ret = (pt_len_test == (int)pt_len && memcmp(pt_test, pt, pt_len) == 0)? 1: 0;
+    if(pt_len_test != 0)
+        safe_free(pt_test, pt_len_test);
 
-    user_info* user_status = (user_info*)shmem;
-    string username = user_status[id].username;
-    vlog("Obtained username of " + username);
-    if(-1 == sem_epilogue(sem_id)){
-        log("ERROR on sem_epilogue");
-        return string();
+    self_checked_records++;
+    if(ret == 0){
+        self_check_failures++;
+        log("ERROR: self check failed on the record " + to_string(conn->send_counter) + " for user " + to_string(conn->user_id));
     }
-    return username;
+    if(self_checked_records % SELF_CHECK_LOG_INTERVAL == 0)
+        vlog("Self check: " + to_string(self_checked_records) + " records, " + to_string(self_check_failures) + " failures");
+    return ret;
 }
+#endif
 
 /**
- *  @brief Removes traces of other execution due to the utilization of "named" data structures (semaphores and pipes) that can survive
+ * @brief make the record buffer of the worker at least size bytes long
+ * @return pointer to the buffer, nullptr in case of error
  */
-void prior_cleanup(){
-    sem_unlink(sem_user_store_name); //Remove traces of usage for older execution  
-    key_t key = ftok(message_queue_name, 65); 
-    int msgid = msgget(key, 0666 | IPC_CREAT);
-    msgctl(msgid, IPC_RMID, NULL);
-    msgid = msgget(key, 0666 | IPC_CREAT);
-
-    //Add more space to buffer
-    struct msqid_ds buf;
-    msgctl(msgid, IPC_STAT, &buf);
-    buf.msg_qbytes = 600000;
-    int ret = msgctl(msgid, IPC_SET, &buf);
-    msgctl(msgid, IPC_STAT, &buf);    
-    vlog("Message queue size: " + to_string(buf.msg_qbytes));
+uchar* reserve_record_buffer(uint size){
+    if(size <= record_buffer_size)
+        return record_buffer;
+    //The content is not kept: the buffer is only used inside send_secure
+    uchar* bigger = secure_buffer_alloc(size);
+    if(!bigger){
+        errorHandler(MALLOC_ERR);
+        return nullptr;
+    }
+    secure_buffer_free(record_buffer);
+    record_buffer = bigger;
+    record_buffer_size = size;
+    return record_buffer;
 }
 
-// ---------------------------------------------------------------------
-// FUNCTIONS of INTER-PROCESS COMMUNICATION
-// ---------------------------------------------------------------------
-
-/** 
- *  Send message to message queue of to_user_id
- *  @return 0 in case of success, -1 in case of error
+/**
+ * @brief set the events of conn in the event loop: the client is read unless one of its relays is parked, the socket
+ * is watched for writing while the send queue holds bytes
+ * @return 0 in case of success, -1 in case of errors
  */
-int relay_write(uint to_user_id, msg_to_relay msg){
-    if(to_user_id >= REGISTERED_USERS)
+int update_connection_events(connection* conn){
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLRDHUP;
+    if(conn->parked_relay == nullptr)
+        event.events |= EPOLLIN;
+    if(!conn->send_queue.empty())
+        event.events |= EPOLLOUT;
+    event.data.fd = conn->socket_id;
+    if(-1 == epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->socket_id, &event)){
+        log("ERROR on epoll_ctl");
         return -1;
-    
-    vlog("Entering relay_write for " + to_string(to_user_id));
-    msg.type = to_user_id + 1;
-    
-    key_t key = ftok(message_queue_name, 65); 
-    vlog("Key of ftok returned is " + to_string(key));
-    int msgid = msgget(key, 0666 | IPC_CREAT);
-    vlog("msgid is " + to_string(msgid));
-
-    return msgsnd(msgid, &msg, sizeof(msg_to_relay), 0);
+    }
+    return 0;
 }
 
 /**
- * @brief read from message queue of user_id (blocking)
- * @return -1 if no message has been read otherwise return the bytes copied
- **/
-int relay_read(int user_id, msg_to_relay& msg, bool blocking){
-    uint time_remained;
-    if(user_id >= REGISTERED_USERS || user_id < 0)
-        return -1;
-    
-    if(blocking)
-        time_remained = alarm(0);
-
-    int ret = -1;
-    vlog("relay_read of user_id " + to_string(user_id) + " [" + (blocking? "blocking": "non blocking") + "]");
-
-    //Read from the message queue
-    key_t key = ftok(message_queue_name, 65); 
-    vlog("Key of ftok returned is " + to_string(key));
-    //msg.type = 0;
-    int msgid = msgget(key, 0666 | IPC_CREAT);
-    vlog("msgid is " + to_string(msgid));
-    
-    ret = msgrcv(msgid, &msg, sizeof(msg), user_id+1, (blocking? 0: IPC_NOWAIT));
-    if(ret == -1)
-        vlog("read nothing");
-
-
-    if(blocking){
-        if(time_remained > 0)
-            alarm(time_remained);
-        else
-            alarm(RELAY_CONTROL_TIME);
+ * @brief send bytes to the client of conn without waiting: what the socket does not accept now is queued after the
+ * bytes already queued, and sent by flush_send_queue when the socket becomes writable
+ * @return 1 in case of success, 0 in case of errors or if the client lets more than SEND_QUEUE_MAX bytes pile up
+ */
+int send_or_queue(connection* conn, const uchar* data, uint len){
+    uint sent = 0;
+    while(conn->send_queue.empty() && sent < len){
+        int ret = send(conn->socket_id, data + sent, len - sent, 0);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if(ret <= 0){
+            log("ERROR on send: " + string(strerror(errno)));
+            return 0;
+        }
+        sent += ret;
     }
-    return ret;
+    if(sent == len)
+        return 1;
+    if(conn->send_queue.size() - conn->send_queue_sent + (len - sent) > SEND_QUEUE_MAX){
+        log("ERROR: the client of user " + to_string(conn->user_id) + " does not read, its send queue is full");
+        return 0;
+    }
+    bool was_empty = conn->send_queue.empty();
+    conn->send_queue.insert(conn->send_queue.end(), data + sent, data + len);
+    return (was_empty && -1 == update_connection_events(conn))? 0: 1;
 }
 
-
-// ---------------------------------------------------------------------
-// FUNCTIONS of HANDLING SIGNALS
-// ---------------------------------------------------------------------
-
-
 /**
- * @brief Handler that handles the SIG_ALARM, this represents the fact that every REQUEST_CONTROL_TIME the client must control for chat request
- * @param sig 
+ * @brief send the bytes queued for the client of conn that the socket accepts now
+ * @return 0 if the connection has to be kept open, -1 if it has to be closed
  */
-void signal_handler(int sig)
-{
-    vlog("signal handler");
-    int ret;
-    uint8_t opcode;
-    int bytes_copied = relay_read(client_user_id, relay_msg, false);
-    uint msg_len;
-
-    if(bytes_copied > 0){
-        opcode = relay_msg.buffer[0];
-        log("Found request to relay with opcode: " + to_string(opcode));
-        
-        if(opcode == CHAT_CMD) {
-            uint username_length, username_length_net;
-            memcpy(&username_length_net, (void*)(relay_msg.buffer + 5), sizeof(int));
-            username_length = ntohl(username_length_net);
-            vlog("USERNAME LENGTH: " + to_string(username_length));
-            
-            if(username_length > UINT_MAX - 9 - PUBKEY_DEFAULT_SER){
-                log("ERROR: unsigned wrap");
-                return;
-            }
-            msg_len = 9 + username_length + PUBKEY_DEFAULT_SER;
-
-            // Send reply of the peer to the client
-            ret = send_secure(comm_socket_id, (uchar*)relay_msg.buffer, msg_len);
-            if(ret == 0){
-                log("ERROR on send_secure");
-                close(comm_socket_id);
-                exit(1);
-            }       
-            // log("Sent to client : ");    
-            // BIO_dump_fp(stdout, (const char*)relay_msg.buffer, msg_len); 
-
-        } else if(opcode == AUTH || opcode == CHAT_RESPONSE){
-            memcpy(&msg_len, relay_msg.buffer + 1, sizeof(int)); //Added len field
-            if(msg_len < 1){
-                log("ERROR: msg_len < 1");
-                close(comm_socket_id);
-                exit(1);
-            }
-
-            uchar* msg_to_send = (uchar*)malloc(msg_len);
-            if(!msg_to_send){
-                log("ERROR on malloc");
-                close(comm_socket_id);
-                exit(1);
-            }
-
-            msg_to_send[0] = opcode;
-            memcpy(msg_to_send + 1, relay_msg.buffer + 5, msg_len - 1);
-
-            ret = send_secure(comm_socket_id, (uchar*)msg_to_send, msg_len);
-            if(ret == 0){
-                log("ERROR on send_secure");
-                close(comm_socket_id);
-                free(msg_to_send);
-                exit(1);
-            }       
-
-            // log("Sent to client : ");    
-            // BIO_dump_fp(stdout, (const char*)msg_to_send, msg_len);
-            free(msg_to_send);
-        } else if(opcode == STOP_CHAT || opcode == CHAT_NEG){
-            msg_len = 5;
-
-            // Send reply of the peer to the client
-            ret = send_secure(comm_socket_id, (uchar*)relay_msg.buffer, msg_len);
-            if(ret == 0){
-                log("ERROR on send_secure");
-                close(comm_socket_id);
-                exit(1);
-            }       
-
-            // log("Sent to client : ");    
-            // BIO_dump_fp(stdout, (const char*)relay_msg.buffer, msg_len);
-        } else {
-            log("OPCODE not recognized (" + to_string(opcode) + ")");
+int flush_send_queue(connection* conn){
+    while(conn->send_queue_sent < conn->send_queue.size()){
+        int ret = send(conn->socket_id, conn->send_queue.data() + conn->send_queue_sent,
+            conn->send_queue.size() - conn->send_queue_sent, 0);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if(ret <= 0){
+            log("ERROR on send: " + string(strerror(errno)));
+            return -1;
         }
+        conn->send_queue_sent += ret;
     }
-                
-
-    alarm(RELAY_CONTROL_TIME);
-    return;
+    //The memory of a long queue is given back once the client has caught up
+    vector<uchar>().swap(conn->send_queue);
+    conn->send_queue_sent = 0;
+    return update_connection_events(conn);
 }
 
-
-// ---------------------------------------------------------------------
-// FUNCTIONS of SECURITY
-// ---------------------------------------------------------------------
-
-uint32_t send_counter=0;
-
 /**
- * @brief perform a an authenticad encryption and then a send operation
+ * @brief perform a an authenticad encryption and then a send operation. The record is built and encrypted in place
+ * in the record buffer of the worker, so no allocation is done once the buffer is big enough
  * @param pt: pointer to plaintext without sequence number
  * @return 1 in case of success, 0 in case of error 
  */
-int send_secure(int comm_socket_id, uchar* pt, uint pt_len){
-    if(pt_len < 0 || comm_socket_id < 0){
+int send_secure(connection* conn, uchar* pt, uint pt_len){
+    if(conn == nullptr || conn->socket_id < 0){
         log("ERROR invalid parameters on send_secure");
         return 0;
     }
 
-    int ret;
-    uchar *tag, *iv, *ct, *aad;
-    //alarm(0);
-
-    uint aad_len;
-    // log("Plaintext to send:");
-    // BIO_dump_fp(stdout, (const char*)pt, pt_len);
-    uint32_t header_len = sizeof(uint32_t)+IV_DEFAULT+TAG_DEFAULT;
-
-    // adding sequence number
-    uint32_t counter_n=htonl(send_counter);
-    // cout <<" adding sequrnce number " << send_counter << endl;
-    if(pt_len > UINT_MAX - sizeof(uint32_t)){
+    uint32_t header_len = RECORD_HEADER_LEN(conn->caps);
+    if(pt_len > UINT_MAX - header_len - sizeof(uint32_t)){
         log("ERROR: unsigned wrap");
         return 0;
     }
+    uint record_pt_len = pt_len + sizeof(uint32_t);
+    uchar* record = reserve_record_buffer(header_len + record_pt_len);
+    if(!record)
+        return 0;
 
-    uchar* pt_seq = (uchar*)malloc(pt_len+sizeof(uint32_t)); 
-    memcpy(pt_seq , &counter_n, sizeof(uint32_t));
-    memcpy(pt_seq+ sizeof(uint32_t), pt, pt_len);
-    pt=pt_seq;
-    pt_len+=sizeof(uint32_t);
+    // plaintext after the header: sequence number and message
+    uint32_t counter_n=htonl(conn->send_counter);
+    memcpy(record + header_len, &counter_n, sizeof(uint32_t));
+    memcpy(record + header_len + sizeof(uint32_t), pt, pt_len);
     // log("Plaintext to send (with seq):");
-    // BIO_dump_fp(stdout, (const char*)pt, pt_len);
+    // BIO_dump_fp(stdout, (const char*)(record + header_len), record_pt_len);
 
-    uint aad_ct_len_net = htonl(pt_len); //Since we use GCM ciphertext == plaintext
-    uint ct_len = auth_enc_encrypt(pt, pt_len, (uchar*)&aad_ct_len_net, sizeof(uint), session_key, &tag, &iv, &ct);
-    if(ct_len == 0){
-        log("auth_enc_encrypt failed");
+#ifdef SEND_SELF_CHECK
+    //The record is decrypted again and compared with a copy of its plaintext
+    uchar iv[EVP_MAX_IV_LENGTH];
+    uchar* pt_copy = secure_buffer_alloc(record_pt_len);
+    if(!pt_copy)
         return 0;
-    }
-    // log("ct_len: " + to_string(ct_len));
-    if(ct_len > UINT_MAX - header_len){
-        log("ERROR: unsigned wrap");
+    memcpy(pt_copy, record + header_len, record_pt_len);
+    uint record_len = auth_enc_session_seal(conn->session, conn->send_counter, record, record_pt_len, iv);
+    if(record_len == 0)
+        log("auth_enc_session_seal failed");
+    int ret = record_len != 0 && self_check_record(conn, pt_copy, record_pt_len, record, record_len, iv);
+    secure_buffer_free(pt_copy);
+    if(!ret)
         return 0;
-    } 
-    uint msg_to_send_len = ct_len + header_len, bytes_copied = 0;
-    uchar* msg_to_send = (uchar*)malloc(msg_to_send_len);
-    if(!msg_to_send){
-        // errorHandler(MALLOC_ERR);
+#else
+    uint record_len = auth_enc_session_seal(conn->session, conn->send_counter, record, record_pt_len, nullptr);
+    if(record_len == 0){
+        log("auth_enc_session_seal failed");
         return 0;
     }
+#endif
+    // log("Msg (authenticated and encrypted) to send:");
+    // BIO_dump_fp(stdout, (const char*)record, record_len);
 
-    // cout << aad_ct_len_net << " -> " << ntohl(aad_ct_len_net) << endl;
-    memcpy(msg_to_send + bytes_copied, &aad_ct_len_net, sizeof(uint));
-    bytes_copied += sizeof(uint);
-    memcpy(msg_to_send + bytes_copied, iv, IV_DEFAULT);
-    bytes_copied += IV_DEFAULT;
-    memcpy(msg_to_send + bytes_copied, tag, TAG_DEFAULT);
-    bytes_copied += TAG_DEFAULT;
-    memcpy(msg_to_send + bytes_copied, ct, ct_len);
-    bytes_copied += sizeof(uint);
-
-    // log("Msg (authenticated and encrypted) to send, (copied " + to_string(bytes_copied) + " of " + to_string(msg_to_send_len) + "):");
-    // BIO_dump_fp(stdout, (const char*)msg_to_send, msg_to_send_len);
-
-    //-----------------------------------------------------------
-    // Controllo encr/decr
-    unsigned char* pt_test = NULL;
-    int pt_len_test = auth_enc_decrypt(ct, ct_len, (uchar*)&aad_ct_len_net, sizeof(uint32_t), session_key, tag, iv, &pt_test);
-    if(pt_len_test == 0){
-        log("auth_enc_decrypt failed");
-        return 0;
-    }
-    // log(" plaintext ");
-    // BIO_dump_fp(stdout, (const char*)pt_test, pt_len_test);
-    safe_free(pt, pt_len);
-    //------------------------------------------------------
-    ret = send(comm_socket_id, msg_to_send, msg_to_send_len, 0);
-    if(ret <= 0 || ret != msg_to_send_len){
+    if(!send_or_queue(conn, record, record_len)){
         errorHandler(SEND_ERR);
-        safe_free(msg_to_send, msg_to_send_len);
         return 0;
     }
-    send_counter++;
-    if(send_counter == 0){
+    conn->send_counter++;
+    if(conn->send_counter == 0){
         log("ERROR: unsigned wrap on SEND COUNTER");
         return 0;
     }
-
-    safe_free(msg_to_send, msg_to_send_len);
-    //alarm(RELAY_CONTROL_TIME);
     return 1;
 }
 
 
-uint32_t receive_counter=0;
-
 /**
- * @brief Receive in a secure way the messages sent by the server, decipher it and return the plaintext in the correspodent parameter. It
- * also control the sequence number
+ * @brief Open in a secure way a message of the client in its receive buffer: the record is decrypted in place and
+ * the sequence number is controlled. The record must be consumed by the caller after the plaintext has been handled
  * 
- * @param socket socket id
- * @param plaintext plaintext obtained by the decryption of the ciphertext
- * @return int plaintext length or -1 if error
+ * @param conn connection of the client
+ * @param offset position of the record in the receive buffer
+ * @param plaintext plaintext obtained by the decryption of the ciphertext, it points into the receive buffer
+ * @param record_len length of the record in the receive buffer
+ * @return int plaintext length, 0 if the buffer does not hold a whole record or -1 if error
  */
-int recv_secure(int comm_socket_id, unsigned char** plaintext)
+int recv_secure(connection* conn, uint offset, unsigned char** plaintext, uint* record_len)
 {
-    // if(comm_socket_id < 0){
-    //     log("INVALID parameters on recv_secure");
-    //     return -1;
-    // }
-
-    vlog(" SECURE RECEIVE ");
-
-    uint32_t header_len = sizeof(uint32_t)+IV_DEFAULT+TAG_DEFAULT; 
-    uint32_t ct_len;
-    unsigned char* ciphertext = NULL;
-    uint32_t pt_len;
-    int ret;
-    //alarm(0);
-    unsigned char* header = (unsigned char*)malloc(header_len);
-    if(!header){
-        cerr << " Error in malloc for header " << endl; 
+    if(conn == nullptr || conn->recv_buffer == nullptr || offset > conn->recv_buffer_len){
+        log("INVALID parameters on recv_secure");
         return -1;
     }
-    unsigned char* iv = (unsigned char*)malloc(IV_DEFAULT);
-    if(!iv){
-        cerr << " Error in malloc for iv " << endl; 
-        safe_free(header, header_len);
-        return -1;
+    uchar* record = conn->recv_buffer + offset;
+    int len = auth_enc_record_len(record, conn->recv_buffer_len - offset, conn->caps, RELAY_MSG_SIZE);
+    if(len <= 0){
+        if(len == -1)
+            log("ERROR: invalid record length");
+        return len;
     }
-    unsigned char* tag = (unsigned char*)malloc(TAG_DEFAULT);
-    if(!tag){
-        cerr << " Error in malloc for tag " << endl; 
-        safe_free(header, header_len);
-        safe_free(iv, IV_DEFAULT);
-        return -1;
-    }
-
-    // Receive Header
-    //cout << " DBG - Before recv " << endl;
-    //BIO_dump_fp(stdout, (const char*)header, header_len);
-    ret = recv(comm_socket_id, (void*)header, header_len, 0);
-    if(ret <= 0 || ret != header_len){
-        cerr << " Error in header reception " << ret << endl;
-        close(comm_socket_id);
-        BIO_dump_fp(stdout, (const char*)header, header_len);
-        safe_free(tag, TAG_DEFAULT);
-        safe_free(header, header_len);
-        safe_free(iv, IV_DEFAULT);
-        return -1;
-    }
-    // BIO_dump_fp(stdout, (const char*)header, header_len);
-
-    // Open header
-    memcpy((void*)&ct_len, header, sizeof(uint32_t));
-    // log(" ct_len :");
-    // BIO_dump_fp(stdout, (const char*)&ct_len, sizeof(uint32_t));
-
-    memcpy(iv, header+sizeof(uint32_t), IV_DEFAULT);
-    // log(" iv :");
-    // BIO_dump_fp(stdout, (const char*)iv, IV_DEFAULT);
-
-    memcpy(tag, header+sizeof(uint32_t)+IV_DEFAULT, TAG_DEFAULT);
-    // log(" tag :");
-    // BIO_dump_fp(stdout, (const char*)tag, TAG_DEFAULT);
-
-    unsigned char* aad = (unsigned char*)malloc(sizeof(uint32_t));
-    if(!aad){
-        cerr << " Error in aad malloc " << endl;
-        safe_free(tag, TAG_DEFAULT);
-        safe_free(header, header_len);
-        safe_free(iv, IV_DEFAULT);
-        return -1;
-    }
-    memcpy(aad, header, sizeof(uint32_t));
-    // log(" AAD : ");
-    // BIO_dump_fp(stdout, (const char*)aad, sizeof(uint32_t));
-
-    // Receive ciphertext
-    // cout << " DBG - ct_len before ntohl is " << ct_len << endl;
-    ct_len = ntohl(ct_len);
-    // cout << " DBG - ct_len real is " << ct_len << endl;
-
-    ciphertext = (unsigned char*)malloc(ct_len);
-    if(!ciphertext){
-        cerr << " Error in malloc for ciphertext " << endl;
-        safe_free(tag, TAG_DEFAULT);
-        safe_free(header, header_len);
-        safe_free(iv, IV_DEFAULT);
-        safe_free(aad, sizeof(uint32_t));
-        return -1;
-    }
-    ret = recv(comm_socket_id, (void*)ciphertext, ct_len, 0);
-    if(ret <= 0){
-        cerr << " Error in AAD reception " << endl;
-        safe_free(ciphertext, ct_len);
-        safe_free(tag, TAG_DEFAULT);
-        safe_free(header, header_len);
-        safe_free(iv, IV_DEFAULT);
-        safe_free(aad, sizeof(uint32_t));
-        return -1;
-    }
-    // cout << " ciphertext is: " << endl;
-    // BIO_dump_fp(stdout, (const char*)ciphertext, ct_len);
+    vlog(" SECURE RECEIVE ");
+    *record_len = len;
 
-    // Decryption
-    // cout<<"Session key:"<<endl;
-    // BIO_dump_fp(stdout, (const char*) session_key, 32);
-    pt_len = auth_enc_decrypt(ciphertext, ct_len, aad, sizeof(uint32_t), session_key, tag, iv, plaintext);
-    if(pt_len == 0 || pt_len!=ct_len){
+    uint pt_len = auth_enc_session_open(conn->session, conn->receive_counter, record, len);
+    if(pt_len <= sizeof(uint32_t)){
         cerr << " Error during decryption " << endl;
-        safe_free(*plaintext, pt_len);
-        safe_free(ciphertext, ct_len);
-        safe_free(tag, TAG_DEFAULT);
-        safe_free(header, header_len);
-        safe_free(iv, IV_DEFAULT);
-        safe_free(aad, sizeof(uint32_t));
         return -1;
     }
-    // cout << " ciphertext is: " << endl;
-    // BIO_dump_fp(stdout, (const char*)ciphertext, ct_len);
+    *plaintext = record + RECORD_HEADER_LEN(conn->caps);
     // cout << " plaintext is " << endl;
     // BIO_dump_fp(stdout, (const char*)*plaintext, pt_len);
-    safe_free(ciphertext, ct_len);
-    safe_free(tag, TAG_DEFAULT);
-    safe_free(header, header_len);
-    safe_free(iv, IV_DEFAULT);
-    safe_free(aad, sizeof(uint32_t));
 
     // check seq number
     uint32_t sequece_number = ntohl(*(uint32_t*) (*plaintext));
     // cout << " received sequence number " << sequece_number  << " aka " << *(uint32_t*) (*plaintext) << endl;
-    // cout << " Expected sequence number " << receive_counter << endl;
-    if(sequece_number<receive_counter){
+    // cout << " Expected sequence number " << conn->receive_counter << endl;
+    if(sequece_number<conn->receive_counter){
         cerr << " Error: wrong seq number " << endl;
-        safe_free(*plaintext, pt_len);
         return -1;
     }
-    receive_counter=sequece_number+1;
-    if(receive_counter == 0){
+    conn->receive_counter=sequece_number+1;
+    if(conn->receive_counter == 0){
         log("ERROR: unsigned wrap on receive_counter");
         return -1;
     }
 
-    //alarm(RELAY_CONTROL_TIME);
     return pt_len;
 }
 
 
 /**
- * @brief handle authentication with the client
- * @return user_id of the client or -1  in case of errors
+ * @brief compute the cookie of the client of conn: period and HMAC of the address of the client, R1 and period
+ * @param cookie output, COOKIE_SIZE bytes
+ * @return 1 on success, 0 on error(s)
  */
-int handle_client_authentication(string pwd_for_keys){
-    /*************************************************************
-     * M1 - R1 and Username
-     *************************************************************/
-    int ret;
-    uchar* R1 = (uchar*)malloc(NONCE_SIZE);
-    if(!R1){
-        errorHandler(MALLOC_ERR);
-        return -1;
-    }
+int compute_cookie(connection* conn, uchar* R1, uint32_t period, uchar* cookie){
+    struct sockaddr_in cl_addr;
+    socklen_t len = sizeof(cl_addr);
+    if(getpeername(conn->socket_id, (struct sockaddr*)&cl_addr, &len) == -1 || cl_addr.sin_family != AF_INET)
+        return 0;
+    uint32_t period_net = htonl(period);
+    uchar document[sizeof(cl_addr.sin_addr) + NONCE_SIZE + sizeof(uint32_t)];
+    memcpy(document, &cl_addr.sin_addr, sizeof(cl_addr.sin_addr));
+    memcpy(document + sizeof(cl_addr.sin_addr), R1, NONCE_SIZE);
+    memcpy(document + sizeof(cl_addr.sin_addr) + NONCE_SIZE, &period_net, sizeof(uint32_t));
+    memcpy(cookie, &period_net, sizeof(uint32_t));
+    return hmac_compute(cookie_secret, COOKIE_SECRET_SIZE, document, sizeof(document), cookie + sizeof(uint32_t));
+}
 
-    ret = recv(comm_socket_id, (void *)R1, NONCE_SIZE, 0);
-    if (ret <= 0 || ret != NONCE_SIZE){
-        errorHandler(REC_ERR);
-        safe_free(R1, NONCE_SIZE);
-        return -1;
-    }
-    // log("M1 auth (0) Received R1: ");
-    // BIO_dump_fp(stdout, (const char*)R1, NONCE_SIZE);
+/**
+ * @brief check a cookie echoed by the client of conn, it is valid in its period and in the following one
+ * @return 1 if the cookie is valid, 0 otherwise
+ */
+int check_cookie(connection* conn, uchar* R1, uchar* cookie){
+    uint32_t current_period = time(NULL) / COOKIE_LIFETIME;
+    uint32_t period = ntohl(*(uint32_t*)cookie);
+    if(period != current_period && period + 1 != current_period)
+        return 0;
+    uchar expected[COOKIE_SIZE];
+    return compute_cookie(conn, R1, period, expected) && digest_compare(expected, cookie, COOKIE_SIZE) == 0;
+}
 
-    uint32_t client_username_len;
-    ret = recv(comm_socket_id, (void *)&client_username_len, sizeof(uint32_t), 0);
-    if (ret <= 0 || ret != sizeof(uint32_t)){
-        errorHandler(REC_ERR);
-        safe_free(R1, NONCE_SIZE);
-        return -1;
-    }
-    client_username_len = ntohl(client_username_len);
-    vlog("M1 auth (1) Received username size: " + to_string(client_username_len));
+/**
+ * @brief answer M1 with a cookie in place of M2 (R2 is 0 and CAP_COOKIE is selected), the connection is then closed
+ * @return 1 on success, 0 on error(s)
+ */
+int send_cookie(connection* conn, uchar* R1){
+    uchar M2[NONCE_SIZE + sizeof(uint32_t) + COOKIE_SIZE] = {0};
+    uint32_t cookie_len_net = htonl(COOKIE_SIZE | ((uint32_t)CAP_COOKIE << CAPS_SHIFT));
+    memcpy(M2 + NONCE_SIZE, &cookie_len_net, sizeof(uint32_t));
+    if(!compute_cookie(conn, R1, time(NULL) / COOKIE_LIFETIME, M2 + NONCE_SIZE + sizeof(uint32_t)))
+        return 0;
+    //The connection is closed right after: the cookie is short and it fits in the send buffer of a new socket
+    return send_or_queue(conn, M2, sizeof(M2));
+}
 
-    char* username = (char*)malloc(client_username_len);
-    if(!username){
-        errorHandler(MALLOC_ERR);
-        safe_free(R1, NONCE_SIZE);
+/**
+ * @brief last step of a login, full or resumed: the user goes online and it receives its user id together with a
+ * new session ticket (USRID, user id, ticket length, ticket). Clients that do not resume ignore the ticket
+ * @param generation ticket generation of the user, 0 to send no ticket
+ * @return user_id of the client or -1 in case of errors
+ */
+int complete_login(connection* conn, int client_user_id, uint32_t generation){
+    //Other handshakes of the same user may have been completed since M1, in this worker or in another one
+    int ret = set_user_socket(client_user_id, conn->socket_id, worker_id);
+    if(ret == 0){
+        log("ERROR user already online");
         return -1;
     }
-
-    ret = recv(comm_socket_id, (void *)username, client_username_len, 0);
-    if (ret <= 0 || ret != client_username_len){
-        errorHandler(REC_ERR);
-        safe_free((uchar*)username, client_username_len);
-        safe_free(R1, NONCE_SIZE);
+    if(ret == -1){
+        log("ERROR on set_user_socket");
         return -1;
     }
-    string client_username(username);
-    vlog("M1 auth (2) Received username: " + client_username);
-    
-    if(get_user_socket_by_user_id(get_user_id_by_username(username)) != -1){
-        log("ERROR user already online");
-        safe_free((uchar*)username, client_username_len);
-        safe_free(R1, NONCE_SIZE);
+
+    uchar userID_msg[1 + 2*sizeof(uint32_t) + MAX_TICKET_SIZE];
+    uint userID_msg_len = 1 + sizeof(uint32_t);
+    int client_user_id_net = htonl(client_user_id);
+    vlog("Found username in the datastore with user_id " + to_string(client_user_id));
+    userID_msg[0] = USRID;
+    memcpy(userID_msg + 1, &client_user_id_net, sizeof(uint32_t));
+    uint ticket_len = (generation == 0)? 0: session_ticket_issue(client_user_id, generation, conn->session_key,
+        conn->session_key_len, userID_msg + userID_msg_len + sizeof(uint32_t));
+    if(ticket_len != 0){
+        uint32_t ticket_len_net = htonl(ticket_len);
+        memcpy(userID_msg + userID_msg_len, &ticket_len_net, sizeof(uint32_t));
+        userID_msg_len += sizeof(uint32_t) + ticket_len;
+    }
+
+    ret = send_secure(conn, userID_msg, userID_msg_len);
+    OPENSSL_cleanse(userID_msg, userID_msg_len);
+    if(ret == 0){
+        log("Error on send secure");
+        clear_user_socket(client_user_id, conn->socket_id, worker_id);
         return -1;
     }
+    return client_user_id;
+}
 
-    
-    safe_free((uchar*)username, client_username_len);
+/**
+ * @brief try to resume a session with the session ticket that ends M1 (ticket length, ticket, binder). If the
+ * ticket is valid the server answers with R2 and CAP_RESUME in place of the ephemeral key length, the session key
+ * is derived from the resumption secret in the ticket and the nonces: no key pair, no signature
+ * @param M1 first message of the client as received, the binder covers all of it but the binder itself
+ * @param ticket_offset offset of the ticket length in M1
+ * @param generation output, ticket generation to issue to the resumed session
+ * @return 1 if the session is resumed, 0 if the full handshake has to follow, -1 in case of errors
+ */
+int resume_session(connection* conn, uchar* M1, uint M1_len, uint ticket_offset, uint32_t* generation){
+    handshake* hs = conn->hs;
+    uint32_t ticket_len = M1_len - ticket_offset - sizeof(uint32_t) - RESUMPTION_BINDER_SIZE;
+    uint bound_len = M1_len - RESUMPTION_BINDER_SIZE;
 
-    /*************************************************************
-     * M2 - Send R2,pubkey_eph,signature,certificate
-     *************************************************************/
-    uchar* R2 = (uchar*)malloc(NONCE_SIZE);
-    if(!R2){
-        errorHandler(MALLOC_ERR);
-        safe_free(R1, NONCE_SIZE);
-        return -1;
+    session_ticket ticket;
+    if(!session_ticket_open(M1 + ticket_offset + sizeof(uint32_t), ticket_len, &ticket))
+        return 0;
+    uchar binder[RESUMPTION_BINDER_SIZE];
+    int ret = ticket.user_id == hs->user_id && hmac_compute(ticket.resumption_secret, RESUMPTION_SECRET_SIZE, M1, bound_len, binder) &&
+        digest_compare(binder, M1 + bound_len, RESUMPTION_BINDER_SIZE) == 0;
+    if(!ret){
+        log("ERROR: session ticket not bound to this login");
+        OPENSSL_cleanse(&ticket, sizeof(ticket));
+        return 0;
     }
-
-    //Generate pair of ephermeral DH keys
-    void* eph_privkey_s;
-    uchar* eph_pubkey_s;
-    uint eph_pubkey_s_len;
-    ret = eph_key_generate(&eph_privkey_s, &eph_pubkey_s, &eph_pubkey_s_len);
-    if(ret != 1){
-        log("Error on EPH_KEY_GENERATE");
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
-        return -1;
+    //A ticket is used only once, a copy of M1 cannot log the user in again
+    *generation = redeem_user_ticket(hs->user_id, ticket.generation);
+    if(*generation == 0){
+        log("Session ticket already used or replaced");
+        OPENSSL_cleanse(&ticket, sizeof(ticket));
+        return 0;
     }
-    // log("M2 auth (1) pubkey: ");
-    // BIO_dump_fp(stdout, (const char*)eph_pubkey_s, eph_pubkey_s_len);
 
-    //Generate nuance R2
-    ret = random_generate(NONCE_SIZE, R2);
-    if(ret != 1){
+    //M2 of a resumption: R2 and the capabilities, with no ephemeral key
+    uchar nonces[2*NONCE_SIZE];
+    memcpy(nonces, hs->R1, NONCE_SIZE);
+    if(random_generate(NONCE_SIZE, nonces + NONCE_SIZE) != 1){
         log("Error on random_generate");
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
+        OPENSSL_cleanse(&ticket, sizeof(ticket));
         return -1;
     }
-
-    // log("auth (2) R2: ");
-    // BIO_dump_fp(stdout, (const char*)R2, NONCE_SIZE);
-
-    //Get certificate of Server
-    FILE* cert_file = fopen("certification/SecureCom_cert.pem", "rb");
-    if(!cert_file){
-        log("Error on opening cert file");
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
+    conn->session_key_len = derive_resumed_session_key(ticket.resumption_secret, nonces, sizeof(nonces), &conn->session_key);
+    OPENSSL_cleanse(&ticket, sizeof(ticket));
+    if(conn->session_key_len == 0){
+        log("Failed derivation of the resumed session key");
         return -1;
     }
-    
-    uchar* certificate_ser;
-    uint certificate_len = serialize_certificate(cert_file, &certificate_ser);
-    if(certificate_len == 0){
-        log("Error on serialize certificate");
-        fclose(cert_file);
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
+    conn->session = auth_enc_session_new(conn->session_key, conn->caps, false);
+    if(conn->session == nullptr){
+        log("Failed creation of the session");
         return -1;
     }
-    // log("auth (3) certificate: ");
-    // BIO_dump_fp(stdout, (const char*)certificate_ser, certificate_len);
-
-    if(eph_pubkey_s_len > UINT_MAX - NONCE_SIZE*2){
-        log("ERROR: unsigned wrap");
+    uchar M2[NONCE_SIZE + sizeof(uint32_t)];
+    uint32_t resumed_caps_net = htonl((uint32_t)(conn->caps | CAP_RESUME) << CAPS_SHIFT);
+    memcpy(M2, nonces + NONCE_SIZE, NONCE_SIZE);
+    memcpy(M2 + NONCE_SIZE, &resumed_caps_net, sizeof(uint32_t));
+    if(!send_or_queue(conn, M2, sizeof(M2))){
+        errorHandler(SEND_ERR);
         return -1;
     }
+    vlog("Session of user " + to_string(hs->user_id) + " resumed");
+    return 1;
+}
 
-    uint M2_to_sign_length = (NONCE_SIZE*2) + eph_pubkey_s_len, M2_signed_length;
-    uchar* M2_signed;
-    uchar* M2_to_sign = (uchar*)malloc(M2_to_sign_length);
-    if(!M2_to_sign){
-        log("Error on M2_to_sign");
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
-        fclose(cert_file);
-        return -1;
+/**
+ * @brief start M2 of a full handshake: take an ephemeral key pair and R2 and queue the signature of R1, R2, ephemeral
+ * key and capabilities for the crypto pool. R2 and the ephemeral key pair are kept in the handshake until M3 arrives
+ * @return 1 on success, 0 on error(s)
+ */
+int sign_M2(connection* conn){
+    handshake* hs = conn->hs;
+    int ret = eph_key_pool_get(&hs->eph_privkey, &hs->eph_pubkey, &hs->eph_pubkey_len, conn->caps);
+    if(ret != 1){
+        log("Error on EPH_KEY_GENERATE");
+        return 0;
+    }
+    if(hs->eph_pubkey_len > CAPS_LEN_MASK){
+        log("ERROR: unsigned wrap");
+        return 0;
     }
 
-    memcpy(M2_to_sign, R1, NONCE_SIZE);
-    memcpy((void*)(M2_to_sign + NONCE_SIZE), R2, NONCE_SIZE);
-    memcpy((void*)(M2_to_sign + (2*NONCE_SIZE)), eph_pubkey_s, eph_pubkey_s_len);
-    // log("auth (4) M2_to_sign: ");
-    // BIO_dump_fp(stdout, (const char*)M2_to_sign, M2_to_sign_length);
-
-
-    ret = sign_document(M2_to_sign, M2_to_sign_length, server_privk,&M2_signed, &M2_signed_length);
+    //Generate nuance R2
+    ret = random_generate(NONCE_SIZE, hs->R2);
     if(ret != 1){
-        log("Error on signing part on M2");
-        safe_free(M2_to_sign, M2_to_sign_length);
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
-        fclose(cert_file);
-        return -1;
-    }
-    //Send M2 part by part
-    if(eph_pubkey_s_len > UINT_MAX - 3*sizeof(uint) - M2_signed_length){
-        log("ERROR unsigned_wrap");
-        return -1;
+        log("Error on random_generate");
+        return 0;
     }
 
-    if(certificate_len > UINT_MAX - 3*sizeof(uint) - eph_pubkey_s_len - M2_signed_length){
-        log("ERROR unsigned_wrap");
-        return -1;
+    crypto_job* job = crypto_job_new(CRYPTO_JOB_SIGN);
+    if(!job){
+        errorHandler(MALLOC_ERR);
+        return 0;
+    }
+    //The capabilities are signed too, so that they cannot be changed in transit
+    job->document_len = (NONCE_SIZE*2) + hs->eph_pubkey_len + 2;
+    job->document = (uchar*)malloc(job->document_len);
+    if(!job->document){
+        log("Error on M2_to_sign");
+        crypto_job_free(job);
+        return 0;
     }
+    memcpy(job->document, hs->R1, NONCE_SIZE);
+    memcpy((void*)(job->document + NONCE_SIZE), hs->R2, NONCE_SIZE);
+    memcpy((void*)(job->document + (2*NONCE_SIZE)), hs->eph_pubkey, hs->eph_pubkey_len);
+    job->document[(2*NONCE_SIZE) + hs->eph_pubkey_len] = hs->offered_caps;
+    job->document[(2*NONCE_SIZE) + hs->eph_pubkey_len + 1] = conn->caps;
+    job->key = server_privk;
+    job->owner = conn;
+    hs->job = job;
+    crypto_pool_submit(job);
+    return 1;
+}
 
-    uint M2_size = NONCE_SIZE + 3*sizeof(uint) + eph_pubkey_s_len + M2_signed_length + certificate_len; 
+/**
+ * @brief send M2 of a full handshake once it has been signed: R2, ephemeral key and capabilities, signature, certificate
+ * @param job signature of M2
+ * @return 1 on success, 0 on error(s)
+ */
+int send_M2(connection* conn, crypto_job* job){
+    handshake* hs = conn->hs;
+    //The key, the signature and the certificate are a few KB at most: no unsigned wrap
+    uint M2_size = NONCE_SIZE + 3*sizeof(uint) + hs->eph_pubkey_len + job->signature_len + server_certificate_len;
     uint offset = 0;
     uchar* M2 = (uchar*)malloc(M2_size);
     if(!M2){
         log("ERROR on malloc");
-         safe_free(M2_to_sign, M2_to_sign_length);
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
-        return -1;
+        return 0;
     }
-    uint eph_pubkey_s_len_net = htonl(eph_pubkey_s_len);
-    uint M2_signed_length_net = htonl(M2_signed_length);
-    uint certificate_len_net = htonl(certificate_len);
-    vlog("Copying");
-    memcpy((void*)(M2 + offset), R2, NONCE_SIZE);
+    uint eph_pubkey_s_len_net = htonl(hs->eph_pubkey_len | ((uint)conn->caps << CAPS_SHIFT));
+    uint M2_signed_length_net = htonl(job->signature_len);
+    uint certificate_len_net = htonl(server_certificate_len);
+    memcpy((void*)(M2 + offset), hs->R2, NONCE_SIZE);
     offset += NONCE_SIZE;
     memcpy((void*)(M2 + offset), &eph_pubkey_s_len_net, sizeof(uint));
     offset += sizeof(uint);
-    memcpy((void*)(M2 + offset), eph_pubkey_s, eph_pubkey_s_len);
-    offset += eph_pubkey_s_len;
+    memcpy((void*)(M2 + offset), hs->eph_pubkey, hs->eph_pubkey_len);
+    offset += hs->eph_pubkey_len;
     memcpy((void*)(M2 + offset), &M2_signed_length_net ,sizeof(uint));
     offset += sizeof(uint);
-    memcpy((void*)(M2 + offset), M2_signed,M2_signed_length);
-    offset += M2_signed_length;
+    memcpy((void*)(M2 + offset), job->signature, job->signature_len);
+    offset += job->signature_len;
     memcpy((void*)(M2 + offset), &certificate_len_net ,sizeof(uint));
     offset += sizeof(uint);
-    memcpy((void*)(M2 + offset), certificate_ser, certificate_len);
-    offset += certificate_len;
-    
+    memcpy((void*)(M2 + offset), server_certificate, server_certificate_len);
+    offset += server_certificate_len;
+
     vlog("M2 size: " + to_string(M2_size));
-    
-    ret = send(comm_socket_id, M2, M2_size, 0);
-    if(ret < M2_size){
+    int ret = send_or_queue(conn, M2, M2_size);
+    safe_free(M2, M2_size);
+    if(!ret){
         errorHandler(SEND_ERR);
-        safe_free(M2_to_sign, M2_to_sign_length);
-        safe_free(R1, NONCE_SIZE);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_s, eph_pubkey_s_len);
-        return -1;
+        return 0;
     }
-    // log("M2 sent");
-    // BIO_dump_fp(stdout, (const char*)M2, offset);
+    return 1;
+}
 
-        
-    safe_free(M2, M2_size);
-    safe_free(M2_to_sign, M2_to_sign_length);
-    safe_free(R1, NONCE_SIZE);
-    safe_free(eph_pubkey_s, eph_pubkey_s_len);
-    
+/**
+ * @brief handle M1 (R1, username length and offered capabilities, username, cookie if CAP_COOKIE is offered, session
+ * ticket and binder if CAP_RESUME is offered): ask for a cookie, resume the session or answer with M2
+ * @return user_id of the client if the session is resumed, HANDSHAKE_PENDING if M2 has been sent, HANDSHAKE_COOKIE_SENT
+ * if the client has been asked for a cookie, -1 in case of errors
+ */
+int handle_M1(connection* conn, uchar* M1, uint M1_len){
+    handshake* hs = conn->hs;
+    uint offset = 0;
+    memcpy(hs->R1, M1, NONCE_SIZE);
+    offset += NONCE_SIZE;
 
-    /*************************************************************
-     * M3 - client_pubkey and signing of pubkey and R2
-     *************************************************************/
-    uint32_t eph_pubkey_c_len;
-    ret = recv(comm_socket_id, &eph_pubkey_c_len, sizeof(uint32_t), 0);
-    if(ret <= 0 || ret != sizeof(uint32_t)){
-        errorHandler(REC_ERR);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
+    uint32_t client_username_len;
+    memcpy(&client_username_len, M1 + offset, sizeof(uint32_t));
+    offset += sizeof(uint32_t);
+    client_username_len = ntohl(client_username_len);
+    hs->offered_caps = client_username_len >> CAPS_SHIFT;
+    conn->caps = hs->offered_caps & SUPPORTED_CAPS;
+    client_username_len &= CAPS_LEN_MASK;
+    vlog("M1 auth (1) Received username size: " + to_string(client_username_len) + ", capabilities: " + to_string(hs->offered_caps));
+
+    char username[MAX_USERNAME_SIZE];
+    memcpy(username, M1 + offset, client_username_len);
+    offset += client_username_len;
+    username[client_username_len - 1] = '\0';
+    string client_username(username);
+    vlog("M1 auth (2) Received username: " + client_username);
+
+    //Under load the handshake starts only once the client has echoed a cookie: nothing is signed before
+    bool cookie_valid = false;
+    if(hs->offered_caps & CAP_COOKIE){
+        cookie_valid = check_cookie(conn, hs->R1, M1 + offset + sizeof(uint32_t));
+        offset += sizeof(uint32_t) + COOKIE_SIZE;
+    }
+    if(cookie_mode && !cookie_valid)
+        return send_cookie(conn, hs->R1)? HANDSHAKE_COOKIE_SENT: -1;
+
+    hs->user_id = get_user_id_by_username(client_username);
+    if(hs->user_id == -1){
+        log("ERROR unknown user " + client_username);
         return -1;
     }
-    
+    if(get_user_socket_by_user_id(hs->user_id) != -1){
+        log("ERROR user already online");
+        return -1;
+    }
+
+    if(hs->offered_caps & CAP_RESUME){
+        uint32_t generation;
+        int ret = resume_session(conn, M1, M1_len, offset, &generation);
+        if(ret != 0)
+            return (ret == 1)? complete_login(conn, hs->user_id, generation): -1;
+        vlog("Session of " + client_username + " not resumed, full handshake");
+    }
+
+    //M2 is sent once the crypto pool has signed it
+    return sign_M2(conn)? HANDSHAKE_PENDING: -1;
+}
+
+/**
+ * @brief handle M3 (ephemeral key length, ephemeral key of the client, signature length, signature of the key and R2):
+ * queue the verification with the registered key of the user for the crypto pool
+ * @return HANDSHAKE_PENDING or -1 in case of errors
+ */
+int handle_M3(connection* conn, uchar* M3, uint M3_len){
+    handshake* hs = conn->hs;
+    uint32_t eph_pubkey_c_len;
+    memcpy(&eph_pubkey_c_len, M3, sizeof(uint32_t));
     eph_pubkey_c_len = ntohl(eph_pubkey_c_len);
-    //eph_pubkey_c_len =178;
+    uchar* eph_pubkey_c = M3 + sizeof(uint32_t);
     vlog("M3 auth (1) pubkey_c_len: "+ to_string(eph_pubkey_c_len));
 
-    uchar* eph_pubkey_c = (uchar*)malloc(eph_pubkey_c_len);
-    if(!eph_pubkey_c ){
-        errorHandler(MALLOC_ERR);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
+    uint32_t m3_signature_len;
+    memcpy(&m3_signature_len, eph_pubkey_c + eph_pubkey_c_len, sizeof(uint32_t));
+    m3_signature_len = ntohl(m3_signature_len);
+    uchar* M3_signed = eph_pubkey_c + eph_pubkey_c_len + sizeof(uint32_t);
+    vlog("M3 auth (3) m3_signature_len: "+ to_string(m3_signature_len));
+
+    //The cache only hands out the public key registered for the user
+    void* pubkey_of_client = pubkey_cache_get_parsed(hs->user_id);
+    if(!pubkey_of_client){
+        log("Unable to obtain the pubkey of user " + to_string(hs->user_id));
         return -1;
     }
 
-    ret = recv(comm_socket_id, eph_pubkey_c, eph_pubkey_c_len, 0);
-    if(ret <= 0 || ret != eph_pubkey_c_len){
-        errorHandler(REC_ERR);
-        free(R2);
-        free(eph_pubkey_c);
+    //Signed document: ephemeral key of the client and R2
+    crypto_job* job = crypto_job_new(CRYPTO_JOB_VERIFY);
+    if(!job){
+        errorHandler(MALLOC_ERR);
         return -1;
     }
-    // log("M3 auth (2) pubkey_c:");
-    // BIO_dump_fp(stdout, (const char*)eph_pubkey_c, eph_pubkey_c_len);
-
-    uint32_t m3_signature_len;
-    ret = recv(comm_socket_id, &m3_signature_len, sizeof(uint32_t), 0);
-    if(ret <= 0){
-        errorHandler(REC_ERR);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_c, eph_pubkey_c_len);
+    job->document_len = eph_pubkey_c_len + NONCE_SIZE;
+    job->document = (uchar*)malloc(job->document_len);
+    job->signature_len = m3_signature_len;
+    job->signature = (uchar*)malloc(m3_signature_len);
+    if(!job->document || !job->signature){
+        errorHandler(MALLOC_ERR);
+        crypto_job_free(job);
         return -1;
     }
-    m3_signature_len = ntohl(m3_signature_len);
-    vlog("M3 auth (3) m3_signature_len: "+ to_string(m3_signature_len));
+    memcpy(job->document, eph_pubkey_c, eph_pubkey_c_len);
+    memcpy(job->document + eph_pubkey_c_len, hs->R2, NONCE_SIZE);
+    memcpy(job->signature, M3_signed, m3_signature_len);
+    job->key = pubkey_of_client;
+    job->owner = conn;
+    hs->job = job;
+    vlog("auth (5) M3, verifying sign");
+    crypto_pool_submit(job);
+    return HANDSHAKE_PENDING;
+}
 
-    uchar* M3_signed = (uchar*)malloc(m3_signature_len);
-    if(!M3_signed){
+/**
+ * @brief queue for the crypto pool the derivation of the session key, from the ephemeral key of the server and the one
+ * of the client in M3
+ * @param verify_job verification of M3, its document starts with the ephemeral key of the client
+ * @return HANDSHAKE_PENDING or -1 in case of errors
+ */
+int derive_M3_session_key(connection* conn, crypto_job* verify_job){
+    handshake* hs = conn->hs;
+    crypto_job* job = crypto_job_new(CRYPTO_JOB_DERIVE);
+    if(!job){
         errorHandler(MALLOC_ERR);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_c, eph_pubkey_c_len);
         return -1;
     }
-    ret = recv(comm_socket_id, M3_signed, m3_signature_len, 0);
-    if(ret <= 0){
-        errorHandler(REC_ERR);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_c, eph_pubkey_c_len);
-        safe_free(M3_signed, m3_signature_len);
+    job->peer_key_len = verify_job->document_len - NONCE_SIZE;
+    job->peer_key = (uchar*)malloc(job->peer_key_len);
+    if(!job->peer_key){
+        errorHandler(MALLOC_ERR);
+        crypto_job_free(job);
+        return -1;
+    }
+    memcpy(job->peer_key, verify_job->document, job->peer_key_len);
+    //The ephemeral private key now belongs to the job
+    job->key = hs->eph_privkey;
+    hs->eph_privkey = nullptr;
+    job->caps = conn->caps;
+    job->owner = conn;
+    hs->job = job;
+    vlog("auth (6) Creating session key");
+    crypto_pool_submit(job);
+    return HANDSHAKE_PENDING;
+}
+
+/**
+ * @brief go on with a handshake whose job of the crypto pool has been completed: send M2 after its signature, derive
+ * the session key after the verification of M3, log the user in after the derivation
+ * @return user_id of the client once it is logged in, HANDSHAKE_PENDING if the handshake goes on, -1 in case of errors
+ */
+int handle_crypto_job(connection* conn, crypto_job* job){
+    conn->hs->job = nullptr;
+    if(job->kind == CRYPTO_JOB_SIGN){
+        if(!job->result){
+            log("Error on signing part on M2");
+            return -1;
+        }
+        if(!send_M2(conn, job))
+            return -1;
+        conn->state = CONN_WAIT_M3;
+        return HANDSHAKE_PENDING;
+    }
+    if(job->kind == CRYPTO_JOB_VERIFY){
+        if(!job->result){
+            log("Failed sign verification on M3");
+            return -1;
+        }
+        return derive_M3_session_key(conn, job);
+    }
+    if(!job->result){
+        log("Failed derivation of the session key");
+        return -1;
+    }
+    conn->session_key = job->session_key;
+    conn->session_key_len = job->session_key_len;
+    job->session_key = nullptr;
+    conn->session = auth_enc_session_new(conn->session_key, conn->caps, false);
+    if(conn->session == nullptr){
+        log("Failed creation of the session");
         return -1;
     }
+    //A full handshake invalidates the tickets issued before
+    return complete_login(conn, conn->hs->user_id, renew_user_ticket(conn->hs->user_id));
+}
 
-    // log("auth (4) M3 signed:");
-    // BIO_dump_fp(stdout, (const char*)M3_signed, m3_signature_len);
+/**
+ * @brief read a length field of the message in the handshake buffer (the capabilities in its high byte included)
+ * @return 1 if the field has been received, 0 otherwise
+ */
+int read_handshake_field(handshake* hs, uint offset, uint32_t* value){
+    if(hs->buffer_len < offset + sizeof(uint32_t))
+        return 0;
+    memcpy(value, hs->buffer + offset, sizeof(uint32_t));
+    *value = ntohl(*value);
+    return 1;
+}
 
-    string pubkey_of_client_path = "certification/" + client_username + "_pubkey.pem";
-    FILE* pubkey_of_client = fopen(pubkey_of_client_path.c_str(), "rb");
-    if(!pubkey_of_client){
-        log("Unable to open pubkey of client");
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_c, eph_pubkey_c_len);
-        safe_free(M3_signed, m3_signature_len);
-        return -1;
+/**
+ * @brief length of the handshake message that the client of conn is sending, M1 or M3 depending on the state
+ * @return length of the message once it is all in the handshake buffer, 0 if more bytes are needed, -1 if the message
+ * is not valid
+ */
+int handshake_message_length(connection* conn){
+    handshake* hs = conn->hs;
+    uint length = 0;
+    uint32_t field;
+    if(conn->state == CONN_WAIT_M1){
+        length = NONCE_SIZE;
+        if(!read_handshake_field(hs, length, &field))
+            return 0;
+        uint8_t offered_caps = field >> CAPS_SHIFT;
+        field &= CAPS_LEN_MASK;
+        if(field == 0 || field > MAX_USERNAME_SIZE){
+            log("ERROR invalid username size");
+            return -1;
+        }
+        length += sizeof(uint32_t) + field;
+        if(offered_caps & CAP_COOKIE){
+            if(!read_handshake_field(hs, length, &field))
+                return 0;
+            if(field != COOKIE_SIZE){
+                log("ERROR invalid cookie size");
+                return -1;
+            }
+            length += sizeof(uint32_t) + field;
+        }
+        if(offered_caps & CAP_RESUME){
+            if(!read_handshake_field(hs, length, &field))
+                return 0;
+            if(field == 0 || field > MAX_TICKET_SIZE){
+                log("ERROR invalid session ticket size");
+                return -1;
+            }
+            length += sizeof(uint32_t) + field + RESUMPTION_BINDER_SIZE;
+        }
     }
-
-    if(eph_pubkey_c_len > UINT_MAX - NONCE_SIZE){
-        log("ERROR unsigned wrap");
-        return -1;
+    else{
+        //Ephemeral key and signature, each one preceded by its length
+        for(int i = 0; i < 2; i++){
+            if(!read_handshake_field(hs, length, &field))
+                return 0;
+            if(field == 0 || field > HANDSHAKE_BUFFER_SIZE){
+                log("ERROR invalid size of a field of M3");
+                return -1;
+            }
+            length += sizeof(uint32_t) + field;
+        }
     }
-    uint m3_document_size = eph_pubkey_c_len + NONCE_SIZE;
-    uchar* m3_document = (uchar*)malloc(m3_document_size);
-    if(!m3_document){
-        errorHandler(MALLOC_ERR);
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_c, eph_pubkey_c_len);
-        safe_free(M3_signed, m3_signature_len);
-        fclose(pubkey_of_client);
+    if(length > HANDSHAKE_BUFFER_SIZE){
+        log("ERROR handshake message too long");
         return -1;
     }
+    return (hs->buffer_len >= length)? length: 0;
+}
 
-    memcpy(m3_document, eph_pubkey_c,eph_pubkey_c_len );
-    memcpy(m3_document+eph_pubkey_c_len, R2, NONCE_SIZE);
-    vlog("auth (5) M3, verifying sign");
-    ret = verify_sign_pubkey(M3_signed, m3_signature_len,m3_document,m3_document_size, pubkey_of_client);
+/**
+ * @brief read the bytes available from the client of conn and handle the handshake messages that are complete.
+ * On success the session key is stored in the connection
+ * @return user_id of the client once it is logged in, HANDSHAKE_PENDING if the handshake waits for more bytes,
+ * HANDSHAKE_COOKIE_SENT if the client has been asked for a cookie, -1 in case of errors
+ */
+int handle_client_handshake(connection* conn){
+    handshake* hs = conn->hs;
+    int ret = recv(conn->socket_id, hs->buffer + hs->buffer_len, HANDSHAKE_BUFFER_SIZE - hs->buffer_len, MSG_DONTWAIT);
     if(ret == 0){
-        log("Failed sign verification on M3");
-        safe_free(R2, NONCE_SIZE);
-        safe_free_privkey(eph_privkey_s);
-        safe_free(eph_pubkey_c, eph_pubkey_c_len);
-        safe_free(M3_signed, m3_signature_len);
-        fclose(pubkey_of_client);
+        log("Connection closed by the client during the handshake");
         return -1;
     }
-    fclose(pubkey_of_client);
-    uchar* shared_seceret;
-    uint shared_seceret_len;
-    vlog("auth (6) Creating session key");
-    shared_seceret_len = derive_secret(eph_privkey_s, eph_pubkey_c, eph_pubkey_c_len, &shared_seceret);
-    if(shared_seceret_len == 0){
-        log("Failed derive secret");
-        safe_free(eph_pubkey_c, eph_pubkey_c_len);
-        safe_free(M3_signed, m3_signature_len);
-        return -1;    
-    }
-    // log("Shared Secret!");
-    // BIO_dump_fp(stdout, (const char*) shared_seceret, shared_seceret_len); 
-    session_key_len=default_digest(shared_seceret, shared_seceret_len, &session_key);
-    if(session_key_len == 0){
-        log("Failed digest computation of the secret");
-        safe_free(eph_pubkey_c, eph_pubkey_c_len);
-        safe_free(M3_signed, m3_signature_len);
-        safe_free(shared_seceret, shared_seceret_len);
-        return -1;    
-    }
-    // log("Session key generated!");
-    // BIO_dump_fp(stdout, (const char*) session_key, session_key_len);
-    safe_free(eph_pubkey_c, eph_pubkey_c_len);
-    safe_free(M3_signed, m3_signature_len);
-    safe_free(shared_seceret, shared_seceret_len);
-    //Send user id of the client 
-    int client_user_id = get_user_id_by_username(client_username);
-    int client_user_id_net = htonl(client_user_id);
-    vlog("Found username in the datastore with user_id " + to_string(client_user_id_net));
-
-    //Set that user is online
-    ret = set_user_socket(client_username, comm_socket_id);
-    if(ret == -1){
-        log("ERROR on set_user_socket");
-        safe_free((uchar*)username, client_username_len);
-        safe_free(R1, NONCE_SIZE);
+    if(ret < 0){
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return HANDSHAKE_PENDING;
+        errorHandler(REC_ERR);
         return -1;
     }
-
-    //SEND User id
-    uchar* userID_msg=(uchar*)malloc(5);
-    *userID_msg=USRID;
-    memcpy(userID_msg+1, &client_user_id_net,4);
-    
-    ret = send_secure(comm_socket_id, userID_msg, 5);
-    if(ret == 0){
-        log("Error on send secure");
+    hs->buffer_len += ret;
+    //The client sends nothing while it waits for M2 or for its user id
+    if(hs->job != nullptr){
+        log("ERROR unexpected bytes during the handshake");
         return -1;
     }
 
-    
-    //Check if present in the user_datastore
-    free(username);
-    return get_user_id_by_username(client_username);
+    int message_len = handshake_message_length(conn);
+    if(message_len <= 0)
+        return (message_len == 0)? HANDSHAKE_PENDING: -1;
+    if(conn->state == CONN_WAIT_M1)
+        ret = handle_M1(conn, hs->buffer, message_len);
+    else
+        ret = handle_M3(conn, hs->buffer, message_len);
+    //The client sends M3 only after M2 and nothing after M3 until it receives its user id
+    if(ret != HANDSHAKE_COOKIE_SENT && hs->buffer_len != (uint)message_len){
+        log("ERROR unexpected bytes after a handshake message");
+        return -1;
+    }
+    hs->buffer_len = 0;
+    return ret;
 }
 
 
@@ -1203,8 +1514,8 @@ int handle_client_authentication(string pwd_for_keys){
  *  Handle the response to the client for the !users_online command
  *  @return 0 in case of success, -1 in case of error
  */
-int handle_get_online_users(int comm_socket_id, uchar* plaintext){
-    if(comm_socket_id < 0 || plaintext == nullptr){
+int handle_get_online_users(connection* conn, uchar* plaintext){
+    if(conn == nullptr || plaintext == nullptr){
         log("Invalid input parameters on handle_get_online_users");
         return -1;
     }
@@ -1213,26 +1524,34 @@ int handle_get_online_users(int comm_socket_id, uchar* plaintext){
     int ret;
     uint offset_reply = 0; 
     unsigned char online_cmd = ONLINE_CMD;
-    user_info* user_datastore_copy = get_user_datastore_copy();
+    //The reply has to fit in one message: with many users online only the first ones that fit are listed
+    uint32_t max_listed = (RELAY_MSG_SIZE - 9) / (2*sizeof(int) + 1);
+    uint32_t listed;
+    online_user* online_users_copy = get_online_users_copy(max_listed, &listed);
+    if(!online_users_copy)
+        return -1;
 
     //Need to calculate how much space to allocate and send (limited users and username sizes in this context, can't overflow those values)
     int total_space_to_allocate = 9; 
     int online_users = 0; //also num_pairs
     
-    for(int i=0; i<REGISTERED_USERS; i++){
-        //Count only online users
-        if(user_datastore_copy[i].socket_id != -1){
-            total_space_to_allocate += user_datastore_copy[i].username.length() + 8;
-            online_users++;
-        }
+    for(uint32_t i=0; i<listed; i++){
+        int entry_size = strlen(online_users_copy[i].username) + 8;
+        if(total_space_to_allocate + entry_size > RELAY_MSG_SIZE)
+            break;
+        total_space_to_allocate += entry_size;
+        online_users++;
     }
 
     vlog("Calculated reply size (pt): " + to_string(total_space_to_allocate));
     
     //Copy various fields in the reply msg
-    uchar* replyToSend = (uchar*)malloc(total_space_to_allocate);
-    if(!replyToSend)
+    uchar* replyToSend = secure_buffer_alloc(total_space_to_allocate);
+    if(!replyToSend){
         errorHandler(MALLOC_ERR);
+        free(online_users_copy);
+        return -1;
+    }
     uint32_t online_users_to_send = htonl(online_users);
     
     //Copy OPCODE and NUM_PAIRS
@@ -1241,27 +1560,25 @@ int handle_get_online_users(int comm_socket_id, uchar* plaintext){
     memcpy(replyToSend+offset_reply, (void*)&online_users_to_send, sizeof(int));
     offset_reply += sizeof(int);
 
-    for(int i=0; i<REGISTERED_USERS; i++){
+    for(int i=0; i<online_users; i++){
 
         //Copy ID, USERNAME_LENGTH and USERNAME for online users
-        if(user_datastore_copy[i].socket_id != -1){
-            int curr_username_length = user_datastore_copy[i].username.length();
-            uint32_t i_to_send = htonl(i);
-            uint32_t curr_username_length_to_send = htonl(curr_username_length);
-            
-            memcpy(replyToSend + offset_reply, (void*)&i_to_send, sizeof(int));
-            offset_reply += sizeof(int);
-            memcpy(replyToSend + offset_reply, (void*)&curr_username_length_to_send, sizeof(int));
-            offset_reply += sizeof(int);
-            memcpy(replyToSend + offset_reply, (void*)user_datastore_copy[i].username.c_str(), curr_username_length);
-            offset_reply += curr_username_length;
-        }
+        int curr_username_length = strlen(online_users_copy[i].username);
+        uint32_t i_to_send = htonl(online_users_copy[i].user_id);
+        uint32_t curr_username_length_to_send = htonl(curr_username_length);
+        
+        memcpy(replyToSend + offset_reply, (void*)&i_to_send, sizeof(int));
+        offset_reply += sizeof(int);
+        memcpy(replyToSend + offset_reply, (void*)&curr_username_length_to_send, sizeof(int));
+        offset_reply += sizeof(int);
+        memcpy(replyToSend + offset_reply, (void*)online_users_copy[i].username, curr_username_length);
+        offset_reply += curr_username_length;
     }
     vlog("Offset reply: " + to_string(offset_reply));
-    ret = send_secure(comm_socket_id, (uchar*)replyToSend, offset_reply);
+    ret = send_secure(conn, (uchar*)replyToSend, offset_reply);
     if(ret == 0){
-        safe_free(replyToSend, total_space_to_allocate);
-        safe_free((uchar*)user_datastore_copy, REGISTERED_USERS*sizeof(user_info));
+        secure_buffer_free(replyToSend);
+        free(online_users_copy);
         errorHandler(SEND_ERR);
         return -1;
     }
@@ -1269,8 +1586,8 @@ int handle_get_online_users(int comm_socket_id, uchar* plaintext){
     // log("Sent to client (pt): ");
     // BIO_dump_fp(stdout, (const char*)replyToSend, ret);
         
-    safe_free(replyToSend, total_space_to_allocate);
-    safe_free((uchar*)user_datastore_copy, REGISTERED_USERS*sizeof(user_info));
+    secure_buffer_free(replyToSend);
+    free(online_users_copy);
     return 0;    
 }
 
@@ -1280,8 +1597,9 @@ int handle_get_online_users(int comm_socket_id, uchar* plaintext){
  *  @brief Handle the response to the client for the !chat command
  *  @return 0 in case of success, -1 in case of error
  */
-int handle_chat_request(int comm_socket_id, int client_user_id, msg_to_relay& relay_msg, uchar* plaintext, uint plain_len){
-    if(comm_socket_id < 0 || client_user_id < 0 || client_user_id >= REGISTERED_USERS || plaintext == nullptr){
+int handle_chat_request(connection* conn, msg_to_relay& relay_msg, uchar* plaintext, uint plain_len){
+    int client_user_id = (conn == nullptr)? -1: conn->user_id;
+    if(!valid_user_id(client_user_id) || plaintext == nullptr){
         log("Invalid input parameters on handle_chat_request");
         return -1;
     }
@@ -1303,7 +1621,7 @@ int handle_chat_request(int comm_socket_id, int client_user_id, msg_to_relay& re
     memcpy(&peer_user_id_net,(const void*)(plaintext + offset_plaintext),sizeof(int));
     offset_plaintext += sizeof(int);
     int peer_user_id = ntohl(peer_user_id_net);
-    if(peer_user_id < 0 || peer_user_id >= REGISTERED_USERS){
+    if(!valid_user_id(peer_user_id)){
         log("ERROR: invalid value of peer user id in handle_chat_request");
         return -1;
     }
@@ -1331,34 +1649,31 @@ int handle_chat_request(int comm_socket_id, int client_user_id, msg_to_relay& re
     memcpy((void*)(relay_msg.buffer + offset_relay), (void*)username, client_username_length);
     offset_relay += client_username_length;
 
-    string pubkey_of_client_path = "certification/" + client_username + "_pubkey.pem";
-    vlog("Opening " + pubkey_of_client_path);
-    FILE* pubkey_of_client_file = fopen(pubkey_of_client_path.c_str(), "rb");
-    if(!pubkey_of_client_file){
-        log("Unable to open pubkey of client");
+    //The public key field has a fixed size: shorter keys (Ed25519) are padded with zeros, PEM parsing stops at their end
+    uchar pubkey_client_ser[PUBKEY_CACHE_MAX_SER] = {0};
+    uint32_t pubkey_client_ser_len = pubkey_cache_get_serialized(client_user_id, pubkey_client_ser);
+    if(pubkey_client_ser_len == 0 || pubkey_client_ser_len > PUBKEY_DEFAULT_SER){
+        log("ERROR on pubkey_cache_get_serialized");
         return -1;
     }
-    uchar* pubkey_client_ser;
-    int pubkey_client_ser_len = serialize_pubkey_from_file(pubkey_of_client_file, &pubkey_client_ser);
+    pubkey_client_ser_len = PUBKEY_DEFAULT_SER;
     // log("Pubkey ser len : " + to_string(pubkey_client_ser_len) + "(default: " + to_string(PUBKEY_DEFAULT_SER) + "), pubkey_ser:");
     // BIO_dump_fp(stdout, (const char*)pubkey_client_ser, pubkey_client_ser_len);
 
     memcpy((void*)(relay_msg.buffer + offset_relay), (void*)pubkey_client_ser, pubkey_client_ser_len);
     offset_relay += pubkey_client_ser_len;
     
-    uint8_t opcode = relay_msg.buffer[0];
-
-    int final_response_len;
-    if(opcode == CHAT_NEG)
-        final_response_len = 5;
-    else
-        final_response_len = 5 + PUBKEY_DEFAULT_SER;
     vlog("Relaying ");
     // BIO_dump_fp(stdout, relay_msg.buffer, offset_relay);    
     vlog("Handle chat request (2)");
 
-    //Handle case user is offline
-    if(get_user_socket_by_user_id(peer_user_id) == -1 || !test_user_busy_by_user_id(peer_user_id)){
+    //From now on the answer of the peer (or the CHAT_NEG of the server) is handled by deliver_relay
+    conn->state = CONN_WAIT_CHAT_REPLY;
+    conn->chat_peer_id = peer_user_id;
+
+    //Handle case user is offline, or its worker cannot accept the request now (ring full)
+    if(get_user_socket_by_user_id(peer_user_id) == -1 || !test_user_busy_by_user_id(peer_user_id) ||
+        0 != relay_write(peer_user_id, relay_msg, offset_relay)){
         log("User: " + to_string(peer_user_id) + "is offline or busy. Sending CHAT_NEG");
         uchar chat_cmd = CHAT_NEG;
         offset_relay = 0; 
@@ -1366,29 +1681,12 @@ int handle_chat_request(int comm_socket_id, int client_user_id, msg_to_relay& re
         offset_relay += sizeof(uchar);
         memcpy((void*)(relay_msg.buffer + offset_relay), (void*)&peer_user_id_net, sizeof(int));
         offset_relay += sizeof(int);
-        relay_write(client_user_id, relay_msg);
+        relay_write(client_user_id, relay_msg, offset_relay);
         return 0;
     }
 
-    relay_write(peer_user_id, relay_msg);
-
-    //Wait for response to the own named message queue (blocking)
+    //The reply of the peer will be sent to the client when it is relayed to this connection
     vlog("Handle chat request (3)");
-    relay_read(client_user_id, relay_msg, true); 
-    memcpy((void*)(relay_msg.buffer + 1), (void*)&peer_user_id, sizeof(int));    
-
-    
-    vlog("Handle chat request (4)");
-    // Send reply of the peer to the client
-    ret = send_secure(comm_socket_id, (uchar*)relay_msg.buffer, final_response_len);
-    if(ret == 0){
-        errorHandler(SEND_ERR);
-        return -1;
-    }
-    if(!set_user_busy_by_user_id(client_user_id, 0)){
-        log("ERROR: setting user busy while e ending requesting to chat \n");
-        return -1;
-    }
     return 0;    
 }
 
@@ -1397,8 +1695,8 @@ int handle_chat_request(int comm_socket_id, int client_user_id, msg_to_relay& re
  * @brief handle CHAT_POS and CHAT_NEG commands
  * @return -1 in case of errors, 0 in case of success
  */
-int handle_chat_pos_neg(uchar* plaintext, uint8_t opcode, uint plain_len){
-    if(plaintext == nullptr){
+int handle_chat_pos_neg(connection* conn, uchar* plaintext, uint8_t opcode, uint plain_len){
+    if(conn == nullptr || plaintext == nullptr){
         log("ERROR invalid parameter on handle_chat_pos_neg");
         return -1;
     }
@@ -1434,7 +1732,7 @@ int handle_chat_pos_neg(uchar* plaintext, uint8_t opcode, uint plain_len){
     // }
 
     int peer_user_id = ntohl(peer_user_id_net);
-    if(peer_user_id < 0 || peer_user_id >= REGISTERED_USERS){
+    if(!valid_user_id(peer_user_id)){
         log("INVALID peer_user_id on handle_chat_pos_neg");
         return -1;
     }
@@ -1446,22 +1744,15 @@ int handle_chat_pos_neg(uchar* plaintext, uint8_t opcode, uint plain_len){
     memcpy((void*)(relay_msg.buffer + offset_relay), (void*)&peer_user_id_net, sizeof(int));
     offset_relay += sizeof(int);
     if(opcode == CHAT_POS){
-        string client_username = get_username_by_user_id(client_user_id);
-        if(client_username.empty()){
-            log("ERROR on get_username_by_user_id");
-            return -1;
-        }
-        string pubkey_of_client_path = "certification/" + client_username + "_pubkey.pem";
-        vlog("Opening " + pubkey_of_client_path);
-        FILE* pubkey_of_client_file = fopen(pubkey_of_client_path.c_str(), "rb");
-        if(!pubkey_of_client_file){
-            log("Unable to open pubkey of client");
+        //Adding pubkey
+        //Padded with zeros to the fixed size of the field, as in handle_chat_request
+        uchar pubkey_client_ser[PUBKEY_CACHE_MAX_SER] = {0};
+        uint32_t pubkey_client_ser_len = pubkey_cache_get_serialized(conn->user_id, pubkey_client_ser);
+        if(pubkey_client_ser_len == 0 || pubkey_client_ser_len > PUBKEY_DEFAULT_SER){
+            log("ERROR on pubkey_cache_get_serialized");
             return -1;
         }
-        
-        //Adding pubkey
-        uchar* pubkey_client_ser;
-        int pubkey_client_ser_len = serialize_pubkey_from_file(pubkey_of_client_file, &pubkey_client_ser);
+        pubkey_client_ser_len = PUBKEY_DEFAULT_SER;
         vlog("Pubkey ser len : " + to_string(pubkey_client_ser_len) + "(default: " + to_string(PUBKEY_DEFAULT_SER) + "), pubkey_client_ser:");
         // BIO_dump_fp(stdout, (const char*)pubkey_client_ser, pubkey_client_ser_len);
 
@@ -1484,7 +1775,8 @@ int handle_chat_pos_neg(uchar* plaintext, uint8_t opcode, uint plain_len){
     //     relay_write(peer_user_id, relay_msg);
     //     return 0;
     // }
-    relay_write(peer_user_id, relay_msg);
+    if(RELAY_RING_FULL == relay_write(peer_user_id, relay_msg, offset_relay))
+        return park_relay(conn, peer_user_id, relay_msg, offset_relay);
     return 0;
 }
 
@@ -1493,7 +1785,11 @@ int handle_chat_pos_neg(uchar* plaintext, uint8_t opcode, uint plain_len){
  * @brief handles AUTH and CHAT_RESPONSE commands
  * @return -1 in case of errors, 0 instead
  */
-int handle_auth_and_msg(uchar* plaintext, uint8_t opcode, int plaintext_len){
+int handle_auth_and_msg(connection* conn, uchar* plaintext, uint8_t opcode, int plaintext_len){
+#ifdef RELAY_TIMESTAMPS
+    struct timespec ingress;
+    clock_gettime(CLOCK_MONOTONIC, &ingress);
+#endif
     if(opcode == AUTH)
         log("\n *** AUTH (" + to_string(opcode) + ") ***\n");
     else if(opcode == CHAT_RESPONSE) 
@@ -1523,6 +1819,20 @@ int handle_auth_and_msg(uchar* plaintext, uint8_t opcode, int plaintext_len){
     offset_relay += sizeof(int);
     memcpy((void*)(relay_msg.buffer + offset_relay), (void*)(plaintext + 5), plaintext_len - 5);
     offset_relay += (plaintext_len - 5);
+#ifdef RELAY_TIMESTAMPS
+    //The trailer of the stamps is relayed and sent to the recipient with the message
+    if(opcode == CHAT_RESPONSE){
+        if(offset_relay + RELAY_STAMPS_SIZE > RELAY_MSG_SIZE){
+            log("ERROR: no space for the relay timestamps");
+            return -1;
+        }
+        uint64_t stamps[RELAY_STAMPS] = {(uint64_t)ingress.tv_sec * 1000000000 + ingress.tv_nsec};
+        memcpy((void*)(relay_msg.buffer + offset_relay), (void*)stamps, RELAY_STAMPS_SIZE);
+        offset_relay += RELAY_STAMPS_SIZE;
+        plain_len_without_seq += RELAY_STAMPS_SIZE;
+        memcpy((void*)(relay_msg.buffer + 1), (void*)&plain_len_without_seq, sizeof(int));
+    }
+#endif
     vlog("plain_len_without_seq: " + to_string(plain_len_without_seq));
     vlog("Relaying: ");
     // BIO_dump_fp(stdout, relay_msg.buffer, offset_relay);
@@ -1536,41 +1846,501 @@ int handle_auth_and_msg(uchar* plaintext, uint8_t opcode, int plaintext_len){
         offset_relay += sizeof(uchar);
         memcpy((void*)(relay_msg.buffer + offset_relay), (void*)&peer_user_id_net, sizeof(int));
         offset_relay += sizeof(int);
-        relay_write(client_user_id, relay_msg);
+        relay_write(conn->user_id, relay_msg, offset_relay);
         return 0;
     }
-    return relay_write(peer_user_id, relay_msg);
+    if(RELAY_RING_FULL == relay_write(peer_user_id, relay_msg, offset_relay))
+        return park_relay(conn, peer_user_id, relay_msg, offset_relay);
+    return 0;
+}
+
+
+
+// ---------------------------------------------------------------------
+// FUNCTIONS of the EVENT LOOP
+// ---------------------------------------------------------------------
+
+/**
+ * @return current time in ms of CLOCK_MONOTONIC
+ */
+uint64_t monotonic_ms(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief release the state of the handshake of conn, once it is over or when the connection is closed
+ */
+void end_handshake(connection* conn){
+    //A job still running is released by the event loop once it is completed
+    if(conn->hs->job)
+        conn->hs->job->owner = nullptr;
+    if(conn->hs->eph_privkey)
+        safe_free_privkey(conn->hs->eph_privkey);
+    free(conn->hs->eph_pubkey);
+    OPENSSL_cleanse(conn->hs, sizeof(handshake));
+    delete conn->hs;
+    conn->hs = nullptr;
+    handshakes_in_progress--;
+}
+
+/**
+ * @brief close the connections whose handshake is not over by its deadline
+ * @return ms until the next deadline, -1 if there are no handshakes in progress
+ */
+int close_expired_handshakes(){
+    uint64_t now = monotonic_ms();
+    while(!handshake_deadlines.empty()){
+        int socket_id = handshake_deadlines.front().first;
+        uint64_t deadline = handshake_deadlines.front().second;
+        connection* conn = ((size_t)socket_id < connections.size())? connections[socket_id]: nullptr;
+        //The socket id may belong by now to a connection that has completed its handshake or to a newer one
+        if(conn == nullptr || conn->hs == nullptr || conn->hs->deadline != deadline){
+            handshake_deadlines.pop_front();
+            continue;
+        }
+        if(deadline > now)
+            return deadline - now;
+        handshake_deadlines.pop_front();
+        log("Handshake timeout, connection closed");
+        close_connection(conn);
+    }
+    return -1;
+}
+
+/**
+ * @brief log the statistics of the pools of this worker, at most once every POOL_STATS_INTERVAL seconds and only if
+ * some connection has been closed since the last log
+ * @return ms until the next log
+ */
+int log_pool_stats(){
+    uint64_t now = monotonic_ms();
+    if(now < next_stats_log)
+        return next_stats_log - now;
+    if(closed_since_stats > 0){
+        secure_pool_log_stats();
+        eph_key_pool_log_stats();
+        crypto_pool_log_stats();
+        closed_since_stats = 0;
+    }
+    next_stats_log = now + POOL_STATS_INTERVAL * 1000;
+    return POOL_STATS_INTERVAL * 1000;
+}
+
+/**
+ * @brief logout the user of the connection, remove its socket from the event loop and free the connection state
+ */
+void close_connection(connection* conn){
+    if(conn == nullptr)
+        return;
+    if(conn->user_id != -1)
+        clear_user_socket(conn->user_id, conn->socket_id, worker_id);
+    if(conn->hs)
+        end_handshake(conn);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->socket_id, NULL);
+    close(conn->socket_id);
+    connections[conn->socket_id] = nullptr;
+    if(conn->session_key)
+        safe_free(conn->session_key, conn->session_key_len);
+    auth_enc_session_free(conn->session);
+    secure_buffer_free(conn->parked_relay);
+    secure_buffer_free(conn->recv_buffer);
+    delete conn;
+    closed_since_stats++;
 }
 
+/**
+ * @brief turn the cookie mode on when the accept queue of the listening socket or the handshakes in progress in this
+ * worker reach COOKIE_QUEUE_THRESHOLD clients, and off when they are back under half of it
+ */
+void update_cookie_mode(int listen_socket_id){
+    if(COOKIE_QUEUE_THRESHOLD == 0)
+        return;
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if(-1 == getsockopt(listen_socket_id, IPPROTO_TCP, TCP_INFO, &info, &len))
+        return;
+    //For a listening socket tcpi_unacked is the number of connections in the accept queue
+    uint waiting = max(info.tcpi_unacked, handshakes_in_progress);
+    bool overloaded = cookie_mode? waiting > COOKIE_QUEUE_THRESHOLD / 2: waiting >= COOKIE_QUEUE_THRESHOLD;
+    if(overloaded != cookie_mode){
+        cookie_mode = overloaded;
+        log(string("Cookie mode ") + (cookie_mode? "on": "off") + ", " + to_string(info.tcpi_unacked) +
+            " clients in the accept queue, " + to_string(handshakes_in_progress) + " handshakes in progress");
+    }
+}
 
+/**
+ * @brief accept a new client and add its socket to the event loop, its handshake goes on as its messages arrive
+ * @return -1 in case of errors on the listening socket, 0 otherwise
+ */
+int handle_new_connection(int listen_socket_id){
+    update_cookie_mode(listen_socket_id);
+    struct sockaddr_in cl_addr;
+    socklen_t len = sizeof(cl_addr);
+    //The sockets of the clients do not block: what a client does not read yet is queued by send_or_queue
+    int socket_id = accept4(listen_socket_id, (struct sockaddr *)&cl_addr, &len, SOCK_NONBLOCK);
+    if(socket_id == -1){
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+            return 0;
+        log("ERROR on accept: " + string(strerror(errno)));
+        return (errno == EMFILE || errno == ENFILE)? 0: -1;
+    }
+    log("Connection established with client");
+
+    if((size_t)socket_id >= connections.size())
+        connections.resize(socket_id + 1, nullptr);
+    connection* conn = new connection();
+    conn->socket_id = socket_id;
+    conn->hs = new handshake();
+    conn->hs->deadline = monotonic_ms() + HANDSHAKE_TIMEOUT * 1000;
+    connections[socket_id] = conn;
+    handshakes_in_progress++;
+    handshake_deadlines.emplace_back(socket_id, conn->hs->deadline);
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.fd = socket_id;
+    if(-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_id, &event)){
+        log("ERROR on epoll_ctl");
+        close_connection(conn);
+    }
+    return 0;
+}
 
-int main(){
-    //Create shared memory for mantaining info about users
-    int ret=system("sudo sysctl -w kernel.msgmni=16384 kernel.msgmax=120000 kernel.msgmnb=600000");
-    if(ret<0){
-        log("failed to initialize kernel variables for message queue");
+/**
+ * @brief act on the result of a step of the handshake of conn: the connection is closed on errors and after a cookie,
+ * the client is served once it is logged in
+ * @param user_id result of the step (handle_client_handshake, handle_crypto_job)
+ * @return 0 if the connection has to be kept open, -1 if it has to be closed
+ */
+int end_handshake_step(connection* conn, int user_id){
+    if(user_id == HANDSHAKE_PENDING)
         return 0;
+    if(user_id == HANDSHAKE_COOKIE_SENT){
+        vlog("Cookie sent to a new client");
+        return -1;
+    }
+    if(user_id == -1){
+        errorHandler(AUTHENTICATION_ERR);
+        log("Errore di autenticazione");
+        return -1;
+    }
+    conn->user_id = user_id;
+    conn->state = CONN_READY;
+    end_handshake(conn);
+    log("--- AUTHENTICATION COMPLETED WITH user: " + get_username_by_user_id(user_id));
+    return 0;
+}
+
+/**
+ * @brief go on with the handshakes whose jobs have been completed by the crypto pool
+ */
+void handle_crypto_completions(int crypto_pool_fd){
+    uint64_t completions;
+    if(-1 == read(crypto_pool_fd, &completions, sizeof(completions)) && errno != EAGAIN)
+        log("ERROR on read of the crypto pool eventfd");
+    crypto_job* job;
+    while((job = crypto_pool_take_completed()) != nullptr){
+        //The connection may have been closed while its job was running
+        connection* conn = (connection*)job->owner;
+        if(conn != nullptr && -1 == end_handshake_step(conn, handle_crypto_job(conn, job)))
+            close_connection(conn);
+        crypto_job_free(job);
+    }
+}
+
+/**
+ * @brief dispatch a message of the client of conn to the handler of its opcode
+ * @param plaintext: message with sequence number, at least 5 bytes
+ * @return 0 if the connection has to be kept open, -1 if it has to be closed
+ */
+int dispatch_client_message(connection* conn, uchar* plaintext, int plain_len){
+    uchar msgOpcode = *(uchar*)(plaintext+4);
+    int ret = 0;
+
+    switch (msgOpcode){
+    case ONLINE_CMD:
+        ret = handle_get_online_users(conn, plaintext);
+        if(ret == -1)
+            log("Error on handle_get_online_users");
+        break;
+
+    case CHAT_CMD:
+        ret = handle_chat_request(conn, relay_msg, plaintext, plain_len);
+        if(ret == -1)
+            log("Error on handle_chat_request");
+        break;
+    
+    case CHAT_POS: 
+    case CHAT_NEG:
+    case STOP_CHAT:
+        ret = handle_chat_pos_neg(conn, plaintext, msgOpcode, plain_len);
+        if(ret == -1)
+            log("Error on handle_chat_pos_neg");
+        break;
+
+    case CHAT_RESPONSE:
+    case AUTH:
+        ret = handle_auth_and_msg(conn, plaintext, msgOpcode, plain_len);
+        if(ret < 0)
+            log("Error on handle_msg");
+        break;
+
+    case EXIT_CMD:
+        ret = -1;
+        break;
+
+    default:
+        log("\n\n***** INVALID COMMAND *****\n\n");
+        break;
+    }
+    return (ret < 0)? -1: 0;
+}
+
+/**
+ * @brief handle the whole records in the receive buffer of conn and move the incomplete one at its start. It stops when
+ * a relay of the client is parked, the other records are handled once the relay is done
+ * @return 0 if the connection has to be kept open, -1 if it has to be closed
+ */
+int handle_buffered_records(connection* conn){
+    uint consumed = 0;
+    int ret = 0;
+    while(ret == 0 && conn->parked_relay == nullptr){
+        uchar* plaintext;
+        uint record_len;
+        int plain_len = recv_secure(conn, consumed, &plaintext, &record_len);
+        if(plain_len == 0)
+            break;
+        if(plain_len < 0){
+            log("ERROR on recv_secure (at least seq num and opcode should be read)");
+            return -1;
+        }
+        ret = dispatch_client_message(conn, plaintext, plain_len);
+        OPENSSL_cleanse(plaintext, plain_len);
+        consumed += record_len;
+    }
+    if(consumed > 0){
+        memmove(conn->recv_buffer, conn->recv_buffer + consumed, conn->recv_buffer_len - consumed);
+        conn->recv_buffer_len -= consumed;
+    }
+    return ret;
+}
+
+/**
+ * @brief read all the bytes available from the client of conn and handle the whole messages received
+ * @return 0 if the connection has to be kept open, -1 if it has to be closed
+ */
+int handle_client_message(connection* conn){
+    if(conn->recv_buffer == nullptr){
+        conn->recv_buffer = secure_buffer_alloc(RECV_BUFFER_SIZE);
+        if(!conn->recv_buffer){
+            errorHandler(MALLOC_ERR);
+            return -1;
+        }
+    }
+    //Level triggered: what is not read now is notified again, unless the client is parked. A client that keeps its
+    //socket readable gets READ_BUDGET bytes for each round of the event loop, the other clients are served in between
+    uint budget = READ_BUDGET;
+    while(conn->parked_relay == nullptr && budget > 0){
+        uint space = min((uint)RECV_BUFFER_SIZE - conn->recv_buffer_len, budget);
+        int ret = recv(conn->socket_id, conn->recv_buffer + conn->recv_buffer_len, space, MSG_DONTWAIT);
+        if(ret == 0){
+            log("Connection closed by the client");
+            return -1;
+        }
+        if(ret < 0){
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            log("ERROR on recv: " + string(strerror(errno)));
+            return -1;
+        }
+        conn->recv_buffer_len += ret;
+        budget -= ret;
+        if(-1 == handle_buffered_records(conn))
+            return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief event loop of a worker: it accepts clients on the shared listening socket, serves the messages of its clients and
+ * delivers the records that other workers wrote in its relay ring
+ * @return only in case of errors
+ */
+int run_worker(int listen_socket_id){
+    epoll_fd = epoll_create1(0);
+    if(epoll_fd == -1){
+        log("ERROR on epoll_create1: ");
+        perror(strerror(errno));
+        return -1;
+    }
+    //With EPOLLEXCLUSIVE a new client wakes up only one of the workers
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.fd = listen_socket_id;
+    if(-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_socket_id, &event)){
+        log("ERROR on epoll_ctl: ");
+        perror(strerror(errno));
+        return -1;
+    }
+    //Other workers write the eventfd of the ring when they relay something to this worker
+    relay_ring* ring = &relay_rings[worker_id];
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = ring->eventfd;
+    if(-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ring->eventfd, &event)){
+        log("ERROR on epoll_ctl: ");
+        perror(strerror(errno));
+        return -1;
+    }
+    //The key files of the users are watched by every worker, a change invalidates the cached key
+    int pubkey_watch_fd = pubkey_cache_watch();
+    if(pubkey_watch_fd == -1)
+        return -1;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = pubkey_watch_fd;
+    if(-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pubkey_watch_fd, &event)){
+        log("ERROR on epoll_ctl: ");
+        perror(strerror(errno));
+        return -1;
+    }
+    //Key pairs for the handshakes are generated in background, ready for a burst of logins
+    if(!eph_key_pool_start(EPH_KEY_POOL_DEPTH))
+        return -1;
+    //Signatures, verifications and key derivations of the handshakes run out of the event loop
+    int crypto_pool_fd = crypto_pool_start(CRYPTO_POOL_THREADS);
+    if(crypto_pool_fd == -1)
+        return -1;
+    //During a reconnect storm the verifications of M3 back up and they are verified in batches
+    crypto_pool_set_verify_batch(verify_batch_size, verify_batch_delay);
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = crypto_pool_fd;
+    if(-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, crypto_pool_fd, &event)){
+        log("ERROR on epoll_ctl: ");
+        perror(strerror(errno));
+        return -1;
+    }
+    log("Worker " + to_string(worker_id) + " is serving clients...");
+
+    struct epoll_event events[MAX_EVENTS];
+    while (true){
+        int timeout = close_expired_handshakes();
+        int stats_timeout = log_pool_stats();
+        if(timeout == -1 || stats_timeout < timeout)
+            timeout = stats_timeout;
+        if(relay_ring_sleep(ring))
+            timeout = 0;
+        int n_events = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        ring->sleeping.store(0, memory_order_relaxed);
+        if(n_events == -1){
+            if(errno == EINTR)
+                continue;
+            log("ERROR on epoll_wait");
+            return -1;
+        }
+
+        for(int i = 0; i < n_events; i++){
+            int fd = events[i].data.fd;
+            if(fd == ring->eventfd){
+                uint64_t wakeups;
+                if(-1 == read(fd, &wakeups, sizeof(wakeups)) && errno != EAGAIN)
+                    log("ERROR on read of the relay eventfd");
+                continue;
+            }
+            if(fd == listen_socket_id){
+                if(-1 == handle_new_connection(listen_socket_id))
+                    return -1;
+                continue;
+            }
+            if(fd == pubkey_watch_fd){
+                pubkey_cache_handle_events(fd);
+                continue;
+            }
+            if(fd == crypto_pool_fd){
+                handle_crypto_completions(fd);
+                continue;
+            }
+
+            //The connection may have been closed while handling a previous event
+            connection* conn = ((size_t)fd < connections.size())? connections[fd]: nullptr;
+            if(conn == nullptr)
+                continue;
+            if((events[i].events & EPOLLOUT) && -1 == flush_send_queue(conn)){
+                close_connection(conn);
+                continue;
+            }
+            if(!(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)))
+                continue;
+
+            if(conn->hs != nullptr){
+                if(-1 == end_handshake_step(conn, handle_client_handshake(conn)))
+                    close_connection(conn);
+                continue;
+            }
+            if((events[i].events & (EPOLLERR | EPOLLHUP)) || -1 == handle_client_message(conn)){
+                close_connection(conn);
+            }
+        }
+
+        //All the records published so far are delivered, not only the ones that caused the wakeup
+        relay_ring_drain(ring);
+        if(!parked_connections.empty())
+            retry_parked_relays();
+    }
+}
+
+/**
+ * @brief fork the worker process with identifier id
+ * @return -1 in case of errors, 0 otherwise
+ */
+int spawn_worker(int id, int listen_socket_id){
+    pid_t pid = fork();
+    if(pid == -1){
+        errorHandler(FORK_ERR);
+        return -1;
+    }
+    if(pid == 0){
+        worker_id = id;
+        signal(SIGHUP, SIG_IGN);
+        run_worker(listen_socket_id);
+        exit(1);
+    }
+    workers[id] = pid;
+    return 0;
+}
+
+
+int main(int argc, char* argv[]){
+    // ./server --verify-batch <jobs> <delay us> sets the batching of the verifications of M3, 1 job disables it
+    if(argc==4 && strcmp(argv[1], "--verify-batch")==0){
+        verify_batch_size = strtoul(argv[2], NULL, 10);
+        verify_batch_delay = strtoul(argv[3], NULL, 10);
     }
-    prior_cleanup();
-    if(shmem == MAP_FAILED){
+    else if(argc!=1){
+        cout << "Usage: ./server [--verify-batch <jobs> <delay us>]" << endl;
+        return 1;
+    }
+    if(relay_rings == MAP_FAILED || !user_directory_create() || !pubkey_cache_create() || !session_ticket_keys_create()){
         log("MMAP failed");
         return 0;
     }
-    user_info user_status[REGISTERED_USERS];
-    ret = initialize_user_info(user_status);
+    int ret = initialize_user_info();
     if(ret == 0){
         log("ERROR on initialize_user_info");
         return 0;
     }
-    memcpy(shmem, user_status, sizeof(user_info)*REGISTERED_USERS);
     
     int listen_socket_id;                   //socket indexes
-    struct sockaddr_in srv_addr, cl_addr;   //address informations
-    pid_t pid;                              
-    string password_for_keys;               
-    uchar msgOpcode;                        //where is received the opcode of the message
-    uchar* plaintext;                       //buffer to store the plaintext
-    int plain_len;
+    struct sockaddr_in srv_addr;            //address informations
 
     // WE MAY WANT TO DISABLE ECHO
     cout << "Enter the password that will be used for reading the keys: ";
@@ -1580,10 +2350,42 @@ int main(){
         cerr << "Wrong key!";
         exit(1);
     }
+    FILE* cert_file = fopen("certification/SecureCom_cert.pem", "rb");
+    if(!cert_file){
+        log("Error on opening cert file");
+        exit(1);
+    }
+    int certificate_len = serialize_certificate(cert_file, &server_certificate);
+    fclose(cert_file);
+    if(certificate_len <= 0){
+        log("Error on serialize certificate");
+        exit(1);
+    }
+    server_certificate_len = certificate_len;
+    if(!random_generate(COOKIE_SECRET_SIZE, cookie_secret)){
+        log("Error on the generation of the cookie secret");
+        exit(1);
+    }
+
+    //A client that disconnects while we are writing must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+
+    //SIGHUP makes the main process apply the changes of the registry file, wait is interrupted to do it
+    struct sigaction reload_action;
+    memset(&reload_action, 0, sizeof(reload_action));
+    reload_action.sa_handler = registry_changed_handler;
+    sigaction(SIGHUP, &reload_action, NULL);
+
+    //Every connection costs a file descriptor: use all the descriptors we are allowed to
+    struct rlimit fd_limit;
+    if(0 == getrlimit(RLIMIT_NOFILE, &fd_limit)){
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
 
     //Preparation of ip address struct
     memset(&srv_addr, 0, sizeof(srv_addr));
-    listen_socket_id = socket(AF_INET, SOCK_STREAM, 0);
+    listen_socket_id = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (listen_socket_id == -1){
         log("ERROR on socket");
         return 0;
@@ -1613,122 +2415,47 @@ int main(){
         perror(strerror(errno));
         return 0;
     }
-        
-    unsigned int len = sizeof(cl_addr);
-    log("Socket is listening...");
 
-    while (true){
-        comm_socket_id = accept(listen_socket_id, (struct sockaddr *)&cl_addr, &len);
-        if(comm_socket_id == -1){
-            log("ERROR on accept");
+    for(int i = 0; i < SERVER_WORKERS; i++){
+        relay_rings[i].eventfd = eventfd(0, EFD_NONBLOCK);
+        if(relay_rings[i].eventfd == -1){
+            log("ERROR on eventfd: ");
+            perror(strerror(errno));
             return 0;
         }
+    }
+    for(int i = 0; i < SERVER_WORKERS; i++){
+        if(-1 == spawn_worker(i, listen_socket_id))
+            return 0;
+    }
+    log("Socket is listening...");
 
-        pid = fork();
-
-        if (pid == 0){
-            close(listen_socket_id);
-            log("Connection established with client");
-
-            //Manage authentication
-            client_user_id = handle_client_authentication(password_for_keys);
-            if(client_user_id == -1){
-                errorHandler(AUTHENTICATION_ERR);
-                log("Errore di autenticazione");
-                return -1;
-            }
-            string client_username = get_username_by_user_id(client_user_id);
-            if(client_username.empty()){
-                log("ERROR on get_username_by_user_id");
-                return -1;
-            }
-            
-            log("--- AUTHENTICATION COMPLETED WITH user: " + client_username);
-            // Every REQUEST_CONTROL_TIME seconds a signal is issued to control if the server has sent
-            // a chat request originated from another clientS 
-            if(SIG_ERR == signal(SIGALRM, signal_handler)){
-                log("ERROR on signal");
-                safe_free(session_key, session_key_len);
-                set_user_socket(get_username_by_user_id(client_user_id), -1);
-                close(comm_socket_id);
-                return 0;
-            }
-
-            alarm(RELAY_CONTROL_TIME);
-
-            //Child process
-            while (true){
-                
-                plain_len = recv_secure(comm_socket_id, &plaintext);
-
-                if(plain_len <= 4){
-                    log("ERROR on recv_secure (at least seq num and opcode should be read) (" + to_string(plain_len) + ")");
-                    safe_free(session_key, session_key_len);
-                    set_user_socket(get_username_by_user_id(client_user_id), -1);
-                    close(comm_socket_id);
-                    return -1;
-                }
-                msgOpcode = *(uchar*)(plaintext+4); //plaintext has at least 5 bytes of memory allocated
-            
-                switch (msgOpcode){
-                case ONLINE_CMD:
-                    if(-1 == handle_get_online_users(comm_socket_id, plaintext)) {
-                        log("Error on handle_get_online_users");
-                        safe_free(session_key, session_key_len);
-                        set_user_socket(get_username_by_user_id(client_user_id), -1);
-                        close(comm_socket_id);
-                        return 0;
-                    }
-                    break;
-
-                case CHAT_CMD:
-                    if(-1 == handle_chat_request(comm_socket_id, client_user_id, relay_msg, plaintext, plain_len)) {
-                        log("Error on handle_chat_request");
-                        safe_free(session_key, session_key_len);
-                        set_user_socket(get_username_by_user_id(client_user_id), -1);
-                        close(comm_socket_id);
-                        return 0;
-                    }
-                    break;
-                
-                case CHAT_POS: 
-                case CHAT_NEG:
-                case STOP_CHAT:
-                    if(-1 == handle_chat_pos_neg(plaintext, msgOpcode, plain_len)){
-                        log("Error on handle_chat_pos_neg");
-                        safe_free(session_key, session_key_len);
-                        set_user_socket(get_username_by_user_id(client_user_id), -1);
-                        close(comm_socket_id);
-                        return 0;
-                    }
-                    break;
-                case CHAT_RESPONSE:
-                case AUTH:
-                    ret = handle_auth_and_msg(plaintext, msgOpcode, plain_len);
-                    if(ret<0) {
-                        log("Error on handle_msg");
-                        safe_free(session_key, session_key_len);
-                        set_user_socket(get_username_by_user_id(client_user_id), -1);
-                        close(comm_socket_id);
-                        return 0;
-                    }
-                    break;
-                case EXIT_CMD:
-                    safe_free(session_key, session_key_len);
-                    set_user_socket(get_username_by_user_id(client_user_id), -1);
-                    close(comm_socket_id);
-                    exit(0);
-                default:
-                    log("\n\n***** INVALID COMMAND *****\n\n");
-                    break;
+    //A worker that terminates is replaced, its users are logged out since their connections are lost
+    while (true){
+        int status;
+        pid_t pid = wait(&status);
+        if(pid == -1){
+            if(errno == EINTR){
+                if(registry_changed){
+                    registry_changed = 0;
+                    int changes = user_directory_sync();
+                    log("Registry reloaded, " + to_string(changes) + " users added or removed");
                 }
-
+                continue;
             }
-        }
-        else if (pid == -1){
-            log("ERROR on fork");
+            log("ERROR on wait");
             return 0;
         }
-        close(comm_socket_id);
+        for(int i = 0; i < SERVER_WORKERS; i++){
+            if(workers[i] != pid)
+                continue;
+            log("Worker " + to_string(i) + " terminated, restarting it");
+            release_users_of_worker(i);
+            pubkey_cache_recover();
+            //The relays to the users of the dead worker that were in progress are over after this wait
+            sleep(1);
+            relay_ring_recover(i);
+            spawn_worker(i, listen_socket_id);
+        }
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,145 @@
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include "session_ticket.h"
+#include "user_directory.h"
+#include "crypto.h"
+#include "util.h"
+
+//Content of a ticket before the sealing: user_id, generation, issued (64 bit), resumption_secret
+#define TICKET_CONTENT_SIZE (2 * sizeof(uint32_t) + sizeof(uint64_t) + RESUMPTION_SECRET_SIZE)
+//Sealed ticket: period, IV, tag, encrypted content
+#define TICKET_HEADER_SIZE (sizeof(uint32_t) + IV_DEFAULT + TAG_DEFAULT)
+
+static_assert(TICKET_KEY_SIZE == 32, "the ticket keys are AUTH_ENCRYPT_DEFAULT keys");
+
+//Shared memory for the keys of the session tickets
+session_ticket_keys* ticket_keys = nullptr;
+
+/**
+ * @brief copy the ticket key of a period
+ * @param create true to generate the key if it does not exist yet (only for the current period)
+ * @return 1 on success, 0 if the key does not exist anymore or on error(s)
+ */
+int get_ticket_key(uint32_t period, bool create, uchar* key){
+    ticket_key* slot = &ticket_keys->keys[period % TICKET_KEYS];
+    int ret = 1;
+    //A process that died holding the lock left nothing to repair: the period of a key is set after the key
+    shared_lock(&ticket_keys->lock);
+    if(slot->period != period){
+        if(!create || !random_generate(TICKET_KEY_SIZE, slot->key)){
+            ret = 0;
+        }
+        else{
+            slot->period = period;
+            vlog("New session ticket key for the period " + to_string(period));
+        }
+    }
+    if(ret)
+        memcpy(key, slot->key, TICKET_KEY_SIZE);
+    shared_unlock(&ticket_keys->lock);
+    return ret;
+}
+
+int session_ticket_keys_create(){
+    void* shared = mmap(NULL, sizeof(session_ticket_keys), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shared == MAP_FAILED){
+        log("ERROR: mmap of the session ticket keys failed");
+        return 0;
+    }
+    //The keys are not swapped, as the buffers of the secure pool
+    mlock(shared, sizeof(session_ticket_keys));
+    ticket_keys = (session_ticket_keys*)shared;
+    //Period 0 is long gone: no key is valid until it is generated
+    for(int i = 0; i < TICKET_KEYS; i++)
+        ticket_keys->keys[i].period = 0;
+    if(!shared_lock_init(&ticket_keys->lock)){
+        log("ERROR: initialization of the lock of the session ticket keys failed");
+        return 0;
+    }
+    return 1;
+}
+
+uint session_ticket_issue(int user_id, uint32_t generation, uchar* session_key, uint session_key_len, uchar* sealed){
+    int64_t now = time(NULL);
+    uint32_t period = now / TICKET_KEY_LIFETIME;
+    uchar key[TICKET_KEY_SIZE];
+    if(!get_ticket_key(period, true, key))
+        return 0;
+
+    uchar content[TICKET_CONTENT_SIZE];
+    uint32_t user_id_net = htonl(user_id);
+    uint32_t generation_net = htonl(generation);
+    uint64_t issued_net = htobe64((uint64_t)now);
+    memcpy(content, &user_id_net, sizeof(uint32_t));
+    memcpy(content + sizeof(uint32_t), &generation_net, sizeof(uint32_t));
+    memcpy(content + 2 * sizeof(uint32_t), &issued_net, sizeof(uint64_t));
+    if(!derive_resumption_secret(session_key, session_key_len, content + 2 * sizeof(uint32_t) + sizeof(uint64_t))){
+        OPENSSL_cleanse(key, TICKET_KEY_SIZE);
+        return 0;
+    }
+
+    uint32_t period_net = htonl(period);
+    uchar *tag, *iv, *ciphertext;
+    int ciphertext_len = auth_enc_encrypt(content, TICKET_CONTENT_SIZE, (uchar*)&period_net, sizeof(uint32_t), key,
+        &tag, &iv, &ciphertext);
+    OPENSSL_cleanse(key, TICKET_KEY_SIZE);
+    OPENSSL_cleanse(content, TICKET_CONTENT_SIZE);
+    if(ciphertext_len != TICKET_CONTENT_SIZE){
+        log("ERROR: sealing of the session ticket failed");
+        return 0;
+    }
+    memcpy(sealed, &period_net, sizeof(uint32_t));
+    memcpy(sealed + sizeof(uint32_t), iv, IV_DEFAULT);
+    memcpy(sealed + sizeof(uint32_t) + IV_DEFAULT, tag, TAG_DEFAULT);
+    memcpy(sealed + TICKET_HEADER_SIZE, ciphertext, ciphertext_len);
+    free(iv);
+    free(tag);
+    free(ciphertext);
+    return TICKET_HEADER_SIZE + ciphertext_len;
+}
+
+int session_ticket_open(uchar* sealed, uint sealed_len, session_ticket* ticket){
+    if(sealed_len != TICKET_HEADER_SIZE + TICKET_CONTENT_SIZE)
+        return 0;
+    int64_t now = time(NULL);
+    uint32_t current_period = now / TICKET_KEY_LIFETIME;
+    uint32_t period = ntohl(*(uint32_t*)sealed);
+    if(period != current_period && period + 1 != current_period){
+        vlog("Session ticket of an expired period");
+        return 0;
+    }
+    uchar key[TICKET_KEY_SIZE];
+    if(!get_ticket_key(period, false, key))
+        return 0;
+
+    uchar* content = nullptr;
+    int content_len = auth_enc_decrypt(sealed + TICKET_HEADER_SIZE, sealed_len - TICKET_HEADER_SIZE, sealed,
+        sizeof(uint32_t), key, sealed + sizeof(uint32_t) + IV_DEFAULT, sealed + sizeof(uint32_t), &content);
+    OPENSSL_cleanse(key, TICKET_KEY_SIZE);
+    if(content_len != TICKET_CONTENT_SIZE){
+        //auth_enc_decrypt leaves its buffer allocated also on error(s)
+        if(content)
+            safe_free(content, TICKET_CONTENT_SIZE);
+        log("ERROR: session ticket not authentic");
+        return 0;
+    }
+    uint64_t issued_net;
+    ticket->user_id = ntohl(*(uint32_t*)content);
+    ticket->generation = ntohl(*(uint32_t*)(content + sizeof(uint32_t)));
+    memcpy(&issued_net, content + 2 * sizeof(uint32_t), sizeof(uint64_t));
+    ticket->issued = be64toh(issued_net);
+    memcpy(ticket->resumption_secret, content + 2 * sizeof(uint32_t) + sizeof(uint64_t), RESUMPTION_SECRET_SIZE);
+    safe_free(content, content_len);
+    if(ticket->issued > now || now - ticket->issued > TICKET_LIFETIME){
+        vlog("Session ticket expired");
+        OPENSSL_cleanse(ticket->resumption_secret, RESUMPTION_SECRET_SIZE);
+        return 0;
+    }
+    return 1;
+}
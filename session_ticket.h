@@ -0,0 +1,66 @@
+#ifndef SESSION_TICKET_INCLUDED
+#define SESSION_TICKET_INCLUDED
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include "constant.h"
+
+using uchar=unsigned char;
+
+using namespace std;
+
+/*
+* Keys of the session tickets, shared by the workers: a client can resume its session with any of them.
+* The key of period p (time / TICKET_KEY_LIFETIME) is kept in keys[p % TICKET_KEYS]; it is generated by the first
+* ticket issued in the period, which overwrites the key of an expired period. lock: lock of the keys, a robust
+* mutex shared among processes
+*/
+struct ticket_key {
+    uint32_t period;
+    uchar key[TICKET_KEY_SIZE];
+};
+
+struct session_ticket_keys {
+    pthread_mutex_t lock;
+    ticket_key keys[TICKET_KEYS];
+};
+
+/*
+* Content of a session ticket. A ticket is sealed with the ticket key of its period (authenticated encryption, the
+* period is the additional data) and it is only readable by the server.
+* generation: ticket generation of the user when the ticket has been issued, only the last ticket of a user is valid
+* issued: time of the issue, in seconds since the epoch
+* resumption_secret: secret derived from the session key of the session that issued the ticket
+*/
+struct session_ticket {
+    int32_t user_id;
+    uint32_t generation;
+    int64_t issued;
+    uchar resumption_secret[RESUMPTION_SECRET_SIZE];
+};
+
+/**
+ * @brief create the ticket keys in shared memory, before forking the processes that use them
+ * @return 1 on success, 0 on error(s)
+ */
+int session_ticket_keys_create();
+
+/**
+ * @brief issue a session ticket for a user, sealed with the ticket key of the current period
+ * @param generation ticket generation of the user (renew_user_ticket or redeem_user_ticket)
+ * @param session_key key of the session that issues the ticket
+ * @param sealed output, MAX_TICKET_SIZE bytes
+ * @return length of the sealed ticket, 0 on error(s)
+ */
+uint session_ticket_issue(int user_id, uint32_t generation, uchar* session_key, uint session_key_len, uchar* sealed);
+
+/**
+ * @brief open a sealed session ticket: its key must be the one of the current period or of the previous one and
+ * the ticket must not be older than TICKET_LIFETIME. The generation is checked by the caller
+ * @param ticket output
+ * @return 1 on success, 0 if the ticket is not valid
+ */
+int session_ticket_open(uchar* sealed, uint sealed_len, session_ticket* ticket);
+
+#endif
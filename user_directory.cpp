@@ -0,0 +1,667 @@
+#include <iostream>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include "user_directory.h"
+#include "util.h"
+
+static_assert(sizeof(user_info) == 64, "an entry of the user directory fills one cache line");
+static_assert((USER_INDEX_SLOTS & (USER_INDEX_SLOTS - 1)) == 0 && USER_INDEX_SLOTS >= 2 * MAX_REGISTERED_USERS,
+    "the index of the user directory needs a power of two of slots, at most half of them used");
+static_assert(atomic<uint32_t>::is_always_lock_free && sizeof(atomic<uint32_t>) == sizeof(uint32_t),
+    "the seqlocks of the user directory are shared among processes");
+static_assert(sizeof(registry_header) == 64 && sizeof(registry_record) == 64, "records of the registry file have a fixed size");
+
+//Shared memory for storing data of users
+user_directory* directory = nullptr;
+
+//Registry file of the users, mapped with the space for MAX_REGISTERED_USERS records: the file grows under the mapping
+const char registry_magic[8] = "SCUSERS";
+const uint32_t registry_version = 1;
+const size_t registry_map_size = sizeof(registry_header) + sizeof(registry_record) * (size_t)MAX_REGISTERED_USERS;
+int registry_fd = -1;
+registry_header* registry = nullptr;
+registry_record* registry_records = nullptr;
+
+/*
+* State of an entry read under its seqlock
+*/
+struct user_presence {
+    int socket_id;
+    int busy;
+    int worker_id;
+};
+
+
+// ---------------------------------------------------------------------
+// FUNCTIONS of the LOCKS shared among processes
+// ---------------------------------------------------------------------
+
+int shared_lock_init(pthread_mutex_t* lock){
+    pthread_mutexattr_t attr;
+    if(pthread_mutexattr_init(&attr) != 0)
+        return 0;
+    int ret = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0 &&
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) == 0 && pthread_mutex_init(lock, &attr) == 0;
+    pthread_mutexattr_destroy(&attr);
+    return ret;
+}
+
+int shared_lock(pthread_mutex_t* lock){
+    int ret = pthread_mutex_lock(lock);
+    if(ret == 0)
+        return 1;
+    if(ret == EOWNERDEAD){
+        //The owner died while holding the lock: mark it usable again, the caller repairs what it protects
+        log("A process died holding a shared lock, the lock has been taken over");
+        pthread_mutex_consistent(lock);
+        return 0;
+    }
+    //Only a bug (the lock is not initialized or not recoverable) gets here
+    log("ERROR: pthread_mutex_lock of a shared lock failed");
+    abort();
+}
+
+void shared_unlock(pthread_mutex_t* lock){
+    pthread_mutex_unlock(lock);
+}
+
+/**
+ * @brief make even again the seqlocks of a stripe whose writer died in the middle of a change, the caller holds the
+ * lock of the stripe. The fields are single stores, they are either written or not
+ */
+void repair_stripe(uint32_t stripe){
+    uint32_t users = directory->users.load(memory_order_acquire);
+    for(uint32_t i = stripe; i < users; i += USER_LOCK_STRIPES){
+        user_info* user = &directory->entries[i];
+        if(user->seq.load(memory_order_relaxed) & 1){
+            user->seq.fetch_add(1, memory_order_release);
+            log("Repaired the entry of " + string(user->username) + " left open by a dead process");
+        }
+    }
+}
+
+/**
+ * @brief lock the stripe of the entries of the writers, repairing it if its previous owner died
+ */
+void lock_stripe(uint32_t stripe){
+    if(!shared_lock(&directory->stripe_locks[stripe]))
+        repair_stripe(stripe);
+}
+
+/**
+ * @brief begin to change the presence of a user: lock the stripe of the entry and make its seqlock odd
+ */
+void begin_user_write(user_info* user){
+    lock_stripe(user->user_id % USER_LOCK_STRIPES);
+    user->seq.fetch_add(1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+/**
+ * @brief end the change of the presence of a user: make its seqlock even and unlock the stripe of the entry
+ */
+void end_user_write(user_info* user){
+    user->seq.fetch_add(1, memory_order_release);
+    shared_unlock(&directory->stripe_locks[user->user_id % USER_LOCK_STRIPES]);
+}
+
+/**
+ * @brief read the presence of a user without locking, the read is repeated if a writer changed it meanwhile
+ */
+user_presence read_user_presence(int user_id){
+    user_info* user = &directory->entries[user_id];
+    user_presence presence;
+    uint32_t seq;
+    do{
+        while((seq = user->seq.load(memory_order_acquire)) & 1)
+            sched_yield(); //a writer is in the middle of a change, let it finish
+        presence.socket_id = user->socket_id.load(memory_order_relaxed);
+        presence.busy = user->busy.load(memory_order_relaxed);
+        presence.worker_id = user->worker_id.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while(user->seq.load(memory_order_relaxed) != seq);
+    return presence;
+}
+
+
+// ---------------------------------------------------------------------
+// FUNCTIONS of the INDEX and of the LIST of the ONLINE USERS
+// ---------------------------------------------------------------------
+
+/**
+ * @brief hash of a username for the index of the user directory (FNV-1a)
+ */
+uint32_t hash_username(const char* username, size_t len){
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < len; i++){
+        hash ^= (uchar)username[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief look for a username in the index of the user directory, without locking: entries are published in the index
+ * only once they are complete and their username never changes
+ * @return the user id, -1 if the user is not registered
+ */
+int find_user(const string& username){
+    if(username.empty() || username.length() > MAX_USERNAME_SIZE)
+        return -1;
+    uint32_t slot = hash_username(username.c_str(), username.length()) & (USER_INDEX_SLOTS - 1);
+    uint32_t published;
+    while((published = directory->index[slot].load(memory_order_acquire)) != 0){
+        user_info* user = &directory->entries[published - 1];
+        if(!user->removed.load(memory_order_acquire) && strncmp(user->username, username.c_str(), MAX_USERNAME_SIZE + 1) == 0)
+            return user->user_id;
+        slot = (slot + 1) & (USER_INDEX_SLOTS - 1);
+    }
+    return -1;
+}
+
+/**
+ * @brief check that a record of the registry file is well formed
+ */
+bool valid_registry_record(const registry_record* record, uint32_t position){
+    size_t len = strnlen(record->username, MAX_USERNAME_SIZE + 1);
+    return record->user_id == position && len > 0 && len <= MAX_USERNAME_SIZE;
+}
+
+/**
+ * @brief copy a user of the registry in its entry of the user directory and publish it in the index, the caller holds the
+ * directory lock (or the directory is not shared yet) and updates the number of users
+ */
+void publish_user(const registry_record* record){
+    user_info* user = &directory->entries[record->user_id];
+    size_t len = strnlen(record->username, MAX_USERNAME_SIZE);
+    memcpy(user->username, record->username, len);
+    user->username[len] = '\0';
+    user->user_id = record->user_id;
+    user->socket_id.store(-1, memory_order_relaxed);
+    user->busy.store(0, memory_order_relaxed);
+    user->worker_id.store(-1, memory_order_relaxed);
+    user->removed.store(record->removed != 0, memory_order_relaxed);
+    user->online_prev = -1;
+    user->online_next = -1;
+    if(record->removed)
+        return;
+
+    uint32_t slot = hash_username(user->username, len) & (USER_INDEX_SLOTS - 1);
+    while(directory->index[slot].load(memory_order_relaxed) != 0)
+        slot = (slot + 1) & (USER_INDEX_SLOTS - 1);
+    directory->index[slot].store(user->user_id + 1, memory_order_release);
+}
+
+/**
+ * @brief append a user to the list of the online users, the caller holds the directory lock
+ */
+void online_list_insert(user_info* user){
+    user->online_prev = directory->online_tail;
+    user->online_next = -1;
+    if(directory->online_tail != -1)
+        directory->entries[directory->online_tail].online_next = user->user_id;
+    else
+        directory->online_head = user->user_id;
+    directory->online_tail = user->user_id;
+    directory->online_users++;
+}
+
+/**
+ * @brief remove a user from the list of the online users, the caller holds the directory lock
+ */
+void online_list_remove(user_info* user){
+    if(user->online_prev != -1)
+        directory->entries[user->online_prev].online_next = user->online_next;
+    else
+        directory->online_head = user->online_next;
+    if(user->online_next != -1)
+        directory->entries[user->online_next].online_prev = user->online_prev;
+    else
+        directory->online_tail = user->online_prev;
+    user->online_prev = -1;
+    user->online_next = -1;
+    directory->online_users--;
+}
+
+/**
+ * @brief rebuild the list of the online users from the sockets of the entries, after a process died while changing it.
+ * The caller holds the directory lock. The login order of the users is lost, they are listed by user id
+ */
+void online_list_rebuild(){
+    directory->online_head = -1;
+    directory->online_tail = -1;
+    directory->online_users = 0;
+    uint32_t users = directory->users.load(memory_order_acquire);
+    for(uint32_t i = 0; i < users; i++){
+        user_info* user = &directory->entries[i];
+        user->online_prev = -1;
+        user->online_next = -1;
+        if(user->socket_id.load(memory_order_relaxed) != -1)
+            online_list_insert(user);
+    }
+    log("Rebuilt the list of the online users left inconsistent by a dead process");
+}
+
+/**
+ * @brief lock the directory lock, repairing the list of the online users if its previous owner died
+ */
+void lock_directory(){
+    if(!shared_lock(&directory->directory_lock))
+        online_list_rebuild();
+}
+
+
+// ---------------------------------------------------------------------
+// FUNCTIONS for accessing to the USER DATASTORE
+// ---------------------------------------------------------------------
+
+int user_directory_create(){
+    //Pages of the directory are only touched as users are registered
+    void* shared = mmap(NULL, sizeof(user_directory), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shared == MAP_FAILED){
+        log("ERROR: mmap of the user directory failed");
+        return 0;
+    }
+    directory = (user_directory*)shared;
+    directory->online_head = -1;
+    directory->online_tail = -1;
+    int ret = shared_lock_init(&directory->directory_lock);
+    for(int i = 0; i < USER_LOCK_STRIPES; i++)
+        ret = ret && shared_lock_init(&directory->stripe_locks[i]);
+    if(!ret)
+        log("ERROR: initialization of the locks of the user directory failed");
+    return ret;
+}
+
+bool valid_user_id(int user_id){
+    return user_id >= 0 && (uint32_t)user_id < directory->users.load(memory_order_acquire) &&
+        !directory->entries[user_id].removed.load(memory_order_acquire);
+}
+
+int user_directory_load(){
+    uint32_t count;
+    const registry_record* records = registry_get_records(&count);
+    if(records == nullptr)
+        return 0;
+    for(uint32_t i = 0; i < count; i++){
+        if(!valid_registry_record(&records[i], i)){
+            log("ERROR: invalid record " + to_string(i) + " in the registry file");
+            return 0;
+        }
+        publish_user(&records[i]);
+    }
+    directory->users.store(count, memory_order_release);
+    return 1;
+}
+
+int user_directory_sync(){
+    uint32_t count;
+    const registry_record* records = registry_get_records(&count);
+    if(records == nullptr)
+        return -1;
+    int changes = 0;
+    lock_directory();
+    uint32_t loaded = directory->users.load(memory_order_relaxed);
+    for(uint32_t i = 0; i < loaded && i < count; i++){
+        if(records[i].removed && !directory->entries[i].removed.load(memory_order_relaxed)){
+            directory->entries[i].removed.store(1, memory_order_release);
+            vlog("Removed user " + string(directory->entries[i].username));
+            changes++;
+        }
+    }
+    for(uint32_t i = loaded; i < count; i++){
+        if(!valid_registry_record(&records[i], i)){
+            log("ERROR: invalid record " + to_string(i) + " in the registry file");
+            shared_unlock(&directory->directory_lock);
+            return -1;
+        }
+        publish_user(&records[i]);
+        directory->users.store(i + 1, memory_order_release);
+        vlog("Added user " + string(directory->entries[i].username));
+        changes++;
+    }
+    shared_unlock(&directory->directory_lock);
+    return changes;
+}
+
+int get_user_fingerprint(int user_id, uchar* fingerprint){
+    if(registry == nullptr || !valid_user_id(user_id))
+        return 0;
+    memcpy(fingerprint, registry_records[user_id].fingerprint, FINGERPRINT_SIZE);
+    return 1;
+}
+
+int get_user_key_type(int user_id){
+    if(registry == nullptr || !valid_user_id(user_id))
+        return -1;
+    return registry_records[user_id].key_type;
+}
+
+uint32_t renew_user_ticket(int user_id){
+    if(!valid_user_id(user_id))
+        return 0;
+    uint32_t generation = directory->entries[user_id].ticket_generation.fetch_add(1, memory_order_relaxed) + 1;
+    //0 never identifies a ticket
+    if(generation == 0)
+        generation = directory->entries[user_id].ticket_generation.fetch_add(1, memory_order_relaxed) + 1;
+    return generation;
+}
+
+uint32_t redeem_user_ticket(int user_id, uint32_t generation){
+    if(!valid_user_id(user_id) || generation == 0)
+        return 0;
+    uint32_t next = (generation + 1 == 0)? 1: generation + 1;
+    if(!directory->entries[user_id].ticket_generation.compare_exchange_strong(generation, next, memory_order_relaxed))
+        return 0;
+    return next;
+}
+
+int get_user_socket_by_user_id(int user_id){
+    if(!valid_user_id(user_id)){
+        log("ERROR: Invalid user id");
+        return -2;
+    }
+    return read_user_presence(user_id).socket_id;
+}
+
+int get_user_worker_by_user_id(int user_id){
+    if(!valid_user_id(user_id)){
+        log("ERROR: Invalid user id");
+        return -2;
+    }
+    user_presence presence = read_user_presence(user_id);
+    return (presence.socket_id == -1)? -1: presence.worker_id;
+}
+
+int test_user_busy_by_user_id(int user_id){
+    if(!valid_user_id(user_id)){
+        log("ERROR: Invalid user id");
+        return -1;
+    }
+    return !read_user_presence(user_id).busy;
+}
+
+int set_user_busy_by_user_id(int user_id, int busy){
+    if(!valid_user_id(user_id)){
+        log("ERROR: Invalid user id");
+        return -1;
+    }
+    user_info* user = &directory->entries[user_id];
+    begin_user_write(user);
+    user->busy.store(busy, memory_order_relaxed);
+    end_user_write(user);
+    return 1;
+}
+
+/**
+ * @brief take a user offline, the caller holds the directory lock and has checked that the user is online
+ */
+void logout_user(user_info* user){
+    online_list_remove(user);
+    begin_user_write(user);
+    user->socket_id.store(-1, memory_order_relaxed);
+    user->worker_id.store(-1, memory_order_relaxed);
+    user->busy.store(0, memory_order_relaxed);
+    end_user_write(user);
+    vlog("\n\n***** logout of client " + string(user->username) + " *****\n\n");
+}
+
+int set_user_socket(int user_id, int socket, int worker){
+    if(socket < 0){ //Sanitization, since file descriptors can have only values >= 0
+        log("SOCKET fd invalid");
+        return -1;
+    }
+    if(!valid_user_id(user_id)){
+        log("ERROR: Invalid user id");
+        return -1;
+    }
+
+    //The test and the claim are done under the same lock: of two logins of the same user only one succeeds
+    user_info* user = &directory->entries[user_id];
+    lock_directory();
+    if(user->socket_id.load(memory_order_relaxed) != -1){
+        shared_unlock(&directory->directory_lock);
+        return 0;
+    }
+    online_list_insert(user);
+    begin_user_write(user);
+    user->socket_id.store(socket, memory_order_relaxed);
+    user->worker_id.store(worker, memory_order_relaxed);
+    end_user_write(user);
+    shared_unlock(&directory->directory_lock);
+    vlog("Set socket of " + string(user->username) + " correctly");
+    return 1;
+}
+
+int clear_user_socket(int user_id, int socket, int worker){
+    //A removed user can still go offline
+    if(user_id < 0 || (uint32_t)user_id >= directory->users.load(memory_order_acquire)){
+        log("ERROR: Invalid user id");
+        return -1;
+    }
+
+    user_info* user = &directory->entries[user_id];
+    lock_directory();
+    if(user->socket_id.load(memory_order_relaxed) != socket || user->worker_id.load(memory_order_relaxed) != worker){
+        shared_unlock(&directory->directory_lock);
+        return 0;
+    }
+    logout_user(user);
+    shared_unlock(&directory->directory_lock);
+    return 1;
+}
+
+int release_users_of_worker(int dead_worker_id){
+    //Locks held by the dead worker are taken over one by one, repairing what it left half done: the readers of an
+    //entry spin on its seqlock even if nobody writes its stripe anymore
+    for(uint32_t i = 0; i < USER_LOCK_STRIPES; i++){
+        lock_stripe(i);
+        shared_unlock(&directory->stripe_locks[i]);
+    }
+    lock_directory();
+    int next;
+    for(int i = directory->online_head; i != -1; i = next){
+        user_info* user = &directory->entries[i];
+        next = user->online_next;
+        //Only the sessions owned by the dead worker, as in clear_user_socket
+        if(user->worker_id.load(memory_order_relaxed) == dead_worker_id)
+            logout_user(user);
+    }
+    shared_unlock(&directory->directory_lock);
+    return 0;
+}
+
+void print_user_data_store(){
+    cout << "\n\n****** USER STATUS *******\n\n" << endl;
+    uint32_t users = directory->users.load(memory_order_acquire);
+    for(uint32_t i=0; i<users; i++){
+        int socket_id = read_user_presence(i).socket_id;
+        cout << "[" << i << "] " << directory->entries[i].username << " | " << socket_id << " | " << " | "  << ((socket_id==-1)?"offline":"online") << endl;
+    }
+    cout << "\n\n**************************\n\n" << endl;
+}
+
+online_user* get_online_users_copy(uint32_t max_users, uint32_t* count){
+    lock_directory();
+    //At least one entry is allocated to return a valid pointer
+    uint32_t to_copy = min(max_users, directory->online_users);
+    online_user* online = (online_user*)malloc(max(to_copy, (uint32_t)1)*sizeof(online_user));
+    if(!online){
+        shared_unlock(&directory->directory_lock);
+        log("ERROR on malloc");
+        return nullptr;
+    }
+    *count = 0;
+    for(int i = directory->online_head; i != -1 && *count < to_copy; i = directory->entries[i].online_next){
+        online[*count].user_id = i;
+        memcpy(online[*count].username, directory->entries[i].username, MAX_USERNAME_SIZE + 1);
+        (*count)++;
+    }
+    shared_unlock(&directory->directory_lock);
+    return online;
+}
+
+int get_user_id_by_username(string username){
+    vlog("Entering get id by username");
+    if(username.empty()){
+        log("INVALID usernam on get_user_id_by_username");
+        return -1;
+    }
+    int ret = find_user(username);
+    if(ret != -1)
+        vlog("Found username " + username + " in the datastore with user_id " + to_string(ret));
+    return ret;
+}
+
+string get_username_by_user_id(size_t id){
+    vlog("get username by id");
+    if(id > INT_MAX || !valid_user_id(id)){
+        log(" ERR - User_id not present");
+        errorHandler(GEN_ERR);
+        return string();
+    }
+    string username = directory->entries[id].username;
+    vlog("Obtained username of " + username);
+    return username;
+}
+
+
+// ---------------------------------------------------------------------
+// FUNCTIONS of the REGISTRY FILE
+// ---------------------------------------------------------------------
+
+int registry_open(const char* path, bool create){
+    registry_fd = open(path, O_RDWR | (create? O_CREAT: 0), 0600);
+    if(registry_fd == -1){
+        log("ERROR: cannot open the registry file " + string(path));
+        return 0;
+    }
+    //The lock avoids that two processes initialize a new file at the same time
+    if(!registry_lock()){
+        registry_close();
+        return 0;
+    }
+    struct stat file_stat;
+    if(-1 == fstat(registry_fd, &file_stat)){
+        log("ERROR on fstat of the registry file");
+        registry_close();
+        return 0;
+    }
+    bool empty = (file_stat.st_size == 0);
+    if(empty && -1 == ftruncate(registry_fd, sizeof(registry_header) + REGISTRY_GROWTH*sizeof(registry_record))){
+        log("ERROR on ftruncate of the registry file");
+        registry_close();
+        return 0;
+    }
+    void* mapping = mmap(NULL, registry_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, registry_fd, 0);
+    if(mapping == MAP_FAILED){
+        log("ERROR: mmap of the registry file failed");
+        registry_close();
+        return 0;
+    }
+    registry = (registry_header*)mapping;
+    registry_records = (registry_record*)(registry + 1);
+    if(empty){
+        memcpy(registry->magic, registry_magic, sizeof(registry_magic));
+        registry->version = registry_version;
+        registry->users.store(0);
+    }
+    else if(memcmp(registry->magic, registry_magic, sizeof(registry_magic)) != 0 || registry->version != registry_version ||
+        registry->users.load() > MAX_REGISTERED_USERS ||
+        (size_t)file_stat.st_size < sizeof(registry_header) + registry->users.load()*sizeof(registry_record)){
+        log("ERROR: " + string(path) + " is not a valid registry file");
+        registry_close();
+        return 0;
+    }
+    registry_unlock();
+    return 1;
+}
+
+void registry_close(){
+    if(registry != nullptr)
+        munmap(registry, registry_map_size);
+    if(registry_fd != -1)
+        close(registry_fd);
+    registry = nullptr;
+    registry_records = nullptr;
+    registry_fd = -1;
+}
+
+int registry_lock(){
+    if(-1 == flock(registry_fd, LOCK_EX)){
+        log("ERROR on flock of the registry file");
+        return 0;
+    }
+    return 1;
+}
+
+void registry_unlock(){
+    flock(registry_fd, LOCK_UN);
+}
+
+int registry_append(const string& username, const uchar* fingerprint, int key_type){
+    if(registry == nullptr)
+        return -1;
+    if(username.empty() || username.length() > MAX_USERNAME_SIZE){
+        log("ERROR: invalid username " + username);
+        return -1;
+    }
+    uint32_t user_id = registry->users.load(memory_order_relaxed);
+    if(user_id >= MAX_REGISTERED_USERS){
+        log("ERROR: the registry is full");
+        return -1;
+    }
+    //The file grows by REGISTRY_GROWTH records at a time
+    struct stat file_stat;
+    size_t needed = sizeof(registry_header) + (user_id + 1)*sizeof(registry_record);
+    if(-1 == fstat(registry_fd, &file_stat)){
+        log("ERROR on fstat of the registry file");
+        return -1;
+    }
+    if((size_t)file_stat.st_size < needed &&
+        -1 == ftruncate(registry_fd, min(needed + (REGISTRY_GROWTH - 1)*sizeof(registry_record), registry_map_size))){
+        log("ERROR on ftruncate of the registry file");
+        return -1;
+    }
+    registry_record* record = &registry_records[user_id];
+    memset(record, 0, sizeof(registry_record));
+    memcpy(record->username, username.c_str(), username.length());
+    record->user_id = user_id;
+    memcpy(record->fingerprint, fingerprint, FINGERPRINT_SIZE);
+    record->key_type = key_type;
+    registry->users.store(user_id + 1, memory_order_release);
+    return user_id;
+}
+
+int registry_remove(int user_id){
+    if(registry == nullptr || user_id < 0 || (uint32_t)user_id >= registry->users.load(memory_order_acquire))
+        return 0;
+    registry_records[user_id].removed = 1;
+    return 1;
+}
+
+int registry_flush(){
+    if(registry == nullptr)
+        return 0;
+    size_t used = sizeof(registry_header) + registry->users.load()*sizeof(registry_record);
+    if(-1 == msync(registry, used, MS_SYNC)){
+        log("ERROR on msync of the registry file");
+        return 0;
+    }
+    return 1;
+}
+
+const registry_record* registry_get_records(uint32_t* count){
+    if(registry == nullptr)
+        return nullptr;
+    *count = registry->users.load(memory_order_acquire);
+    return registry_records;
+}
@@ -0,0 +1,280 @@
+#ifndef USER_DIRECTORY_INCLUDED
+#define USER_DIRECTORY_INCLUDED
+
+#include <string>
+#include <atomic>
+#include <pthread.h>
+#include "constant.h"
+
+using uchar=unsigned char;
+
+using namespace std;
+
+/*
+* Entry of a registered user in the user directory, the user_id is its position in the directory.
+* username and user_id are written once, before the user is published in the index.
+* removed: the user has been removed from the registry, it cannot log in anymore and its id is never used again
+* seq: seqlock of socket_id, busy and worker_id, it is odd while a writer is changing them. Readers do not lock: they read
+* the fields again if seq changed meanwhile. Writers are serialized by the lock of the stripe of the entry
+* socket_id: if equal to -1 the user is not connected to the service
+* worker_id: worker process that owns socket_id (socket ids are meaningful only inside that process)
+* online_prev, online_next: user ids of the neighbours in the list of the online users, -1 at the ends of the list
+* ticket_generation: generation of the last session ticket issued to the user, only that ticket can resume a session
+*/
+struct alignas(64) user_info {
+    atomic<uint32_t> seq;
+    char username[MAX_USERNAME_SIZE + 1];
+    int user_id;
+    atomic<int> socket_id;
+    atomic<int> busy;
+    atomic<int> worker_id;
+    atomic<int> removed;
+    int online_prev;
+    int online_next;
+    atomic<uint32_t> ticket_generation;
+};
+
+/*
+* User directory, placed in shared memory: it has a fixed layout without pointers so that it means the same in every worker.
+* index: open addressing hash table (linear probing) of the usernames, a slot holds user_id + 1 or 0 when it is empty
+* directory_lock: lock of the registration of the users and of the list of the online users, it is taken before
+* the lock of a stripe
+* stripe_locks: locks of the writers of the entries, entry i belongs to stripe i % USER_LOCK_STRIPES
+* Locks are robust mutexes shared among processes: the lock of a worker that dies is taken over by the next process
+* that locks it, which repairs what the dead worker left half done
+*/
+struct user_directory {
+    atomic<uint32_t> users; //registered users, their ids go from 0 to users - 1
+    uint32_t online_users;
+    int online_head; //list of the online users in login order, -1 when nobody is online
+    int online_tail;
+    alignas(64) pthread_mutex_t directory_lock;
+    alignas(64) pthread_mutex_t stripe_locks[USER_LOCK_STRIPES];
+    alignas(64) atomic<uint32_t> index[USER_INDEX_SLOTS];
+    user_info entries[MAX_REGISTERED_USERS];
+};
+
+/*
+* Header of the registry file. users: records in the file, a record is counted only once it is completely written
+*/
+struct registry_header {
+    char magic[8];
+    uint32_t version;
+    atomic<uint32_t> users;
+    uint8_t reserved[48];
+};
+
+/*
+* Record of a registered user in the registry file, user_id is also its position in the file
+* removed: not 0 if the user has been removed, the record is kept so that its id is never used again
+* key_type: kind of identity key of the user (IDENTITY_KEY_RSA, the 0 of the records written before, or IDENTITY_KEY_ED25519)
+* fingerprint: digest of the public key of the user (pubkey_fingerprint_from_file)
+*/
+struct registry_record {
+    char username[MAX_USERNAME_SIZE + 1];
+    uint8_t removed;
+    uint8_t key_type;
+    uint8_t reserved1;
+    uint32_t user_id;
+    uint8_t fingerprint[FINGERPRINT_SIZE];
+    uint8_t reserved2[8];
+};
+
+/*
+* Copy of the public fields of an online user
+*/
+struct online_user {
+    int user_id;
+    char username[MAX_USERNAME_SIZE + 1];
+};
+
+//Shared memory for storing data of users, created by user_directory_create
+extern user_directory* directory;
+
+/**
+ * @brief initialize a lock shared among processes, placed in shared memory before forking the processes that use it
+ * @return 1 on success, 0 on error(s)
+ */
+int shared_lock_init(pthread_mutex_t* lock);
+
+/**
+ * @brief lock a lock shared among processes
+ * @return 1 on success, 0 if the previous owner died holding it: the lock is taken anyway and the caller repairs the
+ * data it protects
+ */
+int shared_lock(pthread_mutex_t* lock);
+
+/**
+ * @brief unlock a lock shared among processes
+ */
+void shared_unlock(pthread_mutex_t* lock);
+
+/**
+ * @brief create the user directory in shared memory, before forking the processes that use it
+ * @return 1 on success, 0 on error(s)
+ */
+int user_directory_create();
+
+/**
+ * @brief check that user_id belongs to a registered user
+ */
+bool valid_user_id(int user_id);
+
+/**
+ * @brief open the registry file of the users and map it in memory
+ * @param path registry file
+ * @param create true to create the file if it does not exist
+ * @return 1 on success, 0 on error(s)
+ */
+int registry_open(const char* path, bool create);
+
+/**
+ * @brief unmap and close the registry file
+ */
+void registry_close();
+
+/**
+ * @brief lock the registry file against the other processes that change it (flock)
+ * @return 1 on success, 0 on error(s)
+ */
+int registry_lock();
+
+/**
+ * @brief unlock the registry file
+ */
+void registry_unlock();
+
+/**
+ * @brief add a record at the end of the registry file, the caller checks that the username is not already registered
+ * @param fingerprint fingerprint of the public key of the user, FINGERPRINT_SIZE bytes
+ * @param key_type kind of identity key of the user
+ * @return the user id, -1 in case of errors (invalid username, full registry)
+ */
+int registry_append(const string& username, const uchar* fingerprint, int key_type);
+
+/**
+ * @brief mark the record of a user as removed in the registry file
+ * @return 1 on success, 0 on error(s)
+ */
+int registry_remove(int user_id);
+
+/**
+ * @brief write the changes of the registry to the disk
+ * @return 1 on success, 0 on error(s)
+ */
+int registry_flush();
+
+/**
+ * @brief obtain the number of records of the registry and a pointer to them, removed users included
+ * @return pointer to the records in the mapping of the registry file, nullptr if the registry is not open
+ */
+const registry_record* registry_get_records(uint32_t* count);
+
+/**
+ * @brief load in the user directory all the users of the registry file, before forking the processes that use it
+ * @return 1 on success, 0 on error(s)
+ */
+int user_directory_load();
+
+/**
+ * @brief apply to the user directory the users added to and removed from the registry file since the last load.
+ * A removed user that is online keeps its connection until the logout
+ * @return number of users added or removed, -1 on error(s)
+ */
+int user_directory_sync();
+
+/**
+ * @brief obtain the fingerprint of the public key registered for a user
+ * @param fingerprint output, FINGERPRINT_SIZE bytes
+ * @return 1 on success, 0 on error(s)
+ */
+int get_user_fingerprint(int user_id, uchar* fingerprint);
+
+/**
+ * @brief obtain the kind of identity key registered for a user
+ * @return IDENTITY_KEY_RSA or IDENTITY_KEY_ED25519, -1 on error(s)
+ */
+int get_user_key_type(int user_id);
+
+/**
+ * @brief start a new generation of session tickets for a user, its older tickets are not valid anymore
+ * @return the generation of the ticket to issue, 0 on error(s)
+ */
+uint32_t renew_user_ticket(int user_id);
+
+/**
+ * @brief redeem the session ticket of a user: it is valid if it is the last ticket issued to the user, a ticket
+ * is redeemed only once even if two workers receive it at the same time
+ * @param generation generation of the ticket
+ * @return the generation of the ticket to issue to the resumed session, 0 if the ticket is not valid
+ */
+uint32_t redeem_user_ticket(int user_id, uint32_t generation);
+
+/**
+ * @brief test socket of communication in the user data store
+ * @return return -1 in case the user is offline, -2 in case of errors, the socket_id otherwise
+ */
+int get_user_socket_by_user_id(int user_id);
+
+/**
+ * @brief obtain the worker that owns the connection of the user
+ * @return return -1 in case the user is offline, -2 in case of errors, the worker_id otherwise
+ */
+int get_user_worker_by_user_id(int user_id);
+
+/**
+ * @brief test if the user is busy in a chat request
+ * @return int 0 if busy, 1 if free, -1 on error(s)
+ */
+int test_user_busy_by_user_id(int user_id);
+
+/**
+ * @brief set the user busy flag
+ * @return 1 on succes, -1 on error
+ */
+int set_user_busy_by_user_id(int user_id, int busy);
+
+/**
+ * @brief set the socket of communication of the user in the user data store: the user goes online only if it is offline
+ * @param worker worker process that owns the socket
+ * @return 1 on success, 0 if the user is already online, -1 in case of errors
+ */
+int set_user_socket(int user_id, int socket, int worker);
+
+/**
+ * @brief the user goes offline if it is online with the connection (socket, worker), its busy flag is cleared too
+ * @return 1 if the user went offline, 0 if it is not online with that connection, -1 in case of errors
+ */
+int clear_user_socket(int user_id, int socket, int worker);
+
+/**
+ * @brief logout all the users whose connection was owned by a terminated worker, after taking over the locks of the
+ * user directory that it held when it died
+ * @return -1 in case of errors, 0 otherwise
+ */
+int release_users_of_worker(int dead_worker_id);
+
+/**
+ * @brief prints content of user datastore for debugging purposes
+ */
+void print_user_data_store();
+
+/**
+ * @brief obtain a copy of the online users, in login order
+ * @param max_users maximum number of users to copy
+ * @param count output number of users copied
+ * @return the copy, to release with free, nullptr in case of errors
+ */
+online_user* get_online_users_copy(uint32_t max_users, uint32_t* count);
+
+/**
+ * @return the user id, -1 if the user is not registered
+ */
+int get_user_id_by_username(string username);
+
+/**
+ * @return username or empty string in case of errors
+ */
+string get_username_by_user_id(size_t id);
+
+#endif